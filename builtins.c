@@ -3,6 +3,8 @@
 #include "file_helpers.h"
 #include "shell.h"
 #include "process.h"
+#include "crc32c.h"
+#include "transfer.h"
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
@@ -33,6 +35,14 @@ static BuiltinCommand builtins[] = {
     {"tail", builtin_tail},
     {"date", builtin_date},
     {"stat", builtin_stat},
+    {"df", builtin_df},
+    {"sync", builtin_sync},
+    {"fsck", builtin_fsck},
+    {"scrub", builtin_scrub},
+    {"import", builtin_import},
+    {"export", builtin_export},
+    {"compact", builtin_compact},
+    {"vfsstat", builtin_vfsstat},
     {"grep", builtin_grep},
     {"find", builtin_find},
     {"sed", builtin_sed},
@@ -155,10 +165,8 @@ int builtin_ls(VFS* vfs, Command* cmd, int input_fd, int output_fd) {
         path = cmd->argv[arg_start];
     }
     
-    FileEntry entries[100];
-    int count = 0;
-    
-    if (!vfs_list_directory(vfs, path, entries, &count)) {
+    VFSDir* dir = vfs_open_dir(vfs, path);
+    if (!dir) {
         FILE* out = get_output_file(output_fd);
         fprintf(out, "ls: cannot access '%s'\n", path);
         if (out != stdout && out != stderr) fclose(out);
@@ -166,28 +174,28 @@ int builtin_ls(VFS* vfs, Command* cmd, int input_fd, int output_fd) {
     }
     
     FILE* out = get_output_file(output_fd);
+    FileEntry entry;
     
-    if (long_format) {
-        // Long format: type permissions size date name
-        for (int i = 0; i < count; i++) {
-            const char* type_str = (entries[i].type == FT_DIRECTORY) ? "d" : "-";
-            const char* perm_str = (entries[i].type == FT_DIRECTORY) ? "rwxr-xr-x" : "rw-r--r--";
+    while (vfs_read_dir(vfs, dir, &entry)) {
+        if (long_format) {
+            // Long format: type permissions size date name
+            const char* type_str = (entry.type == FT_DIRECTORY) ? "d" : "-";
+            const char* perm_str = (entry.type == FT_DIRECTORY) ? "rwxr-xr-x" : "rw-r--r--";
             
-            struct tm* timeinfo = localtime((time_t*)&entries[i].modified_time);
+            struct tm* timeinfo = localtime((time_t*)&entry.modified_time);
             char timebuf[64];
             strftime(timebuf, sizeof(timebuf), "%b %d %H:%M", timeinfo);
             
-            fprintf(out, "%s%s %8u %s %s\n", 
-                    type_str, perm_str, entries[i].size, timebuf, entries[i].name);
-        }
-    } else {
-        // Simple format
-        for (int i = 0; i < count; i++) {
-            if (!show_all && entries[i].name[0] == '.') continue;
-            const char* type_str = (entries[i].type == FT_DIRECTORY) ? "d" : "-";
-            fprintf(out, "%s %s\n", type_str, entries[i].name);
+            fprintf(out, "%s%s %8llu %s %s\n", 
+                    type_str, perm_str, (unsigned long long)entry.size, timebuf, entry.name);
+        } else {
+            // Simple format
+            if (!show_all && entry.name[0] == '.') continue;
+            const char* type_str = (entry.type == FT_DIRECTORY) ? "d" : "-";
+            fprintf(out, "%s %s\n", type_str, entry.name);
         }
     }
+    vfs_close_dir(dir);
     
     if (out != stdout && out != stderr) fclose(out);
     return 0;
@@ -213,6 +221,169 @@ int builtin_rm(VFS* vfs, Command* cmd, int input_fd, int output_fd) {
     return 0;
 }
 
+// Walks the lines of an open VFS file. Lines that sit inside one chunk
+// are returned in place; only a line crossing a chunk boundary is copied.
+typedef struct {
+    VFS* vfs;
+    VFSFile* file;
+    const char* chunk;
+    size_t chunk_len;
+    size_t pos;
+    bool terminated;         // Last line returned ended with '\n'
+    char* scratch;
+    size_t scratch_capacity;
+} LineCursor;
+
+static void line_cursor_init(LineCursor* cursor, VFS* vfs, VFSFile* file) {
+    memset(cursor, 0, sizeof(*cursor));
+    cursor->vfs = vfs;
+    cursor->file = file;
+}
+
+static void line_cursor_free(LineCursor* cursor) {
+    free(cursor->scratch);
+    cursor->scratch = NULL;
+}
+
+static void scratch_append(LineCursor* cursor, size_t* used, const char* data, size_t len) {
+    if (*used + len > cursor->scratch_capacity) {
+        size_t capacity = cursor->scratch_capacity ? cursor->scratch_capacity : 256;
+        while (capacity < *used + len) capacity *= 2;
+        cursor->scratch = (char*)xrealloc(cursor->scratch, capacity);
+        cursor->scratch_capacity = capacity;
+    }
+    memcpy(cursor->scratch + *used, data, len);
+    *used += len;
+}
+
+static bool next_chunk(LineCursor* cursor) {
+    cursor->pos = 0;
+    return vfs_read_chunk(cursor->vfs, cursor->file, &cursor->chunk, &cursor->chunk_len);
+}
+
+static bool next_line(LineCursor* cursor, const char** line, size_t* len) {
+    if (cursor->pos >= cursor->chunk_len && !next_chunk(cursor)) return false;
+    
+    const char* start = cursor->chunk + cursor->pos;
+    size_t avail = cursor->chunk_len - cursor->pos;
+    const char* newline = memchr(start, '\n', avail);
+    
+    if (newline) {
+        *line = start;
+        *len = (size_t)(newline - start);
+        cursor->pos += *len + 1;
+        cursor->terminated = true;
+        return true;
+    }
+    
+    // Line continues into the next chunk: stitch it together
+    size_t used = 0;
+    scratch_append(cursor, &used, start, avail);
+    cursor->terminated = false;
+    cursor->pos = cursor->chunk_len;
+    
+    while (next_chunk(cursor)) {
+        newline = memchr(cursor->chunk, '\n', cursor->chunk_len);
+        size_t take = newline ? (size_t)(newline - cursor->chunk) : cursor->chunk_len;
+        scratch_append(cursor, &used, cursor->chunk, take);
+        cursor->pos = take;
+        
+        if (newline) {
+            cursor->pos++;
+            cursor->terminated = true;
+            break;
+        }
+    }
+    
+    *line = cursor->scratch;
+    *len = used;
+    return true;
+}
+
+// Copy a line into the cursor's scratch space as a C string. The copy
+// stays valid until the next call on the cursor.
+static char* line_string(LineCursor* cursor, const char* line, size_t len) {
+    bool in_scratch = line == cursor->scratch;
+    if (len + 1 > cursor->scratch_capacity) {
+        cursor->scratch = (char*)xrealloc(cursor->scratch, len + 1);
+        cursor->scratch_capacity = len + 1;
+    }
+    if (!in_scratch) memcpy(cursor->scratch, line, len);
+    cursor->scratch[len] = '\0';
+    return cursor->scratch;
+}
+
+// Substring search over a line that is not NUL-terminated
+static const char* line_find(const char* line, size_t len, const char* pattern, bool case_insensitive) {
+    size_t plen = strlen(pattern);
+    if (plen == 0) return line;
+    if (plen > len) return NULL;
+    
+    for (size_t i = 0; i + plen <= len; i++) {
+        size_t j = 0;
+        if (case_insensitive) {
+            while (j < plen && tolower((unsigned char)line[i + j]) == tolower((unsigned char)pattern[j])) j++;
+        } else {
+            while (j < plen && line[i + j] == pattern[j]) j++;
+        }
+        if (j == plen) return line + i;
+    }
+    return NULL;
+}
+
+static bool line_contains(const char* line, size_t len, const char* pattern, bool case_insensitive) {
+    return line_find(line, len, pattern, case_insensitive) != NULL;
+}
+
+// Copy one VFS file into another, sharing its blocks or else streaming it
+// a chunk at a time. Returns 1 when the source cannot be opened, 2 when
+// the destination cannot be written and 3 when both name the same file.
+// A destination created here is removed again when the copy fails.
+static int copy_file(VFS* vfs, const char* source, const char* dest) {
+    VFSFile* in = vfs_open(vfs, source);
+    if (!in) return 1;
+    
+    char source_path[MAX_PATH], dest_path[MAX_PATH];
+    if (vfs_resolve_path(vfs, source, source_path) && vfs_resolve_path(vfs, dest, dest_path) &&
+        strcmp(source_path, dest_path) == 0) {
+        vfs_close_file(vfs, in);
+        return 3;
+    }
+    
+    bool existed = vfs_file_exists(vfs, dest);
+    if (vfs_clone_file(vfs, source, dest)) {
+        vfs_close_file(vfs, in);
+        return 0;
+    }
+    
+    VFSFile* out = vfs_open_writer(vfs, dest, false);
+    if (!out) {
+        vfs_close_file(vfs, in);
+        return 2;
+    }
+    
+    // Holes in the source are skipped and stay holes in the copy; a copy
+    // with none has its blocks reserved up front
+    bool sparse = in->size > 0 && vfs_seek(vfs, in, 0, VFS_SEEK_HOLE) && vfs_tell(in) < in->size;
+    bool ok = vfs_seek(vfs, in, 0, SEEK_SET) && (sparse || vfs_reserve(vfs, dest, in->size));
+    const char* data;
+    size_t len;
+    while (ok && vfs_seek(vfs, in, (int64_t)vfs_tell(in), VFS_SEEK_DATA)) {
+        uint64_t start = vfs_tell(in);
+        uint64_t stop = vfs_seek(vfs, in, (int64_t)start, VFS_SEEK_HOLE) ? vfs_tell(in) : in->size;
+        ok = vfs_seek(vfs, in, (int64_t)start, SEEK_SET) && vfs_seek(vfs, out, (int64_t)start, SEEK_SET);
+        while (ok && vfs_tell(in) < stop && vfs_read_chunk(vfs, in, &data, &len)) {
+            ok = vfs_write(vfs, out, data, len);
+        }
+        ok = ok && vfs_tell(in) >= stop;
+    }
+    ok = vfs_flush(vfs, out) && ok;
+    vfs_close_file(vfs, out);
+    vfs_close_file(vfs, in);
+    if (!ok && !existed) vfs_delete_file(vfs, dest);
+    return ok ? 0 : 2;
+}
+
 int builtin_cat(VFS* vfs, Command* cmd, int input_fd, int output_fd) {
     FILE* out = get_output_file(output_fd);
     
@@ -228,14 +399,18 @@ int builtin_cat(VFS* vfs, Command* cmd, int input_fd, int output_fd) {
         }
     } else {
         for (int i = 1; i < cmd->argc; i++) {
-            char buffer[4096];
-            size_t read = vfs_read_file(vfs, cmd->argv[i], buffer, sizeof(buffer) - 1);
-            if (read > 0) {
-                buffer[read] = '\0';
-                fputs(buffer, out);
-            } else {
+            VFSFile* file = vfs_open(vfs, cmd->argv[i]);
+            if (!file) {
                 fprintf(out, "cat: %s: No such file or directory\n", cmd->argv[i]);
+                continue;
             }
+            
+            const char* data;
+            size_t len;
+            while (vfs_read_chunk(vfs, file, &data, &len)) {
+                fwrite(data, 1, len, out);
+            }
+            vfs_close_file(vfs, file);
         }
     }
     
@@ -278,6 +453,14 @@ int builtin_help(VFS* vfs, Command* cmd, int input_fd, int output_fd) {
     fprintf(out, "  mv <src> <dest>   - Move/rename file\n");
     fprintf(out, "  cat <file>        - Display file contents\n");
     fprintf(out, "  stat <file>       - Show file metadata\n");
+    fprintf(out, "  df                - Show VFS space usage\n");
+    fprintf(out, "  sync [-v]         - Flush cached VFS writes to disk (v=cache counters)\n");
+    fprintf(out, "  fsck [-j N]       - Check VFS metadata and block checksums with N threads\n");
+    fprintf(out, "  scrub [-j N]      - Check block checksums only\n");
+    fprintf(out, "  import [-j N] <hostdir> <dir> - Copy a host directory tree into the VFS, keeping holes\n");
+    fprintf(out, "  export [-j N] <dir> <hostdir> - Copy a VFS directory tree out to the host\n");
+    fprintf(out, "  compact [-b N]    - Defragment the VFS, N blocks per step, and shrink the image\n");
+    fprintf(out, "  vfsstat [-jr]     - Show VFS operation counters (j=JSON, r=reset after and time)\n");
     fprintf(out, "\n");
     fprintf(out, "Text Processing:\n");
     fprintf(out, "  echo <text>       - Print text\n");
@@ -356,17 +539,22 @@ int builtin_cp(VFS* vfs, Command* cmd, int input_fd, int output_fd) {
     const char* source = cmd->argv[1];
     const char* dest = cmd->argv[2];
     
-    char buffer[8192];
-    size_t read = vfs_read_file(vfs, source, buffer, sizeof(buffer) - 1);
-    if (read == 0) {
+    int status = copy_file(vfs, source, dest);
+    if (status == 1) {
         FILE* out = get_output_file(output_fd);
         fprintf(out, "cp: %s: No such file or directory\n", source);
         if (out != stdout && out != stderr) fclose(out);
         return 1;
     }
     
-    buffer[read] = '\0';
-    if (!vfs_write_file(vfs, dest, buffer, read)) {
+    if (status == 3) {
+        FILE* out = get_output_file(output_fd);
+        fprintf(out, "cp: '%s' and '%s' are the same file\n", source, dest);
+        if (out != stdout && out != stderr) fclose(out);
+        return 1;
+    }
+    
+    if (status == 2) {
         FILE* out = get_output_file(output_fd);
         fprintf(out, "cp: cannot create '%s'\n", dest);
         if (out != stdout && out != stderr) fclose(out);
@@ -388,26 +576,38 @@ int builtin_mv(VFS* vfs, Command* cmd, int input_fd, int output_fd) {
     const char* source = cmd->argv[1];
     const char* dest = cmd->argv[2];
     
-    // Copy file
-    char buffer[8192];
-    size_t read = vfs_read_file(vfs, source, buffer, sizeof(buffer) - 1);
-    if (read == 0) {
+    if (!vfs_file_exists(vfs, source)) {
         FILE* out = get_output_file(output_fd);
         fprintf(out, "mv: %s: No such file or directory\n", source);
         if (out != stdout && out != stderr) fclose(out);
         return 1;
     }
     
-    buffer[read] = '\0';
-    if (!vfs_write_file(vfs, dest, buffer, read)) {
+    // Moving onto a directory puts the source inside it
+    char target[MAX_PATH];
+    FileEntry info;
+    if (vfs_stat(vfs, dest, &info) && info.type == FT_DIRECTORY) {
+        const char* base = strrchr(source, '/');
+        snprintf(target, sizeof(target), "%s/%s", dest, base ? base + 1 : source);
+        dest = target;
+    }
+    
+    char source_path[MAX_PATH], dest_path[MAX_PATH];
+    if (vfs_resolve_path(vfs, source, source_path) && vfs_resolve_path(vfs, dest, dest_path) &&
+        strcmp(source_path, dest_path) == 0) {
         FILE* out = get_output_file(output_fd);
-        fprintf(out, "mv: cannot create '%s'\n", dest);
+        fprintf(out, "mv: '%s' and '%s' are the same file\n", source, dest);
         if (out != stdout && out != stderr) fclose(out);
         return 1;
     }
     
-    // Delete source
-    vfs_delete_file(vfs, source);
+    // Only the entry moves; the data stays where it is
+    if (!vfs_rename(vfs, source, dest)) {
+        FILE* out = get_output_file(output_fd);
+        fprintf(out, "mv: cannot move '%s' to '%s'\n", source, dest);
+        if (out != stdout && out != stderr) fclose(out);
+        return 1;
+    }
     return 0;
 }
 
@@ -458,26 +658,30 @@ int builtin_wc(VFS* vfs, Command* cmd, int input_fd, int output_fd) {
         }
     } else {
         for (int i = arg_start; i < cmd->argc; i++) {
-            char buffer[8192];
-            size_t read = vfs_read_file(vfs, cmd->argv[i], buffer, sizeof(buffer) - 1);
-            if (read == 0) {
+            VFSFile* file = vfs_open(vfs, cmd->argv[i]);
+            if (!file) {
                 fprintf(out, "wc: %s: No such file\n", cmd->argv[i]);
                 continue;
             }
             
-            buffer[read] = '\0';
-            int lines = 0, words = 0, chars = (int)read;
+            int lines = 0, words = 0, chars = 0;
             bool in_word = false;
+            const char* data;
+            size_t len;
             
-            for (size_t j = 0; j < read; j++) {
-                if (buffer[j] == '\n') lines++;
-                if (isspace((unsigned char)buffer[j])) {
-                    in_word = false;
-                } else if (!in_word) {
-                    words++;
-                    in_word = true;
+            while (vfs_read_chunk(vfs, file, &data, &len)) {
+                chars += (int)len;
+                for (size_t j = 0; j < len; j++) {
+                    if (data[j] == '\n') lines++;
+                    if (isspace((unsigned char)data[j])) {
+                        in_word = false;
+                    } else if (!in_word) {
+                        words++;
+                        in_word = true;
+                    }
                 }
             }
+            vfs_close_file(vfs, file);
             
             if (show_lines) fprintf(out, "%d ", lines);
             if (show_words) fprintf(out, "%d ", words);
@@ -525,28 +729,24 @@ int builtin_head(VFS* vfs, Command* cmd, int input_fd, int output_fd) {
         }
     } else {
         for (int i = arg_start; i < cmd->argc; i++) {
-            char buffer[8192];
-            size_t read = vfs_read_file(vfs, cmd->argv[i], buffer, sizeof(buffer) - 1);
-            if (read == 0) {
+            VFSFile* file = vfs_open(vfs, cmd->argv[i]);
+            if (!file) {
                 fprintf(out, "head: %s: No such file\n", cmd->argv[i]);
                 continue;
             }
             
-            buffer[read] = '\0';
+            LineCursor cursor;
+            line_cursor_init(&cursor, vfs, file);
+            const char* line;
+            size_t len;
             int lines = 0;
-            char* line = buffer;
-            while (lines < n && *line) {
-                char* newline = strchr(line, '\n');
-                if (newline) {
-                    *newline = '\0';
-                    fprintf(out, "%s\n", line);
-                    line = newline + 1;
-                } else {
-                    fprintf(out, "%s", line);
-                    break;
-                }
+            while (lines < n && next_line(&cursor, &line, &len)) {
+                fwrite(line, 1, len, out);
+                if (cursor.terminated) fputc('\n', out);
                 lines++;
             }
+            line_cursor_free(&cursor);
+            vfs_close_file(vfs, file);
         }
     }
     
@@ -554,6 +754,29 @@ int builtin_head(VFS* vfs, Command* cmd, int input_fd, int output_fd) {
     return 0;
 }
 
+// Where the last n lines of a file start, found by scanning back from the
+// end a block at a time. A final '\n' ends the last line.
+static uint64_t tail_start(VFS* vfs, VFSFile* file, int n) {
+    if (n <= 0) return file->size;
+    
+    char buffer[4096];
+    uint64_t end = file->size;
+    int newlines = 0;
+    while (end > 0) {
+        size_t chunk = end < sizeof(buffer) ? (size_t)end : sizeof(buffer);
+        uint64_t start = end - chunk;
+        vfs_seek(vfs, file, (int64_t)start, SEEK_SET);
+        if (vfs_read(vfs, file, buffer, chunk) != chunk) break;
+        
+        for (size_t j = chunk; j-- > 0; ) {
+            if (buffer[j] != '\n' || start + j == file->size - 1) continue;
+            if (++newlines == n) return start + j + 1;
+        }
+        end = start;
+    }
+    return 0;
+}
+
 // Tail - show last N lines
 int builtin_tail(VFS* vfs, Command* cmd, int input_fd, int output_fd) {
     FILE* out = get_output_file(output_fd);
@@ -603,31 +826,20 @@ int builtin_tail(VFS* vfs, Command* cmd, int input_fd, int output_fd) {
         }
     } else {
         for (int i = arg_start; i < cmd->argc; i++) {
-            char buffer[8192];
-            size_t read = vfs_read_file(vfs, cmd->argv[i], buffer, sizeof(buffer) - 1);
-            if (read == 0) {
+            VFSFile* file = vfs_open(vfs, cmd->argv[i]);
+            if (!file) {
                 fprintf(out, "tail: %s: No such file\n", cmd->argv[i]);
                 continue;
             }
             
-            buffer[read] = '\0';
-            // Count lines
-            int total_lines = 0;
-            for (size_t j = 0; j < read; j++) {
-                if (buffer[j] == '\n') total_lines++;
-            }
-            
             // Print last N lines
-            int start_line = (total_lines > n) ? total_lines - n : 0;
-            int current_line = 0;
-            char* line = buffer;
-            
-            while (*line && current_line < start_line) {
-                if (*line == '\n') current_line++;
-                line++;
+            vfs_seek(vfs, file, (int64_t)tail_start(vfs, file, n), SEEK_SET);
+            const char* data;
+            size_t len;
+            while (vfs_read_chunk(vfs, file, &data, &len)) {
+                fwrite(data, 1, len, out);
             }
-            
-            fputs(line, out);
+            vfs_close_file(vfs, file);
         }
     }
     
@@ -661,32 +873,16 @@ int builtin_stat(VFS* vfs, Command* cmd, int input_fd, int output_fd) {
     FILE* out = get_output_file(output_fd);
     
     for (int i = 1; i < cmd->argc; i++) {
-        char resolved[MAX_PATH];
-        if (!vfs_resolve_path(vfs, cmd->argv[i], resolved)) {
-            fprintf(out, "stat: cannot stat '%s': No such file\n", cmd->argv[i]);
-            continue;
-        }
-        
-        char* filename = strrchr(resolved, '/');
-        if (!filename) filename = (char*)resolved;
-        else filename++;
-        
         // Find file entry
-        FileEntry* entry = NULL;
-        for (uint32_t j = 0; j < vfs->header.num_files; j++) {
-            if (strcmp(vfs->header.entries[j].name, filename) == 0) {
-                entry = &vfs->header.entries[j];
-                break;
-            }
-        }
-        
-        if (!entry) {
+        FileEntry found;
+        if (!vfs_stat(vfs, cmd->argv[i], &found)) {
             fprintf(out, "stat: cannot stat '%s': No such file\n", cmd->argv[i]);
             continue;
         }
+        FileEntry* entry = &found;
         
         fprintf(out, "  File: %s\n", cmd->argv[i]);
-        fprintf(out, "  Size: %u bytes\n", entry->size);
+        fprintf(out, "  Size: %llu bytes\n", (unsigned long long)entry->size);
         fprintf(out, "  Type: %s\n", 
                 entry->type == FT_DIRECTORY ? "directory" : 
                 entry->type == FT_SCRIPT ? "script" : "regular file");
@@ -708,6 +904,303 @@ int builtin_stat(VFS* vfs, Command* cmd, int input_fd, int output_fd) {
     return 0;
 }
 
+// Df - report space usage of the VFS image
+int builtin_df(VFS* vfs, Command* cmd, int input_fd, int output_fd) {
+    FILE* out = get_output_file(output_fd);
+    
+    uint32_t total_blocks, free_blocks;
+    vfs_block_counts(vfs, &total_blocks, &free_blocks);
+    unsigned long long kb_per_block = BLOCK_SIZE / 1024;
+    unsigned long long total = total_blocks;
+    unsigned long long available = free_blocks;
+    unsigned long long used = total - available;
+    unsigned int percent = total ? (unsigned int)((used * 100 + total - 1) / total) : 0;
+    
+    fprintf(out, "%-10s %10s %10s %10s %5s\n", "Filesystem", "1K-blocks", "Used", "Available", "Use%");
+    fprintf(out, "%-10s %10llu %10llu %10llu %4u%%\n", "vfs",
+            total * kb_per_block, used * kb_per_block, available * kb_per_block, percent);
+    
+    if (out != stdout && out != stderr) fclose(out);
+    return 0;
+}
+
+int builtin_sync(VFS* vfs, Command* cmd, int input_fd, int output_fd) {
+    FILE* out = get_output_file(output_fd);
+    int result = 0;
+    
+    if (!vfs_sync(vfs)) {
+        fprintf(out, "sync: failed to flush the VFS image\n");
+        result = 1;
+    }
+    
+    if (cmd->argc > 1 && strcmp(cmd->argv[1], "-v") == 0) {
+        VFSStats stats;
+        vfs_get_stats(vfs, &stats);
+        fprintf(out, "cache: %u blocks, %llu hits, %llu misses, %llu write-backs\n",
+                stats.cache_blocks,
+                (unsigned long long)stats.cache_hits,
+                (unsigned long long)stats.cache_misses,
+                (unsigned long long)stats.cache_writebacks);
+        if (stats.dedup) {
+            fprintf(out, "dedup: %u blocks indexed, %llu blocks shared\n",
+                    stats.dedup_indexed, (unsigned long long)stats.dedup_hits);
+        }
+        fprintf(out, "checksums: %llu blocks verified on read, %llu failures\n",
+                (unsigned long long)stats.blocks_verified,
+                (unsigned long long)stats.checksum_failures);
+        fprintf(out, "paths: %llu resolved from the cache, %llu walked\n",
+                (unsigned long long)stats.path_hits,
+                (unsigned long long)stats.path_misses);
+    }
+    
+    if (out != stdout && out != stderr) fclose(out);
+    return result;
+}
+
+// Shared by fsck and scrub: read every data block back in parallel and,
+// for fsck, check the entries, extents and bitmap against each other
+static int check_image(VFS* vfs, Command* cmd, int output_fd, bool metadata) {
+    FILE* out = get_output_file(output_fd);
+    const char* name = cmd->argv[0];
+    int threads = 4;
+    
+    for (int i = 1; i < cmd->argc; i++) {
+        if (strcmp(cmd->argv[i], "-j") == 0 && i + 1 < cmd->argc) {
+            threads = atoi(cmd->argv[++i]);
+        } else if (strncmp(cmd->argv[i], "-j", 2) == 0 && cmd->argv[i][2]) {
+            threads = atoi(cmd->argv[i] + 2);
+        } else {
+            fprintf(out, "%s: usage: %s [-j threads]\n", name, name);
+            if (out != stdout && out != stderr) fclose(out);
+            return 1;
+        }
+    }
+    if (threads < 1) threads = 1;
+    
+    VFSCheckResult result;
+    bool ok = vfs_check(vfs, threads, metadata, out, &result);
+    fprintf(out, "%s: %llu files, %llu directories\n", name,
+            (unsigned long long)result.files, (unsigned long long)result.directories);
+    fprintf(out, "%s: %llu blocks checked (CRC32C %s), %llu without a checksum\n", name,
+            (unsigned long long)result.blocks_scrubbed, crc32c_implementation(),
+            (unsigned long long)result.blocks_unverified);
+    fprintf(out, "%s: %llu checksum errors", name, (unsigned long long)result.checksum_errors);
+    if (metadata) fprintf(out, ", %llu problems", (unsigned long long)result.problems);
+    fprintf(out, "\n");
+    
+    if (out != stdout && out != stderr) fclose(out);
+    return ok ? 0 : 1;
+}
+
+int builtin_fsck(VFS* vfs, Command* cmd, int input_fd, int output_fd) {
+    return check_image(vfs, cmd, output_fd, true);
+}
+
+int builtin_scrub(VFS* vfs, Command* cmd, int input_fd, int output_fd) {
+    return check_image(vfs, cmd, output_fd, false);
+}
+
+// Shared by import and export: the first operand is the source tree and
+// the second the destination, with the VFS side resolved against the
+// current directory
+static int transfer_command(VFS* vfs, Command* cmd, int output_fd, bool import) {
+    FILE* out = get_output_file(output_fd);
+    const char* name = cmd->argv[0];
+    const char* operands[2];
+    int count = 0;
+    int threads = 4;
+    
+    for (int i = 1; i < cmd->argc; i++) {
+        if (strcmp(cmd->argv[i], "-j") == 0 && i + 1 < cmd->argc) {
+            threads = atoi(cmd->argv[++i]);
+        } else if (strncmp(cmd->argv[i], "-j", 2) == 0 && cmd->argv[i][2]) {
+            threads = atoi(cmd->argv[i] + 2);
+        } else if (count < 2) {
+            operands[count++] = cmd->argv[i];
+        } else {
+            count = 3;
+            break;
+        }
+    }
+    char vfs_dir[MAX_PATH];
+    if (count != 2 || !vfs_resolve_path(vfs, operands[import ? 1 : 0], vfs_dir)) {
+        if (import) {
+            fprintf(out, "%s: usage: %s [-j threads] <hostdir> <dir>\n", name, name);
+        } else {
+            fprintf(out, "%s: usage: %s [-j threads] <dir> <hostdir>\n", name, name);
+        }
+        if (out != stdout && out != stderr) fclose(out);
+        return 1;
+    }
+    if (threads < 1) threads = 1;
+    
+    TransferStats stats;
+    bool ok = import ? transfer_import(vfs, operands[0], vfs_dir, threads, stderr, &stats)
+                     : transfer_export(vfs, vfs_dir, operands[1], threads, stderr, &stats);
+    fprintf(out, "%s: %llu files, %llu directories, %llu KB", name,
+            (unsigned long long)stats.files, (unsigned long long)stats.directories,
+            (unsigned long long)((stats.bytes + 1023) / 1024));
+    if (import) fprintf(out, ", %llu commits", (unsigned long long)stats.commits);
+    fprintf(out, "\n");
+    if (stats.failed > 0) {
+        fprintf(out, "%s: %llu failed\n", name, (unsigned long long)stats.failed);
+    }
+    
+    if (out != stdout && out != stderr) fclose(out);
+    return ok ? 0 : 1;
+}
+
+int builtin_import(VFS* vfs, Command* cmd, int input_fd, int output_fd) {
+    return transfer_command(vfs, cmd, output_fd, true);
+}
+
+int builtin_export(VFS* vfs, Command* cmd, int input_fd, int output_fd) {
+    return transfer_command(vfs, cmd, output_fd, false);
+}
+
+static void print_layout(FILE* out, const char* when, const VFSLayout* layout) {
+    fprintf(out, "compact: %s: %llu files, %llu fragmented, %llu extents; "
+            "%u free runs, largest %u blocks; %u of %u blocks free, image %llu KB\n", when,
+            (unsigned long long)layout->files, (unsigned long long)layout->fragmented_files,
+            (unsigned long long)layout->extents, layout->free_runs, layout->largest_free_run,
+            layout->free_blocks, layout->num_blocks,
+            (unsigned long long)((layout->image_size + 1023) / 1024));
+}
+
+// Compact in steps of a bounded number of blocks, each committed on its
+// own, so Ctrl-C stops it between steps with the work so far kept
+int builtin_compact(VFS* vfs, Command* cmd, int input_fd, int output_fd) {
+    FILE* out = get_output_file(output_fd);
+    long step = 4096;
+    
+    for (int i = 1; i < cmd->argc; i++) {
+        if (strcmp(cmd->argv[i], "-b") == 0 && i + 1 < cmd->argc) {
+            step = atol(cmd->argv[++i]);
+        } else if (strncmp(cmd->argv[i], "-b", 2) == 0 && cmd->argv[i][2]) {
+            step = atol(cmd->argv[i] + 2);
+        } else {
+            fprintf(out, "compact: usage: compact [-b blocks]\n");
+            if (out != stdout && out != stderr) fclose(out);
+            return 1;
+        }
+    }
+    if (step < 1) step = 1;
+    
+    VFSLayout layout;
+    vfs_layout(vfs, &layout);
+    print_layout(out, "before", &layout);
+    
+    VFSCompaction state;
+    memset(&state, 0, sizeof(state));
+    bool ok = true;
+    while (ok && !state.done && !shell_interrupted()) {
+        ok = vfs_compact(vfs, &state, (uint32_t)step);
+    }
+    
+    fprintf(out, "compact: %llu file moves, %llu blocks moved; %llu files skipped; %llu blocks released\n",
+            (unsigned long long)state.files_moved, (unsigned long long)state.blocks_moved,
+            (unsigned long long)state.files_skipped, (unsigned long long)state.blocks_released);
+    if (!ok) {
+        fprintf(out, "compact: VFS update failed\n");
+    } else if (!state.done) {
+        fprintf(out, "compact: interrupted; run it again to carry on\n");
+    }
+    vfs_layout(vfs, &layout);
+    print_layout(out, "after", &layout);
+    
+    if (out != stdout && out != stderr) fclose(out);
+    return ok && state.done ? 0 : 1;
+}
+
+// Operation times are null until `vfsstat -r` turns timing on
+static void print_stats_json(FILE* out, const VFSStats* stats) {
+    fprintf(out, "{\"ops\":{");
+    for (int op = 0; op < VFS_OP_COUNT; op++) {
+        fprintf(out, "%s\"%s\":{\"count\":%llu,\"bytes\":%llu,\"ns\":", op ? "," : "",
+                vfs_op_name((VFSOp)op), (unsigned long long)stats->ops[op].count,
+                (unsigned long long)stats->ops[op].bytes);
+        if (stats->timed) {
+            fprintf(out, "%llu}", (unsigned long long)stats->ops[op].nanoseconds);
+        } else {
+            fprintf(out, "null}");
+        }
+    }
+    fprintf(out, "},\"cache\":{\"blocks\":%u,\"hits\":%llu,\"misses\":%llu,\"writebacks\":%llu},",
+            stats->cache_blocks, (unsigned long long)stats->cache_hits,
+            (unsigned long long)stats->cache_misses, (unsigned long long)stats->cache_writebacks);
+    fprintf(out, "\"metadata_runs\":%llu,", (unsigned long long)stats->metadata_writes);
+    fprintf(out, "\"checksums\":{\"verified\":%llu,\"failures\":%llu},",
+            (unsigned long long)stats->blocks_verified, (unsigned long long)stats->checksum_failures);
+    fprintf(out, "\"paths\":{\"hits\":%llu,\"misses\":%llu},\"dedup_hits\":%llu}\n",
+            (unsigned long long)stats->path_hits, (unsigned long long)stats->path_misses,
+            (unsigned long long)stats->dedup_hits);
+}
+
+static void print_stats_table(FILE* out, const VFSStats* stats) {
+    fprintf(out, "%-12s %10s %12s %12s %10s\n", "operation", "calls", "KB", "total ms", "avg us");
+    for (int op = 0; op < VFS_OP_COUNT; op++) {
+        const VFSOpStats* s = &stats->ops[op];
+        fprintf(out, "%-12s %10llu %12llu", vfs_op_name((VFSOp)op),
+                (unsigned long long)s->count, (unsigned long long)((s->bytes + 1023) / 1024));
+        if (stats->timed) {
+            fprintf(out, " %12.3f %10.2f\n", s->nanoseconds / 1e6,
+                    s->count ? s->nanoseconds / 1e3 / s->count : 0.0);
+        } else {
+            fprintf(out, " %12s %10s\n", "-", "-");
+        }
+    }
+    
+    uint64_t lookups = stats->cache_hits + stats->cache_misses;
+    fprintf(out, "cache: %u blocks, %llu hits, %llu misses (%.1f%% hit), %llu write-backs\n",
+            stats->cache_blocks, (unsigned long long)stats->cache_hits,
+            (unsigned long long)stats->cache_misses, lookups ? 100.0 * stats->cache_hits / lookups : 0.0,
+            (unsigned long long)stats->cache_writebacks);
+    fprintf(out, "metadata: %llu runs of sectors written\n", (unsigned long long)stats->metadata_writes);
+    fprintf(out, "checksums: %llu blocks verified on read, %llu failures\n",
+            (unsigned long long)stats->blocks_verified, (unsigned long long)stats->checksum_failures);
+    fprintf(out, "paths: %llu resolved from the cache, %llu walked\n",
+            (unsigned long long)stats->path_hits, (unsigned long long)stats->path_misses);
+    if (stats->dedup) {
+        fprintf(out, "dedup: %llu blocks shared\n", (unsigned long long)stats->dedup_hits);
+    }
+}
+
+// Counters since the VFS was opened or last reset. -r resets them after
+// printing and times operations from then on, so `vfsstat -r; cmd;
+// vfsstat` shows what cmd cost. Nothing reads the clock before that.
+int builtin_vfsstat(VFS* vfs, Command* cmd, int input_fd, int output_fd) {
+    FILE* out = get_output_file(output_fd);
+    bool json = false;
+    bool reset = false;
+    
+    for (int i = 1; i < cmd->argc; i++) {
+        const char* arg = cmd->argv[i];
+        bool valid = arg[0] == '-' && arg[1];
+        for (const char* c = arg + 1; valid && *c; c++) {
+            if (*c == 'j') json = true;
+            else if (*c == 'r') reset = true;
+            else valid = false;
+        }
+        if (!valid) {
+            fprintf(out, "vfsstat: usage: vfsstat [-jr]\n");
+            if (out != stdout && out != stderr) fclose(out);
+            return 1;
+        }
+    }
+    
+    VFSStats stats;
+    vfs_get_stats(vfs, &stats);
+    if (json) {
+        print_stats_json(out, &stats);
+    } else {
+        print_stats_table(out, &stats);
+    }
+    if (reset) vfs_reset_stats(vfs, true);
+    
+    if (out != stdout && out != stderr) fclose(out);
+    return 0;
+}
+
 // Simple pattern matching (wildcard support)
 static bool match_pattern(const char* text, const char* pattern) {
     if (!pattern || !*pattern) return !text || !*text;
@@ -796,52 +1289,28 @@ int builtin_grep(VFS* vfs, Command* cmd, int input_fd, int output_fd) {
         }
     } else {
         for (int i = arg_start; i < cmd->argc; i++) {
-            char buffer[8192];
-            size_t read = vfs_read_file(vfs, cmd->argv[i], buffer, sizeof(buffer) - 1);
-            if (read == 0) {
+            VFSFile* file = vfs_open(vfs, cmd->argv[i]);
+            if (!file) {
                 if (recursive) continue;
                 fprintf(out, "grep: %s: No such file\n", cmd->argv[i]);
                 continue;
             }
             
-            buffer[read] = '\0';
-            char* line = buffer;
+            LineCursor cursor;
+            line_cursor_init(&cursor, vfs, file);
+            const char* line;
+            size_t len;
             int line_num = 1;
             
-            while (*line) {
-                char* newline = strchr(line, '\n');
-                if (newline) *newline = '\0';
-                
-                char* search_text = line;
-                char search_pattern[256];
-                strncpy(search_pattern, pattern, sizeof(search_pattern) - 1);
-                search_pattern[sizeof(search_pattern) - 1] = '\0';
-                
-                if (case_insensitive) {
-                    char lower_line[4096];
-                    strncpy(lower_line, line, sizeof(lower_line) - 1);
-                    lower_line[sizeof(lower_line) - 1] = '\0';
-                    for (int j = 0; lower_line[j]; j++) {
-                        lower_line[j] = (char)tolower((unsigned char)lower_line[j]);
-                    }
-                    search_text = lower_line;
-                    
-                    for (int j = 0; search_pattern[j]; j++) {
-                        search_pattern[j] = (char)tolower((unsigned char)search_pattern[j]);
-                    }
-                }
-                
-                if (strstr(search_text, search_pattern)) {
-                    fprintf(out, "%s:%d:%s\n", cmd->argv[i], line_num, line);
-                }
-                
-                if (newline) {
-                    line = newline + 1;
-                    line_num++;
-                } else {
-                    break;
+            while (next_line(&cursor, &line, &len)) {
+                if (line_contains(line, len, pattern, case_insensitive)) {
+                    fprintf(out, "%s:%d:%.*s\n", cmd->argv[i], line_num, (int)len, line);
                 }
+                line_num++;
             }
+            
+            line_cursor_free(&cursor);
+            vfs_close_file(vfs, file);
         }
     }
     
@@ -850,6 +1319,31 @@ int builtin_grep(VFS* vfs, Command* cmd, int input_fd, int output_fd) {
 }
 
 // Find - search for files
+// Print the path of every entry below dir whose name matches, descending
+// into subdirectories. path holds dir and is extended in place.
+static bool find_in(VFS* vfs, char* path, const char* pattern, FILE* out) {
+    VFSDir* dir = vfs_open_dir(vfs, path);
+    if (!dir) return false;
+    
+    size_t len = strlen(path);
+    FileEntry entry;
+    while (vfs_read_dir(vfs, dir, &entry)) {
+        const char* sep = path[len - 1] == '/' ? "" : "/";
+        if (len + strlen(sep) + strlen(entry.name) >= MAX_PATH) continue;
+        sprintf(path + len, "%s%s", sep, entry.name);
+        
+        if (match_pattern(entry.name, pattern)) {
+            fprintf(out, "%s\n", path);
+        }
+        if (entry.type == FT_DIRECTORY) {
+            find_in(vfs, path, pattern, out);
+        }
+        path[len] = '\0';
+    }
+    vfs_close_dir(dir);
+    return true;
+}
+
 int builtin_find(VFS* vfs, Command* cmd, int input_fd, int output_fd) {
     if (cmd->argc < 3) {
         FILE* out = get_output_file(output_fd);
@@ -877,15 +1371,11 @@ int builtin_find(VFS* vfs, Command* cmd, int input_fd, int output_fd) {
         return 1;
     }
     
-    // List all files and match pattern
-    FileEntry entries[100];
-    int count = 0;
-    vfs_list_directory(vfs, search_path, entries, &count);
-    
-    for (int i = 0; i < count; i++) {
-        if (match_pattern(entries[i].name, pattern)) {
-            fprintf(out, "%s\n", entries[i].name);
-        }
+    char path[MAX_PATH];
+    if (!vfs_resolve_path(vfs, search_path, path) || !find_in(vfs, path, pattern, out)) {
+        fprintf(out, "find: '%s': No such file or directory\n", search_path);
+        if (out != stdout && out != stderr) fclose(out);
+        return 1;
     }
     
     if (out != stdout && out != stderr) fclose(out);
@@ -960,40 +1450,35 @@ int builtin_sed(VFS* vfs, Command* cmd, int input_fd, int output_fd) {
             fclose(in);
         }
     } else {
+        size_t old_len = strlen(old_str);
         for (int i = 2; i < cmd->argc; i++) {
-            char buffer[8192];
-            size_t read = vfs_read_file(vfs, cmd->argv[i], buffer, sizeof(buffer) - 1);
-            if (read == 0) {
+            VFSFile* file = vfs_open(vfs, cmd->argv[i]);
+            if (!file) {
                 fprintf(out, "sed: %s: No such file\n", cmd->argv[i]);
                 continue;
             }
             
-            buffer[read] = '\0';
-            char* line = buffer;
+            LineCursor cursor;
+            line_cursor_init(&cursor, vfs, file);
+            const char* line;
+            size_t len;
             
-            while (*line) {
-                char* newline = strchr(line, '\n');
-                if (newline) *newline = '\0';
-                
-                char* pos = strstr(line, old_str);
+            while (next_line(&cursor, &line, &len)) {
+                // Replace first occurrence
+                const char* pos = line_find(line, len, old_str, false);
                 if (pos) {
-                    char result[8192];
-                    size_t before_len = pos - line;
-                    strncpy(result, line, before_len);
-                    result[before_len] = '\0';
-                    strcat(result, new_str);
-                    strcat(result, pos + strlen(old_str));
-                    fprintf(out, "%s\n", result);
-                } else {
-                    fprintf(out, "%s\n", line);
-                }
-                
-                if (newline) {
-                    line = newline + 1;
+                    size_t before_len = (size_t)(pos - line);
+                    fwrite(line, 1, before_len, out);
+                    fputs(new_str, out);
+                    fwrite(pos + old_len, 1, len - before_len - old_len, out);
                 } else {
-                    break;
+                    fwrite(line, 1, len, out);
                 }
+                fputc('\n', out);
             }
+            
+            line_cursor_free(&cursor);
+            vfs_close_file(vfs, file);
         }
     }
     
@@ -1046,32 +1531,27 @@ int builtin_sort(VFS* vfs, Command* cmd, int input_fd, int output_fd) {
         }
     } else {
         for (int i = arg_start; i < cmd->argc; i++) {
-            char buffer[8192];
-            size_t read = vfs_read_file(vfs, cmd->argv[i], buffer, sizeof(buffer) - 1);
-            if (read == 0) {
+            VFSFile* file = vfs_open(vfs, cmd->argv[i]);
+            if (!file) {
                 fprintf(out, "sort: %s: No such file\n", cmd->argv[i]);
                 continue;
             }
             
-            buffer[read] = '\0';
-            char* line = buffer;
+            LineCursor cursor;
+            line_cursor_init(&cursor, vfs, file);
+            const char* line;
+            size_t len;
             
-            while (*line) {
-                char* newline = strchr(line, '\n');
-                if (newline) *newline = '\0';
-                
+            while (next_line(&cursor, &line, &len)) {
                 if (line_count >= capacity) {
                     capacity *= 2;
                     lines = (char**)xrealloc(lines, capacity * sizeof(char*));
                 }
-                lines[line_count++] = strdup(line);
-                
-                if (newline) {
-                    line = newline + 1;
-                } else {
-                    break;
-                }
+                lines[line_count++] = strdup(line_string(&cursor, line, len));
             }
+            
+            line_cursor_free(&cursor);
+            vfs_close_file(vfs, file);
         }
     }
     
@@ -1168,21 +1648,19 @@ int builtin_cut(VFS* vfs, Command* cmd, int input_fd, int output_fd) {
         }
     } else {
         for (int i = arg_start; i < cmd->argc; i++) {
-            char buffer[8192];
-            size_t read = vfs_read_file(vfs, cmd->argv[i], buffer, sizeof(buffer) - 1);
-            if (read == 0) {
+            VFSFile* file = vfs_open(vfs, cmd->argv[i]);
+            if (!file) {
                 fprintf(out, "cut: %s: No such file\n", cmd->argv[i]);
                 continue;
             }
             
-            buffer[read] = '\0';
-            char* line = buffer;
+            LineCursor cursor;
+            line_cursor_init(&cursor, vfs, file);
+            const char* line;
+            size_t len;
             
-            while (*line) {
-                char* newline = strchr(line, '\n');
-                if (newline) *newline = '\0';
-                
-                char* line_copy = strdup(line);
+            while (next_line(&cursor, &line, &len)) {
+                char* line_copy = line_string(&cursor, line, len);
                 char* token = strtok(line_copy, delimiter_str);
                 int current_field = 1;
                 
@@ -1194,15 +1672,10 @@ int builtin_cut(VFS* vfs, Command* cmd, int input_fd, int output_fd) {
                     token = strtok(NULL, delimiter_str);
                     current_field++;
                 }
-                
-                free(line_copy);
-                
-                if (newline) {
-                    line = newline + 1;
-                } else {
-                    break;
-                }
             }
+            
+            line_cursor_free(&cursor);
+            vfs_close_file(vfs, file);
         }
     }
     
@@ -39,6 +39,14 @@ int builtin_head(VFS* vfs, Command* cmd, int input_fd, int output_fd);
 int builtin_tail(VFS* vfs, Command* cmd, int input_fd, int output_fd);
 int builtin_date(VFS* vfs, Command* cmd, int input_fd, int output_fd);
 int builtin_stat(VFS* vfs, Command* cmd, int input_fd, int output_fd);
+int builtin_df(VFS* vfs, Command* cmd, int input_fd, int output_fd);
+int builtin_sync(VFS* vfs, Command* cmd, int input_fd, int output_fd);
+int builtin_fsck(VFS* vfs, Command* cmd, int input_fd, int output_fd);
+int builtin_scrub(VFS* vfs, Command* cmd, int input_fd, int output_fd);
+int builtin_import(VFS* vfs, Command* cmd, int input_fd, int output_fd);
+int builtin_export(VFS* vfs, Command* cmd, int input_fd, int output_fd);
+int builtin_compact(VFS* vfs, Command* cmd, int input_fd, int output_fd);
+int builtin_vfsstat(VFS* vfs, Command* cmd, int input_fd, int output_fd);
 int builtin_grep(VFS* vfs, Command* cmd, int input_fd, int output_fd);
 int builtin_find(VFS* vfs, Command* cmd, int input_fd, int output_fd);
 int builtin_sed(VFS* vfs, Command* cmd, int input_fd, int output_fd);
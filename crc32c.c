@@ -0,0 +1,193 @@
+#include "crc32c.h"
+#include <string.h>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define CRC32C_HARDWARE
+#include <nmmintrin.h>
+#endif
+
+// Reflected Castagnoli polynomial
+#define CRC32C_POLY 0x82F63B78u
+
+// table[k][b] is the CRC of byte b followed by k zero bytes
+static uint32_t table[8][256];
+static uint32_t (*implementation)(uint32_t, const unsigned char*, size_t);
+
+static void build_tables(void) {
+    for (uint32_t b = 0; b < 256; b++) {
+        uint32_t crc = b;
+        for (int bit = 0; bit < 8; bit++) {
+            crc = (crc >> 1) ^ (CRC32C_POLY & (0u - (crc & 1)));
+        }
+        table[0][b] = crc;
+    }
+    for (uint32_t b = 0; b < 256; b++) {
+        for (int k = 1; k < 8; k++) {
+            table[k][b] = (table[k - 1][b] >> 8) ^ table[0][table[k - 1][b] & 0xFF];
+        }
+    }
+}
+
+// Eight bytes per step through eight tables. Words are read little-endian,
+// as on every platform the shell builds for.
+static uint32_t crc32c_software(uint32_t crc, const unsigned char* p, size_t len) {
+    while (len >= 8) {
+        uint32_t lo, hi;
+        memcpy(&lo, p, 4);
+        memcpy(&hi, p + 4, 4);
+        lo ^= crc;
+        crc = table[7][lo & 0xFF] ^ table[6][(lo >> 8) & 0xFF] ^
+              table[5][(lo >> 16) & 0xFF] ^ table[4][lo >> 24] ^
+              table[3][hi & 0xFF] ^ table[2][(hi >> 8) & 0xFF] ^
+              table[1][(hi >> 16) & 0xFF] ^ table[0][hi >> 24];
+        p += 8;
+        len -= 8;
+    }
+    while (len-- > 0) {
+        crc = table[0][(crc ^ *p++) & 0xFF] ^ (crc >> 8);
+    }
+    return crc;
+}
+
+#ifdef CRC32C_HARDWARE
+#ifdef __x86_64__
+// The crc32 instruction takes three cycles but can start every cycle, so
+// long buffers are cut into three lanes whose CRCs are computed side by
+// side. Shifting a CRC past n zero bytes is linear, so the lanes are
+// joined with one table lookup per byte of CRC.
+#define CRC32C_LONG 1024
+#define CRC32C_SHORT 128
+
+static uint32_t zeros_long[4][256];
+static uint32_t zeros_short[4][256];
+
+// Multiply a vector by a 32x32 matrix over GF(2), one word per column
+static uint32_t gf2_times(const uint32_t* matrix, uint32_t vector) {
+    uint32_t sum = 0;
+    for (; vector; vector >>= 1, matrix++) {
+        if (vector & 1) sum ^= *matrix;
+    }
+    return sum;
+}
+
+static void gf2_square(uint32_t* square, const uint32_t* matrix) {
+    for (int n = 0; n < 32; n++) {
+        square[n] = gf2_times(matrix, matrix[n]);
+    }
+}
+
+// zeros[k][b] shifts byte k of a CRC past len zero bytes; len is a power
+// of two
+static void build_zeros(uint32_t zeros[4][256], size_t len) {
+    uint32_t even[32];
+    uint32_t odd[32];
+    
+    // One zero bit, then squared up to one zero byte and on to len
+    odd[0] = CRC32C_POLY;
+    for (int n = 1; n < 32; n++) {
+        odd[n] = 1u << (n - 1);
+    }
+    gf2_square(even, odd);
+    gf2_square(odd, even);
+    uint32_t* op = odd;
+    for (;;) {
+        gf2_square(even, odd);
+        op = even;
+        len >>= 1;
+        if (len == 0) break;
+        gf2_square(odd, even);
+        op = odd;
+        len >>= 1;
+        if (len == 0) break;
+    }
+    
+    for (uint32_t b = 0; b < 256; b++) {
+        for (int k = 0; k < 4; k++) {
+            zeros[k][b] = gf2_times(op, b << (8 * k));
+        }
+    }
+}
+
+static uint32_t shift(uint32_t zeros[4][256], uint32_t crc) {
+    return zeros[0][crc & 0xFF] ^ zeros[1][(crc >> 8) & 0xFF] ^
+           zeros[2][(crc >> 16) & 0xFF] ^ zeros[3][crc >> 24];
+}
+
+__attribute__((target("sse4.2")))
+static uint64_t three_lanes(uint64_t crc, const unsigned char* p, size_t lane, uint32_t zeros[4][256]) {
+    uint64_t crc1 = 0;
+    uint64_t crc2 = 0;
+    for (size_t i = 0; i < lane; i += 8) {
+        uint64_t w0, w1, w2;
+        memcpy(&w0, p + i, 8);
+        memcpy(&w1, p + lane + i, 8);
+        memcpy(&w2, p + 2 * lane + i, 8);
+        crc = _mm_crc32_u64(crc, w0);
+        crc1 = _mm_crc32_u64(crc1, w1);
+        crc2 = _mm_crc32_u64(crc2, w2);
+    }
+    crc = shift(zeros, (uint32_t)crc) ^ (uint32_t)crc1;
+    return shift(zeros, (uint32_t)crc) ^ (uint32_t)crc2;
+}
+#endif
+
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_hardware(uint32_t crc, const unsigned char* p, size_t len) {
+#ifdef __x86_64__
+    uint64_t wide = crc;
+    while (len >= 3 * CRC32C_LONG) {
+        wide = three_lanes(wide, p, CRC32C_LONG, zeros_long);
+        p += 3 * CRC32C_LONG;
+        len -= 3 * CRC32C_LONG;
+    }
+    while (len >= 3 * CRC32C_SHORT) {
+        wide = three_lanes(wide, p, CRC32C_SHORT, zeros_short);
+        p += 3 * CRC32C_SHORT;
+        len -= 3 * CRC32C_SHORT;
+    }
+    while (len >= 8) {
+        uint64_t word;
+        memcpy(&word, p, 8);
+        wide = _mm_crc32_u64(wide, word);
+        p += 8;
+        len -= 8;
+    }
+    crc = (uint32_t)wide;
+#endif
+    while (len >= 4) {
+        uint32_t word;
+        memcpy(&word, p, 4);
+        crc = _mm_crc32_u32(crc, word);
+        p += 4;
+        len -= 4;
+    }
+    while (len-- > 0) {
+        crc = _mm_crc32_u8(crc, *p++);
+    }
+    return crc;
+}
+#endif
+
+const char* crc32c_implementation(void) {
+    if (!implementation) {
+#ifdef CRC32C_HARDWARE
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("sse4.2")) {
+#ifdef __x86_64__
+            build_zeros(zeros_long, CRC32C_LONG);
+            build_zeros(zeros_short, CRC32C_SHORT);
+#endif
+            implementation = crc32c_hardware;
+            return "sse4.2";
+        }
+#endif
+        build_tables();
+        implementation = crc32c_software;
+    }
+    return implementation == crc32c_software ? "slicing-by-8" : "sse4.2";
+}
+
+uint32_t crc32c(uint32_t crc, const void* data, size_t len) {
+    if (!implementation) crc32c_implementation();
+    return ~implementation(~crc, (const unsigned char*)data, len);
+}
@@ -0,0 +1,17 @@
+#ifndef CRC32C_H
+#define CRC32C_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// CRC-32C (Castagnoli), used to checksum VFS data blocks. Runs on the
+// SSE4.2 crc32 instruction when the CPU has it and falls back to
+// slicing-by-8 tables otherwise. Pass 0 to start and the previous result
+// to continue: crc32c(crc32c(0, a, n), b, m) is the CRC of a followed by b.
+uint32_t crc32c(uint32_t crc, const void* data, size_t len);
+
+// Name of the implementation in use, "sse4.2" or "slicing-by-8". Also
+// picks it, so call this once before using crc32c from several threads.
+const char* crc32c_implementation(void);
+
+#endif // CRC32C_H
@@ -159,12 +159,17 @@ static bool parse_instruction(const char* line, Instruction* inst) {
 bool interpreter_load_from_vfs(Interpreter* interp, VFS* vfs, const char* script_path) {
     if (!interp || !vfs || !script_path) return false;
     
-    char buffer[8192];
-    size_t read = vfs_read_file(vfs, script_path, buffer, sizeof(buffer) - 1);
-    if (read == 0) return false;
+    VFSFile* file = vfs_open(vfs, script_path);
+    if (!file) return false;
     
+    char* buffer = (char*)xmalloc((size_t)file->size + 1);
+    size_t read = vfs_read(vfs, file, buffer, (size_t)file->size);
+    vfs_close_file(vfs, file);
     buffer[read] = '\0';
-    return interpreter_load_from_string(interp, buffer);
+    
+    bool loaded = read > 0 && interpreter_load_from_string(interp, buffer);
+    free(buffer);
+    return loaded;
 }
 
 bool interpreter_load_from_string(Interpreter* interp, const char* script) {
@@ -0,0 +1,141 @@
+#include "lz.h"
+#include <stdint.h>
+#include <string.h>
+
+// Positions of recent 4-byte sequences, found by hash
+#define LZ_HASH_BITS 12
+
+static uint32_t read32(const unsigned char* p) {
+    uint32_t value;
+    memcpy(&value, p, sizeof(value));
+    return value;
+}
+
+static uint32_t hash4(uint32_t value) {
+    return (value * 2654435761u) >> (32 - LZ_HASH_BITS);
+}
+
+// A count that does not fit in its token nibble continues in bytes of 255
+// followed by the remainder
+static unsigned char* put_length(unsigned char* op, const unsigned char* end, size_t n) {
+    while (n >= 255) {
+        if (op >= end) return NULL;
+        *op++ = 255;
+        n -= 255;
+    }
+    if (op >= end) return NULL;
+    *op++ = (unsigned char)n;
+    return op;
+}
+
+static int get_length(const unsigned char** ip, const unsigned char* end, size_t* n) {
+    unsigned char byte;
+    do {
+        if (*ip >= end) return 0;
+        byte = *(*ip)++;
+        *n += byte;
+    } while (byte == 255);
+    return 1;
+}
+
+// Emit literals followed by a match; the last sequence has no match
+static unsigned char* put_sequence(unsigned char* op, const unsigned char* end,
+                                   const unsigned char* literals, size_t literal_len,
+                                   size_t offset, size_t match_len) {
+    if (op >= end) return NULL;
+    unsigned char* token = op++;
+    *token = (unsigned char)((literal_len < 15 ? literal_len : 15) << 4);
+    if (literal_len >= 15 && !(op = put_length(op, end, literal_len - 15))) return NULL;
+    
+    if ((size_t)(end - op) < literal_len) return NULL;
+    memcpy(op, literals, literal_len);
+    op += literal_len;
+    if (match_len == 0) return op;
+    
+    if (end - op < 2) return NULL;
+    *op++ = (unsigned char)(offset & 0xFF);
+    *op++ = (unsigned char)(offset >> 8);
+    
+    size_t extra = match_len - LZ_MIN_MATCH;
+    *token |= (unsigned char)(extra < 15 ? extra : 15);
+    if (extra >= 15 && !(op = put_length(op, end, extra - 15))) return NULL;
+    return op;
+}
+
+// Greedy parse: take the longest match against the last position with the
+// same 4-byte hash
+size_t lz_compress(const char* src, size_t len, char* dst, size_t capacity) {
+    const unsigned char* in = (const unsigned char*)src;
+    unsigned char* op = (unsigned char*)dst;
+    const unsigned char* end = op + capacity;
+    
+    uint32_t table[1 << LZ_HASH_BITS];  // Position + 1, 0 when empty
+    memset(table, 0, sizeof(table));
+    
+    size_t anchor = 0;
+    size_t pos = 0;
+    while (len >= LZ_MIN_MATCH && pos <= len - LZ_MIN_MATCH) {
+        uint32_t sequence = read32(in + pos);
+        uint32_t hash = hash4(sequence);
+        size_t candidate = table[hash];
+        table[hash] = (uint32_t)pos + 1;
+        
+        if (candidate == 0 || pos - (candidate - 1) > LZ_MAX_OFFSET ||
+            read32(in + candidate - 1) != sequence) {
+            pos++;
+            continue;
+        }
+        
+        size_t ref = candidate - 1;
+        size_t match = LZ_MIN_MATCH;
+        while (pos + match < len && in[ref + match] == in[pos + match]) {
+            match++;
+        }
+        op = put_sequence(op, end, in + anchor, pos - anchor, pos - ref, match);
+        if (!op) return 0;
+        pos += match;
+        anchor = pos;
+    }
+    
+    op = put_sequence(op, end, in + anchor, len - anchor, 0, 0);
+    return op ? (size_t)(op - (unsigned char*)dst) : 0;
+}
+
+size_t lz_decompress(const char* src, size_t len, char* dst, size_t capacity) {
+    const unsigned char* ip = (const unsigned char*)src;
+    const unsigned char* in_end = ip + len;
+    unsigned char* op = (unsigned char*)dst;
+    unsigned char* out_end = op + capacity;
+    
+    while (ip < in_end) {
+        unsigned token = *ip++;
+        size_t literal_len = token >> 4;
+        if (literal_len == 15 && !get_length(&ip, in_end, &literal_len)) return 0;
+        if ((size_t)(in_end - ip) < literal_len || (size_t)(out_end - op) < literal_len) return 0;
+        memcpy(op, ip, literal_len);
+        op += literal_len;
+        ip += literal_len;
+        if (ip == in_end) break;
+        
+        if (in_end - ip < 2) return 0;
+        size_t offset = (size_t)ip[0] | ((size_t)ip[1] << 8);
+        ip += 2;
+        size_t match = token & 15;
+        if (match == 15 && !get_length(&ip, in_end, &match)) return 0;
+        match += LZ_MIN_MATCH;
+        if (offset == 0 || offset > (size_t)(op - (unsigned char*)dst) ||
+            (size_t)(out_end - op) < match) {
+            return 0;
+        }
+        
+        // A match may overlap the bytes it produces
+        const unsigned char* ref = op - offset;
+        if (offset >= match) {
+            memcpy(op, ref, match);
+            op += match;
+        } else {
+            while (match-- > 0) *op++ = *ref++;
+        }
+    }
+    return (size_t)(op - (unsigned char*)dst);
+}
@@ -0,0 +1,21 @@
+#ifndef LZ_H
+#define LZ_H
+
+#include <stddef.h>
+
+// Small LZ77 codec in the style of LZ4, used to compress VFS file data.
+// Each sequence is a token byte (literal count, match length), the
+// literals, and a 16-bit offset back to the match. There is no entropy
+// coding, so both directions run at memory speed.
+#define LZ_MIN_MATCH 4
+#define LZ_MAX_OFFSET 65535
+
+// Compress len bytes into dst. Returns the compressed size, or 0 when it
+// would not fit in capacity.
+size_t lz_compress(const char* src, size_t len, char* dst, size_t capacity);
+
+// Decompress into dst. Returns the decompressed size, or 0 when the input
+// is malformed or would overflow capacity.
+size_t lz_decompress(const char* src, size_t len, char* dst, size_t capacity);
+
+#endif // LZ_H
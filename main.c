@@ -3,17 +3,36 @@
 #include "utils.h"
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 int main(int argc, char* argv[]) {
     const char* vfs_file = NULL;
+    VFSOptions options = {0};
+    options.cache_bytes = VFS_DEFAULT_CACHE_BYTES;
     
-    // Check for VFS file argument
-    if (argc > 1) {
-        vfs_file = argv[1];
+    // Parse options, then the optional VFS file argument
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--mmap") == 0) {
+            options.use_mmap = true;
+        } else if (strncmp(argv[i], "--cache=", 8) == 0) {
+            options.cache_bytes = (size_t)strtoul(argv[i] + 8, NULL, 10) * 1024;
+        } else if (strcmp(argv[i], "--compress") == 0) {
+            options.compress = true;
+        } else if (strcmp(argv[i], "--dedup") == 0) {
+            options.dedup = true;
+        } else if (strcmp(argv[i], "--verify=fail") == 0) {
+            options.verify = VFS_VERIFY_FAIL;
+        } else if (strcmp(argv[i], "--verify=warn") == 0) {
+            options.verify = VFS_VERIFY_WARN;
+        } else if (strcmp(argv[i], "--verify=off") == 0) {
+            options.verify = VFS_VERIFY_OFF;
+        } else if (!vfs_file) {
+            vfs_file = argv[i];
+        }
     }
     
     // Initialize VFS
-    VFS* vfs = vfs_init(vfs_file);
+    VFS* vfs = vfs_init_with_options(vfs_file, &options);
     if (!vfs) {
         print_error("Failed to initialize virtual filesystem");
         return 1;
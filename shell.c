@@ -26,6 +26,13 @@ void signal_handler(int sig) {
     last_signal = sig;
 }
 
+// Long-running builtins poll this between steps to stop on Ctrl-C
+bool shell_interrupted(void) {
+    if (!signal_received || last_signal != SIGINT) return false;
+    signal_received = false;
+    return true;
+}
+
 void shell_init(VFS* vfs) {
     // Initialize history
     history_capacity = MAX_HISTORY;
@@ -196,7 +203,7 @@ int execute_command(VFS* vfs, Command* cmd, int input_fd, int output_fd) {
     
     // Handle VFS output redirection (before Windows file redirection)
     bool vfs_output_redirect = false;
-    bool vfs_append = false;
+    bool vfs_append_output = false;
     char* vfs_output_file = NULL;
     
     if (cmd->output_file) {
@@ -206,7 +213,7 @@ int execute_command(VFS* vfs, Command* cmd, int input_fd, int output_fd) {
             (cmd->output_file[0] == '/' || cmd->output_file[0] == '\\')) {
             vfs_output_redirect = true;
             vfs_output_file = cmd->output_file;
-            vfs_append = cmd->append_output;
+            vfs_append_output = cmd->append_output;
             // Temporarily clear output_file to avoid Windows file creation
             cmd->output_file = NULL;
         }
@@ -215,8 +222,7 @@ int execute_command(VFS* vfs, Command* cmd, int input_fd, int output_fd) {
     // Handle input redirection (for VFS files)
     bool vfs_input_redirect = false;
     char* vfs_input_file = NULL;
-    char* input_content = NULL;
-    size_t input_size = 0;
+    VFSFile* input_handle = NULL;
     
     if (cmd->input_file) {
         // Check if this looks like a VFS path
@@ -224,13 +230,11 @@ int execute_command(VFS* vfs, Command* cmd, int input_fd, int output_fd) {
             (cmd->input_file[0] == '/' || cmd->input_file[0] == '\\')) {
             vfs_input_redirect = true;
             vfs_input_file = cmd->input_file;
-            // Read content from VFS
-            char buffer[8192];
-            input_size = vfs_read_file(vfs, vfs_input_file, buffer, sizeof(buffer) - 1);
-            if (input_size > 0) {
-                input_content = (char*)xmalloc(input_size + 1);
-                memcpy(input_content, buffer, input_size);
-                input_content[input_size] = '\0';
+            // Open the VFS file; its content is streamed in below
+            input_handle = vfs_open(vfs, vfs_input_file);
+            if (input_handle && input_handle->size == 0) {
+                vfs_close_file(vfs, input_handle);
+                input_handle = NULL;
             }
             // Temporarily clear input_file to avoid Windows file opening
             cmd->input_file = NULL;
@@ -244,7 +248,7 @@ int execute_command(VFS* vfs, Command* cmd, int input_fd, int output_fd) {
     if (setup_redirection(cmd, &input_fd, &output_fd) != 0 && 
         (!vfs_input_redirect && !vfs_output_redirect)) {
         fprintf(stderr, "Error setting up redirection\n");
-        if (input_content) free(input_content);
+        if (input_handle) vfs_close_file(vfs, input_handle);
         // Restore cmd fields
         if (vfs_output_file) cmd->output_file = vfs_output_file;
         if (vfs_input_file) cmd->input_file = vfs_input_file;
@@ -253,11 +257,15 @@ int execute_command(VFS* vfs, Command* cmd, int input_fd, int output_fd) {
     
     // If we have VFS input, create a temporary file or use a pipe
     FILE* vfs_input_file_ptr = NULL;
-    if (vfs_input_redirect && input_content) {
+    if (vfs_input_redirect && input_handle) {
         // Create a temporary file with the VFS content
         vfs_input_file_ptr = tmpfile();
         if (vfs_input_file_ptr) {
-            fwrite(input_content, 1, input_size, vfs_input_file_ptr);
+            const char* data;
+            size_t len;
+            while (vfs_read_chunk(vfs, input_handle, &data, &len)) {
+                fwrite(data, 1, len, vfs_input_file_ptr);
+            }
             rewind(vfs_input_file_ptr);
             input_fd = _fileno(vfs_input_file_ptr);
         }
@@ -303,44 +311,46 @@ int execute_command(VFS* vfs, Command* cmd, int input_fd, int output_fd) {
         fflush(vfs_output_file_ptr);
         rewind(vfs_output_file_ptr);
         
-        // Read all output
-        char output_buffer[8192];
-        size_t output_size = fread(output_buffer, 1, sizeof(output_buffer) - 1, vfs_output_file_ptr);
-        output_buffer[output_size] = '\0';
-        
         // Ensure directory exists (create if needed)
         // Extract directory from path (e.g., "projects/readme.txt" -> "projects")
         char* dir_path = strdup(vfs_output_file);
         char* last_slash = strrchr(dir_path, '/');
         if (last_slash && last_slash != dir_path) {
             *last_slash = '\0';
-            // Remove leading slash if present
-            if (dir_path[0] == '/') {
-                memmove(dir_path, dir_path + 1, strlen(dir_path));
-            }
-            if (strlen(dir_path) > 0) {
-                // Try to create directory (vfs_create_directory handles if exists)
-                vfs_create_directory(vfs, dir_path);
+            // Create each missing level in turn (vfs_create_directory handles if exists)
+            for (char* p = dir_path + 1; ; p++) {
+                if (*p == '/' || *p == '\0') {
+                    char saved = *p;
+                    *p = '\0';
+                    vfs_create_directory(vfs, dir_path);
+                    *p = saved;
+                    if (saved == '\0') break;
+                }
             }
         }
         free(dir_path);
         
-        // Write to VFS
-        if (vfs_append && vfs_file_exists(vfs, vfs_output_file)) {
-            // Read existing content
-            char existing[8192];
-            size_t existing_size = vfs_read_file(vfs, vfs_output_file, existing, sizeof(existing) - 1);
-            if (existing_size > 0) {
-                existing[existing_size] = '\0';
-                // Combine existing + new
-                char combined[16384];
-                snprintf(combined, sizeof(combined), "%s%s", existing, output_buffer);
-                vfs_write_file(vfs, vfs_output_file, combined, strlen(combined));
-            } else {
-                vfs_write_file(vfs, vfs_output_file, output_buffer, output_size);
+        // Stream the output into the VFS file; >> only adds to its end.
+        // Its size is known by now, so the blocks are reserved in one run.
+        VFSFile* writer = vfs_open_writer(vfs, vfs_output_file, vfs_append_output);
+        if (writer) {
+            fseek(vfs_output_file_ptr, 0, SEEK_END);
+            long output_total = ftell(vfs_output_file_ptr);
+            rewind(vfs_output_file_ptr);
+            if (output_total > 0) {
+                vfs_reserve(vfs, vfs_output_file, writer->size + (uint64_t)output_total);
+            }
+            char output_buffer[8192];
+            size_t output_size;
+            while ((output_size = fread(output_buffer, 1, sizeof(output_buffer), vfs_output_file_ptr)) > 0) {
+                if (!vfs_write(vfs, writer, output_buffer, output_size)) break;
+            }
+            if (!vfs_flush(vfs, writer)) {
+                fprintf(stderr, "%s: write failed\n", vfs_output_file);
             }
+            vfs_close_file(vfs, writer);
         } else {
-            vfs_write_file(vfs, vfs_output_file, output_buffer, output_size);
+            fprintf(stderr, "%s: cannot open for writing\n", vfs_output_file);
         }
         
         fclose(vfs_output_file_ptr);
@@ -350,7 +360,7 @@ int execute_command(VFS* vfs, Command* cmd, int input_fd, int output_fd) {
     if (vfs_input_file_ptr) {
         fclose(vfs_input_file_ptr);
     }
-    if (input_content) free(input_content);
+    if (input_handle) vfs_close_file(vfs, input_handle);
     
     // Restore cmd fields
     if (vfs_output_file) cmd->output_file = vfs_output_file;
@@ -519,8 +529,10 @@ int shell_run(VFS* vfs) {
             continue;
         }
         
-        // Execute pipeline
+        // Execute pipeline as one VFS transaction: one sync per command line
+        vfs_begin(vfs);
         execute_command_pipeline(vfs, pipeline);
+        vfs_commit(vfs);
         
         // Cleanup
         free_command_pipeline(pipeline);
@@ -34,5 +34,6 @@ int setup_redirection(Command* cmd, int* input_fd, int* output_fd);
 void cleanup_redirection(int input_fd, int output_fd, int original_input, int original_output);
 int create_pipe(int* read_fd, int* write_fd);
 void signal_handler(int sig);
+bool shell_interrupted(void);
 
 #endif // SHELL_H
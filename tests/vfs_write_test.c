@@ -0,0 +1,174 @@
+#include "../vfs.h"
+#include "../utils.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define TEST_IMAGE "vfs_write_test.dat"
+#define FILE_SIZE (4 * 1024 * 1024)
+#define RANDOM_WRITES 5000
+#define SPARSE_STRIDE (2 * BLOCK_SIZE)
+#define SPARSE_WRITES 2048
+#define COMPRESSED_SIZE (40 * 1024 * 1024)
+#define COMPRESSED_APPEND (1024 * 1024)
+#define COMPRESSED_WRITES 200
+
+static int failures = 0;
+
+static void check(bool ok, const char* what) {
+    if (!ok) {
+        fprintf(stderr, "FAIL: %s\n", what);
+        failures++;
+    }
+}
+
+// Read the file back whole and compare it with what it should hold
+static void check_contents(VFS* vfs, const char* path, const char* expected, size_t len, const char* what) {
+    char* data = (char*)malloc(len + 1);
+    size_t got = vfs_read_file(vfs, path, data, len + 1);
+    check(got == len && memcmp(data, expected, len) == 0, what);
+    free(data);
+}
+
+// Small writes at random offsets of a file the file has to itself are
+// made where the data is, so the extent list does not grow with them
+static void random_writes(void) {
+    remove(TEST_IMAGE);
+    VFS* vfs = vfs_init(TEST_IMAGE);
+    char* shadow = (char*)malloc(FILE_SIZE);
+    for (size_t i = 0; i < FILE_SIZE; i++) {
+        shadow[i] = (char)(i * 7);
+    }
+    check(vfs_write_file(vfs, "/random", shadow, FILE_SIZE), "write 4 MB file");
+    
+    srand(1);
+    for (int i = 0; i < RANDOM_WRITES; i++) {
+        uint64_t offset = ((uint64_t)rand() * RAND_MAX + rand()) % FILE_SIZE;
+        char byte = (char)rand();
+        shadow[offset] = byte;
+        if (!vfs_write_at(vfs, "/random", offset, &byte, 1)) {
+            fprintf(stderr, "FAIL: 1-byte write %d at %llu\n", i, (unsigned long long)offset);
+            failures++;
+            break;
+        }
+    }
+    
+    FileEntry entry;
+    check(vfs_stat(vfs, "/random", &entry) && entry.extent_count == 1, "random writes keep one extent");
+    check_contents(vfs, "/random", shadow, FILE_SIZE, "random writes read back");
+    vfs_close(vfs);
+    
+    vfs = vfs_init(TEST_IMAGE);
+    check_contents(vfs, "/random", shadow, FILE_SIZE, "random writes read back after reopening");
+    vfs_close(vfs);
+    free(shadow);
+}
+
+// A write every other block past the end of a file leaves a hole and a
+// block each time, many more extents than fit in one overflow block
+static void sparse_writes(void) {
+    remove(TEST_IMAGE);
+    VFS* vfs = vfs_init(TEST_IMAGE);
+    size_t size = (size_t)SPARSE_WRITES * SPARSE_STRIDE + 1;
+    char* shadow = (char*)calloc(size, 1);
+    for (int i = 0; i <= SPARSE_WRITES; i++) {
+        uint64_t offset = (uint64_t)i * SPARSE_STRIDE;
+        char byte = (char)(i + 1);
+        shadow[offset] = byte;
+        if (!vfs_write_at(vfs, "/sparse", offset, &byte, 1)) {
+            fprintf(stderr, "FAIL: sparse write %d\n", i);
+            failures++;
+            break;
+        }
+    }
+    
+    FileEntry entry;
+    check(vfs_stat(vfs, "/sparse", &entry) && entry.extent_count > 2 * SPARSE_WRITES - 1,
+          "sparse writes keep a hole between blocks");
+    check_contents(vfs, "/sparse", shadow, size, "sparse writes read back");
+    
+    // Filling the holes in order joins the new blocks into long extents
+    for (int i = 0; i < SPARSE_WRITES; i++) {
+        uint64_t offset = (uint64_t)i * SPARSE_STRIDE + BLOCK_SIZE;
+        char byte = (char)(i + 2);
+        shadow[offset] = byte;
+        if (!vfs_write_at(vfs, "/sparse", offset, &byte, 1)) {
+            fprintf(stderr, "FAIL: hole write %d\n", i);
+            failures++;
+            break;
+        }
+    }
+    check_contents(vfs, "/sparse", shadow, size, "filled holes read back");
+    vfs_close(vfs);
+    
+    vfs = vfs_init(TEST_IMAGE);
+    check_contents(vfs, "/sparse", shadow, size, "sparse file read back after reopening");
+    VFSCheckResult result;
+    check(vfs_check(vfs, 1, true, stderr, &result) && result.problems == 0, "fsck finds no problems");
+    vfs_close(vfs);
+    free(shadow);
+}
+
+// A compressed file keeps a chunk index entry per chunk however large it
+// grows, and a small write into it stores only the chunk it lands in again
+static void compressed_writes(void) {
+    remove(TEST_IMAGE);
+    VFSOptions options;
+    memset(&options, 0, sizeof(options));
+    options.cache_bytes = 1024 * 1024;
+    options.compress = true;
+    VFS* vfs = vfs_init_with_options(TEST_IMAGE, &options);
+    char* shadow = (char*)malloc(COMPRESSED_SIZE);
+    for (size_t i = 0; i < COMPRESSED_SIZE; i++) {
+        shadow[i] = "log line\n"[i % 9];
+    }
+    for (size_t at = 0; at < COMPRESSED_SIZE; at += COMPRESSED_APPEND) {
+        if (!vfs_append(vfs, "/log", shadow + at, COMPRESSED_APPEND)) {
+            fprintf(stderr, "FAIL: compressed append at %zu\n", at);
+            failures++;
+            break;
+        }
+    }
+    
+    uint32_t chunks = COMPRESSED_SIZE / VFS_CHUNK_SIZE;
+    FileEntry entry;
+    check(vfs_stat(vfs, "/log", &entry) && entry.chunk_count == chunks && entry.extent_count == chunks,
+          "compressed file keeps every chunk in its chunk index");
+    
+    srand(2);
+    for (int i = 0; i < COMPRESSED_WRITES; i++) {
+        uint64_t offset = ((uint64_t)rand() * RAND_MAX + rand()) % COMPRESSED_SIZE;
+        char byte = (char)('a' + i % 26);
+        shadow[offset] = byte;
+        if (!vfs_write_at(vfs, "/log", offset, &byte, 1)) {
+            fprintf(stderr, "FAIL: compressed write %d at %llu\n", i, (unsigned long long)offset);
+            failures++;
+            break;
+        }
+    }
+    check(vfs_stat(vfs, "/log", &entry) && entry.chunk_count == chunks && entry.extent_count == chunks,
+          "small writes keep the chunk index whole");
+    check_contents(vfs, "/log", shadow, COMPRESSED_SIZE, "compressed writes read back");
+    vfs_close(vfs);
+    
+    vfs = vfs_init(TEST_IMAGE);
+    check_contents(vfs, "/log", shadow, COMPRESSED_SIZE, "compressed file read back after reopening");
+    VFSCheckResult result;
+    check(vfs_check(vfs, 1, true, stderr, &result) && result.problems == 0, "fsck finds no problems");
+    vfs_close(vfs);
+    free(shadow);
+}
+
+int main(void) {
+    random_writes();
+    sparse_writes();
+    compressed_writes();
+    remove(TEST_IMAGE);
+    
+    if (failures > 0) {
+        fprintf(stderr, "%d check(s) failed\n", failures);
+        return 1;
+    }
+    printf("vfs write tests passed\n");
+    return 0;
+}
@@ -0,0 +1,767 @@
+#ifndef _WIN32
+#define _POSIX_C_SOURCE 200809L
+#define _FILE_OFFSET_BITS 64
+#endif
+#ifdef __linux__
+#define _GNU_SOURCE              // SEEK_DATA and SEEK_HOLE
+#endif
+
+#include "transfer.h"
+#include "utils.h"
+#include <errno.h>
+#include <string.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+
+#ifdef _WIN32
+#include <io.h>
+#include <windows.h>
+#else
+#include <dirent.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+// An import commits after this much data or this many files
+#define TRANSFER_BATCH_BYTES ((uint64_t)64 << 20)
+#define TRANSFER_BATCH_FILES 1024
+#define TRANSFER_AHEAD 4         // Files each worker may prepare ahead of the writer
+#define TRANSFER_MAX_THREADS 64
+
+// One file or directory of a tree, by its path below the top
+typedef struct {
+    char* path;              // '/'-separated, "" for the top itself
+    bool directory;
+    uint64_t size;
+} TransferItem;
+
+typedef struct {
+    TransferItem* items;
+    size_t count;
+    size_t capacity;
+} TransferList;
+
+static void list_add(TransferList* list, const char* path, bool directory, uint64_t size) {
+    if (list->count == list->capacity) {
+        list->capacity = list->capacity ? list->capacity * 2 : 256;
+        list->items = (TransferItem*)xrealloc(list->items, list->capacity * sizeof(TransferItem));
+    }
+    TransferItem* item = &list->items[list->count++];
+    item->path = strdup(path);
+    item->directory = directory;
+    item->size = size;
+}
+
+static void list_free(TransferList* list) {
+    for (size_t i = 0; i < list->count; i++) {
+        free(list->items[i].path);
+    }
+    free(list->items);
+}
+
+// base/name, or name alone when base is empty
+static char* path_join(const char* base, const char* name) {
+    if (!name[0]) return strdup(base);
+    if (!base[0]) return strdup(name);
+    
+    size_t base_len = strlen(base);
+    bool slash = base[base_len - 1] == '/' || base[base_len - 1] == '\\';
+    char* path = (char*)xmalloc(base_len + strlen(name) + 2);
+    strcpy(path, base);
+    if (!slash) strcat(path, "/");
+    strcat(path, name);
+    return path;
+}
+
+// Threads wait for each other through one lock and one condition
+typedef struct {
+#ifdef _WIN32
+    CRITICAL_SECTION lock;
+    CONDITION_VARIABLE changed;
+#else
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+#endif
+} Monitor;
+
+static void monitor_init(Monitor* monitor) {
+#ifdef _WIN32
+    InitializeCriticalSection(&monitor->lock);
+    InitializeConditionVariable(&monitor->changed);
+#else
+    pthread_mutex_init(&monitor->lock, NULL);
+    pthread_cond_init(&monitor->changed, NULL);
+#endif
+}
+
+static void monitor_free(Monitor* monitor) {
+#ifdef _WIN32
+    DeleteCriticalSection(&monitor->lock);
+#else
+    pthread_mutex_destroy(&monitor->lock);
+    pthread_cond_destroy(&monitor->changed);
+#endif
+}
+
+static void monitor_enter(Monitor* monitor) {
+#ifdef _WIN32
+    EnterCriticalSection(&monitor->lock);
+#else
+    pthread_mutex_lock(&monitor->lock);
+#endif
+}
+
+static void monitor_leave(Monitor* monitor) {
+#ifdef _WIN32
+    LeaveCriticalSection(&monitor->lock);
+#else
+    pthread_mutex_unlock(&monitor->lock);
+#endif
+}
+
+static void monitor_wait(Monitor* monitor) {
+#ifdef _WIN32
+    SleepConditionVariableCS(&monitor->changed, &monitor->lock, INFINITE);
+#else
+    pthread_cond_wait(&monitor->changed, &monitor->lock);
+#endif
+}
+
+static void monitor_wake(Monitor* monitor) {
+#ifdef _WIN32
+    WakeAllConditionVariable(&monitor->changed);
+#else
+    pthread_cond_broadcast(&monitor->changed);
+#endif
+}
+
+// Worker threads all run the same function on a shared job
+typedef struct {
+    void (*work)(void* job);
+    void* job;
+    int count;
+#ifdef _WIN32
+    HANDLE handles[TRANSFER_MAX_THREADS];
+#else
+    pthread_t handles[TRANSFER_MAX_THREADS];
+#endif
+} Workers;
+
+#ifdef _WIN32
+static DWORD WINAPI worker_main(LPVOID arg) {
+    Workers* workers = (Workers*)arg;
+    workers->work(workers->job);
+    return 0;
+}
+#else
+static void* worker_main(void* arg) {
+    Workers* workers = (Workers*)arg;
+    workers->work(workers->job);
+    return NULL;
+}
+#endif
+
+// Returns how many threads actually started
+static int workers_start(Workers* workers, int count, void (*work)(void*), void* job) {
+    if (count > TRANSFER_MAX_THREADS) count = TRANSFER_MAX_THREADS;
+    workers->work = work;
+    workers->job = job;
+    workers->count = 0;
+    for (int t = 0; t < count; t++) {
+#ifdef _WIN32
+        HANDLE handle = CreateThread(NULL, 0, worker_main, workers, 0, NULL);
+        if (!handle) break;
+        workers->handles[workers->count++] = handle;
+#else
+        if (pthread_create(&workers->handles[workers->count], NULL, worker_main, workers) != 0) break;
+        workers->count++;
+#endif
+    }
+    return workers->count;
+}
+
+static void workers_join(Workers* workers) {
+    for (int t = 0; t < workers->count; t++) {
+#ifdef _WIN32
+        WaitForSingleObject(workers->handles[t], INFINITE);
+        CloseHandle(workers->handles[t]);
+#else
+        pthread_join(workers->handles[t], NULL);
+#endif
+    }
+    workers->count = 0;
+}
+
+// Host files and directories
+
+static bool host_mkdir(const char* path) {
+#ifdef _WIN32
+    return CreateDirectoryA(path, NULL) || GetLastError() == ERROR_ALREADY_EXISTS;
+#else
+    return mkdir(path, 0777) == 0 || errno == EEXIST;
+#endif
+}
+
+// Add everything below root/rel to the list, each directory ahead of its
+// contents
+static void walk_host(const char* root, const char* rel, TransferList* list, FILE* log,
+                      TransferStats* stats) {
+    char* dir = path_join(root, rel);
+#ifdef _WIN32
+    char* pattern = path_join(dir, "*");
+    WIN32_FIND_DATAA found;
+    HANDLE search = FindFirstFileA(pattern, &found);
+    free(pattern);
+    if (search == INVALID_HANDLE_VALUE) {
+        if (log) fprintf(log, "%s: cannot read directory\n", dir);
+        stats->failed++;
+        free(dir);
+        return;
+    }
+    do {
+        const char* name = found.cFileName;
+        if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0) continue;
+        if (found.dwFileAttributes & FILE_ATTRIBUTE_REPARSE_POINT) continue;
+        
+        char* child = path_join(rel, name);
+        if (found.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) {
+            list_add(list, child, true, 0);
+            walk_host(root, child, list, log, stats);
+        } else {
+            list_add(list, child, false,
+                     ((uint64_t)found.nFileSizeHigh << 32) | found.nFileSizeLow);
+        }
+        free(child);
+    } while (FindNextFileA(search, &found));
+    FindClose(search);
+#else
+    DIR* handle = opendir(dir);
+    if (!handle) {
+        if (log) fprintf(log, "%s: cannot read directory: %s\n", dir, strerror(errno));
+        stats->failed++;
+        free(dir);
+        return;
+    }
+    struct dirent* found;
+    while ((found = readdir(handle)) != NULL) {
+        const char* name = found->d_name;
+        if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0) continue;
+        
+        char* child = path_join(rel, name);
+        char* host = path_join(root, child);
+        struct stat info;
+        if (lstat(host, &info) != 0) {
+            if (log) fprintf(log, "%s: %s\n", host, strerror(errno));
+            stats->failed++;
+        } else if (S_ISDIR(info.st_mode)) {
+            list_add(list, child, true, 0);
+            walk_host(root, child, list, log, stats);
+        } else if (S_ISREG(info.st_mode)) {
+            list_add(list, child, false, (uint64_t)info.st_size);
+        }
+        free(host);
+        free(child);
+    }
+    closedir(handle);
+#endif
+    free(dir);
+}
+
+// Read-only mapping of a whole host file. For a file with holes, ranges
+// lists where its data is.
+typedef struct {
+    uint64_t offset;
+    uint64_t length;
+} HostRange;
+
+typedef struct {
+    const char* data;
+    size_t len;
+    bool sparse;
+    HostRange* ranges;
+    size_t range_count;
+    size_t range_capacity;
+#ifdef _WIN32
+    HANDLE file;
+    HANDLE mapping;
+#endif
+} HostMap;
+
+static void range_add(HostMap* map, uint64_t offset, uint64_t length) {
+    if (length == 0) return;
+    if (map->range_count == map->range_capacity) {
+        map->range_capacity = map->range_capacity ? map->range_capacity * 2 : 16;
+        map->ranges = (HostRange*)xrealloc(map->ranges, map->range_capacity * sizeof(HostRange));
+    }
+    map->ranges[map->range_count].offset = offset;
+    map->ranges[map->range_count].length = length;
+    map->range_count++;
+}
+
+// Find the data in a host file that has holes. A file whose data covers
+// it whole, or whose file system cannot say, is left as not sparse.
+#ifdef _WIN32
+static void host_ranges(HANDLE file, HostMap* map) {
+    FILE_ALLOCATED_RANGE_BUFFER query;
+    FILE_ALLOCATED_RANGE_BUFFER found[64];
+    query.FileOffset.QuadPart = 0;
+    query.Length.QuadPart = (LONGLONG)map->len;
+    for (;;) {
+        DWORD bytes = 0;
+        BOOL done = DeviceIoControl(file, FSCTL_QUERY_ALLOCATED_RANGES, &query, sizeof(query),
+                                    found, sizeof(found), &bytes, NULL);
+        if (!done && GetLastError() != ERROR_MORE_DATA) {
+            map->range_count = 0;
+            return;
+        }
+        DWORD count = bytes / sizeof(FILE_ALLOCATED_RANGE_BUFFER);
+        for (DWORD i = 0; i < count; i++) {
+            range_add(map, (uint64_t)found[i].FileOffset.QuadPart, (uint64_t)found[i].Length.QuadPart);
+        }
+        if (done || count == 0) break;
+        
+        LONGLONG next = found[count - 1].FileOffset.QuadPart + found[count - 1].Length.QuadPart;
+        query.Length.QuadPart -= next - query.FileOffset.QuadPart;
+        query.FileOffset.QuadPart = next;
+    }
+    map->sparse = !(map->range_count == 1 && map->ranges[0].offset == 0 &&
+                    map->ranges[0].length >= map->len);
+}
+#else
+static void host_ranges(int fd, HostMap* map) {
+#ifdef SEEK_HOLE
+    off_t hole = lseek(fd, 0, SEEK_HOLE);
+    if (hole < 0 || (uint64_t)hole >= map->len) return;
+    
+    off_t pos = 0;
+    while ((uint64_t)pos < map->len) {
+        off_t data = lseek(fd, pos, SEEK_DATA);
+        if (data < 0) {
+            // ENXIO: nothing but a hole from here to the end
+            if (errno != ENXIO) {
+                map->range_count = 0;
+                return;
+            }
+            break;
+        }
+        off_t end = lseek(fd, data, SEEK_HOLE);
+        if (end < 0 || (uint64_t)end > map->len) end = (off_t)map->len;
+        range_add(map, (uint64_t)data, (uint64_t)(end - data));
+        pos = end;
+    }
+    map->sparse = true;
+#else
+    (void)fd;
+    (void)map;
+#endif
+}
+#endif
+
+static bool host_map(const char* path, HostMap* map) {
+    memset(map, 0, sizeof(HostMap));
+#ifdef _WIN32
+    map->file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING,
+                            FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+    if (map->file == INVALID_HANDLE_VALUE) {
+        map->file = NULL;
+        return false;
+    }
+    LARGE_INTEGER size;
+    if (!GetFileSizeEx(map->file, &size) || (uint64_t)size.QuadPart > SIZE_MAX) {
+        CloseHandle(map->file);
+        map->file = NULL;
+        return false;
+    }
+    map->len = (size_t)size.QuadPart;
+    if (map->len == 0) return true;
+    host_ranges(map->file, map);
+    
+    map->mapping = CreateFileMappingA(map->file, NULL, PAGE_READONLY, 0, 0, NULL);
+    void* base = map->mapping ? MapViewOfFile(map->mapping, FILE_MAP_READ, 0, 0, 0) : NULL;
+    if (!base) {
+        if (map->mapping) CloseHandle(map->mapping);
+        CloseHandle(map->file);
+        free(map->ranges);
+        memset(map, 0, sizeof(HostMap));
+        return false;
+    }
+    map->data = (const char*)base;
+    return true;
+#else
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return false;
+    
+    struct stat info;
+    if (fstat(fd, &info) != 0 || (uint64_t)info.st_size > SIZE_MAX) {
+        close(fd);
+        return false;
+    }
+    map->len = (size_t)info.st_size;
+    if (map->len > 0) {
+        host_ranges(fd, map);
+        void* base = mmap(NULL, map->len, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (base == MAP_FAILED) {
+            close(fd);
+            free(map->ranges);
+            memset(map, 0, sizeof(HostMap));
+            return false;
+        }
+        posix_madvise(base, map->len, POSIX_MADV_SEQUENTIAL);
+        map->data = (const char*)base;
+    }
+    close(fd);
+    return true;
+#endif
+}
+
+static void host_unmap(HostMap* map) {
+#ifdef _WIN32
+    if (map->data) UnmapViewOfFile(map->data);
+    if (map->mapping) CloseHandle(map->mapping);
+    if (map->file) CloseHandle(map->file);
+#else
+    if (map->data) munmap((void*)map->data, map->len);
+#endif
+    free(map->ranges);
+    memset(map, 0, sizeof(HostMap));
+}
+
+static int host_create(const char* path) {
+#ifdef _WIN32
+    return _open(path, _O_WRONLY | _O_CREAT | _O_TRUNC | _O_BINARY, _S_IREAD | _S_IWRITE);
+#else
+    return open(path, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+#endif
+}
+
+static void host_close(int fd) {
+#ifdef _WIN32
+    _close(fd);
+#else
+    close(fd);
+#endif
+}
+
+// Import. Workers claim files in order, map and prepare them; the calling
+// thread writes them in the same order, so at most `ahead` files are held
+// in memory at once.
+
+#define IMPORT_WAITING 0
+#define IMPORT_CLAIMED 1
+#define IMPORT_READY 2
+#define IMPORT_FAILED 3
+
+typedef struct {
+    const TransferItem* item;
+    HostMap map;
+    VFSPrepared* prepared;
+    int state;
+} ImportFile;
+
+typedef struct {
+    VFS* vfs;
+    const char* host_dir;
+    ImportFile* files;
+    size_t count;
+    size_t next;             // Next file to claim
+    size_t written;          // Files the writer is done with
+    size_t ahead;
+    Monitor monitor;
+} ImportJob;
+
+static bool prepare_file(ImportJob* job, ImportFile* file) {
+    char* host = path_join(job->host_dir, file->item->path);
+    bool ok = host_map(host, &file->map);
+    free(host);
+    if (!ok || file->map.sparse) return ok;
+    
+    // An empty file has no mapping but is still written
+    const char* data = file->map.data ? file->map.data : "";
+    file->prepared = vfs_prepare(job->vfs, data, file->map.len);
+    return file->prepared != NULL;
+}
+
+// Only the data of a sparse file is written; its holes stay holes
+static bool import_sparse(VFS* vfs, const char* path, const HostMap* map) {
+    bool ok = vfs_write_file(vfs, path, "", 0);
+    for (size_t i = 0; ok && i < map->range_count; i++) {
+        const HostRange* range = &map->ranges[i];
+        ok = vfs_write_at(vfs, path, range->offset, map->data + range->offset, (size_t)range->length);
+    }
+    return ok && vfs_write_at(vfs, path, map->len, "", 0);
+}
+
+static void import_work(void* arg) {
+    ImportJob* job = (ImportJob*)arg;
+    monitor_enter(&job->monitor);
+    for (;;) {
+        while (job->next < job->count && job->next >= job->written + job->ahead) {
+            monitor_wait(&job->monitor);
+        }
+        if (job->next >= job->count) break;
+        
+        ImportFile* file = &job->files[job->next++];
+        file->state = IMPORT_CLAIMED;
+        monitor_leave(&job->monitor);
+        bool ok = prepare_file(job, file);
+        monitor_enter(&job->monitor);
+        file->state = ok ? IMPORT_READY : IMPORT_FAILED;
+        monitor_wake(&job->monitor);
+    }
+    monitor_leave(&job->monitor);
+}
+
+// Wait for file i, or prepare it here when no worker has claimed it
+static bool import_take(ImportJob* job, size_t i) {
+    ImportFile* file = &job->files[i];
+    monitor_enter(&job->monitor);
+    if (job->next == i) {
+        job->next++;
+        file->state = IMPORT_CLAIMED;
+        monitor_leave(&job->monitor);
+        bool ok = prepare_file(job, file);
+        monitor_enter(&job->monitor);
+        file->state = ok ? IMPORT_READY : IMPORT_FAILED;
+    }
+    while (file->state == IMPORT_CLAIMED) {
+        monitor_wait(&job->monitor);
+    }
+    bool ok = file->state == IMPORT_READY;
+    monitor_leave(&job->monitor);
+    return ok;
+}
+
+static void import_done(ImportJob* job, size_t i) {
+    ImportFile* file = &job->files[i];
+    vfs_free_prepared(file->prepared);
+    file->prepared = NULL;
+    host_unmap(&file->map);
+    
+    monitor_enter(&job->monitor);
+    job->written = i + 1;
+    monitor_wake(&job->monitor);
+    monitor_leave(&job->monitor);
+}
+
+// A directory that is already there is fine
+static bool make_vfs_directory(VFS* vfs, const char* path) {
+    FileEntry info;
+    if (vfs_stat(vfs, path, &info)) return info.type == FT_DIRECTORY;
+    return vfs_create_directory(vfs, path);
+}
+
+bool transfer_import(VFS* vfs, const char* host_dir, const char* vfs_dir, int threads,
+                     FILE* log, TransferStats* stats) {
+    if (!vfs || !host_dir || !vfs_dir || !stats) return false;
+    memset(stats, 0, sizeof(TransferStats));
+    
+    TransferList list = {NULL, 0, 0};
+    list_add(&list, "", true, 0);
+    walk_host(host_dir, "", &list, log, stats);
+    
+    // The whole import is one transaction, made durable a batch at a time.
+    // Directories go first; each comes before its contents.
+    VFSStats before;
+    vfs_get_stats(vfs, &before);
+    size_t file_count = 0;
+    vfs_begin(vfs);
+    for (size_t i = 0; i < list.count; i++) {
+        TransferItem* item = &list.items[i];
+        if (!item->directory) {
+            file_count++;
+            continue;
+        }
+        char* path = path_join(vfs_dir, item->path);
+        if (strlen(path) < MAX_PATH && make_vfs_directory(vfs, path)) {
+            if (item->path[0]) stats->directories++;
+        } else {
+            if (log) fprintf(log, "%s: cannot create directory\n", path);
+            stats->failed++;
+        }
+        free(path);
+    }
+    
+    ImportJob job;
+    memset(&job, 0, sizeof(job));
+    job.vfs = vfs;
+    job.host_dir = host_dir;
+    job.files = (ImportFile*)xmalloc((file_count + 1) * sizeof(ImportFile));
+    memset(job.files, 0, (file_count + 1) * sizeof(ImportFile));
+    for (size_t i = 0; i < list.count; i++) {
+        if (!list.items[i].directory) job.files[job.count++].item = &list.items[i];
+    }
+    monitor_init(&job.monitor);
+    
+    // Without compression or dedup there is nothing to hand off but the
+    // mapping, so the writer does that itself
+    Workers workers;
+    int started = 0;
+    if (threads < 1) threads = 1;
+    job.ahead = (size_t)threads * TRANSFER_AHEAD;
+    if ((vfs->compress || vfs->dedup) && job.count > 1) {
+        started = workers_start(&workers, threads, import_work, &job);
+    }
+    
+    uint64_t batch_bytes = 0;
+    size_t batch_files = 0;
+    for (size_t i = 0; i < job.count; i++) {
+        ImportFile* file = &job.files[i];
+        char* path = path_join(vfs_dir, file->item->path);
+        bool ok = import_take(&job, i) && strlen(path) < MAX_PATH;
+        
+        // A new file gets its blocks, and their room in the host file, in
+        // one piece before it is written
+        if (ok && file->map.sparse) {
+            ok = import_sparse(vfs, path, &file->map);
+        } else {
+            if (ok && !vfs_file_exists(vfs, path)) {
+                ok = vfs_reserve(vfs, path, file->map.len);
+            }
+            ok = ok && vfs_write_prepared(vfs, path, file->prepared);
+        }
+        if (ok) {
+            stats->files++;
+            stats->bytes += file->map.len;
+            batch_bytes += file->map.len;
+        } else {
+            if (log) fprintf(log, "%s: cannot import\n", path);
+            stats->failed++;
+        }
+        batch_files++;
+        import_done(&job, i);
+        free(path);
+        
+        if (batch_bytes >= TRANSFER_BATCH_BYTES || batch_files >= TRANSFER_BATCH_FILES) {
+            vfs_sync(vfs);
+            batch_bytes = 0;
+            batch_files = 0;
+        }
+    }
+    if (batch_files > 0) vfs_sync(vfs);
+    vfs_commit(vfs);
+    VFSStats after;
+    vfs_get_stats(vfs, &after);
+    stats->commits = after.ops[VFS_OP_COMMIT].count - before.ops[VFS_OP_COMMIT].count;
+    
+    if (started > 0) workers_join(&workers);
+    monitor_free(&job.monitor);
+    free(job.files);
+    list_free(&list);
+    return stats->failed == 0;
+}
+
+// Export. Every thread, the caller included, takes the next file off the
+// list; the VFS serves their reads in parallel.
+
+typedef struct {
+    VFS* vfs;
+    const char* vfs_dir;
+    const char* host_dir;
+    const TransferList* list;
+    size_t next;
+    FILE* log;
+    TransferStats* stats;
+    Monitor monitor;
+} ExportJob;
+
+static void walk_vfs(VFS* vfs, const char* root, const char* rel, TransferList* list, FILE* log,
+                     TransferStats* stats) {
+    char* dir = path_join(root, rel);
+    VFSDir* handle = strlen(dir) < MAX_PATH ? vfs_open_dir(vfs, dir) : NULL;
+    if (!handle) {
+        if (log) fprintf(log, "%s: cannot read directory\n", dir);
+        stats->failed++;
+        free(dir);
+        return;
+    }
+    FileEntry entry;
+    while (vfs_read_dir(vfs, handle, &entry)) {
+        char* child = path_join(rel, entry.name);
+        if (entry.type == FT_DIRECTORY) {
+            list_add(list, child, true, 0);
+            walk_vfs(vfs, root, child, list, log, stats);
+        } else {
+            list_add(list, child, false, entry.size);
+        }
+        free(child);
+    }
+    vfs_close_dir(handle);
+    free(dir);
+}
+
+static void export_work(void* arg) {
+    ExportJob* job = (ExportJob*)arg;
+    for (;;) {
+        monitor_enter(&job->monitor);
+        while (job->next < job->list->count && job->list->items[job->next].directory) {
+            job->next++;
+        }
+        if (job->next >= job->list->count) {
+            monitor_leave(&job->monitor);
+            break;
+        }
+        const TransferItem* item = &job->list->items[job->next++];
+        monitor_leave(&job->monitor);
+        
+        char* source = path_join(job->vfs_dir, item->path);
+        char* dest = path_join(job->host_dir, item->path);
+        int fd = host_create(dest);
+        bool ok = fd >= 0 && vfs_export_file(job->vfs, source, fd);
+        if (fd >= 0) host_close(fd);
+        
+        monitor_enter(&job->monitor);
+        if (ok) {
+            job->stats->files++;
+            job->stats->bytes += item->size;
+        } else {
+            if (job->log) fprintf(job->log, "%s: cannot export to %s\n", source, dest);
+            job->stats->failed++;
+        }
+        monitor_leave(&job->monitor);
+        free(source);
+        free(dest);
+    }
+}
+
+bool transfer_export(VFS* vfs, const char* vfs_dir, const char* host_dir, int threads,
+                     FILE* log, TransferStats* stats) {
+    if (!vfs || !vfs_dir || !host_dir || !stats) return false;
+    memset(stats, 0, sizeof(TransferStats));
+    
+    TransferList list = {NULL, 0, 0};
+    list_add(&list, "", true, 0);
+    walk_vfs(vfs, vfs_dir, "", &list, log, stats);
+    
+    for (size_t i = 0; i < list.count; i++) {
+        if (!list.items[i].directory) continue;
+        char* path = path_join(host_dir, list.items[i].path);
+        if (host_mkdir(path)) {
+            if (list.items[i].path[0]) stats->directories++;
+        } else {
+            if (log) fprintf(log, "%s: cannot create directory\n", path);
+            stats->failed++;
+        }
+        free(path);
+    }
+    
+    ExportJob job;
+    memset(&job, 0, sizeof(job));
+    job.vfs = vfs;
+    job.vfs_dir = vfs_dir;
+    job.host_dir = host_dir;
+    job.list = &list;
+    job.log = log;
+    job.stats = stats;
+    monitor_init(&job.monitor);
+    
+    Workers workers;
+    int started = threads > 1 ? workers_start(&workers, threads - 1, export_work, &job) : 0;
+    export_work(&job);
+    if (started > 0) workers_join(&workers);
+    
+    monitor_free(&job.monitor);
+    list_free(&list);
+    return stats->failed == 0;
+}
@@ -0,0 +1,32 @@
+#ifndef TRANSFER_H
+#define TRANSFER_H
+
+#include "vfs.h"
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+// Bulk copies between a host directory tree and the VFS, behind the
+// import and export builtins
+typedef struct {
+    uint64_t files;
+    uint64_t directories;
+    uint64_t bytes;
+    uint64_t failed;         // Files and directories that could not be copied
+    uint64_t commits;        // Journal commits during an import
+} TransferStats;
+
+// Copy the tree under host_dir into vfs_dir, creating it if needed. Files
+// are mapped and, when the VFS compresses or deduplicates, compressed or
+// checksummed by `threads` workers while this thread writes them.
+// The import is one transaction, synced to disk in large batches rather
+// than after each file. Regular files and directories are copied; links
+// and other special files are skipped.
+bool transfer_import(VFS* vfs, const char* host_dir, const char* vfs_dir, int threads,
+                     FILE* log, TransferStats* stats);
+
+// Copy the tree under vfs_dir out to host_dir, `threads` files at a time
+bool transfer_export(VFS* vfs, const char* vfs_dir, const char* host_dir, int threads,
+                     FILE* log, TransferStats* stats);
+
+#endif // TRANSFER_H
@@ -1,382 +1,6654 @@
+#ifndef _WIN32
+#define _POSIX_C_SOURCE 200809L
+#define _FILE_OFFSET_BITS 64
+#endif
+#ifdef __linux__
+#define _GNU_SOURCE              // copy_file_range
+#endif
+
 #include "vfs.h"
+#include "lz.h"
+#include "crc32c.h"
 #include "utils.h"
 #include <time.h>
 #include <errno.h>
 #include <string.h>
 #include <stdbool.h>
 #include <stdint.h>
+#include <stdarg.h>
 
-static uint32_t find_free_block(VFS* vfs) {
-    for (uint32_t i = 0; i < MAX_BLOCKS; i++) {
-        if (!vfs->header.block_used[i]) {
-            vfs->header.block_used[i] = true;
-            return i;
-        }
+#ifdef _WIN32
+#include <io.h>
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#endif
+
+// copy_file_range arrived in glibc 2.27
+#if defined(__linux__) && defined(__GLIBC__) && \
+    (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 27))
+#define VFS_COPY_FILE_RANGE
+#endif
+
+// posix_fallocate, to give reserved blocks host disk space up front
+#if defined(__linux__) || defined(__FreeBSD__)
+#define VFS_FALLOCATE
+#endif
+
+#define VFS_MAGIC "VFS002\n"
+
+// VFS002 images of any other layout revision are refused
+#define VFS_REVISION 1
+
+// Image layout: header block, two journal slots, then the data blocks
+#define JOURNAL_MAGIC "VFSJRN\n"
+#define JOURNAL_OFFSET ((uint64_t)BLOCK_SIZE)
+#define JOURNAL_SLOT_BYTES (sizeof(JournalHeader) + VFS_JOURNAL_SECTORS * sizeof(uint64_t) + \
+                            VFS_JOURNAL_DATA_RECORDS * sizeof(VFSJournalData) + \
+                            VFS_JOURNAL_SECTORS * VFS_SECTOR_SIZE)
+#define JOURNAL_SLOT_SIZE ((JOURNAL_SLOT_BYTES + BLOCK_SIZE - 1) / BLOCK_SIZE * BLOCK_SIZE)
+#define DATA_OFFSET (JOURNAL_OFFSET + 2 * (uint64_t)JOURNAL_SLOT_SIZE)
+
+// A transaction is committed early, between operations, once it has
+// fewer data records left than one file write can produce, or has filled
+// half of the sector space
+#define JOURNAL_RECORD_RESERVE (VFS_WRITE_EXTENTS + 1)
+#define JOURNAL_SECTOR_RESERVE (VFS_JOURNAL_SECTORS / 2)
+
+// The image grows by at least this many blocks, or a quarter of its size
+#define GROW_MIN_BLOCKS 256
+
+// Start of a journal slot. It is followed by the image offsets of the
+// changed sectors, the data records and then the sector images; checksum
+// covers all of it.
+typedef struct {
+    char magic[8];
+    uint64_t sequence;
+    uint32_t sector_count;
+    uint32_t data_count;
+    uint64_t checksum;
+} JournalHeader;
+
+// Dirty runs separated by no more than this many clean sectors are
+// written together: rewriting a few clean sectors is cheaper than
+// another seek and write.
+#define COALESCE_GAP_SECTORS 8
+
+// Changed sectors stay in the journal, and are carried into every later
+// commit, until this many have built up; only then are they written back
+// in place. An operation therefore costs one journal write, and a sector
+// changed by many operations is written back once.
+#define CHECKPOINT_SECTORS 32
+
+static uint64_t block_offset(uint32_t block_num);
+
+// Where a metadata region lives in the image; the header has no extent
+static VFSExtent* region_extent(VFS* vfs, int region) {
+    switch (region) {
+        case VFS_META_BITMAP: return &vfs->header.bitmap_region;
+        case VFS_META_ENTRIES: return &vfs->header.entry_region;
+        case VFS_META_REFS: return &vfs->header.refs_region;
+        case VFS_META_CRCS: return &vfs->header.crcs_region;
+        case VFS_META_TREE: return &vfs->header.tree_region;
+        default: return NULL;
     }
-    return (uint32_t)-1;
 }
 
-static void free_block(VFS* vfs, uint32_t block) {
-    if (block < MAX_BLOCKS) {
-        vfs->header.block_used[block] = false;
+static uint64_t region_offset(VFS* vfs, int region) {
+    VFSExtent* extent = region_extent(vfs, region);
+    return extent ? block_offset(extent->start) : 0;
+}
+
+// Point a region, and the typed pointer the rest of the code uses for
+// it, at a (re)allocated in-memory copy of the given size
+static void region_resize(VFS* vfs, int region, void* base, size_t size) {
+    VFSMetaRegion* meta = &vfs->meta[region];
+    size_t words = ((size + VFS_SECTOR_SIZE - 1) / VFS_SECTOR_SIZE + 63) / 64;
+    if (words > meta->dirty_words) {
+        meta->dirty = (uint64_t*)xrealloc(meta->dirty, words * sizeof(uint64_t));
+        memset(meta->dirty + meta->dirty_words, 0, (words - meta->dirty_words) * sizeof(uint64_t));
+        meta->dirty_words = words;
+    }
+    meta->base = (char*)base;
+    meta->size = size;
+    switch (region) {
+        case VFS_META_BITMAP: vfs->bitmap = (uint64_t*)base; break;
+        case VFS_META_ENTRIES: vfs->entries = (FileEntry*)base; break;
+        case VFS_META_REFS: vfs->refs = (uint16_t*)base; break;
+        case VFS_META_CRCS: vfs->crcs = (uint32_t*)base; break;
+        case VFS_META_TREE: vfs->tree = (VFSTreeNode*)base; break;
+        default: break;
     }
 }
 
-static FileEntry* find_file_entry(VFS* vfs, const char* name) {
-    for (uint32_t i = 0; i < vfs->header.num_files; i++) {
-        if (strcmp(vfs->header.entries[i].name, name) == 0) {
-            return &vfs->header.entries[i];
+// Let go of a region's in-memory copy
+static void region_drop(VFS* vfs, int region) {
+    VFSMetaRegion* meta = &vfs->meta[region];
+    if (region != VFS_META_HEADER && meta->base) {
+        if (!meta->mapped) {
+            free(meta->base);
+        } else {
+#ifdef _WIN32
+            UnmapViewOfFile(meta->base - meta->map_lead);
+#else
+            munmap(meta->base, meta->size);
+#endif
         }
     }
-    return NULL;
+    meta->mapped = false;
+    meta->map_lead = 0;
+    region_resize(vfs, region, NULL, 0);
 }
 
-static FileEntry* allocate_file_entry(VFS* vfs) {
-    if (vfs->header.num_files >= MAX_FILES) {
-        return NULL;
+// Give a region a heap copy of `size` bytes, zero-extended, in place of a
+// mapping or a smaller copy. A mapped region must be detached before it
+// moves: the blocks it leaves may be reused, and untouched pages of the
+// mapping would then show their new contents.
+static void* region_detach(VFS* vfs, int region, size_t size) {
+    VFSMetaRegion* meta = &vfs->meta[region];
+    size_t old_size = meta->size;
+    char* base;
+    if (meta->mapped) {
+        base = (char*)xmalloc(size);
+        memcpy(base, meta->base, old_size < size ? old_size : size);
+        region_drop(vfs, region);
+    } else {
+        base = (char*)xrealloc(meta->base, size);
     }
-    FileEntry* entry = &vfs->header.entries[vfs->header.num_files++];
-    memset(entry, 0, sizeof(FileEntry));
-    return entry;
+    if (size > old_size) memset(base + old_size, 0, size - old_size);
+    region_resize(vfs, region, base, size);
+    return base;
 }
 
-static void write_block(VFS* vfs, uint32_t block_num, const void* data, size_t size) {
-    if (block_num >= MAX_BLOCKS) return;
-    
-    fseek(vfs->file, sizeof(VFSHeader) + block_num * BLOCK_SIZE, SEEK_SET);
-    fwrite(data, 1, size > BLOCK_SIZE ? BLOCK_SIZE : size, vfs->file);
-    fflush(vfs->file);
+static void region_clear_dirty(VFS* vfs, int region) {
+    VFSMetaRegion* meta = &vfs->meta[region];
+    for (size_t w = 0; w < meta->dirty_words; w++) {
+        vfs->dirty_sector_count -= (uint32_t)__builtin_popcountll(meta->dirty[w]);
+        meta->dirty[w] = 0;
+    }
 }
 
-static size_t read_block(VFS* vfs, uint32_t block_num, void* data, size_t max_size) {
-    if (block_num >= MAX_BLOCKS) return 0;
-    
-    fseek(vfs->file, sizeof(VFSHeader) + block_num * BLOCK_SIZE, SEEK_SET);
-    return fread(data, 1, max_size > BLOCK_SIZE ? BLOCK_SIZE : max_size, vfs->file);
+// Remember which metadata sectors a change touched. A region moved by
+// the open transaction is written whole anyway.
+static void mark_dirty(VFS* vfs, const void* field, size_t len) {
+    const char* p = (const char*)field;
+    for (int region = 0; region < VFS_META_REGIONS; region++) {
+        VFSMetaRegion* meta = &vfs->meta[region];
+        if (p < meta->base || p >= meta->base + meta->size) continue;
+        if (meta->relocated) return;
+        
+        size_t offset = (size_t)(p - meta->base);
+        size_t last = (offset + len - 1) / VFS_SECTOR_SIZE;
+        vfs->sectors_changed = true;
+        for (size_t sector = offset / VFS_SECTOR_SIZE; sector <= last; sector++) {
+            uint64_t bit = 1ULL << (sector % 64);
+            if (!(meta->dirty[sector / 64] & bit)) {
+                meta->dirty[sector / 64] |= bit;
+                vfs->dirty_sector_count++;
+            }
+        }
+        return;
+    }
 }
 
-static void save_header(VFS* vfs) {
-    fseek(vfs->file, 0, SEEK_SET);
-    fwrite(&vfs->header, sizeof(VFSHeader), 1, vfs->file);
-    fflush(vfs->file);
+static bool sector_dirty(const VFSMetaRegion* meta, size_t sector) {
+    return (meta->dirty[sector / 64] >> (sector % 64)) & 1;
 }
 
-VFS* vfs_init(const char* vfs_file) {
-    VFS* vfs = (VFS*)xmalloc(sizeof(VFS));
-    memset(vfs, 0, sizeof(VFS));
-    
-    strcpy(vfs->current_dir, "/");
-    
-    // Try to open existing VFS file
-    vfs->file = fopen(vfs_file ? vfs_file : VFS_FILENAME, "r+b");
-    
-    if (vfs->file) {
-        // Read existing header
-        if (fread(&vfs->header, sizeof(VFSHeader), 1, vfs->file) == 1 &&
-            strncmp(vfs->header.magic, "VFS001\n", 8) == 0) {
-            return vfs;
+static size_t region_sectors(const VFSMetaRegion* meta) {
+    return (meta->size + VFS_SECTOR_SIZE - 1) / VFS_SECTOR_SIZE;
+}
+
+static void mark_blocks(VFS* vfs, uint32_t start, uint32_t count, bool used) {
+    while (count > 0) {
+        uint32_t bit = start % 64;
+        uint32_t span = 64 - bit < count ? 64 - bit : count;
+        uint64_t mask = (span == 64 ? ~0ULL : ((1ULL << span) - 1)) << bit;
+        if (used) {
+            vfs->bitmap[start / 64] |= mask;
+        } else {
+            vfs->bitmap[start / 64] &= ~mask;
         }
-        fclose(vfs->file);
-    }
-    
-    // Create new VFS
-    vfs->file = fopen(vfs_file ? vfs_file : VFS_FILENAME, "w+b");
-    if (!vfs->file) {
-        print_error_format("Failed to create VFS file: %s", strerror(errno));
-        free(vfs);
-        return NULL;
-    }
-    
-    // Initialize header
-    strncpy(vfs->header.magic, "VFS001\n", 8);
-    vfs->header.block_size = BLOCK_SIZE;
-    vfs->header.num_blocks = MAX_BLOCKS;
-    vfs->header.num_files = 0;
-    vfs->header.root_dir = 0;
-    vfs->header.free_list = 1;
-    
-    // Initialize block usage
-    for (int i = 0; i < MAX_BLOCKS; i++) {
-        vfs->header.block_used[i] = false;
+        mark_dirty(vfs, &vfs->bitmap[start / 64], sizeof(uint64_t));
+        start += span;
+        count -= span;
     }
-    
-    // Create root directory entry
-    FileEntry* root = allocate_file_entry(vfs);
-    strcpy(root->name, "/");
-    root->type = FT_DIRECTORY;
-    root->size = 0;
-    root->first_block = 0;
-    root->parent_dir = 0;
-    root->created_time = (uint32_t)time(NULL);
-    root->modified_time = root->created_time;
-    vfs->header.block_used[0] = true;
-    
-    save_header(vfs);
-    
-    // Initialize root directory block
-    char empty_block[BLOCK_SIZE] = {0};
-    write_block(vfs, 0, empty_block, BLOCK_SIZE);
-    
-    return vfs;
 }
 
-void vfs_close(VFS* vfs) {
-    if (vfs) {
-        save_header(vfs);
-        if (vfs->file) {
-            fclose(vfs->file);
+// Free-run trees. Nodes live in the free_runs pool and refer to each
+// other by index; RUN_NONE ends a branch.
+#define RUN_NONE UINT32_MAX
+#define RUN_BY_START 0
+#define RUN_BY_LENGTH 1
+
+static bool run_less(const VFS* vfs, int tree, uint32_t a, uint32_t b) {
+    const VFSFreeRun* x = &vfs->free_runs[a];
+    const VFSFreeRun* y = &vfs->free_runs[b];
+    if (tree == RUN_BY_LENGTH && x->length != y->length) return x->length < y->length;
+    return x->start < y->start;
+}
+
+// Recompute a node's longest run from its children in the tree by start
+static void run_update(VFS* vfs, int tree, uint32_t node) {
+    if (tree != RUN_BY_START) return;
+    VFSFreeRun* run = &vfs->free_runs[node];
+    run->largest = run->length;
+    for (int side = 0; side < 2; side++) {
+        uint32_t child = run->child[RUN_BY_START][side];
+        if (child != RUN_NONE && vfs->free_runs[child].largest > run->largest) {
+            run->largest = vfs->free_runs[child].largest;
         }
-        free(vfs);
     }
 }
 
-bool vfs_resolve_path(VFS* vfs, const char* path, char* resolved) {
-    if (!path || !resolved) return false;
-    
-    char* normalized = normalize_path(path);
-    strcpy(resolved, normalized);
-    free(normalized);
+// Insert a node below root and return the subtree's new root
+static uint32_t run_insert(VFS* vfs, int tree, uint32_t root, uint32_t node) {
+    if (root == RUN_NONE) return node;
     
-    // Handle absolute paths
-    if (is_absolute_path(resolved)) {
-        return true;
+    VFSFreeRun* runs = vfs->free_runs;
+    int side = run_less(vfs, tree, root, node);
+    uint32_t child = run_insert(vfs, tree, runs[root].child[tree][side], node);
+    runs[root].child[tree][side] = child;
+    if (runs[child].priority > runs[root].priority) {
+        runs[root].child[tree][side] = runs[child].child[tree][!side];
+        runs[child].child[tree][!side] = root;
+        run_update(vfs, tree, root);
+        root = child;
     }
-    
-    // Handle relative paths
-    char* full_path = join_path(vfs->current_dir, resolved);
-    strcpy(resolved, full_path);
-    free(full_path);
-    
-    return true;
+    run_update(vfs, tree, root);
+    return root;
 }
 
-bool vfs_file_exists(VFS* vfs, const char* path) {
-    if (!path) return false;
-    
-    char resolved[MAX_PATH];
-    if (!vfs_resolve_path(vfs, path, resolved)) return false;
+// Join two subtrees, every key in a before every key in b
+static uint32_t run_join(VFS* vfs, int tree, uint32_t a, uint32_t b) {
+    if (a == RUN_NONE) return b;
+    if (b == RUN_NONE) return a;
     
-    // Check if path exists in VFS
-    char* filename = strrchr(resolved, '/');
-    if (!filename) filename = (char*)resolved;
-    else filename++;
-    
-    // Simple check - in real implementation, would traverse directory tree
-    FileEntry* entry = find_file_entry(vfs, filename);
-    return entry != NULL;
+    VFSFreeRun* runs = vfs->free_runs;
+    if (runs[a].priority > runs[b].priority) {
+        runs[a].child[tree][1] = run_join(vfs, tree, runs[a].child[tree][1], b);
+        run_update(vfs, tree, a);
+        return a;
+    }
+    runs[b].child[tree][0] = run_join(vfs, tree, a, runs[b].child[tree][0]);
+    run_update(vfs, tree, b);
+    return b;
 }
 
-bool vfs_create_file(VFS* vfs, const char* path, FileType type) {
-    if (!path) return false;
+// Remove a node, found by its key, from below root
+static uint32_t run_remove(VFS* vfs, int tree, uint32_t root, uint32_t node) {
+    VFSFreeRun* runs = vfs->free_runs;
+    if (root == node) return run_join(vfs, tree, runs[node].child[tree][0], runs[node].child[tree][1]);
     
-    char resolved[MAX_PATH];
-    if (!vfs_resolve_path(vfs, path, resolved)) return false;
-    
-    char* filename = strrchr(resolved, '/');
-    if (!filename) filename = (char*)resolved;
-    else filename++;
-    
-    if (strlen(filename) == 0 || strlen(filename) >= MAX_FILENAME) {
-        return false;
+    int side = run_less(vfs, tree, root, node);
+    runs[root].child[tree][side] = run_remove(vfs, tree, runs[root].child[tree][side], node);
+    run_update(vfs, tree, root);
+    return root;
+}
+
+static void link_free_run(VFS* vfs, uint32_t node) {
+    VFSFreeRun* run = &vfs->free_runs[node];
+    memset(run->child, 0xFF, sizeof(run->child));
+    run->largest = run->length;
+    for (int tree = 0; tree < 2; tree++) {
+        vfs->free_run_roots[tree] = run_insert(vfs, tree, vfs->free_run_roots[tree], node);
     }
-    
-    // Check if file already exists
-    if (find_file_entry(vfs, filename)) {
-        return false;
+}
+
+static void unlink_free_run(VFS* vfs, uint32_t node) {
+    for (int tree = 0; tree < 2; tree++) {
+        vfs->free_run_roots[tree] = run_remove(vfs, tree, vfs->free_run_roots[tree], node);
     }
-    
-    FileEntry* entry = allocate_file_entry(vfs);
-    if (!entry) return false;
-    
-    strncpy(entry->name, filename, MAX_FILENAME - 1);
-    entry->name[MAX_FILENAME - 1] = '\0';
-    entry->type = type;
-    entry->size = 0;
-    entry->first_block = find_free_block(vfs);
-    entry->parent_dir = 0; // Simplified - would be actual parent in full impl
-    entry->created_time = (uint32_t)time(NULL);
-    entry->modified_time = entry->created_time;
-    
-    if (entry->first_block == (uint32_t)-1) {
-        vfs->header.num_files--;
-        return false;
+}
+
+static uint32_t insert_free_run(VFS* vfs, uint32_t start, uint32_t length) {
+    uint32_t node = vfs->free_run_spare;
+    if (node != RUN_NONE) {
+        vfs->free_run_spare = vfs->free_runs[node].child[0][0];
+    } else {
+        if (vfs->free_run_nodes == vfs->free_run_capacity) {
+            vfs->free_run_capacity = vfs->free_run_capacity ? vfs->free_run_capacity * 2 : 16;
+            vfs->free_runs = (VFSFreeRun*)xrealloc(vfs->free_runs,
+                                                   vfs->free_run_capacity * sizeof(VFSFreeRun));
+        }
+        node = vfs->free_run_nodes++;
     }
     
-    save_header(vfs);
-    return true;
+    VFSFreeRun* run = &vfs->free_runs[node];
+    run->start = start;
+    run->length = length;
+    // Murmur3's finalizer, for priorities that look random
+    uint32_t hash = start ^ (node * 0x9E3779B9u);
+    hash = (hash ^ (hash >> 16)) * 0x85EBCA6Bu;
+    hash = (hash ^ (hash >> 13)) * 0xC2B2AE35u;
+    run->priority = hash ^ (hash >> 16);
+    link_free_run(vfs, node);
+    vfs->free_run_count++;
+    return node;
 }
 
-bool vfs_create_directory(VFS* vfs, const char* path) {
-    return vfs_create_file(vfs, path, FT_DIRECTORY);
+static void remove_free_run(VFS* vfs, uint32_t node) {
+    unlink_free_run(vfs, node);
+    vfs->free_runs[node].child[0][0] = vfs->free_run_spare;
+    vfs->free_run_spare = node;
+    vfs->free_run_count--;
 }
 
-bool vfs_write_file(VFS* vfs, const char* path, const char* data, size_t len) {
-    if (!path || !data) return false;
-    
-    char resolved[MAX_PATH];
-    if (!vfs_resolve_path(vfs, path, resolved)) return false;
-    
-    char* filename = strrchr(resolved, '/');
-    if (!filename) filename = (char*)resolved;
-    else filename++;
-    
-    FileEntry* entry = find_file_entry(vfs, filename);
-    if (!entry) {
-        // Create file if it doesn't exist
-        if (!vfs_create_file(vfs, path, FT_REGULAR)) {
-            return false;
+// Change where a run starts or how long it is; a run of nothing goes
+static void resize_free_run(VFS* vfs, uint32_t node, uint32_t start, uint32_t length) {
+    if (length == 0) {
+        remove_free_run(vfs, node);
+        return;
+    }
+    unlink_free_run(vfs, node);
+    vfs->free_runs[node].start = start;
+    vfs->free_runs[node].length = length;
+    link_free_run(vfs, node);
+}
+
+// The first run starting at or after block
+static uint32_t free_run_from(VFS* vfs, uint32_t block) {
+    uint32_t found = RUN_NONE;
+    for (uint32_t node = vfs->free_run_roots[RUN_BY_START]; node != RUN_NONE; ) {
+        const VFSFreeRun* run = &vfs->free_runs[node];
+        if (run->start >= block) {
+            found = node;
+            node = run->child[RUN_BY_START][0];
+        } else {
+            node = run->child[RUN_BY_START][1];
         }
-        entry = find_file_entry(vfs, filename);
-        if (!entry) return false;
     }
+    return found;
+}
+
+// The last run starting before block
+static uint32_t free_run_before(VFS* vfs, uint32_t block) {
+    uint32_t found = RUN_NONE;
+    for (uint32_t node = vfs->free_run_roots[RUN_BY_START]; node != RUN_NONE; ) {
+        const VFSFreeRun* run = &vfs->free_runs[node];
+        if (run->start < block) {
+            found = node;
+            node = run->child[RUN_BY_START][1];
+        } else {
+            node = run->child[RUN_BY_START][0];
+        }
+    }
+    return found;
+}
+
+// Runs in order of start block: the first, and the one after `node`
+static uint32_t first_free_run(VFS* vfs) {
+    return free_run_from(vfs, 0);
+}
+
+static uint32_t next_free_run(VFS* vfs, uint32_t node) {
+    return free_run_from(vfs, vfs->free_runs[node].start + 1);
+}
+
+static uint32_t last_free_run(VFS* vfs) {
+    return free_run_before(vfs, UINT32_MAX);
+}
+
+static uint64_t op_start(VFS* vfs);
+static void count_op(VFS* vfs, VFSOp op, uint64_t bytes, uint64_t started);
+
+// Rebuild the free-run summary and free count from the bitmap, a word at a time
+static void rebuild_free_runs(VFS* vfs) {
+    uint64_t started = op_start(vfs);
+    vfs->free_runs_built = true;
+    uint32_t num_blocks = vfs->header.num_blocks;
+    uint32_t words = (num_blocks + 63) / 64;
+    uint32_t used = 0;
+    for (uint32_t w = 0; w < words; w++) {
+        used += (uint32_t)__builtin_popcountll(vfs->bitmap[w]);
+    }
+    vfs->header.free_blocks = num_blocks - used;
+    vfs->free_run_count = 0;
+    vfs->free_run_nodes = 0;
+    vfs->free_run_spare = RUN_NONE;
+    vfs->free_run_roots[RUN_BY_START] = RUN_NONE;
+    vfs->free_run_roots[RUN_BY_LENGTH] = RUN_NONE;
     
-    // Write data to blocks
-    uint32_t block = entry->first_block;
-    size_t remaining = len;
-    const char* src = data;
-    
-    while (remaining > 0) {
-        size_t to_write = remaining > BLOCK_SIZE ? BLOCK_SIZE : remaining;
-        write_block(vfs, block, src, to_write);
-        src += to_write;
-        remaining -= to_write;
+    uint32_t block = 0;
+    while (block < num_blocks) {
+        uint64_t free_bits = ~vfs->bitmap[block / 64] >> (block % 64);
+        if (free_bits == 0) {
+            block = (block / 64 + 1) * 64;
+            continue;
+        }
+        block += (uint32_t)__builtin_ctzll(free_bits);
+        if (block >= num_blocks) break;
         
-        if (remaining > 0) {
-            uint32_t next_block = find_free_block(vfs);
-            if (next_block == (uint32_t)-1) {
-                break;
+        uint32_t end = block;
+        while (end < num_blocks) {
+            uint64_t used_bits = vfs->bitmap[end / 64] >> (end % 64);
+            if (used_bits == 0) {
+                end = (end / 64 + 1) * 64;
+                continue;
             }
-            block = next_block;
+            end += (uint32_t)__builtin_ctzll(used_bits);
+            break;
         }
+        if (end > num_blocks) end = num_blocks;
+        
+        insert_free_run(vfs, block, end - block);
+        block = end;
     }
-    
-    entry->size = len;
-    entry->modified_time = (uint32_t)time(NULL);
-    save_header(vfs);
-    
-    return true;
+    count_op(vfs, VFS_OP_ALLOC_SCAN, (uint64_t)words * sizeof(uint64_t), started);
 }
 
-size_t vfs_read_file(VFS* vfs, const char* path, char* buffer, size_t max_len) {
-    if (!path || !buffer) return 0;
-    
-    char resolved[MAX_PATH];
-    if (!vfs_resolve_path(vfs, path, resolved)) return 0;
-    
-    char* filename = strrchr(resolved, '/');
-    if (!filename) filename = (char*)resolved;
-    else filename++;
-    
-    FileEntry* entry = find_file_entry(vfs, filename);
-    if (!entry) return 0;
-    
-    size_t to_read = entry->size > max_len ? max_len : entry->size;
-    uint32_t block = entry->first_block;
-    char* dst = buffer;
-    size_t remaining = to_read;
-    
-    while (remaining > 0 && block < MAX_BLOCKS) {
-        size_t read = read_block(vfs, block, dst, remaining);
-        if (read == 0) break;
-        
-        dst += read;
-        remaining -= read;
+// Take an extent the bitmap shows as free out of the summary
+static void withhold_run(VFS* vfs, VFSExtent extent) {
+    uint32_t end = extent.start + extent.length;
+    uint32_t node = free_run_before(vfs, extent.start);
+    if (node == RUN_NONE) node = free_run_from(vfs, extent.start);
+    while (node != RUN_NONE && extent.length > 0) {
+        VFSExtent run = {vfs->free_runs[node].start, vfs->free_runs[node].length};
+        uint32_t run_end = run.start + run.length;
+        if (run.start >= end) break;
+        uint32_t next = free_run_from(vfs, run.start + 1);
         
-        // Simplified - would traverse block chain in full impl
-        if (remaining > 0) {
-            block++;
-            if (block >= MAX_BLOCKS || !vfs->header.block_used[block]) {
-                break;
-            }
+        if (run.start < extent.start && run_end > end) {
+            resize_free_run(vfs, node, run.start, extent.start - run.start);
+            insert_free_run(vfs, end, run_end - end);
+            break;
         }
+        if (run_end <= extent.start) {
+            // Ends before the extent
+        } else if (run.start < extent.start) {
+            resize_free_run(vfs, node, run.start, extent.start - run.start);
+        } else if (run_end > end) {
+            resize_free_run(vfs, node, end, run_end - end);
+        } else {
+            remove_free_run(vfs, node);
+        }
+        node = next;
     }
-    
-    return to_read - remaining;
 }
 
-bool vfs_delete_file(VFS* vfs, const char* path) {
-    if (!path) return false;
+// The summary is made when space is first allocated rather than at open,
+// so opening an image does not read its bitmap. Blocks freed since open
+// are clear in the bitmap but not reusable yet, so they are kept out.
+static void ensure_free_runs(VFS* vfs) {
+    if (vfs->free_runs_built) return;
+    rebuild_free_runs(vfs);
+    for (uint32_t i = 0; i < vfs->pending_free_count; i++) {
+        withhold_run(vfs, vfs->pending_frees[i]);
+    }
+    for (uint32_t i = 0; i < vfs->settling_free_count; i++) {
+        withhold_run(vfs, vfs->settling_frees[i]);
+    }
+}
+
+// Return a committed free extent to the free-run summary. Before the
+// summary is made the bitmap already says it all.
+static void release_run(VFS* vfs, VFSExtent extent) {
+    if (!vfs->free_runs_built) return;
     
-    char resolved[MAX_PATH];
-    if (!vfs_resolve_path(vfs, path, resolved)) return false;
+    // Merge with the runs either side of the freed one
+    uint32_t prev = free_run_before(vfs, extent.start);
+    uint32_t next = free_run_from(vfs, extent.start);
+    bool joins_prev = prev != RUN_NONE &&
+        vfs->free_runs[prev].start + vfs->free_runs[prev].length == extent.start;
+    bool joins_next = next != RUN_NONE &&
+        extent.start + extent.length == vfs->free_runs[next].start;
     
-    char* filename = strrchr(resolved, '/');
-    if (!filename) filename = (char*)resolved;
-    else filename++;
+    if (joins_prev && joins_next) {
+        uint32_t length = vfs->free_runs[prev].length + extent.length + vfs->free_runs[next].length;
+        remove_free_run(vfs, next);
+        resize_free_run(vfs, prev, vfs->free_runs[prev].start, length);
+    } else if (joins_prev) {
+        resize_free_run(vfs, prev, vfs->free_runs[prev].start, vfs->free_runs[prev].length + extent.length);
+    } else if (joins_next) {
+        resize_free_run(vfs, next, extent.start, extent.length + vfs->free_runs[next].length);
+    } else {
+        insert_free_run(vfs, extent.start, extent.length);
+    }
+}
+
+// Best fit: the smallest free run that holds the request, the lowest of
+// those that are equally small
+static uint32_t best_fit_run(VFS* vfs, uint32_t blocks) {
+    uint64_t started = op_start(vfs);
+    uint32_t best = RUN_NONE;
+    uint32_t visited = 0;
+    for (uint32_t node = vfs->free_run_roots[RUN_BY_LENGTH]; node != RUN_NONE; visited++) {
+        const VFSFreeRun* run = &vfs->free_runs[node];
+        if (run->length >= blocks) {
+            best = node;
+            node = run->child[RUN_BY_LENGTH][0];
+        } else {
+            node = run->child[RUN_BY_LENGTH][1];
+        }
+    }
+    count_op(vfs, VFS_OP_ALLOC_SCAN, (uint64_t)visited * sizeof(VFSFreeRun), started);
+    return best;
+}
+
+static uint32_t largest_free_run(VFS* vfs) {
+    uint32_t node = vfs->free_run_roots[RUN_BY_LENGTH];
+    while (node != RUN_NONE && vfs->free_runs[node].child[RUN_BY_LENGTH][1] != RUN_NONE) {
+        node = vfs->free_runs[node].child[RUN_BY_LENGTH][1];
+    }
+    return node;
+}
+
+// First fit: the lowest free run that holds the request. The longest run
+// kept for each subtree says which way it lies.
+static uint32_t first_fit_run(VFS* vfs, uint32_t blocks) {
+    uint32_t node = vfs->free_run_roots[RUN_BY_START];
+    while (node != RUN_NONE && vfs->free_runs[node].largest >= blocks) {
+        const VFSFreeRun* run = &vfs->free_runs[node];
+        uint32_t left = run->child[RUN_BY_START][0];
+        if (left != RUN_NONE && vfs->free_runs[left].largest >= blocks) {
+            node = left;
+        } else if (run->length >= blocks) {
+            return node;
+        } else {
+            node = run->child[RUN_BY_START][1];
+        }
+    }
+    return RUN_NONE;
+}
+
+static VFSExtent take_from_run(VFS* vfs, uint32_t pick, uint32_t blocks) {
+    VFSExtent extent;
+    VFSFreeRun run = vfs->free_runs[pick];
+    extent.start = run.start;
+    extent.length = run.length < blocks ? run.length : blocks;
+    resize_free_run(vfs, pick, run.start + extent.length, run.length - extent.length);
     
-    FileEntry* entry = find_file_entry(vfs, filename);
-    if (!entry) return false;
+    mark_blocks(vfs, extent.start, extent.length, true);
+    vfs->header.free_blocks -= extent.length;
+    mark_dirty(vfs, &vfs->header.free_blocks, sizeof(vfs->header.free_blocks));
+    return extent;
+}
+
+
+static void free_extent(VFS* vfs, VFSExtent extent);
+static void lock_shared(VFS* vfs);
+static void unlock_shared(VFS* vfs);
+static void lock_exclusive(VFS* vfs);
+static void unlock_exclusive(VFS* vfs);
+
+// Give a region new blocks from free run `pick`. It is written there
+// whole at commit, so the sectors marked so far no longer matter.
+static void move_region(VFS* vfs, int region, uint32_t pick, uint32_t blocks) {
+    VFSExtent* extent = region_extent(vfs, region);
+    VFSExtent old_region = *extent;
+    if (vfs->meta[region].mapped) region_detach(vfs, region, vfs->meta[region].size);
+    *extent = take_from_run(vfs, pick, blocks);
+    if (old_region.length > 0) free_extent(vfs, old_region);
+    region_clear_dirty(vfs, region);
+    vfs->meta[region].relocated = true;
+}
+
+// Extend the image so that a run of `blocks` fits at its end. The bitmap,
+// reference counts and checksums are moved to bigger regions in the new
+// space when they run out of room.
+static bool grow_blocks(VFS* vfs, uint32_t blocks) {
+    uint32_t old_blocks = vfs->header.num_blocks;
     
-    // Free blocks
-    uint32_t block = entry->first_block;
-    while (block < MAX_BLOCKS && vfs->header.block_used[block]) {
-        uint32_t next = block + 1; // Simplified
-        free_block(vfs, block);
-        block = next;
+    // A free run at the end of the image counts toward the request
+    uint32_t tail = 0;
+    uint32_t last = last_free_run(vfs);
+    if (last != RUN_NONE && vfs->free_runs[last].start + vfs->free_runs[last].length == old_blocks) {
+        tail = vfs->free_runs[last].length;
     }
     
-    // Remove entry
-    uint32_t idx = entry - vfs->header.entries;
-    if (idx < vfs->header.num_files - 1) {
-        memmove(entry, entry + 1, 
-                (vfs->header.num_files - idx - 1) * sizeof(FileEntry));
+    uint64_t step = blocks > tail ? blocks - tail : 1;
+    if (step < old_blocks / 4) step = old_blocks / 4;
+    if (step < GROW_MIN_BLOCKS) step = GROW_MIN_BLOCKS;
+    
+    // Room for a moved bitmap, reference counts and checksums, sized for
+    // twice the new block count
+    uint64_t new_blocks = old_blocks + step;
+    uint32_t bitmap_blocks = 0;
+    uint32_t refs_blocks = 0;
+    uint32_t crcs_blocks = 0;
+    if (new_blocks > (uint64_t)vfs->meta[VFS_META_BITMAP].size * 8) {
+        bitmap_blocks = (uint32_t)((new_blocks * 2 / 8 + BLOCK_SIZE - 1) / BLOCK_SIZE);
+        new_blocks += bitmap_blocks;
     }
-    vfs->header.num_files--;
+    if (vfs->refs && new_blocks > vfs->meta[VFS_META_REFS].size / sizeof(uint16_t)) {
+        refs_blocks = (uint32_t)((new_blocks * 2 * sizeof(uint16_t) + BLOCK_SIZE - 1) / BLOCK_SIZE);
+        new_blocks += refs_blocks;
+    }
+    if (vfs->crcs && new_blocks > vfs->meta[VFS_META_CRCS].size / sizeof(uint32_t)) {
+        crcs_blocks = (uint32_t)((new_blocks * 2 * sizeof(uint32_t) + BLOCK_SIZE - 1) / BLOCK_SIZE);
+        new_blocks += crcs_blocks;
+    }
+    if (new_blocks > VFS_MAX_BLOCKS) return false;
+    
+    if (bitmap_blocks > 0) region_detach(vfs, VFS_META_BITMAP, (size_t)bitmap_blocks * BLOCK_SIZE);
+    if (refs_blocks > 0) region_detach(vfs, VFS_META_REFS, (size_t)refs_blocks * BLOCK_SIZE);
+    if (crcs_blocks > 0) region_detach(vfs, VFS_META_CRCS, (size_t)crcs_blocks * BLOCK_SIZE);
     
-    save_header(vfs);
+    uint32_t added = (uint32_t)(new_blocks - old_blocks);
+    vfs->header.num_blocks = (uint32_t)new_blocks;
+    vfs->header.free_blocks += added;
+    mark_dirty(vfs, &vfs->header, sizeof(vfs->header));
+    VFSExtent space = {old_blocks, added};
+    release_run(vfs, space);
+    
+    if (bitmap_blocks > 0) {
+        move_region(vfs, VFS_META_BITMAP, best_fit_run(vfs, bitmap_blocks), bitmap_blocks);
+    }
+    if (refs_blocks > 0) move_region(vfs, VFS_META_REFS, best_fit_run(vfs, refs_blocks), refs_blocks);
+    if (crcs_blocks > 0) move_region(vfs, VFS_META_CRCS, best_fit_run(vfs, crcs_blocks), crcs_blocks);
     return true;
 }
 
-bool vfs_list_directory(VFS* vfs, const char* path, FileEntry* entries, int* count) {
-    if (!entries || !count) return false;
+// Best fit: the smallest free run that holds the request. When none does
+// the image grows; only if it cannot grow any more is the largest run
+// handed out. Returns a zero-length extent when the image is full.
+static VFSExtent alloc_extent(VFS* vfs, uint32_t blocks) {
+    VFSExtent extent = {VFS_INVALID_BLOCK, 0};
+    if (!vfs || blocks == 0) return extent;
     
-    *count = 0;
-    
-    // Simplified - return all files
-    for (uint32_t i = 0; i < vfs->header.num_files && *count < 100; i++) {
-        entries[*count] = vfs->header.entries[i];
-        (*count)++;
+    ensure_free_runs(vfs);
+    uint32_t pick = best_fit_run(vfs, blocks);
+    if (pick == RUN_NONE && grow_blocks(vfs, blocks)) {
+        pick = best_fit_run(vfs, blocks);
     }
+    if (pick == RUN_NONE) pick = largest_free_run(vfs);
+    if (pick == RUN_NONE) return extent;
     
-    return true;
+    return take_from_run(vfs, pick, blocks);
 }
 
-bool vfs_change_directory(VFS* vfs, const char* path) {
-    if (!path) return false;
-    
-    char resolved[MAX_PATH];
-    if (!vfs_resolve_path(vfs, path, resolved)) return false;
+// The free run starting at `block`, RUN_NONE if none does
+static uint32_t free_run_at(VFS* vfs, uint32_t block) {
+    uint32_t node = free_run_from(vfs, block);
+    return node != RUN_NONE && vfs->free_runs[node].start == block ? node : RUN_NONE;
+}
+
+// Take up to `blocks` blocks starting exactly at `block`, so a file can
+// grow its last extent in place. The image is extended when `block` is
+// its end. Returns a zero-length extent when that space is not free.
+static VFSExtent alloc_after(VFS* vfs, uint32_t block, uint32_t blocks) {
+    VFSExtent extent = {VFS_INVALID_BLOCK, 0};
+    ensure_free_runs(vfs);
+    if (block == vfs->header.num_blocks) {
+        grow_blocks(vfs, blocks);
+    }
     
-    // Root directory always exists
-    if (strcmp(resolved, "/") == 0) {
-        strcpy(vfs->current_dir, "/");
-        return true;
+    uint32_t pick = free_run_at(vfs, block);
+    if (pick == RUN_NONE) return extent;
+    return take_from_run(vfs, pick, blocks);
+}
+
+static void dedup_forget(VFS* vfs, VFSExtent extent);
+
+// Blocks freed by a transaction still hold data the last committed
+// metadata may point at. They are handed out again only once the next
+// transaction has committed too: until then the freeing transaction is the
+// newest in the journal, and replay checks its data checksums.
+static void free_extent(VFS* vfs, VFSExtent extent) {
+    if (!vfs || extent.length == 0 || extent.start >= vfs->header.num_blocks ||
+        extent.length > vfs->header.num_blocks - extent.start) {
+        return;
     }
     
-    // Extract directory name from resolved path
-    char* dirname = strrchr(resolved, '/');
-    if (!dirname) dirname = (char*)resolved;
-    else dirname++; // Skip the '/'
+    if (vfs->dedup_where) dedup_forget(vfs, extent);
+    mark_blocks(vfs, extent.start, extent.length, false);
+    vfs->header.free_blocks += extent.length;
+    mark_dirty(vfs, &vfs->header.free_blocks, sizeof(vfs->header.free_blocks));
     
-    // Check if directory exists in VFS
-    FileEntry* entry = find_file_entry(vfs, dirname);
-    if (!entry) {
-        return false; // Directory doesn't exist
+    if (vfs->pending_free_count == vfs->pending_free_capacity) {
+        vfs->pending_free_capacity = vfs->pending_free_capacity ? vfs->pending_free_capacity * 2 : 16;
+        vfs->pending_frees = (VFSExtent*)xrealloc(vfs->pending_frees,
+                                                  vfs->pending_free_capacity * sizeof(VFSExtent));
     }
+    vfs->pending_frees[vfs->pending_free_count++] = extent;
+}
+
+VFSExtent vfs_alloc_extent(VFS* vfs, uint32_t blocks) {
+    VFSExtent extent = {VFS_INVALID_BLOCK, 0};
+    if (!vfs) return extent;
     
-    // Verify it's actually a directory
-    if (entry->type != FT_DIRECTORY) {
-        return false; // Not a directory
-    }
+    lock_exclusive(vfs);
+    extent = alloc_extent(vfs, blocks);
+    unlock_exclusive(vfs);
+    return extent;
+}
+
+void vfs_free_extent(VFS* vfs, VFSExtent extent) {
+    if (!vfs) return;
     
-    // Directory exists and is valid, update current_dir
-    strncpy(vfs->current_dir, resolved, MAX_PATH - 1);
-    vfs->current_dir[MAX_PATH - 1] = '\0';
+    lock_exclusive(vfs);
+    free_extent(vfs, extent);
+    unlock_exclusive(vfs);
+}
+
+uint32_t vfs_free_blocks(VFS* vfs) {
+    if (!vfs) return 0;
     
-    return true;
+    lock_shared(vfs);
+    uint32_t free_blocks = vfs->header.free_blocks;
+    unlock_shared(vfs);
+    return free_blocks;
 }
 
-char* vfs_get_current_dir(VFS* vfs) {
-    return vfs ? vfs->current_dir : NULL;
+// Size of the image and how much of it is free, read together so they
+// agree with each other
+void vfs_block_counts(VFS* vfs, uint32_t* total_blocks, uint32_t* free_blocks) {
+    *total_blocks = 0;
+    *free_blocks = 0;
+    if (!vfs) return;
+    
+    lock_shared(vfs);
+    *total_blocks = vfs->header.num_blocks;
+    *free_blocks = vfs->header.free_blocks;
+    unlock_shared(vfs);
+}
+
+static uint32_t find_free_block(VFS* vfs) {
+    return alloc_extent(vfs, 1).start;
+}
+
+static void free_block(VFS* vfs, uint32_t block) {
+    VFSExtent extent = {block, 1};
+    free_extent(vfs, extent);
 }
 
+// Create a zeroed region holding one `width`-byte value per block. It is
+// sized for twice the block count, like the bitmap. Allocating may grow
+// the image past that, so try again with the new size.
+static void* create_block_region(VFS* vfs, int region, size_t width) {
+    VFSExtent extent;
+    for (;;) {
+        uint32_t blocks = (uint32_t)(((uint64_t)vfs->header.num_blocks * 2 * width +
+                                      BLOCK_SIZE - 1) / BLOCK_SIZE);
+        extent = alloc_extent(vfs, blocks);
+        if (extent.length < blocks) {
+            free_extent(vfs, extent);
+            return NULL;
+        }
+        if ((uint64_t)extent.length * BLOCK_SIZE / width >= vfs->header.num_blocks) break;
+        free_extent(vfs, extent);
+    }
+    
+    size_t size = (size_t)extent.length * BLOCK_SIZE;
+    void* base = xmalloc(size);
+    memset(base, 0, size);
+    region_resize(vfs, region, base, size);
+    
+    *region_extent(vfs, region) = extent;
+    mark_dirty(vfs, &vfs->header, sizeof(vfs->header));
+    vfs->meta[region].relocated = true;
+    return base;
+}
+
+// Reference counts get a region the first time a block is shared. A block
+// with count n belongs to n + 1 files; unshared blocks have count 0.
+static bool ensure_refs(VFS* vfs) {
+    if (!vfs->refs) {
+        vfs->refs = (uint16_t*)create_block_region(vfs, VFS_META_REFS, sizeof(uint16_t));
+    }
+    return vfs->refs != NULL;
+}
+
+// Checksums get a region the first time file data is written. Each data
+// block has the CRC32C of its contents, with the part past the end of
+// what was written taken as zeros; 0 means no checksum was recorded.
+static bool ensure_crcs(VFS* vfs) {
+    if (!vfs->crcs) {
+        vfs->crcs = (uint32_t*)create_block_region(vfs, VFS_META_CRCS, sizeof(uint32_t));
+    }
+    return vfs->crcs != NULL;
+}
+
+static bool block_shared(const VFS* vfs, uint32_t block) {
+    return vfs->refs && vfs->refs[block] > 0;
+}
+
+// Drop one file's claim on a run of data blocks: shared blocks lose a
+// reference, the rest are freed
+static void release_blocks(VFS* vfs, VFSExtent extent) {
+    uint32_t end = extent.start + extent.length;
+    uint32_t run = extent.start;
+    for (uint32_t block = extent.start; block < end; block++) {
+        if (!block_shared(vfs, block)) continue;
+        
+        VFSExtent owned = {run, block - run};
+        free_extent(vfs, owned);
+        vfs->refs[block]--;
+        mark_dirty(vfs, &vfs->refs[block], sizeof(uint16_t));
+        run = block + 1;
+    }
+    VFSExtent owned = {run, end - run};
+    free_extent(vfs, owned);
+}
+
+// Entries are addressed by their slot number, and a free slot has an
+// empty name
+static bool entry_in_use(const FileEntry* entry) {
+    return entry->name[0] != '\0';
+}
+
+// A file of up to VFS_INLINE_SIZE bytes keeps its contents in the entry
+// and owns no blocks
+static bool entry_inline(const FileEntry* entry) {
+    return entry->extent_count == 0 && entry->size > 0;
+}
+
+static uint32_t entry_number(VFS* vfs, const FileEntry* entry) {
+    return (uint32_t)(entry - vfs->entries);
+}
+
+static void mark_entry_dirty(VFS* vfs, const FileEntry* entry) {
+    mark_dirty(vfs, entry, sizeof(FileEntry));
+}
+
+// Directory index: a B+tree in the tree region, keyed on parent, then
+// name prefix, then entry number. Entries whose names share a prefix sit
+// together, and a lookup checks their full names. A key in an internal
+// node is a copy of the first key of the subtree to its right. A node
+// that empties is freed and taken out of its parent; nodes are not
+// merged. The root entry has no key: it is found by path, never by name.
+#define TREE_MAX_HEIGHT 32
+
+static VFSTreeNode* tree_node(VFS* vfs, uint32_t number) {
+    return &vfs->tree[number];
+}
+
+static void make_key(VFSTreeKey* key, uint32_t parent, const char* name, uint32_t entry) {
+    memset(key, 0, sizeof(VFSTreeKey));
+    key->parent = parent;
+    key->entry = entry;
+    memcpy(key->prefix, name, strnlen(name, VFS_TREE_PREFIX));
+}
+
+static int key_order(const VFSTreeKey* a, const VFSTreeKey* b) {
+    if (a->parent != b->parent) return a->parent < b->parent ? -1 : 1;
+    int order = memcmp(a->prefix, b->prefix, VFS_TREE_PREFIX);
+    if (order != 0) return order;
+    if (a->entry != b->entry) return a->entry < b->entry ? -1 : 1;
+    return 0;
+}
+
+// First key at or after `key`
+static uint32_t lower_bound(const VFSTreeNode* node, const VFSTreeKey* key) {
+    uint32_t lo = 0, hi = node->count;
+    while (lo < hi) {
+        uint32_t mid = (lo + hi) / 2;
+        if (key_order(&node->keys[mid], key) < 0) lo = mid + 1;
+        else hi = mid;
+    }
+    return lo;
+}
+
+// Child of an internal node whose subtree holds `key`
+static uint32_t child_for(const VFSTreeNode* node, const VFSTreeKey* key) {
+    uint32_t lo = 0, hi = node->count;
+    while (lo < hi) {
+        uint32_t mid = (lo + hi) / 2;
+        if (key_order(&node->keys[mid], key) <= 0) lo = mid + 1;
+        else hi = mid;
+    }
+    return lo;
+}
+
+// Walk down to the leaf that holds `key`, or would. path and slots get
+// the internal nodes passed and the child taken in each; returns their
+// number.
+static int tree_descend(VFS* vfs, const VFSTreeKey* key, uint32_t* path, uint32_t* slots,
+                        uint32_t* leaf) {
+    uint32_t number = vfs->header.tree_root;
+    int depth = 0;
+    while (!tree_node(vfs, number)->leaf && depth < TREE_MAX_HEIGHT) {
+        const VFSTreeNode* node = tree_node(vfs, number);
+        uint32_t slot = child_for(node, key);
+        path[depth] = number;
+        slots[depth++] = slot;
+        number = node->children[slot];
+    }
+    *leaf = number;
+    return depth;
+}
+
+// Cursor over keys in order: a leaf and a position in it
+typedef struct {
+    uint32_t node;
+    uint32_t index;
+} TreeCursor;
+
+static void tree_seek(VFS* vfs, const VFSTreeKey* key, TreeCursor* cursor) {
+    uint32_t path[TREE_MAX_HEIGHT], slots[TREE_MAX_HEIGHT];
+    tree_descend(vfs, key, path, slots, &cursor->node);
+    cursor->index = lower_bound(tree_node(vfs, cursor->node), key);
+}
+
+// The key under the cursor, moving on to the next leaf as needed; NULL
+// past the last key
+static const VFSTreeKey* tree_current(VFS* vfs, TreeCursor* cursor) {
+    while (cursor->node != VFS_TREE_NONE) {
+        const VFSTreeNode* node = tree_node(vfs, cursor->node);
+        if (cursor->index < node->count) return &node->keys[cursor->index];
+        cursor->node = node->next;
+        cursor->index = 0;
+    }
+    return NULL;
+}
+
+static FileEntry* index_lookup(VFS* vfs, uint32_t parent, const char* name) {
+    VFSTreeKey key;
+    make_key(&key, parent, name, 0);
+    TreeCursor cursor;
+    tree_seek(vfs, &key, &cursor);
+    for (const VFSTreeKey* found; (found = tree_current(vfs, &cursor)) != NULL; cursor.index++) {
+        if (found->parent != parent || memcmp(found->prefix, key.prefix, VFS_TREE_PREFIX) != 0) break;
+        FileEntry* entry = &vfs->entries[found->entry];
+        if (strcmp(entry->name, name) == 0) return entry;
+    }
+    return NULL;
+}
+
+static void mark_node_dirty(VFS* vfs, const VFSTreeNode* node) {
+    mark_dirty(vfs, node, sizeof(VFSTreeNode) - sizeof(node->padding));
+}
+
+// Mark the node header and keys from `from` on, plus the children from
+// `from` on in an internal node
+static void mark_node_tail_dirty(VFS* vfs, const VFSTreeNode* node, uint32_t from) {
+    mark_dirty(vfs, node, offsetof(VFSTreeNode, keys));
+    if (from < node->count) {
+        mark_dirty(vfs, &node->keys[from], (node->count - from) * sizeof(VFSTreeKey));
+    }
+    if (!node->leaf) {
+        mark_dirty(vfs, &node->children[from], (node->count + 1 - from) * sizeof(uint32_t));
+    }
+}
+
+// Double the tree region. Node numbers stay the same.
+static bool grow_tree(VFS* vfs) {
+    VFSExtent old_region = vfs->header.tree_region;
+    VFSExtent region = alloc_extent(vfs, old_region.length * 2);
+    if (region.length < old_region.length * 2) {
+        free_extent(vfs, region);
+        return false;
+    }
+    
+    region_detach(vfs, VFS_META_TREE, (size_t)region.length * BLOCK_SIZE);
+    vfs->header.tree_region = region;
+    mark_dirty(vfs, &vfs->header, sizeof(vfs->header));
+    free_extent(vfs, old_region);
+    region_clear_dirty(vfs, VFS_META_TREE);
+    vfs->meta[VFS_META_TREE].relocated = true;
+    return true;
+}
+
+static uint32_t tree_capacity(const VFS* vfs) {
+    return vfs->header.tree_region.length;
+}
+
+// Make sure `count` nodes can be allocated without the region moving
+static bool tree_reserve(VFS* vfs, uint32_t count) {
+    while (vfs->header.tree_nodes + count > tree_capacity(vfs)) {
+        if (!grow_tree(vfs)) return false;
+    }
+    return true;
+}
+
+static uint32_t tree_alloc(VFS* vfs, bool leaf) {
+    uint32_t number = vfs->header.tree_free;
+    if (number != VFS_TREE_NONE) {
+        vfs->header.tree_free = tree_node(vfs, number)->next;
+    } else {
+        number = vfs->header.tree_nodes++;
+    }
+    mark_dirty(vfs, &vfs->header, sizeof(vfs->header));
+    
+    VFSTreeNode* node = tree_node(vfs, number);
+    memset(node, 0, sizeof(VFSTreeNode));
+    node->leaf = leaf;
+    node->next = VFS_TREE_NONE;
+    node->prev = VFS_TREE_NONE;
+    mark_node_dirty(vfs, node);
+    return number;
+}
+
+static void tree_release(VFS* vfs, uint32_t number) {
+    VFSTreeNode* node = tree_node(vfs, number);
+    node->count = 0;
+    node->next = vfs->header.tree_free;
+    mark_dirty(vfs, node, offsetof(VFSTreeNode, keys));
+    vfs->header.tree_free = number;
+    mark_dirty(vfs, &vfs->header, sizeof(vfs->header));
+}
+
+// Split a full leaf while adding `key` at `pos`. Returns the new right
+// half; *separator gets its first key.
+static uint32_t split_leaf(VFS* vfs, uint32_t number, uint32_t pos, const VFSTreeKey* key,
+                           VFSTreeKey* separator) {
+    uint32_t right_number = tree_alloc(vfs, true);
+    VFSTreeNode* left = tree_node(vfs, number);
+    VFSTreeNode* right = tree_node(vfs, right_number);
+    
+    VFSTreeKey keys[VFS_TREE_KEYS + 1];
+    memcpy(keys, left->keys, pos * sizeof(VFSTreeKey));
+    keys[pos] = *key;
+    memcpy(keys + pos + 1, left->keys + pos, (left->count - pos) * sizeof(VFSTreeKey));
+    
+    uint32_t half = (VFS_TREE_KEYS + 1) / 2;
+    memcpy(left->keys, keys, half * sizeof(VFSTreeKey));
+    memcpy(right->keys, keys + half, (VFS_TREE_KEYS + 1 - half) * sizeof(VFSTreeKey));
+    left->count = (uint16_t)half;
+    right->count = (uint16_t)(VFS_TREE_KEYS + 1 - half);
+    
+    right->next = left->next;
+    right->prev = number;
+    if (left->next != VFS_TREE_NONE) {
+        VFSTreeNode* after = tree_node(vfs, left->next);
+        after->prev = right_number;
+        mark_dirty(vfs, after, offsetof(VFSTreeNode, keys));
+    }
+    left->next = right_number;
+    mark_node_dirty(vfs, left);
+    mark_node_dirty(vfs, right);
+    *separator = right->keys[0];
+    return right_number;
+}
+
+// Split a full internal node while adding `key` with `child` to its right
+// at `pos`. Returns the new right half; *separator gets the middle key,
+// which moves up.
+static uint32_t split_internal(VFS* vfs, uint32_t number, uint32_t pos, const VFSTreeKey* key,
+                               uint32_t child, VFSTreeKey* separator) {
+    uint32_t right_number = tree_alloc(vfs, false);
+    VFSTreeNode* left = tree_node(vfs, number);
+    VFSTreeNode* right = tree_node(vfs, right_number);
+    
+    VFSTreeKey keys[VFS_TREE_KEYS + 1];
+    uint32_t children[VFS_TREE_KEYS + 2];
+    memcpy(keys, left->keys, pos * sizeof(VFSTreeKey));
+    keys[pos] = *key;
+    memcpy(keys + pos + 1, left->keys + pos, (left->count - pos) * sizeof(VFSTreeKey));
+    memcpy(children, left->children, (pos + 1) * sizeof(uint32_t));
+    children[pos + 1] = child;
+    memcpy(children + pos + 2, left->children + pos + 1, (left->count - pos) * sizeof(uint32_t));
+    
+    uint32_t mid = (VFS_TREE_KEYS + 1) / 2;
+    memcpy(left->keys, keys, mid * sizeof(VFSTreeKey));
+    memcpy(left->children, children, (mid + 1) * sizeof(uint32_t));
+    left->count = (uint16_t)mid;
+    *separator = keys[mid];
+    uint32_t rest = VFS_TREE_KEYS - mid;
+    memcpy(right->keys, keys + mid + 1, rest * sizeof(VFSTreeKey));
+    memcpy(right->children, children + mid + 1, (rest + 1) * sizeof(uint32_t));
+    right->count = (uint16_t)rest;
+    mark_node_dirty(vfs, left);
+    mark_node_dirty(vfs, right);
+    return right_number;
+}
+
+// Add a key. Fails only if the tree cannot grow.
+static bool tree_insert(VFS* vfs, const VFSTreeKey* new_key) {
+    VFSTreeKey key = *new_key;
+    uint32_t path[TREE_MAX_HEIGHT], slots[TREE_MAX_HEIGHT];
+    uint32_t leaf;
+    int depth = tree_descend(vfs, &key, path, slots, &leaf);
+    
+    // Each full node on the way up splits, and a full root adds a level
+    uint32_t splits = 0;
+    if (tree_node(vfs, leaf)->count == VFS_TREE_KEYS) {
+        splits = 1;
+        int level = depth;
+        while (level > 0 && tree_node(vfs, path[level - 1])->count == VFS_TREE_KEYS) {
+            splits++;
+            level--;
+        }
+        if (level == 0) splits++;
+    }
+    if (!tree_reserve(vfs, splits)) return false;
+    
+    VFSTreeNode* node = tree_node(vfs, leaf);
+    uint32_t pos = lower_bound(node, &key);
+    if (node->count < VFS_TREE_KEYS) {
+        memmove(&node->keys[pos + 1], &node->keys[pos], (node->count - pos) * sizeof(VFSTreeKey));
+        node->keys[pos] = key;
+        node->count++;
+        mark_node_tail_dirty(vfs, node, pos);
+        return true;
+    }
+    
+    VFSTreeKey separator;
+    uint32_t right = split_leaf(vfs, leaf, pos, &key, &separator);
+    while (depth > 0) {
+        uint32_t parent = path[--depth];
+        uint32_t slot = slots[depth];
+        node = tree_node(vfs, parent);
+        if (node->count < VFS_TREE_KEYS) {
+            memmove(&node->keys[slot + 1], &node->keys[slot], (node->count - slot) * sizeof(VFSTreeKey));
+            memmove(&node->children[slot + 2], &node->children[slot + 1],
+                    (node->count - slot) * sizeof(uint32_t));
+            node->keys[slot] = separator;
+            node->children[slot + 1] = right;
+            node->count++;
+            mark_node_tail_dirty(vfs, node, slot);
+            return true;
+        }
+        VFSTreeKey up;
+        right = split_internal(vfs, parent, slot, &separator, right, &up);
+        separator = up;
+    }
+    
+    // The root split: a new root goes above both halves
+    uint32_t root = tree_alloc(vfs, false);
+    node = tree_node(vfs, root);
+    node->keys[0] = separator;
+    node->children[0] = vfs->header.tree_root;
+    node->children[1] = right;
+    node->count = 1;
+    mark_node_dirty(vfs, node);
+    vfs->header.tree_root = root;
+    mark_dirty(vfs, &vfs->header, sizeof(vfs->header));
+    return true;
+}
+
+static bool index_insert(VFS* vfs, uint32_t number) {
+    const FileEntry* entry = &vfs->entries[number];
+    VFSTreeKey key;
+    make_key(&key, entry->parent_dir, entry->name, number);
+    return tree_insert(vfs, &key);
+}
+
+// Take an emptied leaf out of the sibling chain
+static void unlink_leaf(VFS* vfs, VFSTreeNode* node) {
+    if (node->prev != VFS_TREE_NONE) {
+        VFSTreeNode* before = tree_node(vfs, node->prev);
+        before->next = node->next;
+        mark_dirty(vfs, before, offsetof(VFSTreeNode, keys));
+    }
+    if (node->next != VFS_TREE_NONE) {
+        VFSTreeNode* after = tree_node(vfs, node->next);
+        after->prev = node->prev;
+        mark_dirty(vfs, after, offsetof(VFSTreeNode, keys));
+    }
+}
+
+static void tree_remove(VFS* vfs, const VFSTreeKey* old_key) {
+    VFSTreeKey key = *old_key;
+    uint32_t path[TREE_MAX_HEIGHT], slots[TREE_MAX_HEIGHT];
+    uint32_t leaf;
+    int depth = tree_descend(vfs, &key, path, slots, &leaf);
+    VFSTreeNode* node = tree_node(vfs, leaf);
+    uint32_t pos = lower_bound(node, &key);
+    if (pos == node->count || key_order(&node->keys[pos], &key) != 0) return;
+    
+    memmove(&node->keys[pos], &node->keys[pos + 1], (node->count - pos - 1) * sizeof(VFSTreeKey));
+    node->count--;
+    mark_node_tail_dirty(vfs, node, pos);
+    if (node->count > 0 || depth == 0) return;
+    
+    // Free the empty leaf, and each parent left with no children
+    unlink_leaf(vfs, node);
+    tree_release(vfs, leaf);
+    bool emptied = true;
+    while (emptied && depth > 0) {
+        uint32_t parent = path[--depth];
+        uint32_t slot = slots[depth];
+        node = tree_node(vfs, parent);
+        if (node->count == 0) {
+            if (depth == 0) break;
+            tree_release(vfs, parent);
+            continue;
+        }
+        uint32_t gone = slot > 0 ? slot - 1 : 0;
+        memmove(&node->keys[gone], &node->keys[gone + 1], (node->count - gone - 1) * sizeof(VFSTreeKey));
+        memmove(&node->children[slot], &node->children[slot + 1], (node->count - slot) * sizeof(uint32_t));
+        node->count--;
+        mark_node_tail_dirty(vfs, node, gone);
+        emptied = false;
+    }
+    
+    // A root with one child gives way to it; a root with none becomes an
+    // empty leaf
+    node = tree_node(vfs, vfs->header.tree_root);
+    if (emptied) {
+        node->leaf = true;
+        node->count = 0;
+        node->next = VFS_TREE_NONE;
+        node->prev = VFS_TREE_NONE;
+        mark_node_dirty(vfs, node);
+        return;
+    }
+    while (!node->leaf && node->count == 0) {
+        uint32_t old_root = vfs->header.tree_root;
+        vfs->header.tree_root = node->children[0];
+        mark_dirty(vfs, &vfs->header, sizeof(vfs->header));
+        tree_release(vfs, old_root);
+        node = tree_node(vfs, vfs->header.tree_root);
+    }
+}
+
+// Remove an entry's key, under the name and parent it has now
+static void index_remove(VFS* vfs, uint32_t number) {
+    const FileEntry* entry = &vfs->entries[number];
+    VFSTreeKey key;
+    make_key(&key, entry->parent_dir, entry->name, number);
+    tree_remove(vfs, &key);
+}
+
+// Whether a directory has any key under it
+static bool index_has_children(VFS* vfs, uint32_t dir) {
+    VFSTreeKey key;
+    make_key(&key, dir, "", 0);
+    TreeCursor cursor;
+    tree_seek(vfs, &key, &cursor);
+    const VFSTreeKey* found = tree_current(vfs, &cursor);
+    return found && found->parent == dir;
+}
+
+// Entry numbers of a directory's children in name order. Keys give it
+// except among names that share a whole prefix, which are sorted here.
+static uint32_t* index_children(VFS* vfs, uint32_t dir, uint32_t* count) {
+    uint32_t capacity = 16;
+    uint32_t n = 0;
+    uint32_t* items = (uint32_t*)xmalloc(capacity * sizeof(uint32_t));
+    
+    VFSTreeKey key;
+    make_key(&key, dir, "", 0);
+    TreeCursor cursor;
+    tree_seek(vfs, &key, &cursor);
+    char last[VFS_TREE_PREFIX];
+    uint32_t run = 0;
+    for (const VFSTreeKey* found; (found = tree_current(vfs, &cursor)) != NULL; cursor.index++) {
+        if (found->parent != dir) break;
+        if (n == capacity) {
+            capacity *= 2;
+            items = (uint32_t*)xrealloc(items, capacity * sizeof(uint32_t));
+        }
+        if (n == 0 || memcmp(found->prefix, last, VFS_TREE_PREFIX) != 0) {
+            memcpy(last, found->prefix, VFS_TREE_PREFIX);
+            run = n;
+        }
+        
+        // Insertion sort within a run of keys with the same prefix
+        uint32_t at = n++;
+        const char* name = vfs->entries[found->entry].name;
+        while (at > run && strcmp(vfs->entries[items[at - 1]].name, name) > 0) {
+            items[at] = items[at - 1];
+            at--;
+        }
+        items[at] = found->entry;
+    }
+    *count = n;
+    return items;
+}
+
+// Give a new image an empty directory index
+static bool create_tree(VFS* vfs) {
+    VFSExtent region = alloc_extent(vfs, 1);
+    if (region.length < 1) return false;
+    
+    void* base = xmalloc(BLOCK_SIZE);
+    memset(base, 0, BLOCK_SIZE);
+    region_resize(vfs, VFS_META_TREE, base, BLOCK_SIZE);
+    vfs->header.tree_region = region;
+    vfs->header.tree_nodes = 0;
+    vfs->header.tree_free = VFS_TREE_NONE;
+    vfs->header.tree_root = tree_alloc(vfs, true);
+    mark_dirty(vfs, &vfs->header, sizeof(vfs->header));
+    vfs->meta[VFS_META_TREE].relocated = true;
+    return true;
+}
+
+static const char zero_block[BLOCK_SIZE];
+
+// CRC32C of a block holding len bytes of data followed by zeros
+static uint32_t block_checksum(const char* data, size_t len) {
+    uint32_t crc = crc32c(0, data, len);
+    return len < BLOCK_SIZE ? crc32c(crc, zero_block, BLOCK_SIZE - len) : crc;
+}
+
+// Dedup index: full data blocks of files, found by the CRC32C the block
+// checksum region already holds for them. The table lives only in memory;
+// with VFSOptions.dedup it is filled from that region on the first
+// deduplicated write after the image is opened, and a match is always
+// confirmed by reading the block. dedup_where maps each indexed block back
+// to its slot, so a block leaves the index when it is freed.
+#define DEDUP_EMPTY UINT32_MAX
+#define DEDUP_TOMBSTONE (UINT32_MAX - 1)
+
+static void checksum_blocks(const char* data, size_t count, uint32_t* crcs) {
+    for (size_t i = 0; i < count; i++) {
+        crcs[i] = block_checksum(data + i * BLOCK_SIZE, BLOCK_SIZE);
+    }
+}
+
+static void dedup_insert(VFS* vfs, uint32_t crc, uint32_t block);
+
+// Size the table for the live slots and refill it, dropping tombstones
+static void dedup_rebuild(VFS* vfs) {
+    VFSDedupSlot* old = vfs->dedup_slots;
+    uint32_t old_capacity = vfs->dedup_capacity;
+    
+    uint32_t capacity = 1024;
+    while (capacity < vfs->dedup_live * 4) {
+        capacity *= 2;
+    }
+    vfs->dedup_slots = (VFSDedupSlot*)xmalloc(capacity * sizeof(VFSDedupSlot));
+    vfs->dedup_capacity = capacity;
+    for (uint32_t i = 0; i < capacity; i++) {
+        vfs->dedup_slots[i].block = DEDUP_EMPTY;
+    }
+    vfs->dedup_used = 0;
+    vfs->dedup_live = 0;
+    
+    for (uint32_t i = 0; i < old_capacity; i++) {
+        if (old[i].block != DEDUP_EMPTY && old[i].block != DEDUP_TOMBSTONE) {
+            dedup_insert(vfs, old[i].crc, old[i].block);
+        }
+    }
+    free(old);
+}
+
+static void dedup_insert(VFS* vfs, uint32_t crc, uint32_t block) {
+    // Keep at least a quarter of the table empty so probes stay short
+    if ((vfs->dedup_used + 1) * 4 > vfs->dedup_capacity * 3) {
+        dedup_rebuild(vfs);
+    }
+    if (block >= vfs->dedup_where_count) {
+        uint32_t count = vfs->header.num_blocks > block ? vfs->header.num_blocks : block + 1;
+        vfs->dedup_where = (uint32_t*)xrealloc(vfs->dedup_where, count * sizeof(uint32_t));
+        memset(vfs->dedup_where + vfs->dedup_where_count, 0xFF,
+               (count - vfs->dedup_where_count) * sizeof(uint32_t));
+        vfs->dedup_where_count = count;
+    }
+    
+    uint32_t mask = vfs->dedup_capacity - 1;
+    uint32_t i = crc & mask;
+    while (vfs->dedup_slots[i].block != DEDUP_EMPTY && vfs->dedup_slots[i].block != DEDUP_TOMBSTONE) {
+        i = (i + 1) & mask;
+    }
+    if (vfs->dedup_slots[i].block == DEDUP_EMPTY) {
+        vfs->dedup_used++;
+    }
+    vfs->dedup_slots[i].crc = crc;
+    vfs->dedup_slots[i].block = block;
+    vfs->dedup_live++;
+    vfs->dedup_where[block] = i;
+}
+
+static uint32_t dedup_lookup(VFS* vfs, uint32_t crc) {
+    if (vfs->dedup_capacity == 0) return VFS_INVALID_BLOCK;
+    
+    uint32_t mask = vfs->dedup_capacity - 1;
+    for (uint32_t i = crc & mask; ; i = (i + 1) & mask) {
+        const VFSDedupSlot* slot = &vfs->dedup_slots[i];
+        if (slot->block == DEDUP_EMPTY) return VFS_INVALID_BLOCK;
+        if (slot->block != DEDUP_TOMBSTONE && slot->crc == crc) return slot->block;
+    }
+}
+
+static void dedup_forget(VFS* vfs, VFSExtent extent) {
+    uint32_t end = extent.start + extent.length;
+    if (end > vfs->dedup_where_count) end = vfs->dedup_where_count;
+    for (uint32_t block = extent.start; block < end; block++) {
+        uint32_t slot = vfs->dedup_where[block];
+        if (slot == DEDUP_EMPTY) continue;
+        
+        vfs->dedup_slots[slot].block = DEDUP_TOMBSTONE;
+        vfs->dedup_where[block] = DEDUP_EMPTY;
+        vfs->dedup_live--;
+    }
+}
+
+// Double the entry table into a new region. Entry numbers stay the same,
+// but FileEntry pointers into the old table are no longer valid.
+static bool grow_entries(VFS* vfs) {
+    VFSExtent old_region = vfs->header.entry_region;
+    
+    VFSExtent region = alloc_extent(vfs, old_region.length * 2);
+    if (region.length < old_region.length * 2) {
+        free_extent(vfs, region);
+        return false;
+    }
+    
+    size_t size = (size_t)region.length * BLOCK_SIZE;
+    region_detach(vfs, VFS_META_ENTRIES, size);
+    vfs->header.entry_region = region;
+    vfs->header.entry_count = (uint32_t)(size / sizeof(FileEntry));
+    mark_dirty(vfs, &vfs->header, sizeof(vfs->header));
+    free_extent(vfs, old_region);
+    region_clear_dirty(vfs, VFS_META_ENTRIES);
+    vfs->meta[VFS_META_ENTRIES].relocated = true;
+    return true;
+}
+
+// Unused slots: ones freed since the image was made are chained through
+// parent_dir from header.free_entry, and slots from entry_high up have
+// never been used
+static FileEntry* allocate_file_entry(VFS* vfs) {
+    uint32_t number = vfs->header.free_entry;
+    if (number != VFS_NO_ENTRY) {
+        vfs->header.free_entry = vfs->entries[number].parent_dir;
+    } else {
+        if (vfs->header.entry_high == vfs->header.entry_count && !grow_entries(vfs)) {
+            return NULL;
+        }
+        number = vfs->header.entry_high++;
+    }
+    
+    FileEntry* entry = &vfs->entries[number];
+    memset(entry, 0, sizeof(FileEntry));
+    entry->extent_block = VFS_INVALID_BLOCK;
+    entry->chunk_block = VFS_INVALID_BLOCK;
+    vfs->header.num_files++;
+    mark_entry_dirty(vfs, entry);
+    mark_dirty(vfs, &vfs->header, sizeof(vfs->header));
+    return entry;
+}
+
+static void release_file_entry(VFS* vfs, FileEntry* entry) {
+    memset(entry, 0, sizeof(FileEntry));
+    entry->parent_dir = vfs->header.free_entry;
+    vfs->header.free_entry = entry_number(vfs, entry);
+    vfs->header.num_files--;
+    mark_entry_dirty(vfs, entry);
+    mark_dirty(vfs, &vfs->header, sizeof(vfs->header));
+}
+
+// Walk a path down from the root. On success *parent is the directory
+// holding the last component and name receives that component; the root
+// itself comes back with an empty name.
+static bool resolve_path(VFS* vfs, const char* path, char* resolved);
+static uint32_t path_hash(const char* path);
+static uint32_t cached_entry(VFS* vfs, const char* path, uint32_t hash);
+static void remember_entry(VFS* vfs, const char* path, uint32_t hash, uint32_t number);
+
+static bool walk_path(VFS* vfs, const char* path, uint32_t* parent, char* name) {
+    char resolved[MAX_PATH];
+    if (!path || !resolve_path(vfs, path, resolved)) return false;
+    
+    uint32_t dir = vfs->header.root_dir;
+    char* component = resolved;
+    name[0] = '\0';
+    
+    while (*component) {
+        while (*component == '/') component++;
+        if (!*component) break;
+        
+        char* end = strchr(component, '/');
+        if (end) *end = '\0';
+        
+        if (name[0]) {
+            // The previous component was not the last one, so descend into it
+            FileEntry* entry = index_lookup(vfs, dir, name);
+            if (!entry || entry->type != FT_DIRECTORY) return false;
+            dir = entry_number(vfs, entry);
+        }
+        if (strlen(component) >= MAX_FILENAME) return false;
+        strcpy(name, component);
+        
+        if (!end) break;
+        component = end + 1;
+    }
+    
+    *parent = dir;
+    return true;
+}
+
+static FileEntry* lookup_path(VFS* vfs, const char* path) {
+    if (!path) return NULL;
+    uint32_t hash = path_hash(path);
+    uint32_t number = cached_entry(vfs, path, hash);
+    if (number == VFS_NO_ENTRY) return NULL;
+    if (number != VFS_PATH_UNKNOWN) return &vfs->entries[number];
+    
+    uint32_t parent;
+    char name[MAX_FILENAME];
+    FileEntry* entry = NULL;
+    if (!walk_path(vfs, path, &parent, name)) {
+        entry = NULL;
+    } else if (name[0] == '\0') {
+        entry = &vfs->entries[vfs->header.root_dir];
+    } else {
+        entry = index_lookup(vfs, parent, name);
+    }
+    remember_entry(vfs, path, hash, entry ? entry_number(vfs, entry) : VFS_NO_ENTRY);
+    return entry;
+}
+
+static bool directory_is_empty(VFS* vfs, uint32_t dir) {
+    return !index_has_children(vfs, dir);
+}
+
+static uint64_t block_offset(uint32_t block_num) {
+    return DATA_OFFSET + (uint64_t)block_num * BLOCK_SIZE;
+}
+
+// Locking: lookups and reads share the metadata lock, anything that
+// changes the image holds it exclusively. Readers still update the block
+// cache, its counters and the mapping, so those sit behind a mutex of
+// their own. POSIX read-write locks may let a stream of readers starve a
+// writer, so a writer waits in the turnstile and new readers queue behind
+// it there.
+struct VFSLocks {
+#ifdef _WIN32
+    SRWLOCK metadata;
+    CRITICAL_SECTION cache;
+#else
+    pthread_rwlock_t metadata;
+    pthread_mutex_t turnstile;
+    pthread_mutex_t cache;
+#endif
+};
+
+static void locks_init(VFS* vfs) {
+    vfs->locks = (VFSLocks*)xmalloc(sizeof(VFSLocks));
+#ifdef _WIN32
+    InitializeSRWLock(&vfs->locks->metadata);
+    InitializeCriticalSection(&vfs->locks->cache);
+#else
+    pthread_rwlock_init(&vfs->locks->metadata, NULL);
+    pthread_mutex_init(&vfs->locks->turnstile, NULL);
+    pthread_mutex_init(&vfs->locks->cache, NULL);
+#endif
+}
+
+static void locks_free(VFS* vfs) {
+    if (!vfs->locks) return;
+#ifdef _WIN32
+    DeleteCriticalSection(&vfs->locks->cache);
+#else
+    pthread_rwlock_destroy(&vfs->locks->metadata);
+    pthread_mutex_destroy(&vfs->locks->turnstile);
+    pthread_mutex_destroy(&vfs->locks->cache);
+#endif
+    free(vfs->locks);
+    vfs->locks = NULL;
+}
+
+static void lock_shared(VFS* vfs) {
+#ifdef _WIN32
+    AcquireSRWLockShared(&vfs->locks->metadata);
+#else
+    pthread_mutex_lock(&vfs->locks->turnstile);
+    pthread_mutex_unlock(&vfs->locks->turnstile);
+    pthread_rwlock_rdlock(&vfs->locks->metadata);
+#endif
+}
+
+static void unlock_shared(VFS* vfs) {
+#ifdef _WIN32
+    ReleaseSRWLockShared(&vfs->locks->metadata);
+#else
+    pthread_rwlock_unlock(&vfs->locks->metadata);
+#endif
+}
+
+static void lock_exclusive(VFS* vfs) {
+#ifdef _WIN32
+    AcquireSRWLockExclusive(&vfs->locks->metadata);
+#else
+    pthread_mutex_lock(&vfs->locks->turnstile);
+    pthread_rwlock_wrlock(&vfs->locks->metadata);
+    pthread_mutex_unlock(&vfs->locks->turnstile);
+#endif
+}
+
+static void unlock_exclusive(VFS* vfs) {
+#ifdef _WIN32
+    ReleaseSRWLockExclusive(&vfs->locks->metadata);
+#else
+    pthread_rwlock_unlock(&vfs->locks->metadata);
+#endif
+}
+
+static void cache_enter(VFS* vfs) {
+#ifdef _WIN32
+    EnterCriticalSection(&vfs->locks->cache);
+#else
+    pthread_mutex_lock(&vfs->locks->cache);
+#endif
+}
+
+static void cache_leave(VFS* vfs) {
+#ifdef _WIN32
+    LeaveCriticalSection(&vfs->locks->cache);
+#else
+    pthread_mutex_unlock(&vfs->locks->cache);
+#endif
+}
+
+// Monotonic nanoseconds, for timing operations
+static uint64_t clock_ns(void) {
+#ifdef _WIN32
+    static LARGE_INTEGER frequency;
+    LARGE_INTEGER now;
+    if (frequency.QuadPart == 0) QueryPerformanceFrequency(&frequency);
+    QueryPerformanceCounter(&now);
+    return (uint64_t)(now.QuadPart / frequency.QuadPart) * 1000000000ULL +
+           (uint64_t)(now.QuadPart % frequency.QuadPart) * 1000000000ULL / (uint64_t)frequency.QuadPart;
+#else
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000ULL + (uint64_t)now.tv_nsec;
+#endif
+}
+
+// Start of an operation, or 0 when operations are not being timed
+static uint64_t op_start(VFS* vfs) {
+    return __atomic_load_n(&vfs->stats.timed, __ATOMIC_RELAXED) ? clock_ns() : 0;
+}
+
+// Count one operation. Image reads run in many threads at once under the
+// shared lock, so the counters take atomic adds rather than a lock.
+static void count_op(VFS* vfs, VFSOp op, uint64_t bytes, uint64_t started) {
+    VFSOpStats* stats = &vfs->stats.ops[op];
+    __atomic_fetch_add(&stats->count, 1, __ATOMIC_RELAXED);
+    if (bytes > 0) __atomic_fetch_add(&stats->bytes, bytes, __ATOMIC_RELAXED);
+    if (started > 0) __atomic_fetch_add(&stats->nanoseconds, clock_ns() - started, __ATOMIC_RELAXED);
+}
+
+static int image_descriptor(FILE* file) {
+#ifdef _WIN32
+    return _fileno(file);
+#else
+    return fileno(file);
+#endif
+}
+
+// Images grow past 2 GB, beyond what a long reaches on Windows
+static uint64_t image_end(int fd) {
+#ifdef _WIN32
+    __int64 end = _lseeki64(fd, 0, SEEK_END);
+#else
+    off_t end = lseek(fd, 0, SEEK_END);
+#endif
+    return end < 0 ? 0 : (uint64_t)end;
+}
+
+// Positional I/O on the image descriptor. There is no shared file
+// position, so any number of threads can read at once. Nothing is
+// flushed here; durability comes from sync_image at commit.
+static bool image_write(VFS* vfs, uint64_t offset, const void* data, size_t size) {
+    uint64_t started = op_start(vfs);
+    const char* bytes = (const char*)data;
+    size_t done = 0;
+    while (done < size) {
+#ifdef _WIN32
+        OVERLAPPED at;
+        memset(&at, 0, sizeof(at));
+        at.Offset = (DWORD)(offset + done);
+        at.OffsetHigh = (DWORD)((offset + done) >> 32);
+        DWORD chunk = size - done < 0x40000000 ? (DWORD)(size - done) : 0x40000000;
+        DWORD written;
+        if (!WriteFile((HANDLE)_get_osfhandle(vfs->fd), bytes + done, chunk, &written, &at) ||
+            written == 0) {
+            break;
+        }
+#else
+        ssize_t written = pwrite(vfs->fd, bytes + done, size - done, (off_t)(offset + done));
+        if (written < 0 && errno == EINTR) continue;
+        if (written <= 0) break;
+#endif
+        done += (size_t)written;
+    }
+    if (offset + done > vfs->image_size) {
+        vfs->image_size = offset + done;
+    }
+    count_op(vfs, VFS_OP_WRITE, done, started);
+    return done == size;
+}
+
+// Returns the bytes read, short when the image ends first
+static size_t image_read(VFS* vfs, uint64_t offset, void* data, size_t size) {
+    uint64_t started = op_start(vfs);
+    char* bytes = (char*)data;
+    size_t done = 0;
+    while (done < size) {
+#ifdef _WIN32
+        OVERLAPPED at;
+        memset(&at, 0, sizeof(at));
+        at.Offset = (DWORD)(offset + done);
+        at.OffsetHigh = (DWORD)((offset + done) >> 32);
+        DWORD chunk = size - done < 0x40000000 ? (DWORD)(size - done) : 0x40000000;
+        DWORD got;
+        if (!ReadFile((HANDLE)_get_osfhandle(vfs->fd), bytes + done, chunk, &got, &at) || got == 0) {
+            break;
+        }
+#else
+        ssize_t got = pread(vfs->fd, bytes + done, size - done, (off_t)(offset + done));
+        if (got < 0 && errno == EINTR) continue;
+        if (got <= 0) break;
+#endif
+        done += (size_t)got;
+    }
+    count_op(vfs, VFS_OP_READ, done, started);
+    return done;
+}
+
+static bool cache_flush(VFS* vfs);
+
+// Set the current mapping aside, still mapped, until close
+static void retire_mapping(VFS* vfs) {
+    vfs->retired_maps = (VFSSpan*)xrealloc(vfs->retired_maps,
+                                           (vfs->retired_map_count + 1) * sizeof(VFSSpan));
+    vfs->retired_maps[vfs->retired_map_count].data = vfs->map_base;
+    vfs->retired_maps[vfs->retired_map_count].len = vfs->map_size;
+    vfs->retired_map_count++;
+    vfs->map_base = NULL;
+    vfs->map_size = 0;
+}
+
+// Map the whole image read-only, re-mapping once it has grown past the
+// current mapping. Writes go through the descriptor and show up in the
+// shared mapping via the page cache. Another thread may still be reading
+// from a span of the old mapping, so it stays mapped until close.
+static bool ensure_mapping(VFS* vfs) {
+#ifndef _WIN32
+    cache_enter(vfs);
+    cache_flush(vfs);
+    if (vfs->map_base && vfs->map_size < vfs->image_size) {
+        retire_mapping(vfs);
+    }
+    if (!vfs->map_base) {
+        void* base = mmap(NULL, (size_t)vfs->image_size, PROT_READ, MAP_SHARED, vfs->fd, 0);
+        if (base != MAP_FAILED) {
+            vfs->map_base = (const char*)base;
+            vfs->map_size = (size_t)vfs->image_size;
+        }
+    }
+    bool ok = vfs->map_base != NULL;
+    cache_leave(vfs);
+    return ok;
+#else
+    (void)vfs;
+    return false;
+#endif
+}
+
+static void release_mapping(VFS* vfs) {
+#ifndef _WIN32
+    if (vfs->map_base) {
+        munmap((void*)vfs->map_base, vfs->map_size);
+    }
+    for (int i = 0; i < vfs->retired_map_count; i++) {
+        munmap((void*)vfs->retired_maps[i].data, vfs->retired_maps[i].len);
+    }
+#endif
+    free(vfs->retired_maps);
+    vfs->retired_maps = NULL;
+    vfs->retired_map_count = 0;
+    vfs->map_base = NULL;
+    vfs->map_size = 0;
+}
+
+// Block cache: data blocks are read and written through a fixed number of
+// slots. Dirty slots are written back when evicted and at every commit.
+#define CACHE_DIRTY 1
+#define CACHE_REFERENCED 2
+#define CACHE_VERIFIED 4         // Contents known to match the block's checksum
+#define CACHE_JOURNALED 8        // Overwritten in place; held until its journal slot is durable
+#define CACHE_NO_SLOT UINT32_MAX
+#define CACHE_MAX_READ_RUN 32
+
+static void cache_init(VFS* vfs, size_t bytes) {
+    VFSBlockCache* cache = &vfs->cache;
+    cache->slot_count = (uint32_t)(bytes / BLOCK_SIZE);
+    if (cache->slot_count == 0) return;
+    
+    cache->data = (char*)xmalloc((size_t)cache->slot_count * BLOCK_SIZE);
+    cache->blocks = (uint32_t*)xmalloc(cache->slot_count * sizeof(uint32_t));
+    cache->flags = (uint8_t*)xmalloc(cache->slot_count);
+    for (uint32_t i = 0; i < cache->slot_count; i++) {
+        cache->blocks[i] = VFS_INVALID_BLOCK;
+    }
+    memset(cache->flags, 0, cache->slot_count);
+    
+    cache->table_capacity = 16;
+    while (cache->table_capacity < cache->slot_count * 2) {
+        cache->table_capacity *= 2;
+    }
+    cache->table = (uint32_t*)xmalloc(cache->table_capacity * sizeof(uint32_t));
+    for (uint32_t i = 0; i < cache->table_capacity; i++) {
+        cache->table[i] = CACHE_NO_SLOT;
+    }
+}
+
+static void cache_free(VFS* vfs) {
+    free(vfs->cache.data);
+    free(vfs->cache.blocks);
+    free(vfs->cache.flags);
+    free(vfs->cache.table);
+    memset(&vfs->cache, 0, sizeof(vfs->cache));
+}
+
+static uint32_t cache_home(const VFSBlockCache* cache, uint32_t block) {
+    return (block * 2654435761u) & (cache->table_capacity - 1);
+}
+
+static uint32_t cache_lookup(VFS* vfs, uint32_t block) {
+    VFSBlockCache* cache = &vfs->cache;
+    uint32_t mask = cache->table_capacity - 1;
+    for (uint32_t i = cache_home(cache, block); cache->table[i] != CACHE_NO_SLOT; i = (i + 1) & mask) {
+        if (cache->blocks[cache->table[i]] == block) return cache->table[i];
+    }
+    return CACHE_NO_SLOT;
+}
+
+static void cache_table_insert(VFS* vfs, uint32_t slot) {
+    VFSBlockCache* cache = &vfs->cache;
+    uint32_t mask = cache->table_capacity - 1;
+    uint32_t i = cache_home(cache, cache->blocks[slot]);
+    while (cache->table[i] != CACHE_NO_SLOT) {
+        i = (i + 1) & mask;
+    }
+    cache->table[i] = slot;
+}
+
+// Linear probing without tombstones: pull later members of the cluster back
+// into the hole so every lookup still finds them
+static void cache_table_remove(VFS* vfs, uint32_t block) {
+    VFSBlockCache* cache = &vfs->cache;
+    uint32_t mask = cache->table_capacity - 1;
+    uint32_t hole = cache_home(cache, block);
+    while (cache->table[hole] != CACHE_NO_SLOT && cache->blocks[cache->table[hole]] != block) {
+        hole = (hole + 1) & mask;
+    }
+    if (cache->table[hole] == CACHE_NO_SLOT) return;
+    
+    uint32_t next = hole;
+    while (true) {
+        next = (next + 1) & mask;
+        if (cache->table[next] == CACHE_NO_SLOT) break;
+        uint32_t home = cache_home(cache, cache->blocks[cache->table[next]]);
+        bool movable = hole <= next ? (home <= hole || home > next)
+                                    : (home <= hole && home > next);
+        if (movable) {
+            cache->table[hole] = cache->table[next];
+            hole = next;
+        }
+    }
+    cache->table[hole] = CACHE_NO_SLOT;
+}
+
+static bool cache_write_back(VFS* vfs, uint32_t slot) {
+    VFSBlockCache* cache = &vfs->cache;
+    if (!(cache->flags[slot] & CACHE_DIRTY)) return true;
+    
+    vfs->stats.cache_writebacks++;
+    cache->flags[slot] &= (uint8_t)~CACHE_DIRTY;
+    return image_write(vfs, block_offset(cache->blocks[slot]),
+                       cache->data + (size_t)slot * BLOCK_SIZE, BLOCK_SIZE);
+}
+
+// Take a slot for block, evicting with CLOCK: a referenced slot gets a
+// second chance, the first unreferenced one is reused
+static uint32_t cache_claim(VFS* vfs, uint32_t block) {
+    VFSBlockCache* cache = &vfs->cache;
+    uint32_t slot;
+    while (true) {
+        slot = cache->hand;
+        cache->hand = (cache->hand + 1) % cache->slot_count;
+        if (cache->blocks[slot] == VFS_INVALID_BLOCK) break;
+        if (cache->flags[slot] & CACHE_JOURNALED) continue;
+        if (cache->flags[slot] & CACHE_REFERENCED) {
+            cache->flags[slot] &= (uint8_t)~CACHE_REFERENCED;
+            continue;
+        }
+        cache_write_back(vfs, slot);
+        cache_table_remove(vfs, cache->blocks[slot]);
+        break;
+    }
+    
+    cache->blocks[slot] = block;
+    cache->flags[slot] = CACHE_REFERENCED;
+    cache_table_insert(vfs, slot);
+    return slot;
+}
+
+typedef struct {
+    uint32_t block;
+    uint32_t slot;
+} CacheDirtySlot;
+
+static int compare_dirty_slots(const void* a, const void* b) {
+    uint32_t x = ((const CacheDirtySlot*)a)->block;
+    uint32_t y = ((const CacheDirtySlot*)b)->block;
+    return (x > y) - (x < y);
+}
+
+// A dirty slot that may be written back now
+static bool cache_flushable(const VFSBlockCache* cache, uint32_t slot) {
+    return (cache->flags[slot] & (CACHE_DIRTY | CACHE_JOURNALED)) == CACHE_DIRTY;
+}
+
+// Write every dirty block back in block order, one write per run of
+// consecutive blocks. Blocks waiting for their journal slot stay.
+static bool cache_flush(VFS* vfs) {
+    uint64_t started = op_start(vfs);
+    VFSBlockCache* cache = &vfs->cache;
+    uint32_t count = 0;
+    for (uint32_t i = 0; i < cache->slot_count; i++) {
+        if (cache_flushable(cache, i)) count++;
+    }
+    if (count == 0) {
+        count_op(vfs, VFS_OP_FLUSH, 0, started);
+        return true;
+    }
+    
+    CacheDirtySlot* dirty = (CacheDirtySlot*)xmalloc(count * sizeof(CacheDirtySlot));
+    uint32_t n = 0;
+    for (uint32_t i = 0; i < cache->slot_count; i++) {
+        if (cache_flushable(cache, i)) {
+            dirty[n].block = cache->blocks[i];
+            dirty[n].slot = i;
+            n++;
+        }
+    }
+    qsort(dirty, count, sizeof(CacheDirtySlot), compare_dirty_slots);
+    
+    bool ok = true;
+    char* run = NULL;
+    uint32_t i = 0;
+    while (i < count) {
+        uint32_t end = i + 1;
+        while (end < count && dirty[end].block == dirty[end - 1].block + 1) end++;
+        
+        if (end - i == 1) {
+            ok = cache_write_back(vfs, dirty[i].slot) && ok;
+        } else {
+            if (!run) run = (char*)xmalloc((size_t)count * BLOCK_SIZE);
+            for (uint32_t k = i; k < end; k++) {
+                memcpy(run + (size_t)(k - i) * BLOCK_SIZE,
+                       cache->data + (size_t)dirty[k].slot * BLOCK_SIZE, BLOCK_SIZE);
+                cache->flags[dirty[k].slot] &= (uint8_t)~CACHE_DIRTY;
+            }
+            vfs->stats.cache_writebacks += end - i;
+            ok = image_write(vfs, block_offset(dirty[i].block), run, (size_t)(end - i) * BLOCK_SIZE) && ok;
+        }
+        i = end;
+    }
+    
+    free(run);
+    free(dirty);
+    count_op(vfs, VFS_OP_FLUSH, (uint64_t)count * BLOCK_SIZE, started);
+    return ok;
+}
+
+// Forget the given blocks without writing them back
+static void cache_discard(VFS* vfs, VFSExtent extent) {
+    VFSBlockCache* cache = &vfs->cache;
+    if (cache->slot_count == 0) return;
+    
+    for (uint32_t block = extent.start; block < extent.start + extent.length; block++) {
+        uint32_t slot = cache_lookup(vfs, block);
+        if (slot == CACHE_NO_SLOT) continue;
+        cache_table_remove(vfs, block);
+        cache->blocks[slot] = VFS_INVALID_BLOCK;
+        cache->flags[slot] = 0;
+    }
+}
+
+// Write len bytes starting at the first byte of block. Every write in the
+// VFS replaces whole blocks, so a short final block is zero-filled rather
+// than read first.
+static bool cached_write(VFS* vfs, uint32_t block, const char* data, size_t len) {
+    VFSBlockCache* cache = &vfs->cache;
+    if (cache->slot_count == 0) {
+        return image_write(vfs, block_offset(block), data, len);
+    }
+    
+    while (len > 0) {
+        size_t chunk = len < BLOCK_SIZE ? len : BLOCK_SIZE;
+        uint32_t slot = cache_lookup(vfs, block);
+        if (slot == CACHE_NO_SLOT) {
+            slot = cache_claim(vfs, block);
+        }
+        
+        char* dst = cache->data + (size_t)slot * BLOCK_SIZE;
+        memcpy(dst, data, chunk);
+        if (chunk < BLOCK_SIZE) {
+            memset(dst + chunk, 0, BLOCK_SIZE - chunk);
+        }
+        cache->flags[slot] |= CACHE_DIRTY | CACHE_REFERENCED | CACHE_VERIFIED;
+        
+        block++;
+        data += chunk;
+        len -= chunk;
+    }
+    return true;
+}
+
+// Read len bytes starting at block. Runs of missing blocks are fetched
+// with one transfer and then cached. Several readers can be in here at
+// once: the cache is only touched under its mutex, and the transfer
+// happens outside it. No writer can run meanwhile, so a block found
+// missing cannot become dirty before its copy from the image is cached.
+static size_t cached_read(VFS* vfs, uint32_t block, char* data, size_t len) {
+    VFSBlockCache* cache = &vfs->cache;
+    if (cache->slot_count == 0) {
+        return image_read(vfs, block_offset(block), data, len);
+    }
+    
+    size_t done = 0;
+    char* run = NULL;
+    cache_enter(vfs);
+    while (done < len) {
+        uint32_t slot = cache_lookup(vfs, block);
+        if (slot != CACHE_NO_SLOT) {
+            size_t chunk = len - done < BLOCK_SIZE ? len - done : BLOCK_SIZE;
+            memcpy(data + done, cache->data + (size_t)slot * BLOCK_SIZE, chunk);
+            cache->flags[slot] |= CACHE_REFERENCED;
+            vfs->stats.cache_hits++;
+            block++;
+            done += chunk;
+            continue;
+        }
+        
+        // Gather the run of uncached blocks this read still needs
+        uint32_t wanted = (uint32_t)((len - done + BLOCK_SIZE - 1) / BLOCK_SIZE);
+        uint32_t limit = wanted < CACHE_MAX_READ_RUN ? wanted : CACHE_MAX_READ_RUN;
+        if (limit > cache->slot_count) limit = cache->slot_count;
+        uint32_t count = 1;
+        while (count < limit && cache_lookup(vfs, block + count) == CACHE_NO_SLOT) count++;
+        
+        cache_leave(vfs);
+        if (!run) run = (char*)xmalloc((size_t)CACHE_MAX_READ_RUN * BLOCK_SIZE);
+        size_t bytes = (size_t)count * BLOCK_SIZE;
+        size_t got = image_read(vfs, block_offset(block), run, bytes);
+        if (got < bytes) {
+            // The image ends inside the last block written
+            memset(run + got, 0, bytes - got);
+        }
+        cache_enter(vfs);
+        vfs->stats.cache_misses += count;
+        
+        // Another reader may have cached some of the run meanwhile
+        for (uint32_t k = 0; k < count; k++) {
+            if (cache_lookup(vfs, block + k) != CACHE_NO_SLOT) continue;
+            slot = cache_claim(vfs, block + k);
+            memcpy(cache->data + (size_t)slot * BLOCK_SIZE, run + (size_t)k * BLOCK_SIZE, BLOCK_SIZE);
+        }
+        
+        size_t chunk = len - done < bytes ? len - done : bytes;
+        memcpy(data + done, run, chunk);
+        block += count;
+        done += chunk;
+    }
+    cache_leave(vfs);
+    
+    free(run);
+    return done;
+}
+
+static void write_block(VFS* vfs, uint32_t block_num, const void* data, size_t size) {
+    if (block_num >= vfs->header.num_blocks) return;
+    
+    image_write(vfs, block_offset(block_num), data, size > BLOCK_SIZE ? BLOCK_SIZE : size);
+}
+
+// Push everything written so far to stable storage
+static bool sync_image(VFS* vfs) {
+    uint64_t started = op_start(vfs);
+#ifdef _WIN32
+    bool ok = _commit(vfs->fd) == 0;
+#else
+    bool ok = fdatasync(vfs->fd) == 0;
+#endif
+    count_op(vfs, VFS_OP_SYNC, 0, started);
+    return ok;
+}
+
+// FNV-1a, 64-bit
+static uint64_t journal_checksum(uint64_t hash, const void* data, size_t len) {
+    const unsigned char* bytes = (const unsigned char*)data;
+    for (size_t i = 0; i < len; i++) {
+        hash ^= bytes[i];
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+#define JOURNAL_CHECKSUM_SEED 14695981039346656037ULL
+
+// Write file data for the open transaction. Data written this way goes to
+// blocks the committed metadata does not reference, so it is written in
+// place and only its checksum is journaled.
+static void journal_record_data(VFS* vfs, uint32_t block, const void* data, size_t size) {
+    if (!vfs->journal_data) {
+        vfs->journal_data = (VFSJournalData*)xmalloc(VFS_JOURNAL_DATA_RECORDS * sizeof(VFSJournalData));
+    }
+    VFSJournalData* record = &vfs->journal_data[vfs->journal_data_count++];
+    record->offset = block_offset(block);
+    record->length = (uint32_t)size;
+    record->reserved = 0;
+    record->checksum = journal_checksum(JOURNAL_CHECKSUM_SEED, data, size);
+}
+
+static void record_checksums(VFS* vfs, uint32_t block, const void* data, size_t size) {
+    uint32_t count = (uint32_t)((size + BLOCK_SIZE - 1) / BLOCK_SIZE);
+    for (uint32_t i = 0; i < count; i++) {
+        size_t offset = (size_t)i * BLOCK_SIZE;
+        size_t len = size - offset < BLOCK_SIZE ? size - offset : BLOCK_SIZE;
+        vfs->crcs[block + i] = block_checksum((const char*)data + offset, len);
+    }
+    mark_dirty(vfs, &vfs->crcs[block], count * sizeof(uint32_t));
+}
+
+// A block the committed metadata points at can still be overwritten where
+// it is: its new contents go into the journal slot as sector images, and
+// the cache holds them back from the block itself until that slot is
+// durable. A transaction takes at most JOURNAL_BLOCK_LIMIT such blocks,
+// and never more than half the cache.
+#define JOURNAL_BLOCK_LIMIT 16
+#define SECTORS_PER_BLOCK (BLOCK_SIZE / VFS_SECTOR_SIZE)
+
+static bool journal_has_room(const VFS* vfs, uint32_t blocks) {
+    uint32_t total = vfs->journal_block_count + blocks;
+    return total <= JOURNAL_BLOCK_LIMIT && total <= vfs->cache.slot_count / 2;
+}
+
+// Overwrite a block from its first byte; journal_has_room has said yes
+static bool journal_block_write(VFS* vfs, uint32_t block, const char* data, size_t size) {
+    if (!ensure_crcs(vfs) || !cached_write(vfs, block, data, size)) return false;
+    
+    VFSBlockCache* cache = &vfs->cache;
+    uint32_t slot = cache_lookup(vfs, block);
+    if (!(cache->flags[slot] & CACHE_JOURNALED)) {
+        if (!vfs->journal_blocks) {
+            vfs->journal_blocks = (uint32_t*)xmalloc(JOURNAL_BLOCK_LIMIT * sizeof(uint32_t));
+        }
+        cache->flags[slot] |= CACHE_JOURNALED;
+        vfs->journal_blocks[vfs->journal_block_count++] = block;
+    }
+    record_checksums(vfs, block, data, size);
+    return true;
+}
+
+// Whether the open transaction has written `block` with data_write. Its
+// checksum is journaled, so it is not overwritten in place as well.
+static bool block_written(const VFS* vfs, uint32_t block) {
+    uint64_t offset = block_offset(block);
+    for (uint32_t i = 0; i < vfs->journal_data_count; i++) {
+        const VFSJournalData* record = &vfs->journal_data[i];
+        if (offset >= record->offset && offset < record->offset + record->length) return true;
+    }
+    return false;
+}
+
+static bool block_journaled(VFS* vfs, uint32_t block) {
+    uint32_t slot = vfs->cache.slot_count > 0 ? cache_lookup(vfs, block) : CACHE_NO_SLOT;
+    return slot != CACHE_NO_SLOT && (vfs->cache.flags[slot] & CACHE_JOURNALED);
+}
+
+// A block already overwritten in place by the open transaction stays in
+// the journal if it is written again
+static bool data_write(VFS* vfs, uint32_t block, const void* data, size_t size) {
+    if (size <= BLOCK_SIZE && block_journaled(vfs, block)) {
+        return journal_block_write(vfs, block, (const char*)data, size);
+    }
+    if (vfs->journal_data_count == VFS_JOURNAL_DATA_RECORDS) return false;
+    if (!ensure_crcs(vfs)) return false;
+    if (!cached_write(vfs, block, (const char*)data, size)) return false;
+    journal_record_data(vfs, block, data, size);
+    record_checksums(vfs, block, data, size);
+    return true;
+}
+
+// Once their journal slot is durable, blocks overwritten in place are
+// ordinary dirty blocks: the next commit writes them back before its sync,
+// so they are on disk before that slot is reused
+static void journal_release_blocks(VFS* vfs) {
+    for (uint32_t i = 0; i < vfs->journal_block_count; i++) {
+        uint32_t slot = cache_lookup(vfs, vfs->journal_blocks[i]);
+        vfs->cache.flags[slot] &= (uint8_t)~CACHE_JOURNALED;
+    }
+    vfs->journal_block_count = 0;
+}
+
+// Check data read from the image against the block checksums. data holds
+// len bytes from the start of `block`. A final partial block is checked
+// only if `complete` says the data reaches the end of what is stored in
+// it, as when it ends at the end of the file. Blocks the cache has
+// already checked, or wrote itself, are skipped. Returns false only when
+// a block fails and the policy is to fail the read.
+static bool verify_blocks(VFS* vfs, uint32_t block, const char* data, size_t len, bool complete) {
+    if (vfs->verify == VFS_VERIFY_OFF || !vfs->crcs) return true;
+    
+    bool ok = true;
+    for (size_t offset = 0; offset < len; offset += BLOCK_SIZE, block++) {
+        size_t chunk = len - offset < BLOCK_SIZE ? len - offset : BLOCK_SIZE;
+        if ((chunk < BLOCK_SIZE && !complete) || vfs->crcs[block] == 0) continue;
+        
+        cache_enter(vfs);
+        uint32_t slot = vfs->cache.slot_count > 0 ? cache_lookup(vfs, block) : CACHE_NO_SLOT;
+        bool known = slot != CACHE_NO_SLOT && (vfs->cache.flags[slot] & CACHE_VERIFIED);
+        cache_leave(vfs);
+        if (known) continue;
+        
+        bool match = block_checksum(data + offset, chunk) == vfs->crcs[block];
+        if (!match) print_error_format("VFS block %u does not match its checksum", block);
+        
+        // The slot may have been reused while the lock was not held.
+        // A warning is given once; the cached copy is served as it is
+        // from then on.
+        cache_enter(vfs);
+        vfs->stats.blocks_verified++;
+        if (!match) vfs->stats.checksum_failures++;
+        if ((match || vfs->verify == VFS_VERIFY_WARN) && slot != CACHE_NO_SLOT &&
+            vfs->cache.blocks[slot] == block) {
+            vfs->cache.flags[slot] |= CACHE_VERIFIED;
+        }
+        cache_leave(vfs);
+        if (!match && vfs->verify == VFS_VERIFY_FAIL) ok = false;
+    }
+    return ok;
+}
+
+// cached_read for file data, checked against the checksums. Long reads
+// go a chunk at a time so each piece is checked while it is still in the
+// CPU cache. Returns 0 when the check fails the read.
+static size_t checked_read(VFS* vfs, uint32_t block, char* data, size_t len, bool complete) {
+    if (vfs->verify == VFS_VERIFY_OFF || !vfs->crcs) return cached_read(vfs, block, data, len);
+    
+    size_t done = 0;
+    while (done < len) {
+        size_t want = len - done < VFS_CHUNK_SIZE ? len - done : VFS_CHUNK_SIZE;
+        size_t got = cached_read(vfs, block, data + done, want);
+        if (!verify_blocks(vfs, block, data + done, got, complete && done + got == len)) return 0;
+        done += got;
+        if (got < want) break;
+        block += VFS_CHUNK_SIZE / BLOCK_SIZE;
+    }
+    return done;
+}
+
+// Write back only the metadata sectors marked dirty since the last save,
+// one positional write per coalesced run
+static void save_metadata(VFS* vfs) {
+    uint64_t started = op_start(vfs);
+    uint64_t bytes = 0;
+    
+    for (int region = 0; region < VFS_META_REGIONS; region++) {
+        VFSMetaRegion* meta = &vfs->meta[region];
+        size_t sectors = region_sectors(meta);
+        uint64_t base = region_offset(vfs, region);
+        
+        size_t sector = 0;
+        while (sector < sectors) {
+            if (!sector_dirty(meta, sector)) {
+                sector++;
+                continue;
+            }
+            
+            size_t end = sector + 1;
+            size_t probe = end;
+            while (probe < sectors && probe - end <= COALESCE_GAP_SECTORS) {
+                if (sector_dirty(meta, probe)) {
+                    end = probe + 1;
+                }
+                probe++;
+            }
+            
+            size_t offset = sector * VFS_SECTOR_SIZE;
+            size_t limit = end * VFS_SECTOR_SIZE < meta->size ? end * VFS_SECTOR_SIZE : meta->size;
+            image_write(vfs, base + offset, meta->base + offset, limit - offset);
+            vfs->stats.metadata_writes++;
+            bytes += limit - offset;
+            sector = end;
+        }
+        region_clear_dirty(vfs, region);
+    }
+    count_op(vfs, VFS_OP_HEADER_SAVE, bytes, started);
+}
+
+// A region moved by this transaction goes to its new blocks in one piece,
+// journaled like file data. Metadata is never read through the block
+// cache, so whatever it holds for those blocks is dropped.
+static bool write_relocated_regions(VFS* vfs) {
+    for (int region = 0; region < VFS_META_REGIONS; region++) {
+        VFSMetaRegion* meta = &vfs->meta[region];
+        if (!meta->relocated) continue;
+        
+        VFSExtent extent = *region_extent(vfs, region);
+        cache_discard(vfs, extent);
+        if (!image_write(vfs, block_offset(extent.start), meta->base, meta->size)) return false;
+        journal_record_data(vfs, extent.start, meta->base, meta->size);
+        meta->relocated = false;
+    }
+    return true;
+}
+
+// Too big for a journal slot: empty the journal so replay cannot roll the
+// in-place writes back, then write in place between two syncs. Only an
+// unusually large single update gets here, and it is not atomic.
+static bool commit_unjournaled(VFS* vfs) {
+    JournalHeader empty;
+    memset(&empty, 0, sizeof(empty));
+    if (!sync_image(vfs) ||
+        !image_write(vfs, JOURNAL_OFFSET, &empty, sizeof(empty)) ||
+        !image_write(vfs, JOURNAL_OFFSET + JOURNAL_SLOT_SIZE, &empty, sizeof(empty)) ||
+        !sync_image(vfs)) {
+        return false;
+    }
+    journal_release_blocks(vfs);
+    if (!cache_flush(vfs)) return false;
+    save_metadata(vfs);
+    return sync_image(vfs);
+}
+
+static void settle_free(VFS* vfs, VFSExtent extent) {
+    if (vfs->settling_free_count == vfs->settling_free_capacity) {
+        vfs->settling_free_capacity = vfs->settling_free_capacity ? vfs->settling_free_capacity * 2 : 16;
+        vfs->settling_frees = (VFSExtent*)xrealloc(vfs->settling_frees,
+                                                   vfs->settling_free_capacity * sizeof(VFSExtent));
+    }
+    vfs->settling_frees[vfs->settling_free_count++] = extent;
+}
+
+// Commit the open transaction: append it, with every sector changed since
+// the last checkpoint, to the next journal slot and make it durable with
+// one sync. The newest slot therefore holds all that is not yet in place.
+// Once CHECKPOINT_SECTORS have built up they are written back; those
+// writes become durable with the next commit's sync, before that slot is
+// reused two commits later.
+static bool journal_commit(VFS* vfs) {
+    uint64_t started = op_start(vfs);
+    if (!write_relocated_regions(vfs)) {
+        print_error("VFS metadata write failed");
+        return false;
+    }
+    
+    uint32_t sector_count = vfs->dirty_sector_count + vfs->journal_block_count * SECTORS_PER_BLOCK;
+    if (!vfs->sectors_changed && vfs->journal_block_count == 0 && vfs->journal_data_count == 0 &&
+        vfs->pending_free_count == 0) {
+        return true;
+    }
+    
+    // Data first, so the one sync below covers it too
+    if (!cache_flush(vfs)) {
+        print_error("VFS data write-back failed");
+        return false;
+    }
+    
+    size_t size = 0;
+    bool ok;
+    if (sector_count > VFS_JOURNAL_SECTORS) {
+        ok = commit_unjournaled(vfs);
+    } else {
+        size = sizeof(JournalHeader) + sector_count * sizeof(uint64_t) +
+               vfs->journal_data_count * sizeof(VFSJournalData) +
+               (size_t)sector_count * VFS_SECTOR_SIZE;
+        char* slot = (char*)xmalloc(size);
+        memset(slot, 0, size);
+        
+        JournalHeader* jh = (JournalHeader*)slot;
+        memcpy(jh->magic, JOURNAL_MAGIC, 8);
+        jh->sequence = vfs->journal_sequence;
+        jh->sector_count = sector_count;
+        jh->data_count = vfs->journal_data_count;
+        
+        uint64_t* sectors = (uint64_t*)(slot + sizeof(JournalHeader));
+        VFSJournalData* records = (VFSJournalData*)(sectors + sector_count);
+        char* images = (char*)(records + vfs->journal_data_count);
+        
+        uint32_t n = 0;
+        for (int region = 0; region < VFS_META_REGIONS; region++) {
+            VFSMetaRegion* meta = &vfs->meta[region];
+            uint64_t base = region_offset(vfs, region);
+            for (size_t sector = 0; sector < region_sectors(meta); sector++) {
+                if (!sector_dirty(meta, sector)) continue;
+                size_t offset = sector * VFS_SECTOR_SIZE;
+                size_t len = meta->size - offset < VFS_SECTOR_SIZE ? meta->size - offset : VFS_SECTOR_SIZE;
+                sectors[n] = base + offset;
+                memcpy(images + (size_t)n * VFS_SECTOR_SIZE, meta->base + offset, len);
+                n++;
+            }
+        }
+        for (uint32_t i = 0; i < vfs->journal_block_count; i++) {
+            uint32_t block = vfs->journal_blocks[i];
+            const char* data = vfs->cache.data + (size_t)cache_lookup(vfs, block) * BLOCK_SIZE;
+            for (uint32_t k = 0; k < SECTORS_PER_BLOCK; k++) {
+                sectors[n] = block_offset(block) + (uint64_t)k * VFS_SECTOR_SIZE;
+                memcpy(images + (size_t)n * VFS_SECTOR_SIZE, data + (size_t)k * VFS_SECTOR_SIZE,
+                       VFS_SECTOR_SIZE);
+                n++;
+            }
+        }
+        if (vfs->journal_data_count > 0) {
+            memcpy(records, vfs->journal_data, vfs->journal_data_count * sizeof(VFSJournalData));
+        }
+        jh->checksum = journal_checksum(JOURNAL_CHECKSUM_SEED, slot, size);
+        
+        uint64_t slot_offset = JOURNAL_OFFSET + (vfs->journal_sequence % 2) * JOURNAL_SLOT_SIZE;
+        ok = image_write(vfs, slot_offset, slot, size) && sync_image(vfs);
+        free(slot);
+        if (ok) journal_release_blocks(vfs);
+        if (ok && vfs->dirty_sector_count >= CHECKPOINT_SECTORS) save_metadata(vfs);
+    }
+    if (!ok) {
+        print_error("VFS journal commit failed");
+        return false;
+    }
+    
+    count_op(vfs, VFS_OP_COMMIT, size, started);
+    vfs->sectors_changed = false;
+    vfs->journal_sequence++;
+    vfs->journal_data_count = 0;
+    
+    // An open read handle may still be reading blocks its file has since
+    // dropped, so nothing is handed out again until every handle is closed
+    if (vfs->open_readers > 0) {
+        for (uint32_t i = 0; i < vfs->pending_free_count; i++) {
+            settle_free(vfs, vfs->pending_frees[i]);
+        }
+        vfs->pending_free_count = 0;
+        return true;
+    }
+    
+    for (uint32_t i = 0; i < vfs->settling_free_count; i++) {
+        release_run(vfs, vfs->settling_frees[i]);
+    }
+    
+    // This transaction's frees wait for the next commit
+    VFSExtent* frees = vfs->settling_frees;
+    uint32_t capacity = vfs->settling_free_capacity;
+    vfs->settling_frees = vfs->pending_frees;
+    vfs->settling_free_count = vfs->pending_free_count;
+    vfs->settling_free_capacity = vfs->pending_free_capacity;
+    vfs->pending_frees = frees;
+    vfs->pending_free_count = 0;
+    vfs->pending_free_capacity = capacity;
+    return true;
+}
+
+// Read one journal slot; NULL unless it holds a complete transaction
+static char* journal_load_slot(VFS* vfs, int index) {
+    JournalHeader jh;
+    uint64_t slot_offset = JOURNAL_OFFSET + (uint64_t)index * JOURNAL_SLOT_SIZE;
+    if (image_read(vfs, slot_offset, &jh, sizeof(jh)) != sizeof(jh) ||
+        memcmp(jh.magic, JOURNAL_MAGIC, 8) != 0 ||
+        jh.sector_count > VFS_JOURNAL_SECTORS || jh.data_count > VFS_JOURNAL_DATA_RECORDS) {
+        return NULL;
+    }
+    
+    size_t size = sizeof(JournalHeader) + jh.sector_count * sizeof(uint64_t) +
+                  jh.data_count * sizeof(VFSJournalData) + (size_t)jh.sector_count * VFS_SECTOR_SIZE;
+    char* slot = (char*)xmalloc(size);
+    if (image_read(vfs, slot_offset, slot, size) != size) {
+        free(slot);
+        return NULL;
+    }
+    
+    ((JournalHeader*)slot)->checksum = 0;
+    if (journal_checksum(JOURNAL_CHECKSUM_SEED, slot, size) != jh.checksum) {
+        free(slot);
+        return NULL;
+    }
+    ((JournalHeader*)slot)->checksum = jh.checksum;
+    return slot;
+}
+
+// The newest transaction may have reached the disk without all of its data
+static bool journal_data_intact(VFS* vfs, const char* slot) {
+    const JournalHeader* jh = (const JournalHeader*)slot;
+    const VFSJournalData* records = (const VFSJournalData*)(slot + sizeof(JournalHeader) +
+                                                             jh->sector_count * sizeof(uint64_t));
+    char* buffer = (char*)xmalloc(BLOCK_SIZE);
+    bool intact = true;
+    
+    for (uint32_t i = 0; intact && i < jh->data_count; i++) {
+        uint64_t hash = JOURNAL_CHECKSUM_SEED;
+        uint64_t offset = records[i].offset;
+        size_t remaining = records[i].length;
+        while (remaining > 0) {
+            size_t chunk = remaining < BLOCK_SIZE ? remaining : BLOCK_SIZE;
+            if (image_read(vfs, offset, buffer, chunk) != chunk) {
+                intact = false;
+                break;
+            }
+            hash = journal_checksum(hash, buffer, chunk);
+            offset += chunk;
+            remaining -= chunk;
+        }
+        if (intact && hash != records[i].checksum) intact = false;
+    }
+    
+    free(buffer);
+    return intact;
+}
+
+// Sector images go straight back to their place in the image; the
+// metadata is loaded afterwards
+static void journal_apply(VFS* vfs, const char* slot) {
+    const JournalHeader* jh = (const JournalHeader*)slot;
+    const uint64_t* sectors = (const uint64_t*)(slot + sizeof(JournalHeader));
+    const char* images = (const char*)((const VFSJournalData*)(sectors + jh->sector_count) + jh->data_count);
+    
+    for (uint32_t i = 0; i < jh->sector_count; i++) {
+        image_write(vfs, sectors[i], images + (size_t)i * VFS_SECTOR_SIZE, VFS_SECTOR_SIZE);
+    }
+}
+
+// Redo the committed transactions still held in the journal, oldest first.
+// Replaying a transaction whose checkpoint already reached the disk is
+// harmless: the sector images are whole.
+static void journal_replay(VFS* vfs) {
+    char* slots[2];
+    slots[0] = journal_load_slot(vfs, 0);
+    slots[1] = journal_load_slot(vfs, 1);
+    
+    uint64_t seq[2] = {0, 0};
+    for (int i = 0; i < 2; i++) {
+        if (slots[i]) seq[i] = ((JournalHeader*)slots[i])->sequence;
+    }
+    
+    int newest = (slots[1] && (!slots[0] || seq[1] > seq[0])) ? 1 : 0;
+    int oldest = 1 - newest;
+    vfs->journal_sequence = (seq[0] > seq[1] ? seq[0] : seq[1]) + 1;
+    
+    if (slots[newest] && !journal_data_intact(vfs, slots[newest])) {
+        free(slots[newest]);
+        slots[newest] = NULL;
+    }
+    
+    if (slots[oldest]) journal_apply(vfs, slots[oldest]);
+    if (slots[newest]) journal_apply(vfs, slots[newest]);
+    
+    // Once the replayed state is durable the journal is emptied, so no
+    // block freed before this open needs protecting any more
+    if (slots[0] || slots[1]) {
+        JournalHeader empty;
+        memset(&empty, 0, sizeof(empty));
+        if (sync_image(vfs)) {
+            image_write(vfs, JOURNAL_OFFSET, &empty, sizeof(empty));
+            image_write(vfs, JOURNAL_OFFSET + JOURNAL_SLOT_SIZE, &empty, sizeof(empty));
+            sync_image(vfs);
+        }
+    }
+    free(slots[0]);
+    free(slots[1]);
+}
+
+// The open transaction is running out of data records or sector slots
+static bool journal_filling(const VFS* vfs) {
+    return vfs->journal_data_count > VFS_JOURNAL_DATA_RECORDS - JOURNAL_RECORD_RESERVE - VFS_META_REGIONS ||
+           vfs->dirty_sector_count > JOURNAL_SECTOR_RESERVE;
+}
+
+// Called at the end of every update. Outside a transaction the update is
+// committed on its own; inside one it is committed early only when the
+// journal is filling up, or when blocks were overwritten in place: until
+// commit those are newer in the cache than in the image, which readers on
+// other threads may look at directly.
+static bool finish_update(VFS* vfs) {
+    if (vfs->transaction_depth == 0 || journal_filling(vfs) || vfs->journal_block_count > 0) {
+        return journal_commit(vfs);
+    }
+    return true;
+}
+
+// Every public call that changes the image runs between these two, which
+// hold the metadata lock exclusively for the length of the call. A
+// transaction opened with vfs_begin does not hold the lock: readers on
+// other threads see its updates as they are made.
+static void begin_update(VFS* vfs) {
+    lock_exclusive(vfs);
+    vfs->transaction_depth++;
+}
+
+static bool end_update(VFS* vfs) {
+    if (vfs->transaction_depth > 0) vfs->transaction_depth--;
+    bool ok = finish_update(vfs);
+    unlock_exclusive(vfs);
+    return ok;
+}
+
+// Group several updates into one transaction; transactions nest and only
+// the outermost vfs_commit reaches the disk
+void vfs_begin(VFS* vfs) {
+    if (!vfs) return;
+    
+    lock_exclusive(vfs);
+    vfs->transaction_depth++;
+    unlock_exclusive(vfs);
+}
+
+bool vfs_commit(VFS* vfs) {
+    if (!vfs) return false;
+    
+    lock_exclusive(vfs);
+    return end_update(vfs);
+}
+
+// Make everything done so far durable, even inside an open transaction
+bool vfs_sync(VFS* vfs) {
+    if (!vfs) return false;
+    
+    lock_exclusive(vfs);
+    bool ok = journal_commit(vfs);
+    unlock_exclusive(vfs);
+    return ok;
+}
+
+static bool extent_compressed(VFSExtent extent) {
+    return (extent.length & VFS_EXTENT_COMPRESSED) != 0;
+}
+
+static bool extent_hole(VFSExtent extent) {
+    return extent.start == VFS_HOLE_BLOCK;
+}
+
+// Blocks an extent occupies in the image; none for a hole
+static VFSExtent extent_run(VFSExtent extent) {
+    if (extent_compressed(extent)) {
+        extent.length = ((extent.length & ~VFS_EXTENT_COMPRESSED) + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    } else if (extent_hole(extent)) {
+        extent.length = 0;
+    }
+    return extent;
+}
+
+// A run of blocks holding file data as it is
+static bool extent_plain(VFSExtent extent) {
+    return !extent_compressed(extent) && !extent_hole(extent);
+}
+
+// Bytes of the file an extent holds
+static uint64_t extent_span(VFSExtent extent) {
+    return extent_compressed(extent) ? VFS_CHUNK_SIZE : (uint64_t)extent.length * BLOCK_SIZE;
+}
+
+// Index of the extent holding file offset `offset`, and where it starts
+static uint32_t find_extent(const VFSExtent* extents, uint32_t count, uint64_t offset, uint64_t* base) {
+    uint32_t i = 0;
+    *base = 0;
+    while (i < count && offset >= *base + extent_span(extents[i])) {
+        *base += extent_span(extents[i++]);
+    }
+    return i;
+}
+
+// Blocks holding the extents of a list of `count` past the direct ones.
+// They are consecutive, so the list is read and written in one piece and
+// grows by moving to a longer run.
+static uint32_t overflow_blocks(uint32_t count) {
+    if (count <= VFS_DIRECT_EXTENTS) return 0;
+    return (uint32_t)((count - VFS_DIRECT_EXTENTS + VFS_EXTENTS_PER_BLOCK - 1) / VFS_EXTENTS_PER_BLOCK);
+}
+
+// Blocks holding a chunk index of `chunks` entries, also consecutive
+static uint32_t index_blocks(uint32_t chunks) {
+    return (uint32_t)((chunks + VFS_EXTENTS_PER_BLOCK - 1) / VFS_EXTENTS_PER_BLOCK);
+}
+
+// Extents a file keeps past its chunk index
+static uint32_t listed_extents(const FileEntry* entry) {
+    return entry->extent_count - entry->chunk_count;
+}
+
+static VFSExtent overflow_run(const FileEntry* entry) {
+    VFSExtent run = {entry->extent_block, overflow_blocks(listed_extents(entry))};
+    return run;
+}
+
+static VFSExtent chunk_run(const FileEntry* entry) {
+    VFSExtent run = {entry->chunk_block, index_blocks(entry->chunk_count)};
+    return run;
+}
+
+static bool run_in_image(const VFS* vfs, VFSExtent run) {
+    return run.length == 0 || (run.start < vfs->header.num_blocks &&
+                               run.length <= vfs->header.num_blocks - run.start);
+}
+
+// How many leading extents of a list make up its chunk index: those up to
+// the last compressed chunk, as long as each covers exactly one chunk.
+// Extent i of the index is then chunk i of the file.
+static uint32_t chunk_prefix(const VFSExtent* extents, uint32_t count) {
+    uint32_t prefix = 0;
+    for (uint32_t i = 0; i < count && extent_span(extents[i]) == VFS_CHUNK_SIZE; i++) {
+        if (extent_compressed(extents[i])) prefix = i + 1;
+    }
+    return prefix;
+}
+
+// Collect a file's chunk index, direct extents and overflow extents into
+// one array
+static VFSExtent* load_extents(VFS* vfs, const FileEntry* entry) {
+    if (entry->chunk_count > entry->extent_count ||
+        !run_in_image(vfs, chunk_run(entry)) || !run_in_image(vfs, overflow_run(entry))) {
+        return NULL;
+    }
+    uint32_t chunks = entry->chunk_count;
+    uint32_t listed = listed_extents(entry);
+    uint32_t direct = listed < VFS_DIRECT_EXTENTS ? listed : VFS_DIRECT_EXTENTS;
+    
+    VFSExtent* extents = (VFSExtent*)xmalloc((entry->extent_count + 1) * sizeof(VFSExtent));
+    size_t bytes = chunks * sizeof(VFSExtent);
+    if (chunks > 0 && checked_read(vfs, entry->chunk_block, (char*)extents, bytes, true) != bytes) {
+        free(extents);
+        return NULL;
+    }
+    memcpy(extents + chunks, entry->extents, direct * sizeof(VFSExtent));
+    if (listed > direct) {
+        bytes = (listed - direct) * sizeof(VFSExtent);
+        if (checked_read(vfs, entry->extent_block, (char*)(extents + chunks + direct), bytes,
+                         true) != bytes) {
+            free(extents);
+            return NULL;
+        }
+    }
+    return extents;
+}
+
+// Write `count` extents to `run`, taking the blocks first unless the
+// caller already has. On failure the run is given back.
+static bool write_extent_run(VFS* vfs, VFSExtent* run, const VFSExtent* extents, uint32_t count) {
+    if (run->length == 0) return true;
+    uint32_t blocks = run->length;
+    if (run->start == VFS_INVALID_BLOCK) *run = alloc_extent(vfs, blocks);
+    if (run->length < blocks || !data_write(vfs, run->start, extents, count * sizeof(VFSExtent))) {
+        free_extent(vfs, *run);
+        run->length = 0;
+        return false;
+    }
+    return true;
+}
+
+// Store an extent list: the chunks it starts with go in the chunk index,
+// the next extents in the entry and the rest in overflow blocks. The
+// index and the overflow blocks start at `index` and `overflow` if the
+// caller has taken runs of the right length, and are allocated here when
+// those are VFS_INVALID_BLOCK. A caller that passes the entry's own run
+// keeps it as it is, which it may do only for a list of the same shape
+// whose part in that run has not changed. On failure the entry is left as
+// it was and the runs taken are given back.
+static bool place_extents(VFS* vfs, FileEntry* entry, const VFSExtent* extents, uint32_t count,
+                          uint32_t index, uint32_t overflow) {
+    uint32_t chunks = chunk_prefix(extents, count);
+    uint32_t listed = count - chunks;
+    uint32_t direct = listed < VFS_DIRECT_EXTENTS ? listed : VFS_DIRECT_EXTENTS;
+    VFSExtent index_run = {index, index_blocks(chunks)};
+    VFSExtent run = {overflow, overflow_blocks(listed)};
+    bool same_shape = count == entry->extent_count && chunks == entry->chunk_count;
+    bool keep_index = same_shape && chunks > 0 && index == entry->chunk_block;
+    bool keep_overflow = same_shape && run.length > 0 && overflow == entry->extent_block;
+    if (!keep_index && !write_extent_run(vfs, &index_run, extents, chunks)) {
+        if (!keep_overflow) free_extent(vfs, run);
+        return false;
+    }
+    if (!keep_overflow && !write_extent_run(vfs, &run, extents + chunks + direct, listed - direct)) {
+        if (!keep_index) free_extent(vfs, index_run);
+        return false;
+    }
+    
+    // Neither is rewritten in place: committed metadata may still point at
+    // the old blocks
+    if (entry->chunk_count > 0 && !keep_index) free_extent(vfs, chunk_run(entry));
+    if (entry->extent_block != VFS_INVALID_BLOCK && !keep_overflow) {
+        free_extent(vfs, overflow_run(entry));
+    }
+    memset(entry->extents, 0, sizeof(entry->extents));
+    memcpy(entry->extents, extents + chunks, direct * sizeof(VFSExtent));
+    entry->chunk_block = index_run.length > 0 ? index_run.start : VFS_INVALID_BLOCK;
+    entry->chunk_count = chunks;
+    entry->extent_block = run.length > 0 ? run.start : VFS_INVALID_BLOCK;
+    entry->extent_count = count;
+    mark_entry_dirty(vfs, entry);
+    return true;
+}
+
+static bool store_extents(VFS* vfs, FileEntry* entry, const VFSExtent* extents, uint32_t count) {
+    return place_extents(vfs, entry, extents, count, VFS_INVALID_BLOCK, VFS_INVALID_BLOCK);
+}
+
+// Give back the blocks holding an entry's chunk index and overflow
+// extents, and forget its extents
+static void drop_extent_list(VFS* vfs, FileEntry* entry) {
+    if (entry->chunk_count > 0) free_extent(vfs, chunk_run(entry));
+    if (entry->extent_block != VFS_INVALID_BLOCK) free_extent(vfs, overflow_run(entry));
+    memset(entry->extents, 0, sizeof(entry->extents));
+    entry->chunk_block = VFS_INVALID_BLOCK;
+    entry->chunk_count = 0;
+    entry->extent_block = VFS_INVALID_BLOCK;
+    entry->extent_count = 0;
+    mark_entry_dirty(vfs, entry);
+}
+
+static void free_extent_list(VFS* vfs, const VFSExtent* extents, uint32_t count) {
+    for (uint32_t i = 0; i < count; i++) {
+        release_blocks(vfs, extent_run(extents[i]));
+    }
+}
+
+// Decompress one chunk into out, which holds VFS_CHUNK_SIZE bytes.
+// Returns the bytes produced, 0 if the chunk cannot be read. Readers on
+// other threads may be doing the same, so the compressed bytes go to a
+// buffer of the call's own.
+static size_t read_compressed(VFS* vfs, VFSExtent extent, char* out) {
+    size_t len = extent.length & ~VFS_EXTENT_COMPRESSED;
+    if (len > VFS_CHUNK_SIZE) return 0;
+    
+    char* packed = (char*)xmalloc(len);
+    size_t produced = checked_read(vfs, extent.start, packed, len, true) == len ?
+                      lz_decompress(packed, len, out, VFS_CHUNK_SIZE) : 0;
+    free(packed);
+    return produced;
+}
+
+// Return every block the file owns, including its chunk index and
+// overflow blocks
+static void release_extents(VFS* vfs, FileEntry* entry) {
+    VFSExtent* extents = load_extents(vfs, entry);
+    if (extents) {
+        free_extent_list(vfs, extents, entry->extent_count);
+        free(extents);
+    }
+    drop_extent_list(vfs, entry);
+    memset(entry->inline_data, 0, sizeof(entry->inline_data));
+}
+
+// Layout of VFS001 images, kept only to upgrade them on open
+#define LEGACY_MAGIC "VFS001\n"
+#define LEGACY_MAX_BLOCKS 1024
+#define LEGACY_MAX_FILES 256
+
+typedef struct {
+    char name[MAX_FILENAME];
+    FileType type;
+    uint32_t size;
+    uint32_t first_block;
+    uint32_t parent_dir;
+    uint32_t created_time;
+    uint32_t modified_time;
+} LegacyFileEntry;
+
+typedef struct {
+    char magic[8];
+    uint32_t block_size;
+    uint32_t num_blocks;
+    uint32_t num_files;
+    uint32_t root_dir;
+    uint32_t free_list;
+    LegacyFileEntry entries[LEGACY_MAX_FILES];
+    bool block_used[LEGACY_MAX_BLOCKS];
+} LegacyVFSHeader;
+
+// Rebuild a VFS001 image in the current format through the public API.
+// VFS001 readers treated file data as consecutive blocks from first_block,
+// so that is what gets carried over.
+static bool upgrade_legacy_image(const char* path) {
+    FILE* legacy = fopen(path, "rb");
+    if (!legacy) return true;
+    
+    LegacyVFSHeader* old = (LegacyVFSHeader*)xmalloc(sizeof(LegacyVFSHeader));
+    if (fread(old, sizeof(LegacyVFSHeader), 1, legacy) != 1 ||
+        strncmp(old->magic, LEGACY_MAGIC, 8) != 0) {
+        free(old);
+        fclose(legacy);
+        return true;
+    }
+    
+    char tmp_path[MAX_PATH + 8];
+    snprintf(tmp_path, sizeof(tmp_path), "%s.new", path);
+    remove(tmp_path);
+    
+    VFS* fresh = vfs_init(tmp_path);
+    if (!fresh) {
+        free(old);
+        fclose(legacy);
+        return false;
+    }
+    
+    vfs_begin(fresh);
+    char* data = (char*)xmalloc(LEGACY_MAX_BLOCKS * BLOCK_SIZE);
+    uint32_t num_files = old->num_files < LEGACY_MAX_FILES ? old->num_files : LEGACY_MAX_FILES;
+    
+    for (uint32_t i = 0; i < num_files; i++) {
+        LegacyFileEntry* src = &old->entries[i];
+        src->name[MAX_FILENAME - 1] = '\0';
+        if (src->name[0] == '\0' || strcmp(src->name, "/") == 0) continue;
+        
+        char name_path[MAX_FILENAME + 1];
+        snprintf(name_path, sizeof(name_path), "/%s", src->name);
+        if (!vfs_create_file(fresh, name_path, src->type)) continue;
+        
+        if (src->type != FT_DIRECTORY && src->size > 0 && src->first_block < LEGACY_MAX_BLOCKS) {
+            size_t limit = (size_t)(LEGACY_MAX_BLOCKS - src->first_block) * BLOCK_SIZE;
+            size_t len = src->size < limit ? src->size : limit;
+            fseek(legacy, (long)(sizeof(LegacyVFSHeader) + (size_t)src->first_block * BLOCK_SIZE), SEEK_SET);
+            len = fread(data, 1, len, legacy);
+            vfs_write_file(fresh, name_path, data, len);
+        }
+        
+        FileEntry* entry = lookup_path(fresh, name_path);
+        if (entry) {
+            entry->created_time = src->created_time;
+            entry->modified_time = src->modified_time;
+            mark_entry_dirty(fresh, entry);
+        }
+    }
+    
+    free(data);
+    free(old);
+    fclose(legacy);
+    // The new image has to be on disk before it takes the old one's place
+    bool ok = vfs_commit(fresh) && sync_image(fresh);
+    vfs_close(fresh);
+    if (!ok) {
+        print_error_format("Failed to write converted image %s", tmp_path);
+        return false;
+    }
+    
+    // One step, so a crash leaves either the old image or the new one
+#ifdef _WIN32
+    if (!MoveFileExA(tmp_path, path, MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH)) {
+        print_error_format("Failed to replace VFS001 image %s: error %lu", path, GetLastError());
+        return false;
+    }
+#else
+    if (rename(tmp_path, path) != 0) {
+        print_error_format("Failed to replace VFS001 image %s: %s", path, strerror(errno));
+        return false;
+    }
+#endif
+    return true;
+}
+
+// Bring one metadata region named by the superblock into memory. It is
+// mapped privately (copy-on-write on Windows), so only the pages touched
+// are read and a large table costs nothing to open; changes stay in the
+// mapping until commit writes them. The image may end inside the region
+// if its last sectors were never written, and that part is read instead.
+static void* load_region(VFS* vfs, int region, VFSExtent extent) {
+    size_t bytes = (size_t)extent.length * BLOCK_SIZE;
+    uint64_t offset = block_offset(extent.start);
+#ifdef _WIN32
+    // A view starts on the allocation granularity, so the one for a region
+    // can begin a little before it
+    SYSTEM_INFO system;
+    GetSystemInfo(&system);
+    size_t lead = (size_t)(offset % system.dwAllocationGranularity);
+    HANDLE mapping = NULL;
+    if (offset + bytes <= vfs->image_size) {
+        mapping = CreateFileMappingA((HANDLE)_get_osfhandle(vfs->fd), NULL, PAGE_WRITECOPY, 0, 0, NULL);
+    }
+    if (mapping) {
+        uint64_t start = offset - lead;
+        char* view = (char*)MapViewOfFile(mapping, FILE_MAP_COPY, (DWORD)(start >> 32), (DWORD)start,
+                                          lead + bytes);
+        CloseHandle(mapping);  // The view keeps the mapping alive
+        if (view) {
+            region_resize(vfs, region, view + lead, bytes);
+            vfs->meta[region].mapped = true;
+            vfs->meta[region].map_lead = lead;
+            return view + lead;
+        }
+    }
+#else
+    if (offset + bytes <= vfs->image_size && offset % (uint64_t)sysconf(_SC_PAGESIZE) == 0) {
+        void* mapped = mmap(NULL, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE, vfs->fd, (off_t)offset);
+        if (mapped != MAP_FAILED) {
+            region_resize(vfs, region, mapped, bytes);
+            vfs->meta[region].mapped = true;
+            return mapped;
+        }
+    }
+#endif
+    char* base = (char*)xmalloc(bytes);
+    size_t got = image_read(vfs, offset, base, bytes);
+    memset(base + got, 0, bytes - got);
+    region_resize(vfs, region, base, bytes);
+    return base;
+}
+
+// Re-read the superblock, which replay may have changed, and bring the
+// bitmap and entry table it names into memory
+static bool load_metadata(VFS* vfs) {
+    VFSHeader* h = &vfs->header;
+    if (image_read(vfs, 0, h, sizeof(VFSHeader)) != sizeof(VFSHeader)) return false;
+    if (h->block_size != BLOCK_SIZE || h->num_blocks == 0 || h->num_blocks > VFS_MAX_BLOCKS ||
+        h->bitmap_region.length == 0 || h->entry_region.length == 0 ||
+        h->bitmap_region.start >= h->num_blocks || h->entry_region.start >= h->num_blocks ||
+        (uint64_t)h->bitmap_region.length * BLOCK_SIZE * 8 < h->num_blocks ||
+        (uint64_t)h->entry_count * sizeof(FileEntry) > (uint64_t)h->entry_region.length * BLOCK_SIZE ||
+        h->tree_region.length == 0 || h->tree_region.start >= h->num_blocks ||
+        h->tree_nodes > h->tree_region.length || h->tree_root >= h->tree_nodes ||
+        h->entry_high > h->entry_count) {
+        return false;
+    }
+    if (h->refs_region.length > 0 &&
+        (h->refs_region.start >= h->num_blocks ||
+         (uint64_t)h->refs_region.length * BLOCK_SIZE / sizeof(uint16_t) < h->num_blocks)) {
+        return false;
+    }
+    if (h->crcs_region.length > 0 &&
+        (h->crcs_region.start >= h->num_blocks ||
+         (uint64_t)h->crcs_region.length * BLOCK_SIZE / sizeof(uint32_t) < h->num_blocks)) {
+        return false;
+    }
+    
+    region_resize(vfs, VFS_META_HEADER, &vfs->header, sizeof(VFSHeader));
+    vfs->bitmap = (uint64_t*)load_region(vfs, VFS_META_BITMAP, h->bitmap_region);
+    vfs->entries = (FileEntry*)load_region(vfs, VFS_META_ENTRIES, h->entry_region);
+    if (h->refs_region.length > 0) {
+        vfs->refs = (uint16_t*)load_region(vfs, VFS_META_REFS, h->refs_region);
+    }
+    if (h->crcs_region.length > 0) {
+        vfs->crcs = (uint32_t*)load_region(vfs, VFS_META_CRCS, h->crcs_region);
+    }
+    vfs->tree = (VFSTreeNode*)load_region(vfs, VFS_META_TREE, h->tree_region);
+    return true;
+}
+
+VFS* vfs_init(const char* vfs_file) {
+    return vfs_init_with_options(vfs_file, NULL);
+}
+
+VFS* vfs_init_with_options(const char* vfs_file, const VFSOptions* options) {
+    const char* path = vfs_file ? vfs_file : VFS_FILENAME;
+    
+    if (!upgrade_legacy_image(path)) {
+        return NULL;
+    }
+    
+    VFS* vfs = (VFS*)xmalloc(sizeof(VFS));
+    memset(vfs, 0, sizeof(VFS));
+    
+    strcpy(vfs->current_dir, "/");
+    vfs->path_generation = 1;
+    
+    locks_init(vfs);
+    crc32c_implementation();  // Picked once here, before any thread checksums
+    cache_init(vfs, options ? options->cache_bytes : VFS_DEFAULT_CACHE_BYTES);
+    vfs->compress = options && options->compress;
+    vfs->dedup = options && options->dedup;
+    vfs->verify = options ? options->verify : VFS_VERIFY_FAIL;
+    
+    if (options && options->use_mmap) {
+#ifndef _WIN32
+        vfs->use_mmap = true;
+#else
+        print_error("Memory-mapped VFS is not available on this platform");
+#endif
+    }
+    
+    // Try to open existing VFS file
+    vfs->file = fopen(path, "r+b");
+    
+    if (vfs->file) {
+        vfs->fd = image_descriptor(vfs->file);
+        
+        // Read existing superblock
+        if (image_read(vfs, 0, &vfs->header, sizeof(VFSHeader)) == sizeof(VFSHeader) &&
+            strncmp(vfs->header.magic, VFS_MAGIC, 8) == 0) {
+            if (vfs->header.revision != VFS_REVISION) {
+                print_error_format("%s uses VFS002 layout revision %u, expected %u",
+                                   path, vfs->header.revision, VFS_REVISION);
+                fclose(vfs->file);
+                cache_free(vfs);
+                locks_free(vfs);
+                free(vfs);
+                return NULL;
+            }
+            vfs->image_size = image_end(vfs->fd);
+            journal_replay(vfs);
+            if (!load_metadata(vfs)) {
+                print_error_format("%s has a damaged superblock", path);
+                vfs_close(vfs);
+                return NULL;
+            }
+            
+            // Nothing else is derived at open: free space is summarized
+            // on first allocation, and the index and free slots are on disk
+            return vfs;
+        }
+        
+        // Never overwrite a file we do not recognize
+        if (image_end(vfs->fd) > 0) {
+            print_error_format("%s is not a VFS image", path);
+            fclose(vfs->file);
+            cache_free(vfs);
+            locks_free(vfs);
+            free(vfs);
+            return NULL;
+        }
+        fclose(vfs->file);
+    }
+    
+    // Create new VFS
+    vfs->file = fopen(path, "w+b");
+    if (!vfs->file) {
+        print_error_format("Failed to create VFS file: %s", strerror(errno));
+        cache_free(vfs);
+        locks_free(vfs);
+        free(vfs);
+        return NULL;
+    }
+    vfs->fd = image_descriptor(vfs->file);
+    
+    // Initialize superblock; the image starts small and grows on demand
+    strncpy(vfs->header.magic, VFS_MAGIC, 8);
+    vfs->header.revision = VFS_REVISION;
+    vfs->header.block_size = BLOCK_SIZE;
+    vfs->header.num_blocks = VFS_INITIAL_BLOCKS;
+    vfs->header.num_files = 0;
+    vfs->header.root_dir = 0;
+    region_resize(vfs, VFS_META_HEADER, &vfs->header, sizeof(VFSHeader));
+    
+    size_t bitmap_size = BLOCK_SIZE;
+    size_t entry_blocks = (VFS_INITIAL_FILES * sizeof(FileEntry) + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    size_t entry_size = entry_blocks * BLOCK_SIZE;
+    vfs->bitmap = (uint64_t*)xmalloc(bitmap_size);
+    memset(vfs->bitmap, 0, bitmap_size);
+    vfs->entries = (FileEntry*)xmalloc(entry_size);
+    memset(vfs->entries, 0, entry_size);
+    vfs->header.entry_count = (uint32_t)(entry_size / sizeof(FileEntry));
+    region_resize(vfs, VFS_META_BITMAP, vfs->bitmap, bitmap_size);
+    region_resize(vfs, VFS_META_ENTRIES, vfs->entries, entry_size);
+    
+    vfs->header.free_entry = VFS_NO_ENTRY;
+    vfs->header.bitmap_region = alloc_extent(vfs, 1);
+    vfs->header.entry_region = alloc_extent(vfs, (uint32_t)entry_blocks);
+    create_tree(vfs);
+    
+    // Create root directory entry
+    FileEntry* root = allocate_file_entry(vfs);
+    strcpy(root->name, "/");
+    root->type = FT_DIRECTORY;
+    root->size = 0;
+    root->parent_dir = 0;
+    root->created_time = (uint32_t)time(NULL);
+    root->modified_time = root->created_time;
+    root->extents[0] = alloc_extent(vfs, 1);
+    root->extent_count = 1;
+    
+    // A new image has nothing to protect: write it directly, bypassing the journal
+    for (int region = 0; region < VFS_META_REGIONS; region++) {
+        mark_dirty(vfs, vfs->meta[region].base, vfs->meta[region].size);
+    }
+    save_metadata(vfs);
+    
+    // Initialize root directory block
+    char empty_block[BLOCK_SIZE] = {0};
+    write_block(vfs, root->extents[0].start, empty_block, BLOCK_SIZE);
+    sync_image(vfs);
+    vfs->journal_sequence = 1;
+    
+    return vfs;
+}
+
+void vfs_close(VFS* vfs) {
+    if (vfs) {
+        vfs->transaction_depth = 0;
+        // The last commit is durable; leave nothing for replay to redo
+        if (journal_commit(vfs) && vfs->dirty_sector_count > 0) {
+            save_metadata(vfs);
+            sync_image(vfs);
+        }
+        cache_flush(vfs);
+        release_mapping(vfs);
+        if (vfs->file) {
+            fclose(vfs->file);
+        }
+        free(vfs->chunk_buffer);
+        for (int region = 0; region < VFS_META_REGIONS; region++) {
+            region_drop(vfs, region);
+            free(vfs->meta[region].dirty);
+        }
+        free(vfs->free_runs);
+        free(vfs->dedup_slots);
+        free(vfs->dedup_where);
+        free(vfs->journal_data);
+        free(vfs->journal_blocks);
+        free(vfs->pending_frees);
+        free(vfs->settling_frees);
+        cache_free(vfs);
+        locks_free(vfs);
+        free(vfs);
+    }
+}
+
+// Resolved-path cache. Lookups run in parallel under the shared lock, so
+// the slots sit behind the cache mutex.
+static uint32_t path_hash(const char* path) {
+    // FNV-1a
+    uint32_t hash = 2166136261u;
+    for (const unsigned char* p = (const unsigned char*)path; *p; p++) {
+        hash ^= *p;
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+// The slot holding path, or NULL. Call with the cache mutex held.
+static VFSPathSlot* path_slot(VFS* vfs, const char* path, uint32_t hash) {
+    VFSPathSlot* slot = &vfs->path_cache[hash % VFS_PATH_CACHE_SLOTS];
+    if (slot->generation == vfs->path_generation && slot->hash == hash && strcmp(slot->path, path) == 0) {
+        return slot;
+    }
+    return NULL;
+}
+
+static uint32_t cached_entry(VFS* vfs, const char* path, uint32_t hash) {
+    cache_enter(vfs);
+    VFSPathSlot* slot = path_slot(vfs, path, hash);
+    uint32_t number = slot ? slot->entry : VFS_PATH_UNKNOWN;
+    if (number != VFS_PATH_UNKNOWN) vfs->stats.path_hits++;
+    cache_leave(vfs);
+    return number;
+}
+
+// Record what a path resolves to, and the entry it names if known.
+// Paths too long to keep are not cached.
+static void remember_path(VFS* vfs, const char* path, uint32_t hash, const char* resolved,
+                          uint32_t number) {
+    if (strlen(path) >= MAX_PATH) return;
+    
+    cache_enter(vfs);
+    VFSPathSlot* slot = &vfs->path_cache[hash % VFS_PATH_CACHE_SLOTS];
+    slot->generation = vfs->path_generation;
+    slot->hash = hash;
+    slot->entry = number;
+    strcpy(slot->path, path);
+    strcpy(slot->resolved, resolved);
+    vfs->stats.path_misses++;
+    cache_leave(vfs);
+}
+
+static void remember_entry(VFS* vfs, const char* path, uint32_t hash, uint32_t number) {
+    cache_enter(vfs);
+    VFSPathSlot* slot = path_slot(vfs, path, hash);
+    if (slot) slot->entry = number;
+    cache_leave(vfs);
+}
+
+// Called with the metadata lock held exclusively whenever a path may
+// resolve differently
+static void forget_paths(VFS* vfs) {
+    vfs->path_generation++;
+}
+
+// Make path absolute against the current directory and collapse "//",
+// "." and ".." in a buffer of MAX_PATH bytes, without allocating
+static bool build_path(VFS* vfs, const char* path, char* resolved) {
+    size_t len = 0;
+    if (!is_absolute_path(path)) {
+        len = strlen(vfs->current_dir);
+        memcpy(resolved, vfs->current_dir, len);
+        resolved[len++] = '/';
+    }
+    size_t path_len = strlen(path);
+    if (len + path_len >= MAX_PATH) return false;
+    for (size_t i = 0; i <= path_len; i++) {
+        resolved[len + i] = path[i] == '\\' ? '/' : path[i];
+    }
+    
+    // Collapse empty, "." and ".." components in place
+    char* dst = resolved;
+    const char* src = resolved;
+    while (*src) {
+        while (*src == '/') src++;
+        if (!*src) break;
+        
+        const char* end = strchr(src, '/');
+        size_t part = end ? (size_t)(end - src) : strlen(src);
+        
+        if (part == 1 && src[0] == '.') {
+            // Stay in the same directory
+        } else if (part == 2 && src[0] == '.' && src[1] == '.') {
+            while (dst > resolved && *--dst != '/') {}
+        } else {
+            *dst++ = '/';
+            memmove(dst, src, part);
+            dst += part;
+        }
+        src += part;
+    }
+    if (dst == resolved) {
+        *dst++ = '/';
+    }
+    *dst = '\0';
+    return true;
+}
+
+static bool resolve_path(VFS* vfs, const char* path, char* resolved) {
+    if (!path || !resolved) return false;
+    
+    uint32_t hash = path_hash(path);
+    cache_enter(vfs);
+    VFSPathSlot* slot = path_slot(vfs, path, hash);
+    if (slot) {
+        strcpy(resolved, slot->resolved);
+        vfs->stats.path_hits++;
+    }
+    cache_leave(vfs);
+    if (slot) return true;
+    
+    if (!build_path(vfs, path, resolved)) return false;
+    remember_path(vfs, path, hash, resolved, VFS_PATH_UNKNOWN);
+    return true;
+}
+
+// The current directory can be changed by another thread, so it is read
+// under the lock
+bool vfs_resolve_path(VFS* vfs, const char* path, char* resolved) {
+    if (!vfs) return false;
+    
+    lock_shared(vfs);
+    bool ok = resolve_path(vfs, path, resolved);
+    unlock_shared(vfs);
+    return ok;
+}
+
+bool vfs_file_exists(VFS* vfs, const char* path) {
+    if (!vfs || !path) return false;
+    
+    lock_shared(vfs);
+    bool found = lookup_path(vfs, path) != NULL;
+    unlock_shared(vfs);
+    return found;
+}
+
+bool vfs_stat(VFS* vfs, const char* path, FileEntry* entry) {
+    if (!vfs || !path || !entry) return false;
+    
+    lock_shared(vfs);
+    FileEntry* found = lookup_path(vfs, path);
+    if (found) *entry = *found;
+    unlock_shared(vfs);
+    return found != NULL;
+}
+
+static bool create_entry(VFS* vfs, const char* path, FileType type) {
+    if (!path) return false;
+    
+    uint32_t parent;
+    char filename[MAX_FILENAME];
+    if (!walk_path(vfs, path, &parent, filename)) return false;
+    
+    if (strlen(filename) == 0) {
+        return false;
+    }
+    
+    // Check if file already exists
+    if (index_lookup(vfs, parent, filename)) {
+        return false;
+    }
+    
+    FileEntry* entry = allocate_file_entry(vfs);
+    if (!entry) return false;
+    
+    strcpy(entry->name, filename);
+    entry->type = type;
+    entry->size = 0;
+    entry->parent_dir = parent;
+    entry->created_time = (uint32_t)time(NULL);
+    entry->modified_time = entry->created_time;
+    
+    // Files get their blocks when first written; only directories start
+    // with one
+    if (type == FT_DIRECTORY) {
+        uint32_t first_block = find_free_block(vfs);
+        if (first_block == VFS_INVALID_BLOCK) {
+            release_file_entry(vfs, entry);
+            return false;
+        }
+        entry->extents[0].start = first_block;
+        entry->extents[0].length = 1;
+        entry->extent_count = 1;
+    }
+    mark_entry_dirty(vfs, entry);
+    if (!index_insert(vfs, entry_number(vfs, entry))) {
+        release_extents(vfs, entry);
+        release_file_entry(vfs, entry);
+        return false;
+    }
+    forget_paths(vfs);
+    return true;
+}
+
+bool vfs_create_file(VFS* vfs, const char* path, FileType type) {
+    if (!vfs) return false;
+    
+    begin_update(vfs);
+    bool ok = create_entry(vfs, path, type);
+    return end_update(vfs) && ok;
+}
+
+bool vfs_create_directory(VFS* vfs, const char* path) {
+    return vfs_create_file(vfs, path, FT_DIRECTORY);
+}
+
+// The regular file at path, created empty if it does not exist yet
+static FileEntry* lookup_or_create(VFS* vfs, const char* path) {
+    FileEntry* entry = lookup_path(vfs, path);
+    if (!entry) {
+        if (!create_entry(vfs, path, FT_REGULAR)) {
+            return NULL;
+        }
+        entry = lookup_path(vfs, path);
+    }
+    if (!entry || entry->type == FT_DIRECTORY) return NULL;
+    return entry;
+}
+
+// Compress one chunk into packed. Returns 0 unless that saves at least a
+// block.
+static size_t pack_chunk(const char* data, char* packed) {
+    return lz_compress(data, VFS_CHUNK_SIZE, packed, VFS_CHUNK_SIZE - BLOCK_SIZE);
+}
+
+// Work for a write done ahead of time by vfs_prepare: the compressed
+// bytes of each whole chunk, or the checksum of each full block
+struct VFSPrepared {
+    const char* data;
+    size_t len;
+    char** packed;           // NULL where compression would not save a block
+    size_t* packed_len;      // 0 where it would not
+    uint32_t chunk_count;
+    uint32_t* crcs;
+};
+
+static bool append_blocks(VFS* vfs, FileEntry* entry, const char* data, size_t len);
+static bool append_compressed(VFS* vfs, FileEntry* entry, const char* data, size_t len,
+                              const VFSPrepared* prepared);
+static bool append_deduped(VFS* vfs, FileEntry* entry, const char* data, size_t len,
+                           const VFSPrepared* prepared);
+
+static bool write_entry(VFS* vfs, const char* path, const char* data, size_t len,
+                        const VFSPrepared* prepared) {
+    if (!path || !data) return false;
+    
+    FileEntry* entry = lookup_or_create(vfs, path);
+    if (!entry) return false;
+    
+    // An empty file with blocks reserved by vfs_reserve is filled in them
+    if (entry->size == 0 && entry->extent_count > 0 && len > VFS_INLINE_SIZE &&
+        !vfs->compress && !vfs->dedup) {
+        return append_blocks(vfs, entry, data, len);
+    }
+    
+    // Replace the old contents with freshly allocated extents, or keep
+    // them in the entry when they fit
+    release_extents(vfs, entry);
+    if (len <= VFS_INLINE_SIZE) {
+        memcpy(entry->inline_data, data, len);
+        entry->size = len;
+        entry->modified_time = (uint32_t)time(NULL);
+        mark_entry_dirty(vfs, entry);
+        return true;
+    }
+    entry->size = 0;
+    if (vfs->compress) return append_compressed(vfs, entry, data, len, prepared);
+    if (vfs->dedup) return append_deduped(vfs, entry, data, len, prepared);
+    
+    uint32_t blocks_needed = (uint32_t)((len + BLOCK_SIZE - 1) / BLOCK_SIZE);
+    VFSExtent* extents = (VFSExtent*)xmalloc((blocks_needed + 1) * sizeof(VFSExtent));
+    uint32_t count = 0;
+    
+    uint32_t allocated = 0;
+    
+    while (allocated < blocks_needed && count < VFS_WRITE_EXTENTS) {
+        VFSExtent extent = alloc_extent(vfs, blocks_needed - allocated);
+        if (extent.length == 0) {
+            break;
+        }
+        extents[count++] = extent;
+        allocated += extent.length;
+    }
+    
+    bool ok = allocated == blocks_needed && store_extents(vfs, entry, extents, count);
+    
+    // One seek and one transfer per extent
+    const char* src = data;
+    size_t remaining = len;
+    for (uint32_t i = 0; ok && i < count; i++) {
+        size_t span = (size_t)extents[i].length * BLOCK_SIZE;
+        size_t to_write = remaining < span ? remaining : span;
+        ok = data_write(vfs, extents[i].start, src, to_write);
+        src += to_write;
+        remaining -= to_write;
+    }
+    
+    if (!ok) {
+        // Out of space: give back what was taken and leave the file empty
+        free_extent_list(vfs, extents, count);
+        drop_extent_list(vfs, entry);
+        entry->size = 0;
+        free(extents);
+        return false;
+    }
+    free(extents);
+    
+    entry->size = len;
+    entry->modified_time = (uint32_t)time(NULL);
+    mark_entry_dirty(vfs, entry);
+    return true;
+}
+
+bool vfs_write_file(VFS* vfs, const char* path, const char* data, size_t len) {
+    if (!vfs) return false;
+    
+    begin_update(vfs);
+    bool ok = write_entry(vfs, path, data, len, NULL);
+    return end_update(vfs) && ok;
+}
+
+// Do the compression or checksumming a write of data will need, without
+// taking any lock, so several threads can prepare files while another
+// writes. data has to stay in place until the prepared write is done.
+VFSPrepared* vfs_prepare(VFS* vfs, const char* data, size_t len) {
+    if (!vfs || (!data && len > 0)) return NULL;
+    
+    VFSPrepared* prepared = (VFSPrepared*)xmalloc(sizeof(VFSPrepared));
+    memset(prepared, 0, sizeof(VFSPrepared));
+    prepared->data = data;
+    prepared->len = len;
+    if (len <= VFS_INLINE_SIZE) return prepared;
+    
+    if (vfs->compress) {
+        // As many chunks as append_compressed stores compressed
+        uint64_t chunks = len / VFS_CHUNK_SIZE;
+        if (chunks > VFS_WRITE_EXTENTS - 8) chunks = VFS_WRITE_EXTENTS - 8;
+        prepared->chunk_count = (uint32_t)chunks;
+        prepared->packed = (char**)xmalloc((chunks + 1) * sizeof(char*));
+        prepared->packed_len = (size_t*)xmalloc((chunks + 1) * sizeof(size_t));
+        char* buffer = (char*)xmalloc(VFS_CHUNK_SIZE);
+        for (uint64_t c = 0; c < chunks; c++) {
+            size_t packed = pack_chunk(data + c * VFS_CHUNK_SIZE, buffer);
+            prepared->packed_len[c] = packed;
+            prepared->packed[c] = NULL;
+            if (packed > 0) {
+                prepared->packed[c] = (char*)xmalloc(packed);
+                memcpy(prepared->packed[c], buffer, packed);
+            }
+        }
+        free(buffer);
+    } else if (vfs->dedup) {
+        size_t full = len / BLOCK_SIZE;
+        prepared->crcs = (uint32_t*)xmalloc((full + 1) * sizeof(uint32_t));
+        checksum_blocks(data, full, prepared->crcs);
+    }
+    return prepared;
+}
+
+// Replace the file at path with the prepared data
+bool vfs_write_prepared(VFS* vfs, const char* path, const VFSPrepared* prepared) {
+    if (!vfs || !prepared) return false;
+    
+    begin_update(vfs);
+    bool ok = write_entry(vfs, path, prepared->data, prepared->len, prepared);
+    return end_update(vfs) && ok;
+}
+
+void vfs_free_prepared(VFSPrepared* prepared) {
+    if (!prepared) return;
+    
+    for (uint32_t c = 0; c < prepared->chunk_count; c++) {
+        free(prepared->packed[c]);
+    }
+    free(prepared->packed);
+    free(prepared->packed_len);
+    free(prepared->crcs);
+    free(prepared);
+}
+
+// Write data at `offset` into blocks the file already owns. Only a block
+// that offset starts partway into is read first; everything after the
+// data in its last block is beyond the end of the file.
+static bool write_range(VFS* vfs, const VFSExtent* extents, uint32_t count,
+                        uint64_t offset, const char* data, size_t len) {
+    uint64_t base = 0;
+    for (uint32_t i = 0; i < count && len > 0; i++) {
+        uint64_t span = extent_span(extents[i]);
+        if (offset >= base + span) {
+            base += span;
+            continue;
+        }
+        if (!extent_plain(extents[i])) return false;
+        
+        uint32_t block = extents[i].start + (uint32_t)((offset - base) / BLOCK_SIZE);
+        size_t head = (size_t)((offset - base) % BLOCK_SIZE);
+        if (head > 0) {
+            char buffer[BLOCK_SIZE];
+            size_t take = len < BLOCK_SIZE - head ? len : BLOCK_SIZE - head;
+            if (checked_read(vfs, block, buffer, head, false) != head) return false;
+            memcpy(buffer + head, data, take);
+            if (!data_write(vfs, block, buffer, head + take)) return false;
+            block++;
+            data += take;
+            len -= take;
+            offset += take;
+        }
+        
+        uint64_t left = base + span - offset;
+        size_t take = len < left ? len : (size_t)left;
+        if (take > 0 && !data_write(vfs, block, data, take)) return false;
+        data += take;
+        len -= take;
+        offset += take;
+        base += span;
+    }
+    return len == 0;
+}
+
+// Read data at `offset`, which falls on a block boundary. Holes read as
+// zeros, and a compressed chunk is expanded whole even if only part of it
+// is wanted.
+static bool read_range(VFS* vfs, const VFSExtent* extents, uint32_t count,
+                       uint64_t offset, char* data, size_t len) {
+    uint64_t base;
+    char* partial = NULL;
+    bool ok = true;
+    for (uint32_t i = find_extent(extents, count, offset, &base); ok && i < count && len > 0; i++) {
+        uint64_t skip = offset - base;
+        uint64_t left = extent_span(extents[i]) - skip;
+        size_t take = len < left ? len : (size_t)left;
+        if (extent_hole(extents[i])) {
+            memset(data, 0, take);
+        } else if (!extent_compressed(extents[i])) {
+            ok = checked_read(vfs, extents[i].start + (uint32_t)(skip / BLOCK_SIZE), data, take,
+                              true) == take;
+        } else if (take == VFS_CHUNK_SIZE) {
+            ok = read_compressed(vfs, extents[i], data) == VFS_CHUNK_SIZE;
+        } else {
+            if (!partial) partial = (char*)xmalloc(VFS_CHUNK_SIZE);
+            ok = read_compressed(vfs, extents[i], partial) == VFS_CHUNK_SIZE;
+            memcpy(data, partial + skip, take);
+        }
+        data += take;
+        len -= take;
+        offset += take;
+        base += extent_span(extents[i]);
+    }
+    free(partial);
+    return ok && len == 0;
+}
+
+// Give a file its own copy of block `index` of extent i before it is
+// written, splitting the extent around it; `extents` needs room for two
+// more. Only the first `used` bytes are copied. Returns the copy, or
+// VFS_INVALID_BLOCK when out of space.
+static uint32_t copy_shared_block(VFS* vfs, VFSExtent* extents, uint32_t* count,
+                                  uint32_t i, uint32_t index, size_t used) {
+    uint32_t block = extents[i].start + index;
+    
+    char buffer[BLOCK_SIZE];
+    uint32_t copy = find_free_block(vfs);
+    if (copy == VFS_INVALID_BLOCK) return VFS_INVALID_BLOCK;
+    if (checked_read(vfs, block, buffer, used, true) != used || !data_write(vfs, copy, buffer, used)) {
+        free_block(vfs, copy);
+        return VFS_INVALID_BLOCK;
+    }
+    
+    VFSExtent parts[3];
+    uint32_t n = 0;
+    if (index > 0) {
+        parts[n].start = extents[i].start;
+        parts[n++].length = index;
+    }
+    parts[n].start = copy;
+    parts[n++].length = 1;
+    if (index + 1 < extents[i].length) {
+        parts[n].start = block + 1;
+        parts[n++].length = extents[i].length - index - 1;
+    }
+    memmove(&extents[i + n], &extents[i + 1], (*count - i - 1) * sizeof(VFSExtent));
+    memcpy(&extents[i], parts, n * sizeof(VFSExtent));
+    *count += n - 1;
+    return copy;
+}
+
+// Append to a file kept in blocks. Only its partly filled last block is
+// rewritten, and new blocks extend the last extent in place whenever the
+// space after it is free, so the cost depends on len alone. A last block
+// shared with another file is copied first.
+static bool append_blocks(VFS* vfs, FileEntry* entry, const char* data, size_t len) {
+    VFSExtent* extents = load_extents(vfs, entry);
+    if (!extents) return false;
+    
+    uint32_t count = entry->extent_count;
+    uint64_t allocated = 0;
+    for (uint32_t i = 0; i < count; i++) {
+        allocated += extent_span(extents[i]);
+    }
+    
+    uint64_t end = entry->size + len;
+    uint32_t needed = end > allocated ?
+                      (uint32_t)((end - allocated + BLOCK_SIZE - 1) / BLOCK_SIZE) : 0;
+    extents = (VFSExtent*)xrealloc(extents, (count + needed + 3) * sizeof(VFSExtent));
+    
+    uint32_t shared = VFS_INVALID_BLOCK;
+    uint32_t copy = VFS_INVALID_BLOCK;
+    size_t used = (size_t)(entry->size % BLOCK_SIZE);
+    if (used > 0 && vfs->refs) {
+        // A partly filled block is never in a compressed extent
+        uint64_t base;
+        uint32_t i = find_extent(extents, count, entry->size, &base);
+        uint32_t index = (uint32_t)((entry->size - base) / BLOCK_SIZE);
+        uint32_t block = extents[i].start + index;
+        if (block_shared(vfs, block)) {
+            copy = copy_shared_block(vfs, extents, &count, i, index, used);
+            if (copy == VFS_INVALID_BLOCK) {
+                free(extents);
+                return false;
+            }
+            shared = block;
+        }
+    }
+    
+    uint32_t old_count = count;
+    uint32_t old_last = count > 0 ? extents[count - 1].length : 0;
+    bool ok = true;
+    
+    bool grow = needed > 0;
+    while (needed > 0 && count - old_count < VFS_WRITE_EXTENTS) {
+        VFSExtent extent = {VFS_INVALID_BLOCK, 0};
+        if (count > 0 && extent_plain(extents[count - 1])) {
+            extent = alloc_after(vfs, extents[count - 1].start + extents[count - 1].length, needed);
+        }
+        if (extent.length > 0) {
+            extents[count - 1].length += extent.length;
+        } else {
+            extent = alloc_extent(vfs, needed);
+            if (extent.length == 0) break;
+            extents[count++] = extent;
+        }
+        needed -= extent.length;
+    }
+    if (grow || copy != VFS_INVALID_BLOCK) {
+        ok = needed == 0 && store_extents(vfs, entry, extents, count);
+    }
+    
+    if (!ok) {
+        // Out of space: give back the new blocks and the copy
+        if (old_count > 0 && extents[old_count - 1].length > old_last) {
+            VFSExtent grown = {extents[old_count - 1].start + old_last,
+                               extents[old_count - 1].length - old_last};
+            free_extent(vfs, grown);
+        }
+        free_extent_list(vfs, extents + old_count, count - old_count);
+        if (copy != VFS_INVALID_BLOCK) free_block(vfs, copy);
+        free(extents);
+        return false;
+    }
+    
+    // The file no longer points at the shared block
+    if (shared != VFS_INVALID_BLOCK) {
+        VFSExtent old = {shared, 1};
+        release_blocks(vfs, old);
+    }
+    
+    ok = write_range(vfs, extents, count, entry->size, data, len);
+    free(extents);
+    if (!ok) return false;
+    
+    entry->size = end;
+    entry->modified_time = (uint32_t)time(NULL);
+    mark_entry_dirty(vfs, entry);
+    return true;
+}
+
+// Write data to new blocks added at the end of an extent list
+static bool store_raw(VFS* vfs, VFSExtent* extents, uint32_t* count, const char* data, size_t len) {
+    uint32_t needed = (uint32_t)((len + BLOCK_SIZE - 1) / BLOCK_SIZE);
+    while (needed > 0) {
+        VFSExtent extent = alloc_extent(vfs, needed);
+        if (extent.length == 0) return false;
+        extents[(*count)++] = extent;
+        
+        size_t span = (size_t)extent.length * BLOCK_SIZE;
+        size_t take = len < span ? len : span;
+        if (!data_write(vfs, extent.start, data, take)) return false;
+        data += take;
+        len -= take;
+        needed -= extent.length;
+    }
+    return true;
+}
+
+// Add one full chunk at the end of an extent list, compressed when that
+// saves at least a block. Chunk `index` of a prepared write was
+// compressed ahead of time.
+static bool store_chunk(VFS* vfs, VFSExtent* extents, uint32_t* count, const char* data,
+                        const VFSPrepared* prepared, uint64_t index) {
+    const char* packed;
+    size_t len;
+    if (prepared && index < prepared->chunk_count) {
+        packed = prepared->packed[index];
+        len = prepared->packed_len[index];
+    } else {
+        if (!vfs->chunk_buffer) {
+            vfs->chunk_buffer = (char*)xmalloc(VFS_CHUNK_SIZE);
+        }
+        packed = vfs->chunk_buffer;
+        len = pack_chunk(data, vfs->chunk_buffer);
+    }
+    if (len == 0) {
+        return store_raw(vfs, extents, count, data, VFS_CHUNK_SIZE);
+    }
+    
+    uint32_t blocks = (uint32_t)((len + BLOCK_SIZE - 1) / BLOCK_SIZE);
+    VFSExtent extent = alloc_extent(vfs, blocks);
+    if (extent.length < blocks || !data_write(vfs, extent.start, packed, len)) {
+        free_extent(vfs, extent);
+        return false;
+    }
+    extent.length = VFS_EXTENT_COMPRESSED | (uint32_t)len;
+    extents[(*count)++] = extent;
+    return true;
+}
+
+// Append with compression. The uncompressed tail of the file, which starts
+// on a chunk boundary, is joined with the new data and cut into whole
+// chunks, each stored in new blocks; what is left over is written
+// uncompressed. Every chunk takes a journal record, so past
+// VFS_WRITE_EXTENTS - 8 chunks one write leaves the rest uncompressed. A
+// prepared write starts on an empty file, so its chunks line up with the
+// ones stored here.
+static bool append_compressed(VFS* vfs, FileEntry* entry, const char* data, size_t len,
+                              const VFSPrepared* prepared) {
+    VFSExtent* extents = load_extents(vfs, entry);
+    if (!extents) return false;
+    uint32_t count = entry->extent_count;
+    
+    uint64_t tail_start = 0;
+    uint64_t base = 0;
+    for (uint32_t i = 0; i < count; i++) {
+        base += extent_span(extents[i]);
+        if (extent_compressed(extents[i])) tail_start = base;
+    }
+    tail_start += (entry->size - tail_start) / VFS_CHUNK_SIZE * VFS_CHUNK_SIZE;
+    size_t tail = (size_t)(entry->size - tail_start);
+    
+    // Extents up to the tail stay; one holding its start is cut short
+    uint32_t first = find_extent(extents, count, tail_start, &base);
+    uint32_t cut = (uint32_t)((tail_start - base) / BLOCK_SIZE);
+    uint32_t keep = first + (cut > 0 ? 1 : 0);
+    
+    uint64_t chunks = (tail + len) / VFS_CHUNK_SIZE;
+    if (chunks > VFS_WRITE_EXTENTS - 8) chunks = VFS_WRITE_EXTENTS - 8;
+    if (chunks == 0) {
+        free(extents);
+        return append_blocks(vfs, entry, data, len);
+    }
+    if (tail > 0) prepared = NULL;
+    
+    char* chunk = (char*)xmalloc(VFS_CHUNK_SIZE);
+    size_t rest = (size_t)(tail + len - chunks * VFS_CHUNK_SIZE);
+    size_t capacity = keep + chunks * VFS_READAHEAD_BLOCKS + (rest + BLOCK_SIZE - 1) / BLOCK_SIZE + 1;
+    VFSExtent* list = (VFSExtent*)xmalloc(capacity * sizeof(VFSExtent));
+    memcpy(list, extents, keep * sizeof(VFSExtent));
+    if (cut > 0) list[first].length = cut;
+    uint32_t n = keep;
+    
+    bool ok = read_range(vfs, extents, count, tail_start, chunk, tail);
+    const char* src = data + (VFS_CHUNK_SIZE - tail);
+    if (ok) {
+        memcpy(chunk + tail, data, VFS_CHUNK_SIZE - tail);
+        ok = store_chunk(vfs, list, &n, chunk, prepared, 0);
+    }
+    for (uint64_t c = 1; ok && c < chunks; c++) {
+        ok = store_chunk(vfs, list, &n, src, prepared, c);
+        src += VFS_CHUNK_SIZE;
+    }
+    ok = ok && store_raw(vfs, list, &n, src, (size_t)(data + len - src)) &&
+         store_extents(vfs, entry, list, n);
+    free(chunk);
+    
+    if (!ok) {
+        for (uint32_t i = keep; i < n; i++) {
+            free_extent(vfs, extent_run(list[i]));
+        }
+        free(list);
+        free(extents);
+        return false;
+    }
+    
+    // The old tail blocks are no longer part of the file
+    if (cut > 0 && !extent_hole(extents[first])) {
+        VFSExtent dropped = {extents[first].start + cut, extents[first].length - cut};
+        release_blocks(vfs, dropped);
+    }
+    free_extent_list(vfs, extents + keep, count - keep);
+    free(list);
+    free(extents);
+    
+    entry->size += len;
+    entry->modified_time = (uint32_t)time(NULL);
+    mark_entry_dirty(vfs, entry);
+    return true;
+}
+
+// Fill the index with the full blocks of plain extents that files hold,
+// keyed on their stored checksums. Blocks with no checksum are left out,
+// as are compressed chunks and the partial last block of a file.
+static void dedup_load(VFS* vfs) {
+    vfs->dedup_loaded = true;
+    if (!vfs->crcs) return;
+    
+    for (uint32_t i = 0; i < vfs->header.entry_count; i++) {
+        const FileEntry* entry = &vfs->entries[i];
+        if (!entry_in_use(entry) || entry->type != FT_REGULAR || entry->extent_count == 0) continue;
+        VFSExtent* extents = load_extents(vfs, entry);
+        if (!extents) continue;
+        
+        uint64_t base = 0;
+        for (uint32_t e = 0; e < entry->extent_count && base < entry->size; e++) {
+            if (extent_plain(extents[e])) {
+                for (uint32_t b = 0; b < extents[e].length; b++) {
+                    uint32_t block = extents[e].start + b;
+                    if (base + (uint64_t)(b + 1) * BLOCK_SIZE > entry->size) break;
+                    if (vfs->crcs[block] == 0) continue;
+                    if (block < vfs->dedup_where_count && vfs->dedup_where[block] != DEDUP_EMPTY) continue;
+                    dedup_insert(vfs, vfs->crcs[block], block);
+                }
+            }
+            base += extent_span(extents[e]);
+        }
+        free(extents);
+    }
+}
+
+// Index the full blocks among extents just written; `crcs` holds the
+// checksum of each full block of their data, in order
+static void dedup_index_run(VFS* vfs, const VFSExtent* extents, uint32_t count,
+                            const uint32_t* crcs, size_t full) {
+    size_t index = 0;
+    for (uint32_t i = 0; i < count; i++) {
+        for (uint32_t b = 0; b < extents[i].length && index < full; b++) {
+            dedup_insert(vfs, crcs[index++], extents[i].start + b);
+        }
+    }
+}
+
+// Write full blocks [from, to) of data to new blocks at the end of an
+// extent list and index them
+static bool store_run(VFS* vfs, VFSExtent* extents, uint32_t* count, const char* data,
+                      const uint32_t* crcs, size_t from, size_t to) {
+    uint32_t before = *count;
+    if (!store_raw(vfs, extents, count, data + from * BLOCK_SIZE, (to - from) * BLOCK_SIZE)) {
+        return false;
+    }
+    dedup_index_run(vfs, extents + before, *count - before, crcs + from, to - from);
+    return true;
+}
+
+// For each full block of data, the first block before it with the same
+// contents, or itself
+static size_t* find_repeats(const char* data, const uint32_t* crcs, size_t full) {
+    size_t* repeats = (size_t*)xmalloc((full + 1) * sizeof(size_t));
+    size_t capacity = 16;
+    while (capacity < full * 2) {
+        capacity *= 2;
+    }
+    size_t* table = (size_t*)xmalloc(capacity * sizeof(size_t));
+    memset(table, 0xFF, capacity * sizeof(size_t));
+    
+    size_t mask = capacity - 1;
+    for (size_t i = 0; i < full; i++) {
+        repeats[i] = i;
+        size_t h = crcs[i] & mask;
+        for (; table[h] != SIZE_MAX; h = (h + 1) & mask) {
+            size_t j = table[h];
+            if (crcs[j] == crcs[i] &&
+                memcmp(data + j * BLOCK_SIZE, data + i * BLOCK_SIZE, BLOCK_SIZE) == 0) {
+                repeats[i] = j;
+                break;
+            }
+        }
+        if (repeats[i] == i) table[h] = i;
+    }
+    free(table);
+    return repeats;
+}
+
+// Write data to new blocks at the end of an extent list, except that a
+// full block whose contents are already stored gains a reference
+// instead. A checksum match is confirmed against the stored block
+// before it is shared. Runs of new blocks are allocated and written
+// together, and sharing stops once the write has added nearly
+// VFS_WRITE_EXTENTS extents.
+// `known` holds the checksums when they were worked out ahead of time.
+static bool store_deduped(VFS* vfs, VFSExtent* extents, uint32_t* count, const char* data, size_t len,
+                          const uint32_t* known) {
+    if (!vfs->dedup_loaded) dedup_load(vfs);
+    
+    size_t full = len / BLOCK_SIZE;
+    uint32_t* crcs = (uint32_t*)xmalloc((full + 1) * sizeof(uint32_t));
+    if (known) {
+        memcpy(crcs, known, full * sizeof(uint32_t));
+    } else {
+        checksum_blocks(data, full, crcs);
+    }
+    size_t* repeats = find_repeats(data, crcs, full);
+    char* stored = (char*)xmalloc(BLOCK_SIZE);
+    uint32_t first = *count;
+    size_t run = 0;
+    size_t i = 0;
+    bool ok = true;
+    
+    for (; ok && i < full && *count - first + 3 < VFS_WRITE_EXTENTS; i++) {
+        // A repeat of a block still waiting to be written can share it
+        // once it is
+        if (repeats[i] != i && repeats[i] >= run) {
+            ok = store_run(vfs, extents, count, data, crcs, run, i);
+            if (!ok) break;
+            run = i;
+        }
+        
+        const char* block_data = data + i * BLOCK_SIZE;
+        uint32_t block = dedup_lookup(vfs, crcs[i]);
+        if (block == VFS_INVALID_BLOCK) continue;
+        if (cached_read(vfs, block, stored, BLOCK_SIZE) != BLOCK_SIZE ||
+            memcmp(stored, block_data, BLOCK_SIZE) != 0 || !ensure_refs(vfs)) {
+            continue;
+        }
+        if (vfs->refs[block] == VFS_MAX_BLOCK_REFS) {
+            // Let the next copy of this block take its place
+            VFSExtent extent = {block, 1};
+            dedup_forget(vfs, extent);
+            continue;
+        }
+        
+        ok = store_run(vfs, extents, count, data, crcs, run, i);
+        if (!ok) break;
+        vfs->refs[block]++;
+        mark_dirty(vfs, &vfs->refs[block], sizeof(uint16_t));
+        vfs->stats.dedup_hits++;
+        if (*count > first && extents[*count - 1].start + extents[*count - 1].length == block) {
+            extents[*count - 1].length++;
+        } else {
+            extents[*count].start = block;
+            extents[(*count)++].length = 1;
+        }
+        run = i + 1;
+    }
+    
+    // The rest, indexing only the blocks looked at above
+    if (ok) {
+        uint32_t before = *count;
+        ok = store_raw(vfs, extents, count, data + run * BLOCK_SIZE, len - run * BLOCK_SIZE);
+        if (ok) dedup_index_run(vfs, extents + before, *count - before, crcs + run, i - run);
+    }
+    free(stored);
+    free(repeats);
+    free(crcs);
+    return ok;
+}
+
+// Append with deduplication. Only blocks past the end of the file are
+// written, so this is used when the file ends on a block boundary and
+// owns no spare blocks; anything else takes the ordinary path.
+static bool append_deduped(VFS* vfs, FileEntry* entry, const char* data, size_t len,
+                           const VFSPrepared* prepared) {
+    VFSExtent* extents = load_extents(vfs, entry);
+    if (!extents) return false;
+    uint32_t count = entry->extent_count;
+    
+    uint64_t allocated = 0;
+    for (uint32_t i = 0; i < count; i++) {
+        allocated += extent_span(extents[i]);
+    }
+    if (allocated != entry->size) {
+        free(extents);
+        return append_blocks(vfs, entry, data, len);
+    }
+    
+    size_t capacity = count + (len + BLOCK_SIZE - 1) / BLOCK_SIZE + 1;
+    VFSExtent* list = (VFSExtent*)xmalloc(capacity * sizeof(VFSExtent));
+    memcpy(list, extents, count * sizeof(VFSExtent));
+    free(extents);
+    
+    const uint32_t* crcs = prepared && entry->size == 0 ? prepared->crcs : NULL;
+    uint32_t n = count;
+    bool ok = store_deduped(vfs, list, &n, data, len, crcs) && store_extents(vfs, entry, list, n);
+    if (!ok) {
+        // Drops the references taken as well as the new blocks
+        free_extent_list(vfs, list + count, n - count);
+        free(list);
+        return false;
+    }
+    free(list);
+    
+    entry->size += len;
+    entry->modified_time = (uint32_t)time(NULL);
+    mark_entry_dirty(vfs, entry);
+    return true;
+}
+
+// Append to a file. It stays inline while it fits; past that its inline
+// contents move to the first block.
+static bool append_entry(VFS* vfs, FileEntry* entry, const char* data, size_t len) {
+    if (len == 0) return true;
+    
+    if (entry->extent_count == 0) {
+        uint64_t end = entry->size + len;
+        if (end <= VFS_INLINE_SIZE) {
+            memcpy(entry->inline_data + entry->size, data, len);
+            entry->size = end;
+            entry->modified_time = (uint32_t)time(NULL);
+            mark_entry_dirty(vfs, entry);
+            return true;
+        }
+        
+        if (entry->size > 0) {
+            char head[VFS_INLINE_SIZE];
+            size_t head_len = (size_t)entry->size;
+            memcpy(head, entry->inline_data, head_len);
+            entry->size = 0;
+            if (!append_blocks(vfs, entry, head, head_len)) {
+                entry->size = head_len;
+                return false;
+            }
+            memset(entry->inline_data, 0, sizeof(entry->inline_data));
+        }
+    }
+    if (vfs->compress) return append_compressed(vfs, entry, data, len, NULL);
+    if (vfs->dedup && entry->size % BLOCK_SIZE == 0) return append_deduped(vfs, entry, data, len, NULL);
+    return append_blocks(vfs, entry, data, len);
+}
+
+bool vfs_append(VFS* vfs, const char* path, const char* data, size_t len) {
+    if (!vfs || !path || !data) return false;
+    
+    begin_update(vfs);
+    FileEntry* entry = lookup_or_create(vfs, path);
+    bool ok = entry && append_entry(vfs, entry, data, len);
+    return end_update(vfs) && ok;
+}
+
+static bool append_zeros(VFS* vfs, FileEntry* entry, uint64_t len) {
+    while (len > 0) {
+        size_t chunk = len < BLOCK_SIZE ? (size_t)len : BLOCK_SIZE;
+        if (!append_entry(vfs, entry, zero_block, chunk)) return false;
+        len -= chunk;
+    }
+    return true;
+}
+
+// Part of a plain extent or hole, `skip` blocks in
+static VFSExtent extent_slice(VFSExtent extent, uint64_t skip, uint64_t length) {
+    if (!extent_hole(extent)) extent.start += (uint32_t)skip;
+    extent.length = (uint32_t)length;
+    return extent;
+}
+
+// Copy an extent list, joining neighbouring holes and plain extents that
+// follow on from each other. Returns the new count.
+static uint32_t merge_extents(VFSExtent* out, const VFSExtent* extents, uint32_t count) {
+    uint32_t n = 0;
+    for (uint32_t i = 0; i < count; i++) {
+        VFSExtent extent = extents[i];
+        if (n > 0) {
+            VFSExtent* prev = &out[n - 1];
+            bool joins = extent_hole(*prev) ? extent_hole(extent) :
+                         extent_plain(*prev) && extent_plain(extent) &&
+                         prev->start + prev->length == extent.start;
+            if (joins && prev->length < VFS_EXTENT_COMPRESSED - extent.length) {
+                prev->length += extent.length;
+                continue;
+            }
+        }
+        out[n++] = extent;
+    }
+    return n;
+}
+
+// Grow a file with zeros to `size` bytes. The whole blocks in between
+// become a hole, and only the partial blocks at either end of it are
+// written. Blocks reserved past the old end are given back first, since
+// the hole takes their place.
+static bool extend_entry(VFS* vfs, FileEntry* entry, uint64_t size) {
+    uint64_t hole_start = (entry->size + BLOCK_SIZE - 1) / BLOCK_SIZE * BLOCK_SIZE;
+    uint64_t hole_end = size / BLOCK_SIZE * BLOCK_SIZE;
+    if (hole_end <= hole_start) return append_zeros(vfs, entry, size - entry->size);
+    
+    uint64_t blocks = (hole_end - hole_start) / BLOCK_SIZE;
+    if (blocks >= VFS_EXTENT_COMPRESSED || !append_zeros(vfs, entry, hole_start - entry->size)) {
+        return false;
+    }
+    
+    VFSExtent* extents = load_extents(vfs, entry);
+    if (!extents) return false;
+    uint32_t count = entry->extent_count;
+    
+    // Extents up to the end of the file stay; the last may be cut short
+    uint32_t keep = 0;
+    uint64_t allocated = 0;
+    while (keep < count && allocated < entry->size) {
+        allocated += extent_span(extents[keep++]);
+    }
+    VFSExtent spare = {VFS_HOLE_BLOCK, 0};
+    VFSExtent* list = (VFSExtent*)xmalloc((keep + 1) * sizeof(VFSExtent));
+    memcpy(list, extents, keep * sizeof(VFSExtent));
+    if (allocated > entry->size && extent_plain(list[keep - 1])) {
+        uint32_t blocks_past = (uint32_t)((allocated - entry->size) / BLOCK_SIZE);
+        list[keep - 1].length -= blocks_past;
+        spare = extent_slice(extents[keep - 1], list[keep - 1].length, blocks_past);
+    }
+    list[keep].start = VFS_HOLE_BLOCK;
+    list[keep].length = (uint32_t)blocks;
+    
+    VFSExtent* merged = (VFSExtent*)xmalloc((keep + 1) * sizeof(VFSExtent));
+    bool ok = store_extents(vfs, entry, merged, merge_extents(merged, list, keep + 1));
+    if (ok) {
+        release_blocks(vfs, extent_run(spare));
+        free_extent_list(vfs, extents + keep, count - keep);
+    }
+    free(merged);
+    free(list);
+    free(extents);
+    if (!ok) return false;
+    
+    entry->size = hole_end;
+    entry->modified_time = (uint32_t)time(NULL);
+    mark_entry_dirty(vfs, entry);
+    return append_zeros(vfs, entry, size - hole_end);
+}
+
+// Write data to new blocks at the end of an extent list, as store_raw
+// does, but continue the plain extent before them when the space after
+// it is free, so that merge_extents joins them into one
+static bool store_following(VFS* vfs, VFSExtent* extents, uint32_t* count, const char* data, size_t len) {
+    uint32_t needed = (uint32_t)((len + BLOCK_SIZE - 1) / BLOCK_SIZE);
+    const VFSExtent* last = *count > 0 && extent_plain(extents[*count - 1]) ? &extents[*count - 1] : NULL;
+    if (last && last->length < VFS_EXTENT_COMPRESSED - needed) {
+        ensure_free_runs(vfs);
+        uint32_t pick = free_run_at(vfs, last->start + last->length);
+        if (pick != RUN_NONE && vfs->free_runs[pick].length >= needed) {
+            VFSExtent extent = take_from_run(vfs, pick, needed);
+            extents[(*count)++] = extent;
+            return data_write(vfs, extent.start, data, len);
+        }
+    }
+    return store_raw(vfs, extents, count, data, len);
+}
+
+// The image blocks behind blocks [first, last) of a file, if every one can
+// be overwritten where it is: plain, not shared with another file, and
+// few enough for the journal to take
+static bool blocks_in_place(VFS* vfs, const VFSExtent* extents, uint32_t count,
+                            uint64_t first, uint64_t last, uint32_t* blocks) {
+    if (last - first > JOURNAL_BLOCK_LIMIT || !journal_has_room(vfs, (uint32_t)(last - first))) {
+        return false;
+    }
+    
+    uint64_t base;
+    uint32_t i = find_extent(extents, count, first * BLOCK_SIZE, &base);
+    for (uint64_t b = first; b < last; b++) {
+        while (i < count && b * BLOCK_SIZE >= base + extent_span(extents[i])) {
+            base += extent_span(extents[i++]);
+        }
+        if (i == count || !extent_plain(extents[i])) return false;
+        
+        uint32_t block = extents[i].start + (uint32_t)(b - base / BLOCK_SIZE);
+        if (block_shared(vfs, block) || block_written(vfs, block)) return false;
+        blocks[b - first] = block;
+    }
+    return true;
+}
+
+// Write over [offset, offset + len) of a file kept in plain extents and
+// holes, all of it before the end of the file. A few blocks the file has
+// to itself are overwritten where they are, through the journal.
+// Otherwise the blocks the range touches go to new blocks and the old ones
+// are released, which copes with blocks shared with other files and with
+// holes alike. Either way only the first and last blocks are read, for
+// the bytes around the data.
+static bool overwrite_blocks(VFS* vfs, FileEntry* entry, uint64_t offset, const char* data, size_t len) {
+    VFSExtent* extents = load_extents(vfs, entry);
+    if (!extents) return false;
+    uint32_t count = entry->extent_count;
+    
+    uint64_t first = offset / BLOCK_SIZE;
+    uint64_t last = (offset + len + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    uint64_t start = first * BLOCK_SIZE;
+    uint64_t stop = last * BLOCK_SIZE < entry->size ? last * BLOCK_SIZE : entry->size;
+    size_t head = (size_t)(offset - start);
+    size_t bytes = (size_t)(stop - start);
+    char* buffer = (char*)xmalloc(bytes);
+    bool ok = true;
+    if (head > 0) {
+        size_t block_len = bytes < BLOCK_SIZE ? bytes : BLOCK_SIZE;
+        ok = read_range(vfs, extents, count, start, buffer, block_len);
+    }
+    uint64_t tail = (last - 1) * BLOCK_SIZE;
+    if (ok && offset + len < stop && (tail > start || head == 0)) {
+        ok = read_range(vfs, extents, count, tail, buffer + (tail - start), (size_t)(stop - tail));
+    }
+    memcpy(buffer + head, data, len);
+    
+    uint32_t blocks[JOURNAL_BLOCK_LIMIT];
+    if (ok && blocks_in_place(vfs, extents, count, first, last, blocks)) {
+        for (uint64_t b = first; ok && b < last; b++) {
+            size_t at = (size_t)(b - first) * BLOCK_SIZE;
+            VFSExtent block = {blocks[b - first], 1};
+            dedup_forget(vfs, block);
+            size_t chunk = bytes - at < BLOCK_SIZE ? bytes - at : BLOCK_SIZE;
+            ok = journal_block_write(vfs, block.start, buffer + at, chunk);
+        }
+        free(buffer);
+        free(extents);
+        if (ok) {
+            entry->modified_time = (uint32_t)time(NULL);
+            mark_entry_dirty(vfs, entry);
+        }
+        return ok;
+    }
+    
+    // Pieces before and after the range stay, and the data goes between
+    VFSExtent* list = (VFSExtent*)xmalloc((count + (last - first) + 2) * sizeof(VFSExtent));
+    VFSExtent* dropped = (VFSExtent*)xmalloc((count + 1) * sizeof(VFSExtent));
+    uint32_t n = 0;
+    uint32_t dropped_count = 0;
+    uint32_t fresh = 0;
+    uint32_t fresh_end = 0;
+    uint64_t at = 0;
+    for (uint32_t i = 0; ok && i < count; i++) {
+        uint64_t from = at;
+        uint64_t to = at + extent_span(extents[i]) / BLOCK_SIZE;
+        at = to;
+        if (to <= first || from >= last) {
+            list[n++] = extents[i];
+            continue;
+        }
+        
+        uint64_t low = from > first ? from : first;
+        uint64_t high = to < last ? to : last;
+        if (from < first) list[n++] = extent_slice(extents[i], 0, first - from);
+        if (!extent_hole(extents[i])) {
+            dropped[dropped_count++] = extent_slice(extents[i], low - from, high - low);
+        }
+        if (from <= first) {
+            fresh = n;
+            ok = store_following(vfs, list, &n, buffer, bytes);
+            fresh_end = n;
+        }
+        if (to > last) list[n++] = extent_slice(extents[i], last - from, to - last);
+    }
+    free(buffer);
+    free(extents);
+    
+    VFSExtent* merged = (VFSExtent*)xmalloc((n + 1) * sizeof(VFSExtent));
+    ok = ok && store_extents(vfs, entry, merged, merge_extents(merged, list, n));
+    if (ok) {
+        for (uint32_t i = 0; i < dropped_count; i++) {
+            release_blocks(vfs, dropped[i]);
+        }
+        entry->modified_time = (uint32_t)time(NULL);
+        mark_entry_dirty(vfs, entry);
+    } else {
+        free_extent_list(vfs, list + fresh, fresh_end - fresh);
+    }
+    free(merged);
+    free(dropped);
+    free(list);
+    return ok;
+}
+
+// Overwrite the blocks of a file's chunk index that change between `old`
+// and `extents`, which have the same shape, through the journal. Returns
+// false without writing anything if the journal cannot take them, or one
+// was written fresh by the open transaction; *failed is set if a write
+// went wrong.
+static bool chunk_index_in_place(VFS* vfs, const FileEntry* entry, const VFSExtent* old,
+                                 const VFSExtent* extents, bool* failed) {
+    uint32_t changed[JOURNAL_BLOCK_LIMIT];
+    uint32_t n = 0;
+    for (uint32_t b = 0; b < index_blocks(entry->chunk_count); b++) {
+        uint32_t first = b * VFS_EXTENTS_PER_BLOCK;
+        uint32_t left = entry->chunk_count - first;
+        size_t bytes = (left < VFS_EXTENTS_PER_BLOCK ? left : VFS_EXTENTS_PER_BLOCK) * sizeof(VFSExtent);
+        if (memcmp(old + first, extents + first, bytes) == 0) continue;
+        if (n == JOURNAL_BLOCK_LIMIT || block_written(vfs, entry->chunk_block + b)) return false;
+        changed[n++] = b;
+    }
+    if (!journal_has_room(vfs, n)) return false;
+    
+    for (uint32_t k = 0; k < n && !*failed; k++) {
+        uint32_t first = changed[k] * VFS_EXTENTS_PER_BLOCK;
+        uint32_t left = entry->chunk_count - first;
+        size_t bytes = (left < VFS_EXTENTS_PER_BLOCK ? left : VFS_EXTENTS_PER_BLOCK) * sizeof(VFSExtent);
+        *failed = !journal_block_write(vfs, entry->chunk_block + changed[k],
+                                       (const char*)(extents + first), bytes);
+    }
+    return true;
+}
+
+// Write over [offset, offset + len) of a file, all of it before the end,
+// when part of it lies in compressed chunks. Only the chunks the range
+// touches are read, changed and stored again, compressed if an append
+// would be; a last chunk the file ends partway into stays uncompressed. When
+// the list keeps its shape, only the chunk index blocks that changed are
+// written.
+static bool rewrite_chunks(VFS* vfs, FileEntry* entry, uint64_t offset, const char* data, size_t len) {
+    VFSExtent* extents = load_extents(vfs, entry);
+    if (!extents) return false;
+    uint32_t count = entry->extent_count;
+    
+    uint64_t low = offset / VFS_CHUNK_SIZE * VFS_CHUNK_SIZE;
+    uint64_t high = (offset + len + VFS_CHUNK_SIZE - 1) / VFS_CHUNK_SIZE * VFS_CHUNK_SIZE;
+    if (high > entry->size) high = entry->size;
+    size_t bytes = (size_t)(high - low);
+    char* buffer = (char*)xmalloc(bytes);
+    bool ok = read_range(vfs, extents, count, low, buffer, bytes);
+    memcpy(buffer + (offset - low), data, len);
+    
+    // Pieces before and after the chunks stay, and the chunks go between.
+    // Compressed chunks start on chunk boundaries, so only plain extents
+    // and holes are cut.
+    uint64_t first = low / BLOCK_SIZE;
+    uint64_t last = (high + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    size_t capacity = count + 2 + (bytes + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    VFSExtent* list = (VFSExtent*)xmalloc(capacity * sizeof(VFSExtent));
+    VFSExtent* dropped = (VFSExtent*)xmalloc((count + 1) * sizeof(VFSExtent));
+    uint32_t n = 0;
+    uint32_t dropped_count = 0;
+    uint32_t fresh = 0;
+    uint32_t fresh_end = 0;
+    uint64_t at = 0;
+    for (uint32_t i = 0; ok && i < count; i++) {
+        uint64_t from = at;
+        uint64_t to = at + extent_span(extents[i]) / BLOCK_SIZE;
+        at = to;
+        if (to <= first || from >= last) {
+            list[n++] = extents[i];
+            continue;
+        }
+        
+        uint64_t low_block = from > first ? from : first;
+        uint64_t high_block = to < last ? to : last;
+        if (from < first) list[n++] = extent_slice(extents[i], 0, first - from);
+        if (extent_compressed(extents[i])) {
+            dropped[dropped_count++] = extent_run(extents[i]);
+        } else if (!extent_hole(extents[i])) {
+            dropped[dropped_count++] = extent_slice(extents[i], low_block - from, high_block - low_block);
+        }
+        if (from <= first) {
+            fresh = n;
+            size_t done = 0;
+            for (; ok && vfs->compress && bytes - done >= VFS_CHUNK_SIZE; done += VFS_CHUNK_SIZE) {
+                ok = store_chunk(vfs, list, &n, buffer + done, NULL, 0);
+            }
+            if (ok && done < bytes) ok = store_following(vfs, list, &n, buffer + done, bytes - done);
+            fresh_end = n;
+        }
+        if (to > last) list[n++] = extent_slice(extents[i], last - from, to - last);
+    }
+    free(buffer);
+    
+    VFSExtent* merged = (VFSExtent*)xmalloc((n + 1) * sizeof(VFSExtent));
+    uint32_t merged_count = merge_extents(merged, list, n);
+    bool failed = false;
+    if (ok) {
+        bool in_place = merged_count == count && chunk_prefix(merged, count) == entry->chunk_count &&
+                        memcmp(merged + entry->chunk_count, extents + entry->chunk_count,
+                               listed_extents(entry) * sizeof(VFSExtent)) == 0 &&
+                        chunk_index_in_place(vfs, entry, extents, merged, &failed);
+        ok = in_place ? !failed : store_extents(vfs, entry, merged, merged_count);
+    }
+    
+    // An index partly written in place may point at old chunks and new
+    // ones alike, so after such a failure both are kept
+    if (ok) {
+        for (uint32_t i = 0; i < dropped_count; i++) {
+            release_blocks(vfs, dropped[i]);
+        }
+        entry->modified_time = (uint32_t)time(NULL);
+        mark_entry_dirty(vfs, entry);
+    } else if (!failed) {
+        for (uint32_t i = fresh; i < fresh_end; i++) {
+            free_extent(vfs, extent_run(list[i]));
+        }
+    }
+    free(merged);
+    free(dropped);
+    free(list);
+    free(extents);
+    return ok;
+}
+
+// Whether any compressed chunk holds part of [offset, offset + len)
+static bool range_compressed(VFS* vfs, const FileEntry* entry, uint64_t offset, size_t len) {
+    VFSExtent* extents = load_extents(vfs, entry);
+    if (!extents) return true;
+    
+    bool compressed = false;
+    uint64_t base = 0;
+    for (uint32_t i = 0; i < entry->extent_count && base < offset + len && !compressed; i++) {
+        uint64_t span = extent_span(extents[i]);
+        compressed = extent_compressed(extents[i]) && base + span > offset;
+        base += span;
+    }
+    free(extents);
+    return compressed;
+}
+
+// Write data at any offset of a file. Past the end, the whole blocks
+// skipped over become a hole; before it, the data replaces what is there
+// and whatever runs past the end is appended.
+static bool write_at_entry(VFS* vfs, FileEntry* entry, uint64_t offset, const char* data, size_t len) {
+    if (entry->type == FT_DIRECTORY) return false;
+    if (len == 0) return offset <= entry->size || extend_entry(vfs, entry, offset);
+    if (offset >= entry->size) {
+        return (offset == entry->size || extend_entry(vfs, entry, offset)) &&
+               append_entry(vfs, entry, data, len);
+    }
+    
+    size_t inside = offset + len < entry->size ? len : (size_t)(entry->size - offset);
+    bool ok;
+    if (entry_inline(entry)) {
+        memcpy(entry->inline_data + offset, data, inside);
+        entry->modified_time = (uint32_t)time(NULL);
+        mark_entry_dirty(vfs, entry);
+        ok = true;
+    } else if (range_compressed(vfs, entry, offset, inside)) {
+        ok = rewrite_chunks(vfs, entry, offset, data, inside);
+    } else {
+        ok = overwrite_blocks(vfs, entry, offset, data, inside);
+    }
+    return ok && (inside == len || append_entry(vfs, entry, data + inside, len - inside));
+}
+
+// Write data at `offset` in a file, creating it if needed. The offset may
+// lie past the end; the whole blocks that skips are left as a hole. With
+// no data, a file shorter than `offset` is extended to it that way.
+bool vfs_write_at(VFS* vfs, const char* path, uint64_t offset, const char* data, size_t len) {
+    if (!vfs || !path || !data) return false;
+    
+    begin_update(vfs);
+    FileEntry* entry = lookup_or_create(vfs, path);
+    bool ok = entry && write_at_entry(vfs, entry, offset, data, len);
+    return end_update(vfs) && ok;
+}
+
+// Give reserved blocks space in the host file now, so the image does not
+// fragment on the host disk as they are written. Only running out of
+// space counts as failure; file systems without preallocation are fine.
+static bool reserve_host(VFS* vfs, VFSExtent extent) {
+#ifdef VFS_FALLOCATE
+    uint64_t offset = block_offset(extent.start);
+    uint64_t bytes = (uint64_t)extent.length * BLOCK_SIZE;
+    int error = posix_fallocate(vfs->fd, (off_t)offset, (off_t)bytes);
+    if (error == ENOSPC) return false;
+    if (error == 0 && offset + bytes > vfs->image_size) vfs->image_size = offset + bytes;
+#else
+    (void)vfs;
+    (void)extent;
+#endif
+    return true;
+}
+
+// Make sure a file has blocks for its first `bytes` bytes. Blocks it has
+// count; the rest are taken as one run, right after its last extent when
+// that space is free and best fit otherwise, and stay reserved past the
+// end of the file until appends fill them. Small files stay inline, and
+// with compression or dedup the blocks a write needs are not known ahead.
+static bool reserve_entry(VFS* vfs, FileEntry* entry, uint64_t bytes) {
+    if (entry->type == FT_DIRECTORY) return false;
+    if (bytes <= VFS_INLINE_SIZE || vfs->compress || vfs->dedup) return true;
+    
+    VFSExtent* extents = load_extents(vfs, entry);
+    if (!extents) return false;
+    uint32_t count = entry->extent_count;
+    uint64_t allocated = 0;
+    for (uint32_t i = 0; i < count; i++) {
+        allocated += extent_span(extents[i]);
+    }
+    if (allocated >= bytes) {
+        free(extents);
+        return true;
+    }
+    
+    uint64_t wanted = (bytes - allocated + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    if (wanted > VFS_MAX_BLOCKS) {
+        free(extents);
+        return false;
+    }
+    uint32_t needed = (uint32_t)wanted;
+    extents = (VFSExtent*)xrealloc(extents, (count + needed + 1) * sizeof(VFSExtent));
+    
+    // Grow the last extent in place only if the whole run fits there
+    VFSExtent* last = count > 0 && extent_plain(extents[count - 1]) ? &extents[count - 1] : NULL;
+    uint32_t after = last ? last->start + last->length : VFS_INVALID_BLOCK;
+    ensure_free_runs(vfs);
+    uint32_t pick = last ? free_run_at(vfs, after) : RUN_NONE;
+    bool in_place = last && (after == vfs->header.num_blocks ||
+                             (pick != RUN_NONE && vfs->free_runs[pick].length >= needed));
+    
+    uint32_t old_count = count;
+    uint32_t old_last = last ? last->length : 0;
+    uint32_t got = 0;
+    if (in_place) {
+        VFSExtent extent = alloc_after(vfs, after, needed);
+        last->length += extent.length;
+        got = extent.length;
+    }
+    while (got < needed && count - old_count < VFS_WRITE_EXTENTS) {
+        VFSExtent extent = alloc_extent(vfs, needed - got);
+        if (extent.length == 0) break;
+        extents[count++] = extent;
+        got += extent.length;
+    }
+    
+    // Inline contents move to the first block
+    bool ok = got == needed;
+    if (ok && entry_inline(entry)) {
+        ok = data_write(vfs, extents[0].start, entry->inline_data, (size_t)entry->size);
+    }
+    if (ok && last && last->length > old_last) {
+        VFSExtent grown = {last->start + old_last, last->length - old_last};
+        ok = reserve_host(vfs, grown);
+    }
+    for (uint32_t i = old_count; ok && i < count; i++) {
+        ok = reserve_host(vfs, extents[i]);
+    }
+    ok = ok && store_extents(vfs, entry, extents, count);
+    
+    if (!ok) {
+        if (last && last->length > old_last) {
+            VFSExtent grown = {last->start + old_last, last->length - old_last};
+            free_extent(vfs, grown);
+        }
+        free_extent_list(vfs, extents + old_count, count - old_count);
+        free(extents);
+        return false;
+    }
+    memset(entry->inline_data, 0, sizeof(entry->inline_data));
+    mark_entry_dirty(vfs, entry);
+    free(extents);
+    return true;
+}
+
+bool vfs_reserve(VFS* vfs, const char* path, uint64_t bytes) {
+    if (!vfs || !path) return false;
+    
+    begin_update(vfs);
+    FileEntry* entry = lookup_or_create(vfs, path);
+    bool ok = entry && reserve_entry(vfs, entry, bytes);
+    return end_update(vfs) && ok;
+}
+
+// Point target at the blocks of entry instead of copying them. Only the
+// extent list is written; each block gains a reference and is copied
+// when either file later rewrites it.
+static bool share_entry(VFS* vfs, const FileEntry* entry, FileEntry* target) {
+    // Inline contents are simply copied
+    if (entry_inline(entry)) {
+        release_extents(vfs, target);
+        memcpy(target->inline_data, entry->inline_data, (size_t)entry->size);
+        target->size = entry->size;
+        target->modified_time = (uint32_t)time(NULL);
+        mark_entry_dirty(vfs, target);
+        return true;
+    }
+    
+    VFSExtent* extents = load_extents(vfs, entry);
+    if (!extents) return false;
+    
+    // Only the blocks that hold data are shared
+    uint32_t count = 0;
+    for (uint64_t covered = 0; count < entry->extent_count && covered < entry->size; count++) {
+        if (!extent_compressed(extents[count])) {
+            uint64_t blocks = (entry->size - covered + BLOCK_SIZE - 1) / BLOCK_SIZE;
+            if (extents[count].length > blocks) extents[count].length = (uint32_t)blocks;
+        }
+        covered += extent_span(extents[count]);
+    }
+    
+    // A deduplicated file can hold the same block more than once, so the
+    // counts are raised first and put back if one would overflow
+    bool ok = count == 0 || ensure_refs(vfs);
+    uint64_t raised = 0;
+    for (uint32_t i = 0; ok && i < count; i++) {
+        VFSExtent run = extent_run(extents[i]);
+        for (uint32_t b = 0; ok && b < run.length; b++) {
+            if (vfs->refs[run.start + b] == VFS_MAX_BLOCK_REFS) {
+                ok = false;
+            } else {
+                vfs->refs[run.start + b]++;
+                raised++;
+            }
+        }
+    }
+    if (!ok) {
+        for (uint32_t i = 0; raised > 0; i++) {
+            VFSExtent run = extent_run(extents[i]);
+            for (uint32_t b = 0; raised > 0 && b < run.length; b++, raised--) {
+                vfs->refs[run.start + b]--;
+            }
+        }
+        free(extents);
+        return false;
+    }
+    for (uint32_t i = 0; i < count; i++) {
+        VFSExtent run = extent_run(extents[i]);
+        if (run.length > 0) mark_dirty(vfs, &vfs->refs[run.start], run.length * sizeof(uint16_t));
+    }
+    
+    release_extents(vfs, target);
+    ok = store_extents(vfs, target, extents, count);
+    if (!ok) free_extent_list(vfs, extents, count);
+    free(extents);
+    if (!ok) return false;
+    
+    target->size = entry->size;
+    target->modified_time = (uint32_t)time(NULL);
+    mark_entry_dirty(vfs, target);
+    return true;
+}
+
+static bool delete_entry(VFS* vfs, const char* path);
+
+// A dest this creates is deleted again if the clone fails
+static bool clone_entry(VFS* vfs, const char* source, const char* dest) {
+    FileEntry* entry = lookup_path(vfs, source);
+    if (!entry || entry->type != FT_REGULAR) return false;
+    uint32_t number = entry_number(vfs, entry);
+    
+    // Creating dest may move the entry table
+    bool created = lookup_path(vfs, dest) == NULL;
+    FileEntry* target = lookup_or_create(vfs, dest);
+    if (!target || entry_number(vfs, target) == number) return false;
+    
+    bool ok = share_entry(vfs, &vfs->entries[number], target);
+    if (!ok && created) delete_entry(vfs, dest);
+    return ok;
+}
+
+bool vfs_clone_file(VFS* vfs, const char* source, const char* dest) {
+    if (!vfs || !source || !dest) return false;
+    
+    begin_update(vfs);
+    bool ok = clone_entry(vfs, source, dest);
+    return end_update(vfs) && ok;
+}
+
+static size_t read_entry(VFS* vfs, const FileEntry* entry, char* buffer, size_t max_len) {
+    size_t to_read = entry->size > max_len ? max_len : (size_t)entry->size;
+    if (entry_inline(entry)) {
+        memcpy(buffer, entry->inline_data, to_read);
+        return to_read;
+    }
+    
+    VFSExtent* extents = load_extents(vfs, entry);
+    if (!extents) return 0;
+    
+    char* dst = buffer;
+    size_t remaining = to_read;
+    
+    // One seek and one transfer per extent. A compressed chunk is expanded
+    // in place unless only part of it fits.
+    char* partial = NULL;
+    for (uint32_t i = 0; i < entry->extent_count && remaining > 0; i++) {
+        size_t span = (size_t)extent_span(extents[i]);
+        size_t want = remaining < span ? remaining : span;
+        size_t read;
+        if (extent_hole(extents[i])) {
+            memset(dst, 0, want);
+            read = want;
+        } else if (!extent_compressed(extents[i])) {
+            read = checked_read(vfs, extents[i].start, dst, want, to_read == entry->size);
+        } else if (want == VFS_CHUNK_SIZE) {
+            read = read_compressed(vfs, extents[i], dst);
+        } else {
+            if (!partial) partial = (char*)xmalloc(VFS_CHUNK_SIZE);
+            read = read_compressed(vfs, extents[i], partial) < want ? 0 : want;
+            memcpy(dst, partial, read);
+        }
+        dst += read;
+        remaining -= read;
+        if (read < want) break;
+    }
+    free(partial);
+    
+    free(extents);
+    return to_read - remaining;
+}
+
+size_t vfs_read_file(VFS* vfs, const char* path, char* buffer, size_t max_len) {
+    if (!vfs || !path || !buffer) return 0;
+    
+    lock_shared(vfs);
+    FileEntry* entry = lookup_path(vfs, path);
+    size_t len = entry ? read_entry(vfs, entry, buffer, max_len) : 0;
+    unlock_shared(vfs);
+    return len;
+}
+
+static bool host_write(int fd, const char* data, size_t len) {
+    while (len > 0) {
+#ifdef _WIN32
+        unsigned int chunk = len < 0x40000000 ? (unsigned int)len : 0x40000000;
+        int written = _write(fd, data, chunk);
+#else
+        ssize_t written = write(fd, data, len);
+        if (written < 0 && errno == EINTR) continue;
+#endif
+        if (written <= 0) return false;
+        data += written;
+        len -= (size_t)written;
+    }
+    return true;
+}
+
+// Whether a read of these blocks would check nothing, so the data does
+// not need to pass through memory
+static bool blocks_unchecked(const VFS* vfs, uint32_t start, uint32_t count) {
+    if (vfs->verify == VFS_VERIFY_OFF || !vfs->crcs) return true;
+    for (uint32_t i = 0; i < count; i++) {
+        if (vfs->crcs[start + i] != 0) return false;
+    }
+    return true;
+}
+
+// Copy len bytes of the image at offset to the host file inside the
+// kernel. Returns the bytes copied; the caller copies the rest itself.
+static size_t copy_in_kernel(VFS* vfs, uint64_t offset, int fd, size_t len) {
+#ifdef VFS_COPY_FILE_RANGE
+    loff_t from = (loff_t)offset;
+    size_t done = 0;
+    while (done < len) {
+        ssize_t copied = copy_file_range(vfs->fd, &from, fd, NULL, len - done, 0);
+        if (copied < 0 && errno == EINTR) continue;
+        if (copied <= 0) break;
+        done += (size_t)copied;
+    }
+    return done;
+#else
+    (void)vfs;
+    (void)offset;
+    (void)fd;
+    (void)len;
+    return 0;
+#endif
+}
+
+// Move len bytes on in the host file without writing them, so a host file
+// system that supports holes leaves one. The size is set if that is the
+// end of the file. Where fd cannot seek, zeros are written instead.
+static bool host_skip(int fd, uint64_t len, bool last) {
+#ifdef _WIN32
+    __int64 end = _lseeki64(fd, (__int64)len, SEEK_CUR);
+    if (end >= 0) return !last || _chsize_s(fd, end) == 0;
+#else
+    off_t end = lseek(fd, (off_t)len, SEEK_CUR);
+    if (end >= 0) return !last || ftruncate(fd, end) == 0;
+#endif
+    while (len > 0) {
+        size_t chunk = len < BLOCK_SIZE ? (size_t)len : BLOCK_SIZE;
+        if (!host_write(fd, zero_block, chunk)) return false;
+        len -= chunk;
+    }
+    return true;
+}
+
+static bool export_entry(VFS* vfs, const FileEntry* entry, int fd) {
+    if (entry_inline(entry)) return host_write(fd, entry->inline_data, (size_t)entry->size);
+    
+    VFSExtent* extents = load_extents(vfs, entry);
+    if (!extents) return false;
+    
+    // Kernel copies read the image file, so cached writes go there first
+    bool flushed = false;
+    char* buffer = (char*)xmalloc(VFS_CHUNK_SIZE);
+    uint64_t remaining = entry->size;
+    bool ok = true;
+    for (uint32_t i = 0; ok && i < entry->extent_count && remaining > 0; i++) {
+        uint64_t span = extent_span(extents[i]);
+        uint64_t want = remaining < span ? remaining : span;
+        remaining -= want;
+        
+        if (extent_hole(extents[i])) {
+            ok = host_skip(fd, want, remaining == 0);
+            continue;
+        }
+        if (extent_compressed(extents[i])) {
+            size_t len = read_compressed(vfs, extents[i], buffer);
+            ok = len >= want && host_write(fd, buffer, (size_t)want);
+            continue;
+        }
+        
+        uint32_t block = extents[i].start;
+        if (blocks_unchecked(vfs, block, extents[i].length)) {
+            if (!flushed) {
+                cache_enter(vfs);
+                cache_flush(vfs);
+                cache_leave(vfs);
+                flushed = true;
+            }
+            size_t copied = copy_in_kernel(vfs, block_offset(block), fd, (size_t)want);
+            if (copied == want) continue;
+            block += (uint32_t)(copied / BLOCK_SIZE);
+            want -= copied - copied % BLOCK_SIZE;
+            
+            // Part of a block went out already; skip it in the read below
+            size_t skip = copied % BLOCK_SIZE;
+            if (skip > 0) {
+                size_t len = want < BLOCK_SIZE ? (size_t)want : BLOCK_SIZE;
+                ok = checked_read(vfs, block, buffer, len, true) == len &&
+                     host_write(fd, buffer + skip, len - skip);
+                block++;
+                want -= len;
+            }
+        }
+        while (ok && want > 0) {
+            size_t len = want < VFS_CHUNK_SIZE ? (size_t)want : VFS_CHUNK_SIZE;
+            ok = checked_read(vfs, block, buffer, len, remaining == 0 && len == want) == len &&
+                 host_write(fd, buffer, len);
+            block += VFS_CHUNK_SIZE / BLOCK_SIZE;
+            want -= len;
+        }
+    }
+    free(buffer);
+    free(extents);
+    return ok;
+}
+
+// Write a file's contents to the host file open for writing on fd. Plain
+// extents with no checksums to check are copied by the kernel
+// (copy_file_range, Linux only) without passing through memory; the rest
+// is read through the cache and checked on the way.
+bool vfs_export_file(VFS* vfs, const char* path, int fd) {
+    if (!vfs || !path || fd < 0) return false;
+    
+    lock_shared(vfs);
+    FileEntry* entry = lookup_path(vfs, path);
+    bool ok = entry && entry->type != FT_DIRECTORY && export_entry(vfs, entry, fd);
+    unlock_shared(vfs);
+    return ok;
+}
+
+static VFSFile* open_file(VFS* vfs, const char* path) {
+    FileEntry* entry = lookup_path(vfs, path);
+    if (!entry || entry->type == FT_DIRECTORY) return NULL;
+    
+    VFSExtent* extents = load_extents(vfs, entry);
+    if (!extents) return NULL;
+    
+    VFSFile* file = (VFSFile*)xmalloc(sizeof(VFSFile));
+    memset(file, 0, sizeof(VFSFile));
+    file->entry = entry_number(vfs, entry);
+    file->size = entry->size;
+    file->extents = extents;
+    file->extent_count = entry->extent_count;
+    file->readahead = 1;
+    
+    // Inline contents are the whole window from the start
+    if (entry_inline(entry)) {
+        file->buffer = (char*)xmalloc((size_t)VFS_READAHEAD_BLOCKS * BLOCK_SIZE);
+        memcpy(file->buffer, entry->inline_data, (size_t)entry->size);
+        file->buffer_len = (size_t)entry->size;
+    }
+    return file;
+}
+
+// Open a file for streaming reads. The handle works from the extents the
+// file had when it was opened, and no block is reused while it is open,
+// so it keeps reading that version even if the file is rewritten.
+VFSFile* vfs_open(VFS* vfs, const char* path) {
+    if (!vfs || !path) return NULL;
+    
+    lock_shared(vfs);
+    VFSFile* file = open_file(vfs, path);
+    if (file) {
+        cache_enter(vfs);
+        vfs->open_readers++;
+        cache_leave(vfs);
+    }
+    unlock_shared(vfs);
+    return file;
+}
+
+// Move the extent cursor to the extent holding pos; false past the data
+static bool locate_extent(VFSFile* file) {
+    if (file->pos < file->extent_base) {
+        file->extent_index = 0;
+        file->extent_base = 0;
+    }
+    while (file->extent_index < file->extent_count) {
+        uint64_t span = extent_span(file->extents[file->extent_index]);
+        if (file->pos < file->extent_base + span) return true;
+        file->extent_base += span;
+        file->extent_index++;
+    }
+    return false;
+}
+
+// Fill the readahead window from the block holding pos, without leaving
+// the current extent. Sequential refills double the window.
+static bool refill_window(VFS* vfs, VFSFile* file, uint64_t extent_end) {
+    if (!file->buffer) {
+        file->buffer = (char*)xmalloc((size_t)VFS_READAHEAD_BLOCKS * BLOCK_SIZE);
+    }
+    if (file->buffer_len > 0 && file->pos == file->buffer_start + file->buffer_len) {
+        if (file->readahead < VFS_READAHEAD_BLOCKS) file->readahead *= 2;
+    } else {
+        file->readahead = 1;
+    }
+    
+    // A compressed chunk is always expanded whole
+    VFSExtent extent = file->extents[file->extent_index];
+    if (extent_compressed(extent)) {
+        size_t len = read_compressed(vfs, extent, file->buffer);
+        if (len > extent_end - file->extent_base) len = (size_t)(extent_end - file->extent_base);
+        file->buffer_start = file->extent_base;
+        file->buffer_len = len;
+        return file->pos < file->buffer_start + file->buffer_len;
+    }
+    
+    uint64_t block = (file->pos - file->extent_base) / BLOCK_SIZE;
+    uint64_t start = file->extent_base + block * BLOCK_SIZE;
+    uint64_t end = start + (uint64_t)file->readahead * BLOCK_SIZE;
+    if (end > extent_end) end = extent_end;
+    
+    file->buffer_start = start;
+    if (extent_hole(extent)) {
+        memset(file->buffer, 0, (size_t)(end - start));
+        file->buffer_len = (size_t)(end - start);
+    } else {
+        uint32_t first = extent.start + (uint32_t)block;
+        file->buffer_len = checked_read(vfs, first, file->buffer, (size_t)(end - start), true);
+    }
+    return file->pos < file->buffer_start + file->buffer_len;
+}
+
+// Mapped data bypasses the cache, so it is checked here a window at a
+// time, from the block holding pos, and *avail is cut to what has been
+// checked
+static bool map_verified(VFS* vfs, VFSFile* file, uint64_t extent_end, size_t* avail) {
+    if (vfs->verify == VFS_VERIFY_OFF || !vfs->crcs) return true;
+    
+    if (file->pos < file->verified_start || file->pos >= file->verified_end) {
+        const VFSExtent* extent = &file->extents[file->extent_index];
+        uint64_t block = (file->pos - file->extent_base) / BLOCK_SIZE;
+        uint64_t start = file->extent_base + block * BLOCK_SIZE;
+        uint64_t end = start + VFS_CHUNK_SIZE < extent_end ? start + VFS_CHUNK_SIZE : extent_end;
+        const char* data = vfs->map_base + block_offset(extent->start + (uint32_t)block);
+        if (!verify_blocks(vfs, extent->start + (uint32_t)block, data, (size_t)(end - start), true)) {
+            return false;
+        }
+        file->verified_start = start;
+        file->verified_end = end;
+    }
+    if (*avail > file->verified_end - file->pos) *avail = (size_t)(file->verified_end - file->pos);
+    return true;
+}
+
+// Data at the cursor, without consuming it. A mapped image hands out the
+// rest of the current extent in place; otherwise it comes from the
+// readahead window.
+static bool file_window(VFS* vfs, VFSFile* file, const char** data, size_t* len) {
+    if (file->writing || file->pos >= file->size) return false;
+    
+    if (file->pos < file->buffer_start || file->pos >= file->buffer_start + file->buffer_len) {
+        if (!locate_extent(file)) return false;
+        
+        const VFSExtent* extent = &file->extents[file->extent_index];
+        uint64_t extent_end = file->extent_base + extent_span(*extent);
+        if (extent_end > file->size) extent_end = file->size;
+        
+        if (extent_plain(*extent) && vfs->use_mmap && ensure_mapping(vfs)) {
+            uint64_t offset = block_offset(extent->start) + (file->pos - file->extent_base);
+            size_t avail = (size_t)(extent_end - file->pos);
+            if (offset + avail <= vfs->map_size && map_verified(vfs, file, extent_end, &avail)) {
+                *data = vfs->map_base + offset;
+                *len = avail;
+                return true;
+            }
+        }
+        if (!refill_window(vfs, file, extent_end)) return false;
+    }
+    
+    size_t skip = (size_t)(file->pos - file->buffer_start);
+    *data = file->buffer + skip;
+    *len = file->buffer_len - skip;
+    return true;
+}
+
+// Borrow the next piece of the file and move the cursor past it. The data
+// stays valid until the next call on this handle or the next write to the
+// VFS.
+bool vfs_read_chunk(VFS* vfs, VFSFile* file, const char** data, size_t* len) {
+    if (!vfs || !file || !data || !len) return false;
+    
+    lock_shared(vfs);
+    bool ok = file_window(vfs, file, data, len);
+    unlock_shared(vfs);
+    if (ok) file->pos += *len;
+    return ok;
+}
+
+size_t vfs_read(VFS* vfs, VFSFile* file, char* data, size_t len) {
+    if (!vfs || !file || !data) return 0;
+    
+    lock_shared(vfs);
+    size_t done = 0;
+    while (done < len) {
+        const char* chunk;
+        size_t avail;
+        if (!file_window(vfs, file, &chunk, &avail)) break;
+        
+        size_t take = len - done < avail ? len - done : avail;
+        memcpy(data + done, chunk, take);
+        file->pos += take;
+        done += take;
+    }
+    unlock_shared(vfs);
+    return done;
+}
+
+// The first offset at or after `offset` that holds data, or that lies in
+// a hole, going by the handle's extents; the size if there is none
+static uint64_t next_region(const VFSFile* file, uint64_t offset, bool data) {
+    if (file->extent_count == 0) return data ? offset : file->size;
+    
+    uint64_t base;
+    uint32_t i = find_extent(file->extents, file->extent_count, offset, &base);
+    for (; i < file->extent_count && base < file->size; i++) {
+        if (extent_hole(file->extents[i]) != data) return base > offset ? base : offset;
+        base += extent_span(file->extents[i]);
+    }
+    return file->size;
+}
+
+// Move the cursor. A writer handle first appends what it has gathered,
+// and its next write goes where the cursor is, even past the end.
+// VFS_SEEK_DATA and VFS_SEEK_HOLE take an offset from the start and work
+// on read handles; past the last data, VFS_SEEK_DATA fails.
+static bool seek_file(VFS* vfs, VFSFile* file, int64_t offset, int whence) {
+    if (whence == VFS_SEEK_DATA || whence == VFS_SEEK_HOLE) {
+        if (file->writing || offset < 0 || (uint64_t)offset >= file->size) return false;
+        uint64_t next = next_region(file, (uint64_t)offset, whence == VFS_SEEK_DATA);
+        if (next >= file->size && whence == VFS_SEEK_DATA) return false;
+        file->pos = next;
+        return true;
+    }
+    if (file->writing && !vfs_flush(vfs, file)) return false;
+    
+    int64_t base;
+    switch (whence) {
+        case SEEK_SET: base = 0; break;
+        case SEEK_CUR: base = (int64_t)file->pos; break;
+        case SEEK_END: base = (int64_t)file->size; break;
+        default: return false;
+    }
+    if (offset < -base) return false;
+    
+    file->pos = (uint64_t)(base + offset);
+    return true;
+}
+
+bool vfs_seek(VFS* vfs, VFSFile* file, int64_t offset, int whence) {
+    if (!vfs || !file) return false;
+    
+    uint64_t started = op_start(vfs);
+    uint64_t from = file->pos;
+    bool ok = seek_file(vfs, file, offset, whence);
+    count_op(vfs, VFS_OP_SEEK, file->pos > from ? file->pos - from : from - file->pos, started);
+    return ok;
+}
+
+uint64_t vfs_tell(const VFSFile* file) {
+    return file ? file->pos : 0;
+}
+
+// Open a file for streaming writes at its end, creating it if needed.
+// Without append the file is emptied first. Writes are gathered in the
+// handle and appended a window at a time; after a seek they go straight
+// to the cursor, and one past the end leaves a hole.
+VFSFile* vfs_open_writer(VFS* vfs, const char* path, bool append) {
+    if (!vfs || !path) return NULL;
+    
+    begin_update(vfs);
+    FileEntry* entry = lookup_or_create(vfs, path);
+    if (entry && !append && (entry->size > 0 || entry->extent_count > 0)) {
+        release_extents(vfs, entry);
+        entry->size = 0;
+        entry->modified_time = (uint32_t)time(NULL);
+        mark_entry_dirty(vfs, entry);
+    }
+    uint32_t number = entry ? entry_number(vfs, entry) : 0;
+    uint64_t size = entry ? entry->size : 0;
+    bool ok = end_update(vfs) && entry;
+    if (!ok) return NULL;
+    
+    VFSFile* file = (VFSFile*)xmalloc(sizeof(VFSFile));
+    memset(file, 0, sizeof(VFSFile));
+    file->entry = number;
+    file->size = size;
+    file->pos = size;
+    file->writing = true;
+    file->buffer = (char*)xmalloc((size_t)VFS_READAHEAD_BLOCKS * BLOCK_SIZE);
+    return file;
+}
+
+// Append whatever the handle has gathered so far
+bool vfs_flush(VFS* vfs, VFSFile* file) {
+    if (!vfs || !file || !file->writing) return false;
+    if (file->buffer_len == 0) return true;
+    
+    begin_update(vfs);
+    FileEntry* entry = &vfs->entries[file->entry];
+    bool ok = entry_in_use(entry) && append_entry(vfs, entry, file->buffer, file->buffer_len);
+    ok = end_update(vfs) && ok;
+    if (ok) file->size += file->buffer_len;
+    file->buffer_len = 0;
+    return ok;
+}
+
+bool vfs_write(VFS* vfs, VFSFile* file, const char* data, size_t len) {
+    if (!vfs || !file || !file->writing || !data) return false;
+    
+    if (file->pos != file->size + file->buffer_len) {
+        if (!vfs_flush(vfs, file)) return false;
+        
+        begin_update(vfs);
+        FileEntry* entry = &vfs->entries[file->entry];
+        bool ok = entry_in_use(entry) && write_at_entry(vfs, entry, file->pos, data, len);
+        uint64_t size = entry->size;
+        ok = end_update(vfs) && ok;
+        if (ok) {
+            file->size = size;
+            file->pos += len;
+        }
+        return ok;
+    }
+    
+    size_t capacity = (size_t)VFS_READAHEAD_BLOCKS * BLOCK_SIZE;
+    if (file->buffer_len + len > capacity) {
+        if (!vfs_flush(vfs, file)) return false;
+        
+        // Large writes skip the buffer
+        if (len >= capacity) {
+            begin_update(vfs);
+            FileEntry* entry = &vfs->entries[file->entry];
+            bool ok = entry_in_use(entry) && append_entry(vfs, entry, data, len);
+            ok = end_update(vfs) && ok;
+            if (ok) {
+                file->size += len;
+                file->pos += len;
+            }
+            return ok;
+        }
+    }
+    
+    memcpy(file->buffer + file->buffer_len, data, len);
+    file->buffer_len += len;
+    file->pos += len;
+    return true;
+}
+
+void vfs_close_file(VFS* vfs, VFSFile* file) {
+    if (!file) return;
+    
+    if (file->writing) {
+        vfs_flush(vfs, file);
+    } else if (vfs) {
+        lock_shared(vfs);
+        cache_enter(vfs);
+        vfs->open_readers--;
+        cache_leave(vfs);
+        unlock_shared(vfs);
+    }
+    free(file->extents);
+    free(file->buffer);
+    free(file);
+}
+
+// Free an entry's blocks and its slot
+static void remove_entry(VFS* vfs, FileEntry* entry) {
+    release_extents(vfs, entry);
+    index_remove(vfs, entry_number(vfs, entry));
+    release_file_entry(vfs, entry);
+    forget_paths(vfs);
+}
+
+static bool delete_entry(VFS* vfs, const char* path) {
+    if (!path) return false;
+    
+    FileEntry* entry = lookup_path(vfs, path);
+    if (!entry) return false;
+    
+    // The root and directories that still hold files stay
+    uint32_t number = entry_number(vfs, entry);
+    if (number == vfs->header.root_dir ||
+        (entry->type == FT_DIRECTORY && !directory_is_empty(vfs, number))) {
+        return false;
+    }
+    
+    remove_entry(vfs, entry);
+    return true;
+}
+
+bool vfs_delete_file(VFS* vfs, const char* path) {
+    if (!vfs) return false;
+    
+    begin_update(vfs);
+    bool ok = delete_entry(vfs, path);
+    return end_update(vfs) && ok;
+}
+
+// Give an entry a new name and parent. Only the entry changes; its blocks
+// stay where they are. An existing file at the new path is replaced, as
+// is an empty directory when a directory is moved onto it.
+static bool rename_entry(VFS* vfs, const char* old_path, const char* new_path) {
+    FileEntry* entry = lookup_path(vfs, old_path);
+    if (!entry) return false;
+    uint32_t number = entry_number(vfs, entry);
+    if (number == vfs->header.root_dir) return false;
+    
+    uint32_t parent;
+    char name[MAX_FILENAME];
+    if (!walk_path(vfs, new_path, &parent, name) || name[0] == '\0') return false;
+    
+    // A directory cannot move below itself
+    for (uint32_t dir = parent; dir != vfs->header.root_dir; dir = vfs->entries[dir].parent_dir) {
+        if (dir == number) return false;
+    }
+    
+    FileEntry* target = index_lookup(vfs, parent, name);
+    if (target == entry) return true;
+    if (target && ((entry->type == FT_DIRECTORY) != (target->type == FT_DIRECTORY) ||
+                   (target->type == FT_DIRECTORY &&
+                    !directory_is_empty(vfs, entry_number(vfs, target))))) {
+        return false;
+    }
+    
+    // The new key goes in first, so a tree that cannot grow leaves
+    // everything as it was
+    VFSTreeKey old_key, new_key;
+    make_key(&old_key, entry->parent_dir, entry->name, number);
+    make_key(&new_key, parent, name, number);
+    bool rekey = key_order(&old_key, &new_key) != 0;
+    if (rekey && !tree_insert(vfs, &new_key)) return false;
+    if (target) remove_entry(vfs, target);
+    if (rekey) tree_remove(vfs, &old_key);
+    
+    strcpy(entry->name, name);
+    entry->parent_dir = parent;
+    mark_entry_dirty(vfs, entry);
+    forget_paths(vfs);
+    return true;
+}
+
+bool vfs_rename(VFS* vfs, const char* old_path, const char* new_path) {
+    if (!vfs || !old_path || !new_path) return false;
+    
+    begin_update(vfs);
+    bool ok = rename_entry(vfs, old_path, new_path);
+    return end_update(vfs) && ok;
+}
+
+VFSDir* vfs_open_dir(VFS* vfs, const char* path) {
+    if (!vfs || !path) return NULL;
+    
+    lock_shared(vfs);
+    FileEntry* entry = lookup_path(vfs, path);
+    if (!entry || entry->type != FT_DIRECTORY) {
+        unlock_shared(vfs);
+        return NULL;
+    }
+    
+    uint32_t number = entry_number(vfs, entry);
+    VFSDir* dir = (VFSDir*)xmalloc(sizeof(VFSDir));
+    dir->entry = number;
+    dir->next = 0;
+    dir->children = index_children(vfs, number, &dir->count);
+    unlock_shared(vfs);
+    return dir;
+}
+
+// Copy out the next child. Returns false once every child has been seen.
+bool vfs_read_dir(VFS* vfs, VFSDir* dir, FileEntry* entry) {
+    if (!vfs || !dir || !entry) return false;
+    
+    lock_shared(vfs);
+    bool found = false;
+    while (!found && dir->next < dir->count) {
+        uint32_t number = dir->children[dir->next++];
+        const FileEntry* child = &vfs->entries[number];
+        if (number < vfs->header.entry_count && entry_in_use(child) &&
+            child->parent_dir == dir->entry) {
+            *entry = *child;
+            found = true;
+        }
+    }
+    unlock_shared(vfs);
+    return found;
+}
+
+void vfs_close_dir(VFSDir* dir) {
+    if (!dir) return;
+    free(dir->children);
+    free(dir);
+}
+
+static bool change_directory(VFS* vfs, const char* path) {
+    char resolved[MAX_PATH];
+    if (!resolve_path(vfs, path, resolved)) return false;
+    
+    // Root directory always exists
+    if (strcmp(resolved, "/") == 0) {
+        strcpy(vfs->current_dir, "/");
+        forget_paths(vfs);
+        return true;
+    }
+    
+    // Check if directory exists in VFS
+    FileEntry* entry = lookup_path(vfs, resolved);
+    if (!entry) {
+        return false; // Directory doesn't exist
+    }
+    
+    // Verify it's actually a directory
+    if (entry->type != FT_DIRECTORY) {
+        return false; // Not a directory
+    }
+    
+    // Directory exists and is valid, update current_dir
+    strncpy(vfs->current_dir, resolved, MAX_PATH - 1);
+    vfs->current_dir[MAX_PATH - 1] = '\0';
+    forget_paths(vfs);
+    return true;
+}
+
+bool vfs_change_directory(VFS* vfs, const char* path) {
+    if (!vfs || !path) return false;
+    
+    lock_exclusive(vfs);
+    bool ok = change_directory(vfs, path);
+    unlock_exclusive(vfs);
+    return ok;
+}
+
+char* vfs_get_current_dir(VFS* vfs) {
+    return vfs ? vfs->current_dir : NULL;
+}
+
+
+// Consistency check. Every block a file keeps data in is read back from
+// the image and compared with its checksum. The reads are spread over
+// worker threads that read the image directly with positional I/O, so
+// they never touch the cache.
+#define VFS_MAX_CHECK_THREADS 64
+
+typedef struct {
+    uint32_t block;
+    uint32_t len;            // Bytes of the block in use
+    uint32_t entry;          // File the block belongs to
+    bool failed;
+} CheckItem;
+
+typedef struct {
+    CheckItem* items;
+    size_t count;
+    size_t capacity;
+} CheckList;
+
+typedef struct {
+    VFS* vfs;
+    CheckItem* items;
+    size_t count;
+    uint64_t scrubbed;
+    uint64_t unverified;
+    uint64_t errors;
+} CheckWorker;
+
+static void add_check_item(CheckList* list, uint32_t block, size_t len, uint32_t entry) {
+    if (list->count == list->capacity) {
+        list->capacity = list->capacity ? list->capacity * 2 : 1024;
+        list->items = (CheckItem*)xrealloc(list->items, list->capacity * sizeof(CheckItem));
+    }
+    CheckItem* item = &list->items[list->count++];
+    item->block = block;
+    item->len = (uint32_t)len;
+    item->entry = entry;
+    item->failed = false;
+}
+
+static int compare_check_items(const void* a, const void* b) {
+    uint32_t x = ((const CheckItem*)a)->block;
+    uint32_t y = ((const CheckItem*)b)->block;
+    return (x > y) - (x < y);
+}
+
+// Workers share the image descriptor; the caller holds the metadata lock
+// so the checksums cannot change underneath them
+static void scrub_items(CheckWorker* worker) {
+    char data[BLOCK_SIZE];
+    for (size_t i = 0; i < worker->count; i++) {
+        CheckItem* item = &worker->items[i];
+        uint32_t crc = worker->vfs->crcs ? worker->vfs->crcs[item->block] : 0;
+        if (crc == 0) {
+            worker->unverified++;
+            continue;
+        }
+        
+        // The image may end inside the last block written
+        size_t got = image_read(worker->vfs, block_offset(item->block), data, item->len);
+        memset(data + got, 0, item->len - got);
+        worker->scrubbed++;
+        if (block_checksum(data, item->len) != crc) {
+            item->failed = true;
+            worker->errors++;
+        }
+    }
+}
+
+#ifdef _WIN32
+static DWORD WINAPI scrub_thread(LPVOID arg) {
+    scrub_items((CheckWorker*)arg);
+    return 0;
+}
+#else
+static void* scrub_thread(void* arg) {
+    scrub_items((CheckWorker*)arg);
+    return NULL;
+}
+#endif
+
+// Split the items into one contiguous share per thread. The calling
+// thread takes the first share; a thread that cannot be started has its
+// share done here as well.
+static void scrub_all(VFS* vfs, CheckList* list, int threads, VFSCheckResult* result) {
+    if (threads < 1) threads = 1;
+    if (threads > VFS_MAX_CHECK_THREADS) threads = VFS_MAX_CHECK_THREADS;
+    if ((size_t)threads > list->count) threads = list->count > 0 ? (int)list->count : 1;
+    
+    CheckWorker workers[VFS_MAX_CHECK_THREADS];
+#ifdef _WIN32
+    HANDLE handles[VFS_MAX_CHECK_THREADS];
+#else
+    pthread_t handles[VFS_MAX_CHECK_THREADS];
+#endif
+    bool started[VFS_MAX_CHECK_THREADS];
+    
+    size_t share = list->count / (size_t)threads;
+    size_t extra = list->count % (size_t)threads;
+    size_t next = 0;
+    for (int t = 0; t < threads; t++) {
+        memset(&workers[t], 0, sizeof(CheckWorker));
+        workers[t].vfs = vfs;
+        workers[t].items = list->items + next;
+        workers[t].count = share + ((size_t)t < extra ? 1 : 0);
+        next += workers[t].count;
+        
+        started[t] = false;
+        if (t == 0) continue;
+#ifdef _WIN32
+        handles[t] = CreateThread(NULL, 0, scrub_thread, &workers[t], 0, NULL);
+        started[t] = handles[t] != NULL;
+#else
+        started[t] = pthread_create(&handles[t], NULL, scrub_thread, &workers[t]) == 0;
+#endif
+    }
+    
+    for (int t = 0; t < threads; t++) {
+        if (!started[t]) {
+            scrub_items(&workers[t]);
+        } else {
+#ifdef _WIN32
+            WaitForSingleObject(handles[t], INFINITE);
+            CloseHandle(handles[t]);
+#else
+            pthread_join(handles[t], NULL);
+#endif
+        }
+        result->blocks_scrubbed += workers[t].scrubbed;
+        result->blocks_unverified += workers[t].unverified;
+        result->checksum_errors += workers[t].errors;
+    }
+}
+
+// Path of an entry for the report, built backwards from its name.
+// Returns false when the parent chain does not lead to the root; the
+// path is then just the name under "?".
+static bool entry_path(VFS* vfs, uint32_t number, char* path) {
+    char buffer[MAX_PATH];
+    size_t start = MAX_PATH - 1;
+    buffer[start] = '\0';
+    bool truncated = false;
+    const char* own = vfs->entries[number].name;
+    
+    // A chain longer than the table has to loop
+    for (uint32_t steps = 0; number != vfs->header.root_dir; steps++) {
+        if (number >= vfs->header.entry_count || steps == vfs->header.entry_count) {
+            snprintf(path, MAX_PATH, "?/%.*s", MAX_FILENAME - 1, own);
+            return false;
+        }
+        const char* name = vfs->entries[number].name;
+        size_t len = strnlen(name, MAX_FILENAME - 1);
+        if (truncated || len + 1 > start) {
+            truncated = true;
+        } else {
+            start -= len;
+            memcpy(buffer + start, name, len);
+            buffer[--start] = '/';
+        }
+        number = vfs->entries[number].parent_dir;
+    }
+    strcpy(path, start == MAX_PATH - 1 ? "/" : buffer + start);
+    return true;
+}
+
+static void report(FILE* log, VFSCheckResult* result, const char* format, ...) {
+    result->problems++;
+    if (!log) return;
+    
+    va_list args;
+    va_start(args, format);
+    vfprintf(log, format, args);
+    va_end(args);
+    fputc('\n', log);
+}
+
+static void own_blocks(uint32_t* owners, VFSExtent run) {
+    for (uint32_t b = 0; b < run.length; b++) {
+        owners[run.start + b]++;
+    }
+}
+
+// The blocks holding `count` extents of an entry's chunk index or extent
+// list are checked like data. Returns false if they are out of range.
+static bool check_list_run(VFS* vfs, VFSExtent run, uint32_t count, uint32_t number, const char* path,
+                           const char* what, CheckList* list, uint32_t* owners, FILE* log,
+                           VFSCheckResult* result) {
+    if (run.length == 0) return true;
+    if (!run_in_image(vfs, run)) {
+        report(log, result, "%s: %s blocks %u-%u are out of range", path, what, run.start,
+               run.start + run.length - 1);
+        return false;
+    }
+    uint64_t stored = (uint64_t)count * sizeof(VFSExtent);
+    for (uint32_t b = 0; b < run.length; b++) {
+        uint64_t left = stored - (uint64_t)b * BLOCK_SIZE;
+        add_check_item(list, run.start + b, left < BLOCK_SIZE ? (size_t)left : BLOCK_SIZE, number);
+    }
+    if (owners) own_blocks(owners, run);
+    return true;
+}
+
+// Check one entry's place in the tree and its extents, and queue the
+// blocks it keeps data in. owners is NULL when only scrubbing.
+static void check_entry(VFS* vfs, uint32_t number, CheckList* list, uint32_t* owners,
+                        FILE* log, VFSCheckResult* result) {
+    const FileEntry* entry = &vfs->entries[number];
+    char path[MAX_PATH];
+    bool reachable = entry_path(vfs, number, path);
+    
+    if (owners) {
+        if (entry->type != FT_REGULAR && entry->type != FT_DIRECTORY && entry->type != FT_SCRIPT) {
+            report(log, result, "%s: unknown type %d", path, (int)entry->type);
+        }
+        if (number != vfs->header.root_dir) {
+            uint32_t parent = entry->parent_dir;
+            if (parent >= vfs->header.entry_count || !entry_in_use(&vfs->entries[parent]) ||
+                vfs->entries[parent].type != FT_DIRECTORY) {
+                report(log, result, "%s: parent entry %u is not a directory", path, parent);
+            } else if (!reachable) {
+                report(log, result, "%s: not reachable from the root", path);
+            }
+        }
+        if (entry_inline(entry) && (entry->type == FT_DIRECTORY || entry->size > VFS_INLINE_SIZE)) {
+            report(log, result, "%s: %llu bytes cannot be stored inline", path,
+                   (unsigned long long)entry->size);
+        }
+    }
+    if (entry->extent_count == 0) return;
+    
+    if (entry->chunk_count > entry->extent_count) {
+        report(log, result, "%s: chunk index of %u is longer than its %u extents", path,
+               entry->chunk_count, entry->extent_count);
+        return;
+    }
+    uint32_t listed = listed_extents(entry);
+    uint32_t direct = listed < VFS_DIRECT_EXTENTS ? listed : VFS_DIRECT_EXTENTS;
+    if (!check_list_run(vfs, chunk_run(entry), entry->chunk_count, number, path, "chunk index",
+                        list, owners, log, result) ||
+        !check_list_run(vfs, overflow_run(entry), listed - direct, number, path, "extent list",
+                        list, owners, log, result)) {
+        return;
+    }
+    VFSExtent* extents = load_extents(vfs, entry);
+    if (!extents) {
+        report(log, result, "%s: cannot read its extent list", path);
+        return;
+    }
+    
+    uint64_t base = 0;
+    for (uint32_t i = 0; i < entry->extent_count; i++) {
+        if (owners && i < entry->chunk_count && extent_span(extents[i]) != VFS_CHUNK_SIZE) {
+            report(log, result, "%s: chunk index entry %u does not cover one chunk", path, i);
+        }
+        VFSExtent run = extent_run(extents[i]);
+        if (extent_hole(extents[i]) && extents[i].length > 0 && entry->type != FT_DIRECTORY) {
+            base += extent_span(extents[i]);
+            continue;
+        }
+        if (run.length == 0 || run.start >= vfs->header.num_blocks ||
+            run.length > vfs->header.num_blocks - run.start) {
+            report(log, result, "%s: extent %u+%u is out of range", path, run.start, run.length);
+            base += extent_span(extents[i]);
+            continue;
+        }
+        if (owners) own_blocks(owners, run);
+        
+        // Directory blocks hold no file data
+        if (entry->type != FT_DIRECTORY) {
+            uint64_t stored = extent_compressed(extents[i]) ?
+                              (extents[i].length & ~VFS_EXTENT_COMPRESSED) :
+                              (entry->size > base ? entry->size - base : 0);
+            for (uint32_t b = 0; b < run.length && stored > (uint64_t)b * BLOCK_SIZE; b++) {
+                uint64_t left = stored - (uint64_t)b * BLOCK_SIZE;
+                add_check_item(list, run.start + b, left < BLOCK_SIZE ? (size_t)left : BLOCK_SIZE, number);
+            }
+        }
+        base += extent_span(extents[i]);
+    }
+    free(extents);
+    
+    if (owners && entry->type != FT_DIRECTORY && base < entry->size) {
+        report(log, result, "%s: size %llu is past the %llu bytes its extents hold", path,
+               (unsigned long long)entry->size, (unsigned long long)base);
+    }
+}
+
+// Every block is owned by its metadata region, or by as many files as its
+// reference count says, exactly when the bitmap marks it used
+static void check_blocks(VFS* vfs, const uint32_t* owners, FILE* log, VFSCheckResult* result) {
+    uint32_t used = 0;
+    for (uint32_t block = 0; block < vfs->header.num_blocks; block++) {
+        bool marked = (vfs->bitmap[block / 64] >> (block % 64)) & 1;
+        uint32_t expected = vfs->refs ? vfs->refs[block] + 1u : 1u;
+        if (owners[block] > 0) used++;
+        
+        if (owners[block] == 0 && marked) {
+            report(log, result, "block %u is marked used but nothing owns it", block);
+        } else if (owners[block] > 0 && !marked) {
+            report(log, result, "block %u is in use but marked free", block);
+        } else if (owners[block] > 0 && owners[block] != expected) {
+            report(log, result, "block %u has %u owners but a reference count of %u",
+                   block, owners[block], expected - 1);
+        }
+    }
+    if (vfs->header.num_blocks - used != vfs->header.free_blocks) {
+        report(log, result, "%u blocks are free but the superblock counts %u",
+               vfs->header.num_blocks - used, vfs->header.free_blocks);
+    }
+}
+
+// The directory index holds one key for every entry but the root, each
+// matching its entry, in order. Leaves are walked along their links from
+// the leftmost, bounded by the node count so a loop cannot hang the check.
+static void check_index(VFS* vfs, uint32_t entries, FILE* log, VFSCheckResult* result) {
+    uint32_t nodes = vfs->header.tree_nodes;
+    uint32_t number = vfs->header.tree_root;
+    for (uint32_t depth = 0; number < nodes && !tree_node(vfs, number)->leaf; depth++) {
+        if (depth == TREE_MAX_HEIGHT) number = nodes;
+        else number = tree_node(vfs, number)->children[0];
+    }
+    
+    uint32_t keys = 0;
+    const VFSTreeKey* last = NULL;
+    for (uint32_t steps = 0; number != VFS_TREE_NONE; steps++) {
+        if (number >= nodes || steps == nodes) {
+            report(log, result, "directory index: leaf chain is broken at node %u", number);
+            return;
+        }
+        const VFSTreeNode* node = tree_node(vfs, number);
+        for (uint32_t i = 0; i < node->count && i < VFS_TREE_KEYS; i++) {
+            const VFSTreeKey* key = &node->keys[i];
+            if (key->entry >= vfs->header.entry_count || !entry_in_use(&vfs->entries[key->entry])) {
+                report(log, result, "directory index: key for unused entry %u", key->entry);
+            } else {
+                const FileEntry* entry = &vfs->entries[key->entry];
+                VFSTreeKey expected;
+                make_key(&expected, entry->parent_dir, entry->name, key->entry);
+                if (key_order(key, &expected) != 0) {
+                    report(log, result, "directory index: key for entry %u does not match it", key->entry);
+                }
+            }
+            if (last && key_order(last, key) >= 0) {
+                report(log, result, "directory index: keys out of order at node %u", number);
+            }
+            last = key;
+            keys++;
+        }
+        number = node->next;
+    }
+    if (keys + 1 != entries) {
+        report(log, result, "directory index: %u keys for %u entries", keys, entries - 1);
+    }
+}
+
+bool vfs_check(VFS* vfs, int threads, bool metadata, FILE* log, VFSCheckResult* result) {
+    if (!vfs || !result) return false;
+    memset(result, 0, sizeof(VFSCheckResult));
+    
+    // Workers read the image file, so it has to be up to date
+    lock_shared(vfs);
+    cache_enter(vfs);
+    cache_flush(vfs);
+    cache_leave(vfs);
+    
+    uint32_t* owners = NULL;
+    if (metadata) {
+        owners = (uint32_t*)xmalloc((size_t)vfs->header.num_blocks * sizeof(uint32_t));
+        memset(owners, 0, (size_t)vfs->header.num_blocks * sizeof(uint32_t));
+        for (int region = VFS_META_BITMAP; region < VFS_META_REGIONS; region++) {
+            VFSExtent extent = *region_extent(vfs, region);
+            if (extent.length > 0 && extent.start < vfs->header.num_blocks &&
+                extent.length <= vfs->header.num_blocks - extent.start) {
+                own_blocks(owners, extent);
+            } else if (extent.length > 0) {
+                report(log, result, "metadata region %d at %u+%u is out of range",
+                       region, extent.start, extent.length);
+            }
+        }
+    }
+    
+    CheckList list = {NULL, 0, 0};
+    for (uint32_t i = 0; i < vfs->header.entry_count; i++) {
+        if (!entry_in_use(&vfs->entries[i])) continue;
+        if (vfs->entries[i].type == FT_DIRECTORY) {
+            result->directories++;
+        } else {
+            result->files++;
+        }
+        if (i >= vfs->header.entry_high) {
+            report(log, result, "entry %u is in use above the high-water mark %u", i, vfs->header.entry_high);
+        }
+        check_entry(vfs, i, &list, owners, log, result);
+    }
+    if (owners) {
+        check_index(vfs, result->directories + result->files, log, result);
+        check_blocks(vfs, owners, log, result);
+        free(owners);
+    }
+    
+    // Shared blocks are read once
+    if (list.count > 1) qsort(list.items, list.count, sizeof(CheckItem), compare_check_items);
+    size_t unique = 0;
+    for (size_t i = 0; i < list.count; i++) {
+        if (unique == 0 || list.items[i].block != list.items[unique - 1].block) {
+            list.items[unique++] = list.items[i];
+        }
+    }
+    list.count = unique;
+    
+    scrub_all(vfs, &list, threads, result);
+    for (size_t i = 0; i < list.count; i++) {
+        if (list.items[i].failed && log) {
+            char path[MAX_PATH];
+            entry_path(vfs, list.items[i].entry, path);
+            fprintf(log, "%s: block %u does not match its checksum\n", path, list.items[i].block);
+        }
+    }
+    free(list.items);
+    unlock_shared(vfs);
+    return result->problems == 0 && result->checksum_errors == 0;
+}
+
+// Layout and compaction
+
+// Runs of consecutive blocks in an extent list; extents that follow on
+// from each other count as one, and holes not at all
+static uint32_t count_runs(const VFSExtent* extents, uint32_t count) {
+    uint32_t runs = 0;
+    uint32_t end = VFS_INVALID_BLOCK;
+    for (uint32_t i = 0; i < count; i++) {
+        if (extent_hole(extents[i])) continue;
+        
+        VFSExtent run = extent_run(extents[i]);
+        if (run.start != end) runs++;
+        end = run.start + run.length;
+    }
+    return runs;
+}
+
+bool vfs_layout(VFS* vfs, VFSLayout* layout) {
+    if (!vfs || !layout) return false;
+    memset(layout, 0, sizeof(VFSLayout));
+    
+    // Exclusive: the free-space summary may not have been made yet
+    lock_exclusive(vfs);
+    bool ok = true;
+    for (uint32_t i = 0; i < vfs->header.entry_count; i++) {
+        const FileEntry* entry = &vfs->entries[i];
+        if (!entry_in_use(entry) || entry->type == FT_DIRECTORY || entry->extent_count == 0) continue;
+        
+        VFSExtent* extents = load_extents(vfs, entry);
+        if (!extents) {
+            ok = false;
+            continue;
+        }
+        uint32_t runs = count_runs(extents, entry->extent_count);
+        layout->files++;
+        layout->extents += runs;
+        if (runs > 1) layout->fragmented_files++;
+        free(extents);
+    }
+    
+    ensure_free_runs(vfs);
+    layout->free_runs = vfs->free_run_count;
+    uint32_t largest = largest_free_run(vfs);
+    if (largest != RUN_NONE) layout->largest_free_run = vfs->free_runs[largest].length;
+    layout->num_blocks = vfs->header.num_blocks;
+    layout->free_blocks = vfs->header.free_blocks;
+    layout->image_size = vfs->image_size;
+    unlock_exclusive(vfs);
+    return ok;
+}
+
+// Copy the counters. Readers change the operation counts atomically and
+// the rest only behind the cache mutex.
+void vfs_get_stats(VFS* vfs, VFSStats* stats) {
+    if (!vfs || !stats) return;
+    lock_shared(vfs);
+    cache_enter(vfs);
+    memcpy(stats, &vfs->stats, offsetof(VFSStats, timed));
+    stats->cache_blocks = vfs->cache.slot_count;
+    stats->dedup_indexed = vfs->dedup_live;
+    stats->dedup = vfs->dedup;
+    stats->timed = __atomic_load_n(&vfs->stats.timed, __ATOMIC_RELAXED);
+    for (int op = 0; op < VFS_OP_COUNT; op++) {
+        stats->ops[op].count = __atomic_load_n(&vfs->stats.ops[op].count, __ATOMIC_RELAXED);
+        stats->ops[op].bytes = __atomic_load_n(&vfs->stats.ops[op].bytes, __ATOMIC_RELAXED);
+        stats->ops[op].nanoseconds = __atomic_load_n(&vfs->stats.ops[op].nanoseconds, __ATOMIC_RELAXED);
+    }
+    cache_leave(vfs);
+    unlock_shared(vfs);
+}
+
+// Zero the counters, timing operations from now on if `timed`. Handle
+// seeks are counted without any lock, so the operation counts are
+// cleared atomically too.
+void vfs_reset_stats(VFS* vfs, bool timed) {
+    if (!vfs) return;
+    lock_exclusive(vfs);
+    cache_enter(vfs);
+    memset(&vfs->stats, 0, offsetof(VFSStats, timed));
+    __atomic_store_n(&vfs->stats.timed, timed, __ATOMIC_RELAXED);
+    for (int op = 0; op < VFS_OP_COUNT; op++) {
+        __atomic_store_n(&vfs->stats.ops[op].count, 0, __ATOMIC_RELAXED);
+        __atomic_store_n(&vfs->stats.ops[op].bytes, 0, __ATOMIC_RELAXED);
+        __atomic_store_n(&vfs->stats.ops[op].nanoseconds, 0, __ATOMIC_RELAXED);
+    }
+    cache_leave(vfs);
+    unlock_exclusive(vfs);
+}
+
+const char* vfs_op_name(VFSOp op) {
+    static const char* names[VFS_OP_COUNT] = {
+        "read", "write", "seek", "header_save", "commit", "sync", "flush", "alloc_scan"
+    };
+    return op < VFS_OP_COUNT ? names[op] : "unknown";
+}
+
+// Compaction moves data toward the start of the image so that free space
+// collects at the end, where it can be cut off the host file. An entry is
+// moved when its blocks are scattered and a free run holds them all, or
+// when it reaches past the size the image would have packed tight and a
+// free run lower down holds it; data inside that size stays. The data
+// goes over a piece at a time: each piece is copied into the run and the
+// entry is repointed at the copy in the same transaction, so the file is
+// whole at every commit. Blocks a move frees are reused only two commits later, as
+// always, so one pass makes room for the next. Once a pass moves nothing,
+// the free run at the end of the image is released.
+//
+// Files that share blocks with others, through cp or deduplication, are
+// not made contiguous; their extents are only moved down, with every file
+// that refers to the blocks repointed together.
+#define COMPACT_PIECE_BLOCKS 256     // Largest piece copied at once
+#define COMPACT_STEP_ENTRIES 4096    // Entries one call looks at
+
+// The overflow blocks of an entry being compacted go as low as they can,
+// but not at `avoid`, where its next piece of data is headed. Returns
+// VFS_INVALID_BLOCK when no free run holds them, to allocate as usual.
+static uint32_t compact_overflow_block(VFS* vfs, uint32_t avoid, uint32_t blocks) {
+    for (uint32_t node = first_free_run(vfs); node != RUN_NONE; node = next_free_run(vfs, node)) {
+        if (vfs->free_runs[node].start != avoid && vfs->free_runs[node].length >= blocks) {
+            return take_from_run(vfs, node, blocks).start;
+        }
+    }
+    return VFS_INVALID_BLOCK;
+}
+
+static bool extents_shared(const VFS* vfs, const VFSExtent* extents, uint32_t count) {
+    if (!vfs->refs) return false;
+    for (uint32_t i = 0; i < count; i++) {
+        VFSExtent run = extent_run(extents[i]);
+        for (uint32_t b = 0; b < run.length; b++) {
+            if (block_shared(vfs, run.start + b)) return true;
+        }
+    }
+    return false;
+}
+
+static bool runs_overlap(VFSExtent a, VFSExtent b) {
+    return a.start < b.start + b.length && b.start < a.start + a.length;
+}
+
+// An entry's extent list with the blocks of `source` swapped for the
+// copies starting at `target`. A plain extent that covers part of the
+// source is split; a compressed one has to lie inside it. Returns NULL
+// if the list cannot take the change, and sets *changed if it refers to
+// the source at all.
+static VFSExtent* repointed_extents(VFS* vfs, const FileEntry* entry, VFSExtent source,
+                                    uint32_t target, uint32_t* count, bool* changed) {
+    *changed = false;
+    if (entry->chunk_count == 0 && entry->extent_count <= VFS_DIRECT_EXTENTS) {
+        for (uint32_t i = 0; i < entry->extent_count && !*changed; i++) {
+            *changed = runs_overlap(extent_run(entry->extents[i]), source);
+        }
+        if (!*changed) return NULL;
+    }
+    
+    // An index or overflow block that cannot be read may refer to the
+    // source too
+    *changed = true;
+    VFSExtent* extents = load_extents(vfs, entry);
+    if (!extents) return NULL;
+    VFSExtent* list = (VFSExtent*)xmalloc((entry->extent_count * 3 + 1) * sizeof(VFSExtent));
+    uint32_t n = 0;
+    uint32_t source_end = source.start + source.length;
+    bool fits = true;
+    *changed = false;
+    for (uint32_t i = 0; i < entry->extent_count && fits; i++) {
+        VFSExtent run = extent_run(extents[i]);
+        if (!runs_overlap(run, source)) {
+            list[n++] = extents[i];
+            continue;
+        }
+        *changed = true;
+        
+        uint32_t run_end = run.start + run.length;
+        if (extent_compressed(extents[i])) {
+            fits = run.start >= source.start && run_end <= source_end;
+            list[n].start = target + (run.start - source.start);
+            list[n++].length = extents[i].length;
+            continue;
+        }
+        uint32_t low = run.start > source.start ? run.start : source.start;
+        uint32_t high = run_end < source_end ? run_end : source_end;
+        if (run.start < low) {
+            list[n].start = run.start;
+            list[n++].length = low - run.start;
+        }
+        list[n].start = target + (low - source.start);
+        list[n++].length = high - low;
+        if (high < run_end) {
+            list[n].start = high;
+            list[n++].length = run_end - high;
+        }
+    }
+    free(extents);
+    
+    if (!fits) {
+        free(list);
+        return NULL;
+    }
+    *count = n;
+    return list;
+}
+
+// The new extent lists of every file that refers to some blocks being
+// moved, worked out before anything changes
+typedef struct {
+    uint32_t* numbers;       // Entries to update
+    uint32_t* counts;
+    VFSExtent** lists;
+    uint32_t count;
+    uint32_t capacity;
+} RepointPlan;
+
+static void free_repoint_plan(RepointPlan* plan) {
+    for (uint32_t k = 0; k < plan->count; k++) {
+        free(plan->lists[k]);
+    }
+    free(plan->numbers);
+    free(plan->counts);
+    free(plan->lists);
+}
+
+// Plan the repointing of every file that refers to the blocks of `source`
+// at their copies from `target` on. Returns false if some extent list
+// cannot take the change.
+static bool plan_repoint(VFS* vfs, VFSExtent source, uint32_t target, RepointPlan* plan) {
+    memset(plan, 0, sizeof(RepointPlan));
+    for (uint32_t i = 0; i < vfs->header.entry_count; i++) {
+        const FileEntry* entry = &vfs->entries[i];
+        if (!entry_in_use(entry) || entry->type == FT_DIRECTORY || entry->extent_count == 0) continue;
+        
+        uint32_t count = 0;
+        bool changed;
+        VFSExtent* list = repointed_extents(vfs, entry, source, target, &count, &changed);
+        if (!list) {
+            if (!changed) continue;
+            free_repoint_plan(plan);
+            return false;
+        }
+        if (!changed) {
+            free(list);
+            continue;
+        }
+        if (plan->count == plan->capacity) {
+            plan->capacity = plan->capacity ? plan->capacity * 2 : 8;
+            plan->numbers = (uint32_t*)xrealloc(plan->numbers, plan->capacity * sizeof(uint32_t));
+            plan->counts = (uint32_t*)xrealloc(plan->counts, plan->capacity * sizeof(uint32_t));
+            plan->lists = (VFSExtent**)xrealloc(plan->lists, plan->capacity * sizeof(VFSExtent*));
+        }
+        plan->numbers[plan->count] = i;
+        plan->counts[plan->count] = count;
+        plan->lists[plan->count++] = list;
+    }
+    return true;
+}
+
+// Store the planned extent lists, hand the reference counts over to the
+// copies and free the source. Returns false if the image could not be
+// updated.
+static bool apply_repoint(VFS* vfs, const RepointPlan* plan, VFSExtent source, uint32_t target) {
+    for (uint32_t k = 0; k < plan->count; k++) {
+        if (!store_extents(vfs, &vfs->entries[plan->numbers[k]], plan->lists[k], plan->counts[k])) {
+            return false;
+        }
+    }
+    
+    if (vfs->refs) {
+        memcpy(vfs->refs + target, vfs->refs + source.start, source.length * sizeof(uint16_t));
+        memset(vfs->refs + source.start, 0, source.length * sizeof(uint16_t));
+        mark_dirty(vfs, &vfs->refs[target], source.length * sizeof(uint16_t));
+        mark_dirty(vfs, &vfs->refs[source.start], source.length * sizeof(uint16_t));
+    }
+    free_extent(vfs, source);
+    return true;
+}
+
+// Data is moved only if it matches its checksums, whatever the read
+// policy: a damaged block copied elsewhere would get a fresh checksum,
+// and the damage could no longer be detected
+static bool compact_verify(VFS* vfs, uint32_t block, const char* data, size_t len) {
+    if (!vfs->crcs) return true;
+    
+    for (size_t offset = 0; offset < len; offset += BLOCK_SIZE, block++) {
+        size_t chunk = len - offset < BLOCK_SIZE ? len - offset : BLOCK_SIZE;
+        if (vfs->crcs[block] == 0) continue;
+        vfs->stats.blocks_verified++;
+        if (block_checksum(data + offset, chunk) != vfs->crcs[block]) {
+            print_error_format("VFS block %u does not match its checksum; left where it is", block);
+            vfs->stats.checksum_failures++;
+            return false;
+        }
+    }
+    return true;
+}
+
+// Blocks the image would have with no free space in it. Data reaching
+// past this is worth moving down.
+static uint32_t compact_limit(const VFS* vfs) {
+    return vfs->header.num_blocks - vfs->header.free_blocks;
+}
+
+static void compact_next(VFSCompaction* state) {
+    state->entry++;
+    state->moving = false;
+    state->moved_some = false;
+}
+
+// Files left where they are are counted in the first pass only; later
+// passes meet the same ones again
+static void compact_skip(VFSCompaction* state) {
+    if (state->passes == 0) state->files_skipped++;
+}
+
+// Bytes of data in `blocks` blocks at file offset `base`: blocks past
+// the end of the file, and those of directories, hold none
+static size_t compact_stored(const FileEntry* entry, uint64_t base, uint32_t blocks) {
+    if (entry->type == FT_DIRECTORY || entry->size <= base) return 0;
+    uint64_t left = entry->size - base;
+    return left < (uint64_t)blocks * BLOCK_SIZE ? (size_t)left : (size_t)blocks * BLOCK_SIZE;
+}
+
+// Take a lower run for the blocks of a chunk index or extent list if they
+// reach past the packed size. Returns its start, VFS_INVALID_BLOCK if the
+// blocks stay.
+static uint32_t compact_list_run(VFS* vfs, VFSExtent run) {
+    uint32_t pick = run.length > 0 ? first_fit_run(vfs, run.length) : RUN_NONE;
+    if (run.start + run.length <= compact_limit(vfs) || pick == RUN_NONE ||
+        vfs->free_runs[pick].start >= run.start) {
+        return VFS_INVALID_BLOCK;
+    }
+    return take_from_run(vfs, pick, run.length).start;
+}
+
+// Move an entry's chunk index and overflow blocks down if they reach past
+// the packed size; whichever does not move stays where it is
+static void compact_overflow(VFS* vfs, VFSCompaction* state, FileEntry* entry,
+                             const VFSExtent* extents, uint32_t count, uint32_t* moved, bool* ok) {
+    VFSExtent index = chunk_run(entry);
+    VFSExtent run = overflow_run(entry);
+    uint32_t index_start = compact_list_run(vfs, index);
+    uint32_t overflow_start = compact_list_run(vfs, run);
+    if (index_start == VFS_INVALID_BLOCK && overflow_start == VFS_INVALID_BLOCK) return;
+    
+    *moved = (index_start != VFS_INVALID_BLOCK ? index.length : 0) +
+             (overflow_start != VFS_INVALID_BLOCK ? run.length : 0);
+    if (index_start == VFS_INVALID_BLOCK && index.length > 0) index_start = index.start;
+    if (overflow_start == VFS_INVALID_BLOCK && run.length > 0) overflow_start = run.start;
+    *ok = place_extents(vfs, entry, extents, count, index_start, overflow_start);
+    if (*ok) {
+        state->blocks_moved += *moved;
+        state->pass_moved = true;
+    } else {
+        *moved = 0;
+    }
+}
+
+// Move one piece of a file that shares blocks down, if any can go lower:
+// the piece is copied into the lowest free run that holds it, and every
+// file referring to it is repointed. A plain extent goes over at most
+// COMPACT_PIECE_BLOCKS at a time, and no more than the lowest run holds.
+// Returns true if a piece moved, so the entry is looked at again; *ok is
+// set to false if the image could not be updated.
+static bool compact_shared(VFS* vfs, VFSCompaction* state, FileEntry* entry,
+                           const VFSExtent* extents, uint32_t count, uint32_t* moved, bool* ok) {
+    uint64_t base = 0;
+    for (uint32_t i = 0; i < count; base += extent_span(extents[i]), i++) {
+        VFSExtent source = extent_run(extents[i]);
+        bool compressed = extent_compressed(extents[i]);
+        if (extent_hole(extents[i]) || source.start + source.length <= compact_limit(vfs)) continue;
+        
+        // A plain extent is split to fit the lowest free run
+        uint32_t pick;
+        if (compressed) {
+            pick = first_fit_run(vfs, source.length);
+        } else {
+            if (source.length > COMPACT_PIECE_BLOCKS) source.length = COMPACT_PIECE_BLOCKS;
+            pick = first_free_run(vfs);
+            if (pick == RUN_NONE) break;
+            if (vfs->free_runs[pick].length < source.length) source.length = vfs->free_runs[pick].length;
+        }
+        if (pick == RUN_NONE || vfs->free_runs[pick].start >= source.start) continue;
+        
+        // The copy goes at the start of the run. Blocks a compressed chunk
+        // only partly covers stay where they are.
+        RepointPlan plan;
+        if (!plan_repoint(vfs, source, vfs->free_runs[pick].start, &plan)) continue;
+        size_t stored = compressed ? extents[i].length & ~VFS_EXTENT_COMPRESSED :
+                                     compact_stored(entry, base, source.length);
+        char* data = (char*)xmalloc(stored ? stored : 1);
+        bool intact = cached_read(vfs, source.start, data, stored) == stored &&
+                      compact_verify(vfs, source.start, data, stored);
+        if (!intact) {
+            free(data);
+            free_repoint_plan(&plan);
+            compact_skip(state);
+            return false;
+        }
+        VFSExtent target = take_from_run(vfs, pick, source.length);
+        *ok = (stored == 0 || data_write(vfs, target.start, data, stored)) &&
+              apply_repoint(vfs, &plan, source, target.start);
+        free(data);
+        free_repoint_plan(&plan);
+        if (!*ok) return false;
+        
+        *moved = source.length;
+        state->blocks_moved += source.length;
+        state->pass_moved = true;
+        if (!state->moved_some) state->files_moved++;
+        state->moved_some = true;
+        return true;
+    }
+    compact_overflow(vfs, state, entry, extents, count, moved, ok);
+    return false;
+}
+
+// Decide whether an entry moves, and start the move. One that stays put
+// may still have its overflow block moved down, which is done at once.
+static bool compact_target(VFS* vfs, VFSCompaction* state, FileEntry* entry,
+                           const VFSExtent* extents, uint32_t count, uint32_t* moved, bool* ok) {
+    uint32_t total = 0;
+    uint32_t first = VFS_INVALID_BLOCK;
+    uint32_t end = 0;
+    for (uint32_t i = 0; i < count; i++) {
+        if (extent_hole(extents[i])) continue;
+        
+        VFSExtent run = extent_run(extents[i]);
+        if (first == VFS_INVALID_BLOCK) first = run.start;
+        total += run.length;
+        if (run.start + run.length > end) end = run.start + run.length;
+    }
+    uint32_t pick = first_fit_run(vfs, total);
+    bool scattered = count_runs(extents, count) > 1;
+    bool outside = end > compact_limit(vfs) && pick != RUN_NONE &&
+                   vfs->free_runs[pick].start < first;
+    if (pick != RUN_NONE && (scattered || outside)) {
+        state->target_start = vfs->free_runs[pick].start;
+        state->target_next = state->target_start;
+        state->moving = true;
+        return true;
+    }
+    
+    compact_overflow(vfs, state, entry, extents, count, moved, ok);
+    return false;
+}
+
+// Copy an entry's extents from `index` on into its target run, up to
+// `budget` blocks, then repoint the entry at the copies in one update.
+// A plain extent may be split. Returns false only if the image could not
+// be updated.
+static bool compact_pieces(VFS* vfs, VFSCompaction* state, FileEntry* entry,
+                           const VFSExtent* extents, uint32_t count, uint32_t index,
+                           uint32_t budget, uint32_t* moved) {
+    VFSExtent* list = (VFSExtent*)xmalloc((count + 1) * sizeof(VFSExtent));
+    VFSExtent* sources = (VFSExtent*)xmalloc(count * sizeof(VFSExtent));
+    memcpy(list, extents, index * sizeof(VFSExtent));
+    uint32_t n = index;
+    uint32_t source_count = 0;
+    
+    uint64_t base = 0;
+    for (uint32_t i = 0; i < index; i++) {
+        base += extent_span(extents[i]);
+    }
+    
+    VFSExtent current = extents[index];
+    uint32_t i = index;
+    bool written = true;
+    bool damaged = false;
+    bool stopped = false;
+    while (i < count && *moved < budget && !(*moved > 0 && journal_filling(vfs))) {
+        // Holes have nothing to move
+        if (extent_hole(current)) {
+            list[n++] = current;
+            base += extent_span(current);
+            if (++i < count) current = extents[i];
+            continue;
+        }
+        
+        VFSExtent run = extent_run(current);
+        bool compressed = extent_compressed(current);
+        if (compressed && *moved > 0 && *moved + run.length > budget) break;
+        
+        bool joins = n > 0 && !compressed && extent_plain(list[n - 1]) &&
+                     list[n - 1].start + list[n - 1].length == state->target_next &&
+                     list[n - 1].length < VFS_EXTENT_COMPRESSED - run.length;
+        uint32_t piece = run.length;
+        if (!compressed) {
+            if (piece > budget - *moved) piece = budget - *moved;
+            if (piece > COMPACT_PIECE_BLOCKS) piece = COMPACT_PIECE_BLOCKS;
+        }
+        
+        // The run may have been taken since the move started
+        VFSExtent target = {VFS_INVALID_BLOCK, 0};
+        if (state->target_next < vfs->header.num_blocks) {
+            target = alloc_after(vfs, state->target_next, piece);
+        }
+        if (target.length == 0 || (compressed && target.length < piece)) {
+            free_extent(vfs, target);
+            stopped = true;
+            break;
+        }
+        piece = target.length;
+        
+        size_t stored = compressed ? current.length & ~VFS_EXTENT_COMPRESSED :
+                                     compact_stored(entry, base, piece);
+        if (stored > 0) {
+            char* data = (char*)xmalloc(stored);
+            bool intact = cached_read(vfs, run.start, data, stored) == stored &&
+                          compact_verify(vfs, run.start, data, stored);
+            written = intact && data_write(vfs, target.start, data, stored);
+            free(data);
+            if (!written) {
+                free_extent(vfs, target);
+                damaged = !intact;
+                written = damaged;
+                stopped = true;
+                break;
+            }
+        }
+        
+        if (joins) {
+            list[n - 1].length += piece;
+        } else {
+            list[n].start = target.start;
+            list[n].length = compressed ? current.length : piece;
+            n++;
+        }
+        sources[source_count].start = run.start;
+        sources[source_count].length = piece;
+        source_count++;
+        state->target_next = target.start + piece;
+        *moved += piece;
+        
+        if (compressed || piece == run.length) {
+            base += extent_span(current);
+            if (++i < count) current = extents[i];
+        } else {
+            current.start += piece;
+            current.length -= piece;
+            base += (uint64_t)piece * BLOCK_SIZE;
+        }
+    }
+    
+    // The rest of the list stays where it is
+    if (i < count) {
+        list[n++] = current;
+        memcpy(list + n, extents + i + 1, (count - i - 1) * sizeof(VFSExtent));
+        n += count - i - 1;
+    }
+    bool ok = written;
+    if (source_count > 0) {
+        uint32_t chunks = chunk_prefix(list, n);
+        uint32_t index = chunks > 0 ?
+                         compact_overflow_block(vfs, state->target_next, index_blocks(chunks)) :
+                         VFS_INVALID_BLOCK;
+        uint32_t overflow = n - chunks > VFS_DIRECT_EXTENTS ?
+                            compact_overflow_block(vfs, state->target_next, overflow_blocks(n - chunks)) :
+                            VFS_INVALID_BLOCK;
+        if (place_extents(vfs, entry, list, n, index, overflow)) {
+            for (uint32_t k = 0; k < source_count; k++) {
+                free_extent(vfs, sources[k]);
+            }
+        } else {
+            ok = false;
+        }
+        state->blocks_moved += *moved;
+        state->pass_moved = true;
+    }
+    free(list);
+    free(sources);
+    
+    if (ok && i == count) {
+        state->files_moved++;
+        compact_next(state);
+    } else if (ok && stopped) {
+        if (damaged) compact_skip(state);
+        compact_next(state);
+    }
+    return ok;
+}
+
+// Take the current entry a step further. Returns false only if the image
+// could not be updated.
+static bool compact_entry(VFS* vfs, VFSCompaction* state, uint32_t budget, uint32_t* moved) {
+    *moved = 0;
+    FileEntry* entry = &vfs->entries[state->entry];
+    if (!entry_in_use(entry) || entry->extent_count == 0) {
+        compact_next(state);
+        return true;
+    }
+    
+    VFSExtent* extents = load_extents(vfs, entry);
+    if (!extents) {
+        compact_skip(state);
+        compact_next(state);
+        return true;
+    }
+    uint32_t count = entry->extent_count;
+    
+    bool ok = true;
+    if (!state->moving && extents_shared(vfs, extents, count)) {
+        if (!compact_shared(vfs, state, entry, extents, count, moved, &ok)) compact_next(state);
+        free(extents);
+        return ok;
+    }
+    
+    // A move carries on from where it stopped if the entry still starts
+    // with the data moved so far; otherwise it is reconsidered
+    uint32_t index = 0;
+    if (state->moving) {
+        uint32_t cursor = state->target_start;
+        while (index < count && (extent_hole(extents[index]) ||
+                                 extent_run(extents[index]).start == cursor)) {
+            cursor += extent_run(extents[index++]).length;
+        }
+        if (cursor != state->target_next || index == count) {
+            state->moving = false;
+            index = 0;
+        }
+    }
+    
+    if (state->moving || compact_target(vfs, state, entry, extents, count, moved, &ok)) {
+        ok = compact_pieces(vfs, state, entry, extents, count, index, budget, moved);
+    } else {
+        compact_next(state);
+    }
+    free(extents);
+    return ok;
+}
+
+// At the end of a pass the metadata regions follow the data down
+static uint32_t compact_regions(VFS* vfs, VFSCompaction* state) {
+    uint32_t moved = 0;
+    for (int region = VFS_META_BITMAP; region < VFS_META_REGIONS; region++) {
+        VFSExtent extent = *region_extent(vfs, region);
+        if (extent.length == 0) continue;
+        
+        uint32_t pick = first_fit_run(vfs, extent.length);
+        if (pick == RUN_NONE || vfs->free_runs[pick].start >= extent.start ||
+            extent.start + extent.length <= compact_limit(vfs)) {
+            continue;
+        }
+        move_region(vfs, region, pick, extent.length);
+        mark_dirty(vfs, &vfs->header, sizeof(vfs->header));
+        moved += extent.length;
+    }
+    if (moved > 0) {
+        state->blocks_moved += moved;
+        state->pass_moved = true;
+    }
+    return moved;
+}
+
+// Hand the blocks freed so far back to the allocator: one commit makes
+// them settle and the next releases them
+static bool compact_settle(VFS* vfs) {
+    for (int i = 0; i < 2; i++) {
+        mark_dirty(vfs, &vfs->header.free_blocks, sizeof(vfs->header.free_blocks));
+        if (!journal_commit(vfs)) return false;
+    }
+    return true;
+}
+
+// Cut the host file down to `size` bytes
+static bool shrink_image(VFS* vfs, uint64_t size) {
+#ifdef _WIN32
+    // Windows does not cut a file that has mapped views, so the regions
+    // still mapped are copied to the heap first
+    for (int region = 0; region < VFS_META_REGIONS; region++) {
+        if (vfs->meta[region].mapped) region_detach(vfs, region, vfs->meta[region].size);
+    }
+    bool ok = _chsize_s(vfs->fd, (__int64)size) == 0;
+#else
+    bool ok = ftruncate(vfs->fd, (off_t)size) == 0;
+#endif
+    if (!ok) return false;
+    
+    // The mapping reaches past the new end, so the next one is made afresh
+    cache_enter(vfs);
+    vfs->image_size = size;
+    if (vfs->map_base && vfs->map_size > size) retire_mapping(vfs);
+    cache_leave(vfs);
+    return true;
+}
+
+// Drop the free run at the end of the image. The smaller block count is
+// committed before the host file is cut, so a crash in between only
+// leaves the file longer than it needs to be.
+static bool compact_truncate(VFS* vfs, VFSCompaction* state) {
+    uint32_t node = last_free_run(vfs);
+    if (node == RUN_NONE) return true;
+    VFSExtent last = {vfs->free_runs[node].start, vfs->free_runs[node].length};
+    if (last.start + last.length != vfs->header.num_blocks) return true;
+    
+    remove_free_run(vfs, node);
+    vfs->header.num_blocks = last.start;
+    vfs->header.free_blocks -= last.length;
+    mark_dirty(vfs, &vfs->header, sizeof(vfs->header));
+    if (!journal_commit(vfs)) return false;
+    state->blocks_released += last.length;
+    
+    VFSBlockCache* cache = &vfs->cache;
+    for (uint32_t slot = 0; slot < cache->slot_count; slot++) {
+        uint32_t block = cache->blocks[slot];
+        if (block != VFS_INVALID_BLOCK && block >= last.start) {
+            cache_table_remove(vfs, block);
+            cache->blocks[slot] = VFS_INVALID_BLOCK;
+            cache->flags[slot] = 0;
+        }
+    }
+    
+    uint64_t size = block_offset(last.start);
+    return vfs->image_size <= size || shrink_image(vfs, size);
+}
+
+// One step of a compaction: move up to max_blocks blocks, or look at a
+// bounded number of entries, and commit. The metadata lock is held only
+// for the step, so other threads get in between steps.
+bool vfs_compact(VFS* vfs, VFSCompaction* state, uint32_t max_blocks) {
+    if (!vfs || !state) return false;
+    if (state->done) return true;
+    if (max_blocks == 0) max_blocks = 1;
+    
+    lock_exclusive(vfs);
+    ensure_free_runs(vfs);
+    bool ok = true;
+    uint32_t moved = 0;
+    uint32_t looked = 0;
+    while (ok && !state->done && moved < max_blocks && looked < COMPACT_STEP_ENTRIES) {
+        if (journal_filling(vfs) && !journal_commit(vfs)) {
+            ok = false;
+            break;
+        }
+        if (state->entry < vfs->header.entry_count) {
+            uint32_t piece;
+            ok = compact_entry(vfs, state, max_blocks - moved, &piece);
+            moved += piece;
+            looked++;
+            continue;
+        }
+        
+        // End of a pass. Another follows while passes keep moving
+        // things, and once more after the space they freed is released.
+        moved += compact_regions(vfs, state);
+        state->passes++;
+        if (state->pass_moved) {
+            state->entry = 0;
+            state->pass_moved = false;
+        } else if (vfs->open_readers == 0 &&
+                   (vfs->pending_free_count > 0 || vfs->settling_free_count > 0)) {
+            ok = compact_settle(vfs);
+            state->entry = 0;
+        } else {
+            ok = compact_truncate(vfs, state);
+            state->done = true;
+        }
+    }
+    ok = journal_commit(vfs) && ok;
+    unlock_exclusive(vfs);
+    return ok;
+}
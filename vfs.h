@@ -10,8 +10,13 @@
 #define MAX_FILENAME 256
 #define MAX_PATH 512
 #define BLOCK_SIZE 4096
-#define MAX_BLOCKS 1024
-#define MAX_FILES 256
+#define VFS_INITIAL_BLOCKS 1024  // A new image starts this size and grows on demand
+#define VFS_INITIAL_FILES 256
+#define VFS_MAX_BLOCKS ((uint32_t)-2)  // Block numbers are 32-bit: up to 16 TB of data
+#define VFS_DIRECT_EXTENTS 4
+#define VFS_INLINE_SIZE 180      // Fills a FileEntry out to one 512-byte sector
+#define VFS_INVALID_BLOCK ((uint32_t)-1)
+#define VFS_NO_ENTRY ((uint32_t)-1)
 
 // File types
 typedef enum {
@@ -20,49 +25,437 @@ typedef enum {
     FT_SCRIPT = 2
 } FileType;
 
+// Run of consecutive data blocks
+typedef struct {
+    uint32_t start;
+    uint32_t length;
+} VFSExtent;
+
+#define VFS_EXTENTS_PER_BLOCK (BLOCK_SIZE / sizeof(VFSExtent))
+#define VFS_WRITE_EXTENTS 512    // Most extents one write adds to a file
+
 // File metadata
 typedef struct {
     char name[MAX_FILENAME];
     FileType type;
-    uint32_t size;
-    uint32_t first_block;
+    uint64_t size;
     uint32_t parent_dir;
     uint32_t created_time;
     uint32_t modified_time;
+    uint32_t extent_count;   // Chunk index entries and extents together
+    uint32_t extent_block;   // First of the blocks holding the extents past the direct ones
+    uint32_t chunk_count;    // Leading extents kept in the chunk index
+    uint32_t chunk_block;    // First of the blocks holding the chunk index
+    VFSExtent extents[VFS_DIRECT_EXTENTS];  // The first extents past the chunk index
+    char inline_data[VFS_INLINE_SIZE];  // Contents of a small file that has no blocks
 } FileEntry;
 
-// VFS header
+// Directory index: a B+tree over (parent, name) in which every entry but
+// the root has a key. A node fills one block of the tree region. Keys
+// hold the start of the name; names that share it are told apart by the
+// entry they name, so lookups of long names check the entry itself.
+#define VFS_TREE_PREFIX 24
+#define VFS_TREE_KEYS 112
+#define VFS_TREE_NONE ((uint32_t)-1)
+
+typedef struct {
+    uint32_t parent;
+    uint32_t entry;
+    char prefix[VFS_TREE_PREFIX];  // Start of the name, zero-padded
+} VFSTreeKey;
+
+typedef struct {
+    uint16_t leaf;
+    uint16_t count;          // Keys in use
+    uint32_t next;           // Leaf: right sibling; free node: next free one
+    uint32_t prev;           // Leaf: left sibling
+    uint32_t reserved;
+    VFSTreeKey keys[VFS_TREE_KEYS];
+    uint32_t children[VFS_TREE_KEYS + 1];  // Internal node: child i holds keys below keys[i]
+    char padding[BLOCK_SIZE - 16 - VFS_TREE_KEYS * sizeof(VFSTreeKey) -
+                 (VFS_TREE_KEYS + 1) * sizeof(uint32_t)];
+} VFSTreeNode;
+
+// VFS header (superblock) at the start of the image. The block bitmap, the
+// entry table, the directory index, the reference counts and the checksums
+// live in data blocks and are moved when they outgrow them.
 typedef struct {
-    char magic[8];           // "VFS001\n"
+    char magic[8];           // "VFS002\n"
+    uint32_t revision;       // Layout revision within VFS002
     uint32_t block_size;
-    uint32_t num_blocks;
+    uint32_t num_blocks;     // Data blocks in the image
+    uint32_t free_blocks;    // Kept in step with the bitmap
     uint32_t num_files;
     uint32_t root_dir;
-    uint32_t free_list;
-    FileEntry entries[MAX_FILES];
-    bool block_used[MAX_BLOCKS];
+    uint32_t entry_count;    // Slots in the entry table
+    VFSExtent bitmap_region; // One bit per block, set when used
+    VFSExtent entry_region;  // FileEntry table
+    VFSExtent refs_region;   // Extra references per block; empty until a block is shared
+    VFSExtent crcs_region;   // CRC32C per block; empty until file data is written
+    VFSExtent tree_region;   // Directory index nodes
+    uint32_t tree_root;
+    uint32_t tree_nodes;     // Nodes handed out at least once
+    uint32_t tree_free;      // First freed node, VFS_TREE_NONE if none
+    uint32_t entry_high;     // Entry slots handed out at least once
+    uint32_t free_entry;     // First freed slot, chained through parent_dir; VFS_NO_ENTRY if none
 } VFSHeader;
 
-// VFS context
+// Metadata is written back in sectors that actually changed. The header,
+// the bitmap, the entry table, the reference counts, the checksums and
+// the directory index are tracked as separate regions.
+#define VFS_SECTOR_SIZE 512
+#define VFS_META_HEADER 0
+#define VFS_META_BITMAP 1
+#define VFS_META_ENTRIES 2
+#define VFS_META_REFS 3
+#define VFS_META_CRCS 4
+#define VFS_META_TREE 5
+#define VFS_META_REGIONS 6
+
+// A block can be shared by this many files plus one
+#define VFS_MAX_BLOCK_REFS UINT16_MAX
+
+typedef struct {
+    char* base;              // In-memory copy
+    size_t size;
+    bool mapped;             // base is a private mapping of the image, paged in as touched
+    size_t map_lead;         // Bytes the mapped view starts before base (Windows)
+    uint64_t* dirty;         // One bit per sector
+    size_t dirty_words;
+    bool relocated;          // Moved by the open transaction, written whole at commit
+} VFSMetaRegion;
+
+// Redo journal: two slots after the header, used alternately. Each slot
+// holds one committed transaction: the metadata sectors it changed, the
+// data blocks it overwrote in place, and a checksum of every data range
+// it wrote to fresh blocks.
+#define VFS_JOURNAL_SECTORS 512
+#define VFS_JOURNAL_DATA_RECORDS (2 * (VFS_WRITE_EXTENTS + 1) + VFS_META_REGIONS)
+
+// Data range written by the open transaction
+typedef struct {
+    uint64_t offset;
+    uint32_t length;
+    uint32_t reserved;
+    uint64_t checksum;
+} VFSJournalData;
+
+// Operations counted with their bytes and time spent, for vfsstat
+typedef enum {
+    VFS_OP_READ,             // Reads from the image
+    VFS_OP_WRITE,            // Writes to the image
+    VFS_OP_SEEK,             // vfs_seek on a handle; bytes are the distance moved
+    VFS_OP_HEADER_SAVE,      // Dirty metadata sectors written back; bytes are those sectors
+    VFS_OP_COMMIT,           // Transactions committed; bytes are journal bytes
+    VFS_OP_SYNC,             // Image synced to stable storage
+    VFS_OP_FLUSH,            // Block cache written back; bytes are dirty blocks
+    VFS_OP_ALLOC_SCAN,       // Free space searched or rebuilt; bytes are bitmap and runs looked at
+    VFS_OP_COUNT
+} VFSOp;
+
+// Times nest: a commit includes the flush, writes and sync it makes
+typedef struct {
+    uint64_t count;
+    uint64_t bytes;
+    uint64_t nanoseconds;
+} VFSOpStats;
+
+// I/O counters. Header saves, commits and syncs, with the metadata and
+// journal bytes written, are in ops. Operations are timed only after a
+// vfs_reset_stats that asks for it, so the clock is not read otherwise.
+typedef struct {
+    uint64_t metadata_writes;   // Runs of sectors written by header saves
+    uint64_t cache_hits;
+    uint64_t cache_misses;
+    uint64_t cache_writebacks;
+    uint64_t dedup_hits;     // Blocks shared instead of written
+    uint64_t blocks_verified;
+    uint64_t checksum_failures;
+    uint64_t path_hits;      // Paths answered from the resolved-path cache
+    uint64_t path_misses;
+    uint32_t cache_blocks;   // Size of the block cache, filled in by vfs_get_stats
+    uint32_t dedup_indexed;  // Blocks in the dedup index, likewise
+    bool dedup;              // Whether writes are deduplicated
+    bool timed;
+    VFSOpStats ops[VFS_OP_COUNT];   // Last, so the counters above can be cleared apart from them
+} VFSStats;
+
+// Resolved-path cache: paths as given, with what they resolve to and the
+// entry they name. Slots are picked by hash, one per path. Creating,
+// deleting or renaming anything, and cd, bump the generation, which
+// empties every slot at once.
+#define VFS_PATH_CACHE_SLOTS 64
+#define VFS_PATH_UNKNOWN ((uint32_t)-2)
+
+typedef struct {
+    uint64_t generation;     // Slot is valid while this matches the VFS's
+    uint32_t hash;
+    uint32_t entry;          // Entry named, VFS_NO_ENTRY if none, VFS_PATH_UNKNOWN if not looked up yet
+    char path[MAX_PATH];
+    char resolved[MAX_PATH];
+} VFSPathSlot;
+
+// Write-back cache of data blocks, evicted with the CLOCK algorithm
+#define VFS_DEFAULT_CACHE_BYTES (1024 * 1024)
+
+typedef struct {
+    char* data;              // slot_count blocks
+    uint32_t* blocks;        // Block held by each slot, VFS_INVALID_BLOCK if empty
+    uint8_t* flags;          // CACHE_DIRTY / CACHE_REFERENCED per slot
+    uint32_t slot_count;
+    uint32_t hand;           // CLOCK hand
+    uint32_t* table;         // Block number -> slot, open addressing
+    uint32_t table_capacity;
+} VFSBlockCache;
+
+// What a read does with a block that does not match its checksum. Blocks
+// are checked when they come from the image, not again while cached.
+typedef enum {
+    VFS_VERIFY_FAIL = 0,     // Report it and fail the read
+    VFS_VERIFY_WARN,         // Report it and return the data anyway
+    VFS_VERIFY_OFF           // Do not check reads; fsck still does
+} VFSVerifyPolicy;
+
+// Options for vfs_init_with_options
+typedef struct {
+    bool use_mmap;           // Map the image read-only and serve handle reads from it (POSIX only)
+    size_t cache_bytes;      // Block cache budget; 0 disables the cache
+    bool compress;           // Compress file data written from now on
+    bool dedup;              // Store identical data blocks once
+    VFSVerifyPolicy verify;  // Checksum mismatches on read
+} VFSOptions;
+
+// A read-only mapping of the image
+typedef struct {
+    const char* data;
+    size_t len;
+} VFSSpan;
+
+// Open file with a read cursor. Reads follow the file's extents in chunks
+// of at most VFS_READAHEAD_BLOCKS; the window doubles while the file is
+// read sequentially and drops back to one block after a seek. A writer
+// handle gathers up to the same amount before appending it to the file.
+#define VFS_READAHEAD_BLOCKS 16
+
+// Compressed data. With VFSOptions.compress a file is cut into chunks of
+// one readahead window, and each chunk that compresses by at least a
+// block becomes an extent of its own: its length holds
+// VFS_EXTENT_COMPRESSED and the compressed byte count instead of a block
+// count. The part of the last chunk written so far stays uncompressed
+// until the chunk is full. The extents of a file's chunks, one per chunk
+// up to the last compressed one, are its chunk index, kept in blocks of
+// their own apart from the rest of its extent list.
+#define VFS_CHUNK_SIZE (VFS_READAHEAD_BLOCKS * BLOCK_SIZE)
+#define VFS_EXTENT_COMPRESSED 0x80000000u
+
+// Sparse files. A write past the end of a file leaves the whole blocks it
+// skips as a hole: an extent starting at VFS_HOLE_BLOCK whose length
+// counts the blocks. A hole takes no space and reads as zeros.
+#define VFS_HOLE_BLOCK VFS_INVALID_BLOCK
+
+// Extra whences for vfs_seek on a read handle, like lseek's SEEK_DATA and
+// SEEK_HOLE: move to the first data, or the first hole, at or after the
+// offset. The end of the file counts as a hole.
+#define VFS_SEEK_DATA 3
+#define VFS_SEEK_HOLE 4
+
+// A free run in the free-space summary. Each is a node of two treaps at
+// once, one ordered by start block and one by length and then start, so
+// best fit, first fit and merging with neighbours all take O(log n).
+typedef struct {
+    uint32_t start;
+    uint32_t length;
+    uint32_t child[2][2];    // Left and right child in each tree
+    uint32_t largest;        // Longest run in this node's subtree by start
+    uint32_t priority;
+} VFSFreeRun;
+
+// Deduplication index slot: a data block and the CRC32C of its contents
+typedef struct {
+    uint32_t crc;
+    uint32_t block;
+} VFSDedupSlot;
+
+typedef struct {
+    uint32_t entry;          // Entry number of the open file
+    uint64_t size;
+    uint64_t pos;            // Cursor
+    VFSExtent* extents;      // Snapshot taken at open
+    uint32_t extent_count;
+    uint32_t extent_index;   // Extent holding pos, or just before it
+    uint64_t extent_base;    // File offset where that extent starts
+    char* buffer;            // Readahead window
+    uint64_t buffer_start;   // File offset of buffer[0]
+    size_t buffer_len;
+    uint32_t readahead;      // Blocks fetched by the next refill
+    uint64_t verified_start; // Mapped range already checked against its checksums
+    uint64_t verified_end;
+    bool writing;            // Opened by vfs_open_writer; buffer holds unwritten data
+} VFSFile;
+
+// Open directory. Children are snapshotted at open in name order, and
+// entries removed or moved away since are skipped.
+typedef struct {
+    uint32_t entry;          // Entry number of the directory
+    uint32_t* children;
+    uint32_t count;
+    uint32_t next;
+} VFSDir;
+
+// Metadata lock and cache mutex; platform types, so defined in vfs.c
+typedef struct VFSLocks VFSLocks;
+
+// Compression or block checksums for a write, worked out by vfs_prepare
+typedef struct VFSPrepared VFSPrepared;
+
+// VFS context. One VFS may be shared by threads: calls that only read run
+// in parallel, and a call that changes the image has it to itself. A file
+// or directory handle belongs to one thread at a time.
 typedef struct {
     VFSHeader header;
+    uint64_t* bitmap;        // Contents of the bitmap region
+    FileEntry* entries;      // Contents of the entry table
+    VFSTreeNode* tree;       // Contents of the directory index
+    uint16_t* refs;          // Contents of the reference counts, NULL until needed
+    uint32_t* crcs;          // Contents of the checksums, NULL until needed; 0 means none recorded
+    VFSMetaRegion meta[VFS_META_REGIONS];
+    uint32_t dirty_sector_count;  // Sectors changed since the last checkpoint
+    bool sectors_changed;          // Some sector changed since the last commit
     FILE* file;
+    int fd;                  // Descriptor of file; all image I/O is positional through it
+    VFSLocks* locks;
     char current_dir[MAX_PATH];
+    uint64_t image_size;     // Bytes in the host file
+    bool use_mmap;
+    VFSVerifyPolicy verify;
+    bool compress;           // Write new data compressed
+    char* chunk_buffer;      // Compressed bytes of one chunk
+    bool dedup;              // Share full blocks with identical stored ones
+    bool dedup_loaded;       // Index filled from the stored block checksums
+    VFSDedupSlot* dedup_slots;  // Open-addressing table of blocks keyed on checksum
+    uint32_t dedup_capacity;
+    uint32_t dedup_used;     // Live slots plus tombstones
+    uint32_t dedup_live;
+    uint32_t* dedup_where;   // Slot of each indexed block, by block number
+    uint32_t dedup_where_count;
+    const char* map_base;    // Read-only mapping of the image, if any
+    size_t map_size;
+    VFSSpan* retired_maps;   // Outgrown mappings, kept until close for chunks still read from them
+    int retired_map_count;
+    VFSFreeRun* free_runs;   // Free-space summary: pool of tree nodes
+    uint32_t free_run_roots[2];  // Root of the tree by start, and by length
+    uint32_t free_run_count;
+    uint32_t free_run_nodes; // Nodes of the pool handed out so far
+    uint32_t free_run_capacity;
+    uint32_t free_run_spare; // Chain of unused nodes
+    bool free_runs_built;    // Summary made from the bitmap; done on first use
+    int transaction_depth;   // Open vfs_begin calls
+    uint64_t journal_sequence;  // Sequence number of the next commit
+    VFSJournalData* journal_data;
+    uint32_t journal_data_count;
+    uint32_t* journal_blocks;   // Overwritten in place by the open transaction, held in the cache
+    uint32_t journal_block_count;
+    VFSExtent* pending_frees;   // Freed in the open transaction
+    uint32_t pending_free_count;
+    uint32_t pending_free_capacity;
+    VFSExtent* settling_frees;  // Freed by the last commit, reusable after the next one
+    uint32_t open_readers;   // Read handles open; settling frees wait until there are none
+    uint32_t settling_free_count;
+    uint32_t settling_free_capacity;
+    VFSBlockCache cache;
+    VFSPathSlot path_cache[VFS_PATH_CACHE_SLOTS];  // Guarded by the cache mutex, like the block cache
+    uint64_t path_generation;
+    VFSStats stats;
 } VFS;
 
+// Outcome of vfs_check
+typedef struct {
+    uint64_t files;
+    uint64_t directories;
+    uint64_t blocks_scrubbed;   // Data blocks read and checked
+    uint64_t blocks_unverified; // Data blocks with no checksum recorded
+    uint64_t checksum_errors;
+    uint64_t problems;          // Metadata inconsistencies
+} VFSCheckResult;
+
+// How scattered the image is, reported by vfs_layout. Directories are
+// left out of the file counts.
+typedef struct {
+    uint64_t files;             // Files that own blocks
+    uint64_t fragmented_files;  // Files whose blocks are not one run
+    uint64_t extents;           // Runs of consecutive blocks those files own
+    uint32_t free_runs;
+    uint32_t largest_free_run;
+    uint32_t num_blocks;
+    uint32_t free_blocks;
+    uint64_t image_size;        // Bytes in the host file
+} VFSLayout;
+
+// Progress of a compaction run by repeated vfs_compact calls. Zero it
+// before the first call; done is set once there is nothing left to do.
+typedef struct {
+    uint32_t entry;             // Next entry to look at in this pass
+    uint32_t target_start;      // Where the data of the entry being moved goes
+    uint32_t target_next;       // Where its next piece goes
+    bool moving;                // Part of that entry has been moved
+    bool moved_some;            // Some blocks of the entry being looked at have moved
+    bool pass_moved;            // This pass has moved something
+    bool done;
+    uint32_t passes;            // Passes over the entries finished
+    uint64_t files_moved;       // Counted again in each pass that moves them
+    uint64_t blocks_moved;
+    uint64_t files_skipped;     // Left where they are: unreadable, or damaged
+    uint64_t blocks_released;   // Cut off the end of the image
+} VFSCompaction;
+
 // Function prototypes
 VFS* vfs_init(const char* vfs_file);
+VFS* vfs_init_with_options(const char* vfs_file, const VFSOptions* options);
 void vfs_close(VFS* vfs);
+void vfs_begin(VFS* vfs);
+bool vfs_commit(VFS* vfs);
+bool vfs_sync(VFS* vfs);
 bool vfs_create_file(VFS* vfs, const char* path, FileType type);
 bool vfs_create_directory(VFS* vfs, const char* path);
 bool vfs_write_file(VFS* vfs, const char* path, const char* data, size_t len);
+bool vfs_append(VFS* vfs, const char* path, const char* data, size_t len);
+bool vfs_write_at(VFS* vfs, const char* path, uint64_t offset, const char* data, size_t len);
+bool vfs_reserve(VFS* vfs, const char* path, uint64_t bytes);
+bool vfs_clone_file(VFS* vfs, const char* source, const char* dest);
+VFSPrepared* vfs_prepare(VFS* vfs, const char* data, size_t len);
+bool vfs_write_prepared(VFS* vfs, const char* path, const VFSPrepared* prepared);
+void vfs_free_prepared(VFSPrepared* prepared);
 size_t vfs_read_file(VFS* vfs, const char* path, char* buffer, size_t max_len);
+bool vfs_export_file(VFS* vfs, const char* path, int fd);
+VFSFile* vfs_open(VFS* vfs, const char* path);
+size_t vfs_read(VFS* vfs, VFSFile* file, char* data, size_t len);
+bool vfs_read_chunk(VFS* vfs, VFSFile* file, const char** data, size_t* len);
+bool vfs_seek(VFS* vfs, VFSFile* file, int64_t offset, int whence);
+uint64_t vfs_tell(const VFSFile* file);
+VFSFile* vfs_open_writer(VFS* vfs, const char* path, bool append);
+bool vfs_write(VFS* vfs, VFSFile* file, const char* data, size_t len);
+bool vfs_flush(VFS* vfs, VFSFile* file);
+void vfs_close_file(VFS* vfs, VFSFile* file);
 bool vfs_delete_file(VFS* vfs, const char* path);
-bool vfs_list_directory(VFS* vfs, const char* path, FileEntry* entries, int* count);
+bool vfs_rename(VFS* vfs, const char* old_path, const char* new_path);
+VFSDir* vfs_open_dir(VFS* vfs, const char* path);
+bool vfs_read_dir(VFS* vfs, VFSDir* dir, FileEntry* entry);
+void vfs_close_dir(VFSDir* dir);
 bool vfs_change_directory(VFS* vfs, const char* path);
 bool vfs_file_exists(VFS* vfs, const char* path);
+bool vfs_stat(VFS* vfs, const char* path, FileEntry* entry);
 char* vfs_get_current_dir(VFS* vfs);
 bool vfs_resolve_path(VFS* vfs, const char* path, char* resolved);
+VFSExtent vfs_alloc_extent(VFS* vfs, uint32_t blocks);
+void vfs_free_extent(VFS* vfs, VFSExtent extent);
+uint32_t vfs_free_blocks(VFS* vfs);
+void vfs_block_counts(VFS* vfs, uint32_t* total_blocks, uint32_t* free_blocks);
+bool vfs_check(VFS* vfs, int threads, bool metadata, FILE* log, VFSCheckResult* result);
+bool vfs_layout(VFS* vfs, VFSLayout* layout);
+bool vfs_compact(VFS* vfs, VFSCompaction* state, uint32_t max_blocks);
+void vfs_get_stats(VFS* vfs, VFSStats* stats);
+void vfs_reset_stats(VFS* vfs, bool timed);
+const char* vfs_op_name(VFSOp op);
 
 #endif // VFS_H
 